@@ -5,11 +5,29 @@
 =============================================================================*/
 
 #include "SceneSoftwareOcclusion.h"
+#include "SnowOcclusionCapture.h"
+#include "SnowOcclusionCore.h"
+#include "SnowOcclusionPortals.h"
+#include "SnowOcclusionPVS.h"
+#include "SnowOcclusionReference.h"
 #include "EngineGlobals.h"
 #include "CanvasTypes.h"
+#include "Async/ParallelFor.h"
 #include "Async/TaskGraphInterfaces.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "Components/SkinnedMeshComponent.h"
+#include "Engine/SkeletalMesh.h"
+#include "Engine/StaticMesh.h"
+#include "HAL/FileManager.h"
+#include "Misc/DateTime.h"
+#include "Misc/Paths.h"
 #include "Math/Vector.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "ProfilingDebugging/CsvProfiler.h"
+#include "Rendering/SkeletalMeshRenderData.h"
 #include "SceneManagement.h"
+#include "StaticMeshResources.h"
+#include <algorithm>
 
 //#pragma optimize("", off)
 // //////////////////////////////////////////////////////
@@ -65,8 +83,7 @@ TUniquePtr<FSnowMeshOccluderData> FSnowMeshOccluderData::Build(UStaticMesh* Owne
 
 		for (int i = 0; i < NumVtx; ++i)
 		{
-			FVector Elem = FVector(LODModel.VertexBuffers.PositionVertexBuffer.VertexPosition(i));
-			Result->VerticesSP->GetData()[i] = Elem;
+			Result->VerticesSP->GetData()[i] = LODModel.VertexBuffers.PositionVertexBuffer.VertexPosition(i);
 		}
 
 		for (int i = 0; i < NumIndices; ++i)
@@ -89,19 +106,101 @@ USnowPrimitiveInfo::USnowPrimitiveInfo()
 	, bOccluder(true)
 	, bOcludee(true)
 	, bVisible(false)
+	, bShadowCaster(false)
+	, bShadowVisible(true)
 	, MaxDrawDistance(0.0f)
 {
 }
 
+void USnowPrimitiveInfo::BuildRenderCost(const UPrimitiveComponent* Primitive)
+{
+	LODCosts.Reset();
+	NumInstances = 1;
+
+	if (const UStaticMeshComponent* MeshComponent = Cast<UStaticMeshComponent>(Primitive))
+	{
+		const UStaticMesh* Mesh = MeshComponent->GetStaticMesh();
+		const FStaticMeshRenderData* RenderData = Mesh ? Mesh->GetRenderData() : nullptr;
+		if (RenderData)
+		{
+			// LODs that aren't streamed in can't be drawn, a forced LOD is the only one drawn
+			const int32 ForcedLOD = MeshComponent->ForcedLodModel > 0 ? FMath::Min(MeshComponent->ForcedLodModel - 1, RenderData->LODResources.Num() - 1) : INDEX_NONE;
+			const int32 FirstLOD = ForcedLOD != INDEX_NONE ? ForcedLOD : RenderData->CurrentFirstLODIdx;
+			const int32 EndLOD = ForcedLOD != INDEX_NONE ? ForcedLOD + 1 : RenderData->LODResources.Num();
+			for (int32 LODIdx = FirstLOD; LODIdx < EndLOD; ++LODIdx)
+			{
+				const FStaticMeshLODResources& LOD = RenderData->LODResources[LODIdx];
+				const float ScreenSize = ForcedLOD != INDEX_NONE ? 0.0f : RenderData->ScreenSize[LODIdx].GetValue();
+				LODCosts.Add({ ScreenSize, LOD.GetNumTriangles(), LOD.Sections.Num() });
+			}
+		}
+
+		if (const UInstancedStaticMeshComponent* InstancedComponent = Cast<UInstancedStaticMeshComponent>(MeshComponent))
+		{
+			NumInstances = InstancedComponent->GetInstanceCount();
+		}
+	}
+	else if (const USkinnedMeshComponent* SkinnedComponent = Cast<USkinnedMeshComponent>(Primitive))
+	{
+		const USkinnedAsset* Asset = SkinnedComponent->GetSkinnedAsset();
+		const FSkeletalMeshRenderData* RenderData = SkinnedComponent->GetSkeletalMeshRenderData();
+		if (Asset && RenderData)
+		{
+			for (int32 LODIdx = RenderData->CurrentFirstLODIdx; LODIdx < RenderData->LODRenderData.Num(); ++LODIdx)
+			{
+				const FSkeletalMeshLODRenderData& LOD = RenderData->LODRenderData[LODIdx];
+				const FSkeletalMeshLODInfo* LODInfo = Asset->GetLODInfo(LODIdx);
+				LODCosts.Add({ LODInfo ? LODInfo->ScreenSize.GetValue() : 0.0f, (int32)LOD.GetTotalFaces(), LOD.RenderSections.Num() });
+			}
+		}
+	}
+}
+
+void USnowPrimitiveInfo::UpdateRenderCost(const TArray<FSnowViewInfo>& Views)
+{
+	NumTriangles = 0;
+	NumDrawCalls = 0;
+	if (LODCosts.IsEmpty())
+	{
+		return;
+	}
+
+	// Instances get their LOD from the bounds of the whole primitive, close enough for an estimate
+	float MaxScreenSize = 0.0f;
+	for (const FSnowViewInfo& View : Views)
+	{
+		if (!View.bShadowView)
+		{
+			MaxScreenSize = FMath::Max(MaxScreenSize, ComputeBoundsScreenSize(Bounds.Origin, Bounds.SphereRadius, View.ViewOrigin, View.ProjectionMatrix));
+		}
+	}
+
+	// Same pick as the renderer: the last LOD whose screen size is still above the one of the bounds
+	int32 LODIdx = LODCosts.Num() - 1;
+	for (int32 Idx = 0; Idx < LODCosts.Num() - 1; ++Idx)
+	{
+		if (MaxScreenSize >= LODCosts[Idx + 1].ScreenSize)
+		{
+			LODIdx = Idx;
+			break;
+		}
+	}
+	NumTriangles = LODCosts[LODIdx].NumTriangles;
+	NumDrawCalls = LODCosts[LODIdx].NumDrawCalls;
+}
+
 // //////////////////////////////////////////////////////
 
 DECLARE_STATS_GROUP(TEXT("Software Occlusion"), STATGROUP_SoftwareOcclusion, STATCAT_Advanced);
 DECLARE_CYCLE_STAT(TEXT("(RT) Gather Time"), STAT_SoftwareOcclusionGather, STATGROUP_SoftwareOcclusion);
 DECLARE_CYCLE_STAT(TEXT("(Task) Process Time"), STAT_SoftwareOcclusionProcess, STATGROUP_SoftwareOcclusion);
-DECLARE_CYCLE_STAT(TEXT("(Task) Process Occluder Time"), STAT_SoftwareOcclusionProcessOccluder, STATGROUP_SoftwareOcclusion);
-DECLARE_CYCLE_STAT(TEXT("(Task) Process Occludee Time"), STAT_SoftwareOcclusionProcessOccludee, STATGROUP_SoftwareOcclusion);
-DECLARE_CYCLE_STAT(TEXT("(Task) Sort Time"), STAT_SoftwareOcclusionSort, STATGROUP_SoftwareOcclusion);
-DECLARE_CYCLE_STAT(TEXT("(Task) Rasterize Time"), STAT_SoftwareOcclusionRasterize, STATGROUP_SoftwareOcclusion);
+// Phases are timed inside the occlusion core, summed over views
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("(Task) Process Occluder Time (ms)"), STAT_SoftwareOcclusionProcessOccluder, STATGROUP_SoftwareOcclusion);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("(Task) Process Occludee Time (ms)"), STAT_SoftwareOcclusionProcessOccludee, STATGROUP_SoftwareOcclusion);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("(Task) Sort Time (ms)"), STAT_SoftwareOcclusionSort, STATGROUP_SoftwareOcclusion);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("(Task) Rasterize Time (ms)"), STAT_SoftwareOcclusionRasterize, STATGROUP_SoftwareOcclusion);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("(Task) Reference Time (ms)"), STAT_SoftwareOcclusionReference, STATGROUP_SoftwareOcclusion);
+DECLARE_MEMORY_STAT(TEXT("Frame arena"), STAT_SoftwareOcclusionArenaMemory, STATGROUP_SoftwareOcclusion);
 
 DECLARE_DWORD_COUNTER_STAT(TEXT("Culled"), STAT_SoftwareCulledPrimitives, STATGROUP_SoftwareOcclusion);
 DECLARE_DWORD_COUNTER_STAT(TEXT("Total occluders"), STAT_SoftwareOccluders, STATGROUP_SoftwareOcclusion);
@@ -109,6 +208,34 @@ DECLARE_DWORD_COUNTER_STAT(TEXT("Total occludees"), STAT_SoftwareOccludees, STAT
 DECLARE_DWORD_COUNTER_STAT(TEXT("Total triangles"), STAT_SoftwareTriangles, STATGROUP_SoftwareOcclusion);
 DECLARE_DWORD_COUNTER_STAT(TEXT("Rasterized occluder tris"), STAT_SoftwareOccluderTris, STATGROUP_SoftwareOcclusion);
 DECLARE_DWORD_COUNTER_STAT(TEXT("Rasterized occludee tris"), STAT_SoftwareOccludeeTris, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Occludee groups"), STAT_SoftwareOccludeeGroups, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Expanded occludee groups"), STAT_SoftwareExpandedOccludeeGroups, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Culled shadows"), STAT_SoftwareCulledShadows, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Culled triangles (estimate)"), STAT_SoftwareCulledTriangles, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Culled draw calls (estimate)"), STAT_SoftwareCulledDrawCalls, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Occludee triangles (estimate)"), STAT_SoftwareOccludeeRenderTriangles, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Occluders skipped by reprojection"), STAT_SoftwareReprojectionSkippedOccluders, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Reused results"), STAT_SoftwareReusedResults, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Retested occludees"), STAT_SoftwareRetestedOccludees, STATGROUP_SoftwareOcclusion);
+// Measured against the reference rasterizer with r.so.Accuracy
+DECLARE_DWORD_COUNTER_STAT(TEXT("Accuracy: visible in reference"), STAT_SoftwareAccuracyReferenceVisible, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Accuracy: false visible"), STAT_SoftwareAccuracyFalseVisible, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Accuracy: false occluded"), STAT_SoftwareAccuracyFalseOccluded, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Accuracy: false visible shadows"), STAT_SoftwareAccuracyFalseVisibleShadows, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Accuracy: false occluded shadows"), STAT_SoftwareAccuracyFalseOccludedShadows, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Amortized occludees"), STAT_SoftwareAmortizedOccludees, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Portal culled occludees"), STAT_SoftwarePortalCulledOccludees, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Portal culled occluders"), STAT_SoftwarePortalCulledOccluders, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Portal visible cells"), STAT_SoftwarePortalVisibleCells, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("PVS culled occludees"), STAT_SoftwarePVSCulledOccludees, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("PVS culled occluders"), STAT_SoftwarePVSCulledOccluders, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Skipped submissions"), STAT_SoftwareSkippedSubmissions, STATGROUP_SoftwareOcclusion);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Results age"), STAT_SoftwareResultsAge, STATGROUP_SoftwareOcclusion);
+
+// Stats are per frame and don't survive into a capture, the CSV profiler keeps the counters over a whole session
+CSV_DEFINE_CATEGORY(SnowOcclusion, true);
+
+UE_TRACE_CHANNEL_DEFINE(SnowOcclusionChannel);
 
 float GSOMinScreenRadiusForOccluder = 0.075f;
 static FAutoConsoleVariableRef CVarSOMinScreenRadiusForOccluder(
@@ -142,6 +269,198 @@ static FAutoConsoleVariableRef CVarSOSIMD(
 	ECVF_RenderThreadSafe
 );
 
+static int32 GSOPrediction = 1;
+static FAutoConsoleVariableRef CVarSOPrediction(
+	TEXT("r.so.Prediction"),
+	GSOPrediction,
+	TEXT("Rasterize with a view extrapolated from the camera motion to compensate for the results latency"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOPredictionMinLinearSpeed = 100.0f;
+static FAutoConsoleVariableRef CVarSOPredictionMinLinearSpeed(
+	TEXT("r.so.PredictionMinLinearSpeed"),
+	GSOPredictionMinLinearSpeed,
+	TEXT("Camera speed (cm/s) above which the view position is extrapolated"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOPredictionMinAngularSpeed = 20.0f;
+static FAutoConsoleVariableRef CVarSOPredictionMinAngularSpeed(
+	TEXT("r.so.PredictionMinAngularSpeed"),
+	GSOPredictionMinAngularSpeed,
+	TEXT("Camera angular speed (deg/s) above which the view rotation is extrapolated and the frustum widened"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOPredictionWidenScale = 1.0f;
+static FAutoConsoleVariableRef CVarSOPredictionWidenScale(
+	TEXT("r.so.PredictionWidenScale"),
+	GSOPredictionWidenScale,
+	TEXT("Scale of the predicted rotation angle the frustum is widened by, so that it covers both the current and the predicted view"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOMaxResultsAge = 4;
+static FAutoConsoleVariableRef CVarSOMaxResultsAge(
+	TEXT("r.so.MaxResultsAge"),
+	GSOMaxResultsAge,
+	TEXT("Maximum age in frames of occlusion results before they are ignored and everything is considered visible"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOShadowVolumeLength = 2000.0f;
+static FAutoConsoleVariableRef CVarSOShadowVolumeLength(
+	TEXT("r.so.ShadowVolumeLength"),
+	GSOShadowVolumeLength,
+	TEXT("How far, in cm, the shadow of an occluded caster is assumed to reach along the light direction when looking for visible receivers"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOOccludeeGroupCellSize = 2000.0f;
+static FAutoConsoleVariableRef CVarSOOccludeeGroupCellSize(
+	TEXT("r.so.OccludeeGroupCellSize"),
+	GSOOccludeeGroupCellSize,
+	TEXT("Size, in cm, of the grid cells occludees are grouped by. A group is tested as one box before its members. 0 disables grouping"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOOccludeeGroupMinMembers = 4;
+static FAutoConsoleVariableRef CVarSOOccludeeGroupMinMembers(
+	TEXT("r.so.OccludeeGroupMinMembers"),
+	GSOOccludeeGroupMinMembers,
+	TEXT("Minimum number of occludees in a grid cell for them to be grouped"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOReprojection = 0;
+static FAutoConsoleVariableRef CVarSOReprojection(
+	TEXT("r.so.Reprojection"),
+	GSOReprojection,
+	TEXT("Reproject the previous frame's occlusion buffer into each view and skip the occluders it already covers"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOReprojectionOccluderScale = 1.5f;
+static FAutoConsoleVariableRef CVarSOReprojectionOccluderScale(
+	TEXT("r.so.ReprojectionOccluderScale"),
+	GSOReprojectionOccluderScale,
+	TEXT("With reprojection, occluders collected as a multiple of r.so.MaxOccluderNum. Each view still rasterizes at most r.so.MaxOccluderNum, skipped occluders make room for the next ones"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOCoherence = 1;
+static FAutoConsoleVariableRef CVarSOCoherence(
+	TEXT("r.so.Coherence"),
+	GSOCoherence,
+	TEXT("Reuse the last results while the views and the occluders don't change, only occludees that changed are tested against the last occlusion buffers"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOCoherencePositionTolerance = 0.1f;
+static FAutoConsoleVariableRef CVarSOCoherencePositionTolerance(
+	TEXT("r.so.CoherencePositionTolerance"),
+	GSOCoherencePositionTolerance,
+	TEXT("Distance, in cm, a view can move from where the reused results were rasterized"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOCoherenceRotationTolerance = 0.001f;
+static FAutoConsoleVariableRef CVarSOCoherenceRotationTolerance(
+	TEXT("r.so.CoherenceRotationTolerance"),
+	GSOCoherenceRotationTolerance,
+	TEXT("Tolerance on the view rotation matrix entries, about 0.06 degrees by default, a view can turn from where the reused results were rasterized"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOCoherenceMaxRetestedOccludees = 64;
+static FAutoConsoleVariableRef CVarSOCoherenceMaxRetestedOccludees(
+	TEXT("r.so.CoherenceMaxRetestedOccludees"),
+	GSOCoherenceMaxRetestedOccludees,
+	TEXT("Maximum number of changed occludees tested against the reused results, more than that submits the scene again"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOAmortizeInterval = 1;
+static FAutoConsoleVariableRef CVarSOAmortizeInterval(
+	TEXT("r.so.AmortizeInterval"),
+	GSOAmortizeInterval,
+	TEXT("Occludees occluded with a wide margin are only tested every this many frames, round robin. 1 tests every occludee every frame"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOAmortizeMarginPixels = 4;
+static FAutoConsoleVariableRef CVarSOAmortizeMarginPixels(
+	TEXT("r.so.AmortizeMarginPixels"),
+	GSOAmortizeMarginPixels,
+	TEXT("An occludee is occluded with a wide margin if its screen rectangle grown by this many pixels is still occluded"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOAmortizeMinDistance = 2000.0f;
+static FAutoConsoleVariableRef CVarSOAmortizeMinDistance(
+	TEXT("r.so.AmortizeMinDistance"),
+	GSOAmortizeMinDistance,
+	TEXT("Occludees closer than this, in cm, to a view are tested every frame"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOAmortizeCutDistance = 500.0f;
+static FAutoConsoleVariableRef CVarSOAmortizeCutDistance(
+	TEXT("r.so.AmortizeCutDistance"),
+	GSOAmortizeCutDistance,
+	TEXT("A view that moved more than this, in cm, since the last results is a camera cut and every occludee is tested"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOAmortizeCutAngle = 30.0f;
+static FAutoConsoleVariableRef CVarSOAmortizeCutAngle(
+	TEXT("r.so.AmortizeCutAngle"),
+	GSOAmortizeCutAngle,
+	TEXT("A view that turned more than this, in degrees, since the last results is a camera cut and every occludee is tested"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOPortals = 1;
+static FAutoConsoleVariableRef CVarSOPortals(
+	TEXT("r.so.Portals"),
+	GSOPortals,
+	TEXT("Cull the occludees and occluders no camera sees through the portals before rasterizing, in levels with portal cells"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOPVS = 1;
+static FAutoConsoleVariableRef CVarSOPVS(
+	TEXT("r.so.PVS"),
+	GSOPVS,
+	TEXT("Cull the static occludees and occluders the baked potentially visible sets of the camera cells don't hold before rasterizing, in levels with baked sets"),
+	ECVF_RenderThreadSafe
+);
+
+static int32 GSOFoveation = 0;
+static FAutoConsoleVariableRef CVarSOFoveation(
+	TEXT("r.so.Foveation"),
+	GSOFoveation,
+	TEXT("Variable resolution occlusion buffer, more pixels in the center region and fewer at the edges. 0 = off, 1 = stereo views, 2 = all views"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOFoveationCenterSize = 0.5f;
+static FAutoConsoleVariableRef CVarSOFoveationCenterSize(
+	TEXT("r.so.FoveationCenterSize"),
+	GSOFoveationCenterSize,
+	TEXT("Size of the center region on each axis, as a fraction of the view"),
+	ECVF_RenderThreadSafe
+);
+
+static float GSOFoveationCenterResolution = 0.75f;
+static FAutoConsoleVariableRef CVarSOFoveationCenterResolution(
+	TEXT("r.so.FoveationCenterResolution"),
+	GSOFoveationCenterResolution,
+	TEXT("Fraction of the buffer on each axis given to the center region"),
+	ECVF_RenderThreadSafe
+);
+
 static int32 GSOVisualizeBuffer = 0;
 static FAutoConsoleVariableRef CVarSOVisualizeBuffer(
 	TEXT("r.so.VisualizeBuffer"),
@@ -150,929 +469,965 @@ static FAutoConsoleVariableRef CVarSOVisualizeBuffer(
 	ECVF_RenderThreadSafe
 );
 
+static int32 GSOVisualizeView = 0;
+static FAutoConsoleVariableRef CVarSOVisualizeView(
+	TEXT("r.so.VisualizeView"),
+	GSOVisualizeView,
+	TEXT("Index of the view whose occlusion buffer is visualized"),
+	ECVF_RenderThreadSafe
+);
 
+static int32 GSOAccuracy = 0;
+static FAutoConsoleVariableRef CVarSOAccuracy(
+	TEXT("r.so.Accuracy"),
+	GSOAccuracy,
+	TEXT("Compare every processed frame with a reference rasterizer and count the culling mistakes in the stats. Slow, for tuning only"),
+	ECVF_RenderThreadSafe
+);
 
-static const int32 BIN_WIDTH = 64;
-static const int32 BIN_NUM = 6;
-static const int32 FRAMEBUFFER_WIDTH = BIN_WIDTH * BIN_NUM;
-static const int32 FRAMEBUFFER_HEIGHT = 256;
-
-namespace EScreenVertexFlags
-{
-	const uint8 None = 0;
-	const uint8 ClippedLeft = 1 << 0;	// Vertex is clipped by left plane
-	const uint8 ClippedRight = 1 << 1;	// Vertex is clipped by right plane
-	const uint8 ClippedTop = 1 << 2;	// Vertex is clipped by top plane
-	const uint8 ClippedBottom = 1 << 3;	// Vertex is clipped by bottom plane
-	const uint8 ClippedNear = 1 << 4;   // Vertex is clipped by near plane
-	const uint8 Discard = 1 << 5;	// Polygon using this vertex should be discarded
-}
+static int32 GSOAccuracyScale = SnowOcclusion::DEFAULT_REFERENCE_SCALE;
+static FAutoConsoleVariableRef CVarSOAccuracyScale(
+	TEXT("r.so.AccuracyScale"),
+	GSOAccuracyScale,
+	TEXT("Reference buffer size as a multiple of the occlusion buffer, 1 to 8"),
+	ECVF_RenderThreadSafe
+);
 
-struct FFramebufferBin
+/**
+ * Every setting that changes what a processed frame finds, from the scene gathering to the core. Results computed with
+ * other settings aren't reused, a cvar that changes the results belongs here. Only 4 byte members, hashed as memory.
+ */
+struct FOcclusionSettings
 {
-	uint64 Data[FRAMEBUFFER_HEIGHT];
-	uint64 Type[FRAMEBUFFER_HEIGHT];
+	float MinScreenRadiusForOccluder;
+	float MaxDistanceForOccluder;
+	int32 MaxOccluderNum;
+	int32 SIMD;
+	int32 Prediction;
+	float PredictionMinLinearSpeed;
+	float PredictionMinAngularSpeed;
+	float PredictionWidenScale;
+	float ShadowVolumeLength;
+	float OccludeeGroupCellSize;
+	int32 OccludeeGroupMinMembers;
+	int32 Reprojection;
+	float ReprojectionOccluderScale;
+	int32 AmortizeInterval;
+	int32 AmortizeMarginPixels;
+	float AmortizeMinDistance;
+	float AmortizeCutDistance;
+	float AmortizeCutAngle;
+	int32 Portals;
+	int32 PVS;
+	int32 Foveation;
+	float FoveationCenterSize;
+	float FoveationCenterResolution;
+	int32 Accuracy;
+	int32 AccuracyScale;
+
+	static FOcclusionSettings Get()
+	{
+		return {
+			GSOMinScreenRadiusForOccluder,
+			GSOMaxDistanceForOccluder,
+			GSOMaxOccluderNum,
+			GSOSIMD,
+			GSOPrediction,
+			GSOPredictionMinLinearSpeed,
+			GSOPredictionMinAngularSpeed,
+			GSOPredictionWidenScale,
+			GSOShadowVolumeLength,
+			GSOOccludeeGroupCellSize,
+			GSOOccludeeGroupMinMembers,
+			GSOReprojection,
+			GSOReprojectionOccluderScale,
+			GSOAmortizeInterval,
+			GSOAmortizeMarginPixels,
+			GSOAmortizeMinDistance,
+			GSOAmortizeCutDistance,
+			GSOAmortizeCutAngle,
+			GSOPortals,
+			GSOPVS,
+			GSOFoveation,
+			GSOFoveationCenterSize,
+			GSOFoveationCenterResolution,
+			GSOAccuracy,
+			GSOAccuracyScale,
+		};
+	}
 };
+static_assert(sizeof(FOcclusionSettings) == 25 * 4, "FOcclusionSettings is hashed as memory, it can't have padding");
+
+/** Capture asked for with r.so.Capture, picked up by the next processed frame */
+static int32 GSOCaptureRequestFrames = 0;
+static FString GSOCaptureRequestPath;
+
+static FAutoConsoleCommand CmdSOCapture(
+	TEXT("r.so.Capture"),
+	TEXT("Writes the next N processed occlusion frames (default 60) to a capture for SnowOcclusionReplay.\n")
+	TEXT("Usage: r.so.Capture [NumFrames] [FileName], the file goes to Saved/Profiling/SnowOcclusion by default"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		GSOCaptureRequestFrames = Args.Num() > 0 ? FMath::Max(FCString::Atoi(*Args[0]), 1) : 60;
+		GSOCaptureRequestPath = Args.Num() > 1 ? Args[1] : FString();
+	})
+);
 
-struct FScreenPosition
+/** Capture being written, frames are appended by the task */
+struct FOcclusionCapture
 {
-	int32 X, Y;
+	SnowOcclusion::FCaptureWriter Writer;
+	FString Path;
+	int32 FramesLeft = 0;
 };
 
-struct FScreenTriangle
+/** What results were computed from: views, occluders and a hash of each occludee */
+struct FOcclusionSceneSignature
 {
-	FScreenPosition V[3];
+	TArray<FSnowViewInfo> Views;
+	uint32 OccludersHash = 0;
+	TMap<FPrimitiveComponentId, uint32> OccludeeHashes;
 };
 
 struct FOcclusionFrameResults
 {
-	FFramebufferBin	Bins[BIN_NUM];
+	// Buffers and per occludee visibility of each view, indexed like OccludeePrimIds
+	SnowOcclusion::FFrameResults Frame;
+	TArray<FPrimitiveComponentId> OccludeePrimIds;
+	// Visibility combined over all views
 	TMap<FPrimitiveComponentId, bool> VisibilityMap;
+	// Visibility of the sub-bounds of primitives that have them, indexed like USnowPrimitiveInfo::SubBounds
+	TMap<FPrimitiveComponentId, TBitArray<>> SubVisibilityMap;
+	// Whether the shadow of a caster can reach a visible receiver, only filled when there are shadow views
+	TMap<FPrimitiveComponentId, bool> ShadowVisibilityMap;
+	// Visibility in each view of the visible primitives, indexed like the views. Only filled with more than one regular view.
+	TMap<FPrimitiveComponentId, TBitArray<>> ViewVisibilityMap;
+	// Occludees still occluded with their screen rectangle grown by a margin, candidates for amortized testing
+	TSet<FPrimitiveComponentId> DeeplyOccluded;
+
+	FOcclusionSceneSignature Signature;
+
+	// Frame the scene was gathered in, used to tell how stale the results are
+	uint64 FrameNumber = 0;
+	bool bValid = false;
+
+	void Reset(uint64 InFrameNumber, int32 NumViews)
+	{
+		Frame.Reset(NumViews);
+		OccludeePrimIds.Reset();
+		VisibilityMap.Reset();
+		SubVisibilityMap.Reset();
+		ShadowVisibilityMap.Reset();
+		ViewVisibilityMap.Reset();
+		DeeplyOccluded.Reset();
+		FrameNumber = InFrameNumber;
+		bValid = false;
+	}
 };
 
-struct FOcclusionMeshData
+struct FPotentialOccluderPrimitive
 {
-	FMatrix					LocalToWorld;
-	FOccluderVertexArraySP	VerticesSP;
-	FOccluderIndexArraySP	IndicesSP;
-	FPrimitiveComponentId	PrimId;
-};
+	FPrimitiveComponentId PrimitiveComponentId;
+	const FSnowMeshOccluderData* OccluderData;
+	FMatrix LocalToWorld;
+	FBox Bounds;
 
-struct FSortedIndexDepth
-{
-	int32 Index;
-	float Depth;
+	float Weight;
 };
 
-struct FOcclusionFrameData
+/** Scene gathered for the task. A single one is reused frame after frame, only one task is in flight at a time. */
+struct FOcclusionSceneData
 {
-	// binned tris
-	TArray<FSortedIndexDepth>		SortedTriangles[BIN_NUM];
-
-	// tris data	
-	TArray<FScreenTriangle>			ScreenTriangles;
-	TArray<FPrimitiveComponentId>	ScreenTrianglesPrimID;
-	TArray<uint8>					ScreenTrianglesFlags;
-
-	void ReserveBuffers(int32 NumTriangles)
+	// Plain scene processed by the core, occludees are indexed like OccludeeBoxPrimId
+	SnowOcclusion::FScene			Scene;
+	TArray<FPrimitiveComponentId>	OccludeeBoxPrimId;
+	TArray<int32>					OccludeeBoxSubIdx; // index into USnowPrimitiveInfo::SubBounds, INDEX_NONE for whole primitives
+	// Indexed like Scene.Occluders, keeps the occluder geometry the core points into alive until the task is done
+	TArray<FPrimitiveComponentId>	OccluderPrimIds;
+	TArray<FOccluderVertexArraySP>	OccluderVertices;
+	TArray<FOccluderIndexArraySP>	OccluderIndices;
+
+	// Deeply occluded primitives not tested this frame, they stay occluded. Margins are only measured with amortizing on.
+	TArray<FPrimitiveComponentId>	AmortizedOccludees;
+	bool							bAmortize = false;
+
+	// Whole primitives culled by the baked sets or the portals, never handed to the core
+	TArray<FPrimitiveComponentId>	PreCulledOccludees;
+
+	// Reference buffer scale to measure the culling accuracy with, 0 doesn't measure it
+	int32							AccuracyScale = 0;
+
+	// Gather scratch, kept for its memory
+	TArray<FPotentialOccluderPrimitive> PotentialOccluders;
+	TArray<int32>					ShadowCasterIdx;
+	TArray<SnowOcclusion::FPortalVisibility> PortalVisibility; // indexed like the views, empty for shadow views
+	std::vector<int32>				PVSViewSets;
+	std::vector<int32>				PVSFoundSets;
+	// Baked sets of the cells the cameras were in, decoded into one byte per baked primitive until the cells change
+	std::vector<int32>				PVSDecodedSets;
+	std::vector<uint8>				PVSVisible;
+	// Transient data of the gather and of the core, reset every frame
+	SnowOcclusion::FLinearArena		GatherArena;
+	SnowOcclusion::FFrameArena		FrameArena;
+
+	/** Empties the scene for the next frame, keeping the memory. Releases the occluder geometry. */
+	void Reset()
 	{
-		const int32 NumTrianglesPerBin = NumTriangles / BIN_NUM + 1;
-		for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
-		{
-			SortedTriangles[BinIdx].Reserve(NumTrianglesPerBin);
-		}
-
-		ScreenTriangles.Reserve(NumTriangles);
-		ScreenTrianglesPrimID.Reserve(NumTriangles);
-		ScreenTrianglesFlags.Reserve(NumTriangles);
+		Scene.Reset();
+		OccludeeBoxPrimId.Reset();
+		OccludeeBoxSubIdx.Reset();
+		OccluderPrimIds.Reset();
+		OccluderVertices.Reset();
+		OccluderIndices.Reset();
+		AmortizedOccludees.Reset();
+		bAmortize = false;
+		PreCulledOccludees.Reset();
+		AccuracyScale = 0;
+		PotentialOccluders.Reset();
+		ShadowCasterIdx.Reset();
 	}
 };
 
-struct FOcclusionSceneData
-{
-	FMatrix							ViewProj;
-	TArray<FVector>					OccludeeBoxMinMax;
-	TArray<FPrimitiveComponentId>	OccludeeBoxPrimId;
-	TArray<FOcclusionMeshData>		OccluderData;
-	int32							NumOccluderTriangles;
-};
+static_assert(sizeof(FVector3f) == sizeof(SnowOcclusion::FVec3), "Occluder vertices are handed to the core as they are");
 
-inline uint64 ComputeBinRowMask(int32 BinMinX, float fX0, float fX1)
+static SnowOcclusion::FVec3 ToCore(const FVector& V)
 {
-	int32 X0 = FMath::RoundToInt(fX0) - BinMinX;
-	int32 X1 = FMath::RoundToInt(fX1) - BinMinX;
-	if (X0 >= BIN_WIDTH || X1 < 0)
-	{
-		// not in bin
-		return 0ull;
-	}
-	else
-	{
-		X0 = FMath::Max(0, X0);
-		X1 = FMath::Min(BIN_WIDTH - 1, X1);
-		int32 Num = (X1 - X0) + 1;
-		return (Num == BIN_WIDTH) ? ~0ull : ((1ull << Num) - 1) << X0;
-	}
+	return { (float)V.X, (float)V.Y, (float)V.Z };
 }
 
-inline void RasterizeHalf(float X0, float X1, float DX0, float DX1, int32 Row0, int32 Row1, uint64* BinData, uint64* BinType, int32 BinMinX)
+static SnowOcclusion::FBox3 ToCore(const FBox& Box)
 {
-	checkSlow(Row0 <= Row1);
-	checkSlow(Row0 >= 0 && Row1 < FRAMEBUFFER_HEIGHT);
+	return { ToCore(Box.Min), ToCore(Box.Max) };
+}
 
-	for (int32 Row = Row0; Row <= Row1; Row++, X0 += DX0, X1 += DX1)
+static SnowOcclusion::FMat4 ToCore(const FMatrix& M)
+{
+	SnowOcclusion::FMat4 Result;
+	for (int32 Row = 0; Row < 4; ++Row)
 	{
-		uint64 FrameBufferMask = BinData[Row];
-		if (FrameBufferMask != ~0ull) // whether this row is already fully rasterized
+		for (int32 Col = 0; Col < 4; ++Col)
 		{
-			*BinType = 0;
-			uint64 RowMask = ComputeBinRowMask(BinMinX, X0, X1);
-			if (RowMask)
-			{
-				BinData[Row] = (FrameBufferMask | RowMask);
-			}
+			Result.M[Row][Col] = (float)M.M[Row][Col];
 		}
 	}
+	return Result;
 }
 
-static void RasterizeOccluderTri(const FScreenTriangle& Tri, uint64* BinData, uint64* BinType, int32 BinMinX)
+static FBox FromCore(const SnowOcclusion::FVec3& Min, const SnowOcclusion::FVec3& Max)
 {
-	FScreenPosition A = Tri.V[0];
-	FScreenPosition B = Tri.V[1];
-	FScreenPosition C = Tri.V[2];
-
-	int32 RowMin = FMath::Max<int32>(A.Y, 0);
-	int32 RowMax = FMath::Min<int32>(FRAMEBUFFER_HEIGHT - 1, C.Y);
-
-	bool bRasterized = false;
+	return FBox(FVector(Min.X, Min.Y, Min.Z), FVector(Max.X, Max.Y, Max.Z));
+}
 
-	int32 RowS = RowMin;
-	if ((B.Y - RowMin) > 0)
+static void CollectOccludeeGeom(const FBox& Box, const SnowOcclusion::FOrientedBox* OrientedBox, FPrimitiveComponentId PrimitiveId, int32 SubIdx, FOcclusionSceneData& SceneData)
+{
+	if (OrientedBox)
 	{
-		// A -> B
-		int32 RowE = FMath::Min<int32>(RowMax, B.Y);
-		// Edge gradients
-		float dX0 = float(B.X - A.X) / (B.Y - A.Y);
-		float dX1 = float(C.X - A.X) / (C.Y - A.Y);
-		if (dX0 > dX1)
-		{
-			Swap(dX0, dX1);
-		}
-		float X0 = A.X + dX0 * (RowS - A.Y);
-		float X1 = A.X + dX1 * (RowS - A.Y);
-		ensure(X0 <= X1);
-		RasterizeHalf(X0, X1, dX0, dX1, RowS, RowE, BinData, BinType, BinMinX);
-		bRasterized |= true;
-		RowS = RowE + 1;
-	}
-
-	if ((RowMax - RowS) > 0)
-	{
-		// B -> C
-		// Edge gradients
-		float dX0 = float(C.X - A.X) / (C.Y - A.Y);
-		float dX1 = float(C.X - B.X) / (C.Y - B.Y);
-		float X0 = A.X + dX0 * (RowS - A.Y);
-		float X1 = B.X + dX1 * (RowS - B.Y);
-		if (X0 > X1)
-		{
-			Swap(X0, X1);
-			Swap(dX0, dX1);
-		}
-		RasterizeHalf(X0, X1, dX0, dX1, RowS, RowMax, BinData, BinType, BinMinX);
-		bRasterized |= true;
+		SceneData.Scene.AddOccludee(ToCore(Box), *OrientedBox);
 	}
-
-	// one line triangle
-	if (!bRasterized)
+	else
 	{
-		float X0 = FMath::Min3(A.X, B.X, C.X);
-		float X1 = FMath::Max3(A.X, B.X, C.X);
-		RasterizeHalf(X0, X1, 0.0f, 0.0f, RowS, RowS, BinData, BinType, BinMinX);
+		SceneData.Scene.AddOccludee(ToCore(Box));
 	}
+	SceneData.OccludeeBoxPrimId.Add(PrimitiveId);
+	SceneData.OccludeeBoxSubIdx.Add(SubIdx);
 }
 
-static bool RasterizeOccludeeQuad(const FScreenTriangle& Tri, uint64* BinData, uint64* BinType, int32 BinMinX)
+class FSWOccluderElementsCollector
 {
-	int32 RowMin = Tri.V[0].Y; // Quad MinY
-	int32 RowMax = Tri.V[2].Y; // Quad MaxY
-	// occludee expected to be clipped to screen
-	checkSlow(RowMin >= 0);
-	checkSlow(RowMax < FRAMEBUFFER_HEIGHT);
-
-	// clip X to bin bounds
-	int32 X0 = FMath::Max(Tri.V[0].X - BinMinX, 0); // MinX
-	int32 X1 = FMath::Min(Tri.V[1].X - BinMinX, BIN_WIDTH - 1); //MaxX
-	checkSlow(X0 <= X1);
-
-	int32 NumBits = (X1 - X0) + 1;
-	uint64 RowMask = (NumBits == BIN_WIDTH) ? ~0ull : ((1ull << NumBits) - 1) << X0;
+public:
+	FSWOccluderElementsCollector(FOcclusionSceneData& InData)
+		: SceneData(InData)
+	{
+		SceneData.Scene.NumOccluderTriangles = 0;
+	}
 
-#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
-	for (int32 Row = RowMin; Row <= RowMax; ++Row)
+	void SetPrimitiveID(FPrimitiveComponentId PrimitiveId)
 	{
-		BinType[Row] |= RowMask;
+		CurrentPrimitiveId = PrimitiveId;
 	}
-#endif
 
-	for (int32 Row = RowMin; Row <= RowMax; ++Row)
+	void AddElements(const FOccluderVertexArraySP& Vertices, const FOccluderIndexArraySP& Indices, const FMatrix& LocalToWorld, const FBox& WorldBounds)
 	{
-		uint64 FrameBufferMask = BinData[Row];
-		if ((~FrameBufferMask & RowMask))
-		{
-			return true;
-		}
+		SnowOcclusion::FOccluderMesh& MeshData = SceneData.Scene.Occluders.emplace_back();
+		MeshData.LocalToWorld = ToCore(LocalToWorld);
+		MeshData.WorldBounds = ToCore(WorldBounds);
+		MeshData.Vertices = reinterpret_cast<const SnowOcclusion::FVec3*>(Vertices->GetData());
+		MeshData.NumVertices = Vertices->Num();
+		MeshData.Indices = Indices->GetData();
+		MeshData.NumIndices = Indices->Num();
+
+		SceneData.OccluderPrimIds.Add(CurrentPrimitiveId);
+		SceneData.OccluderVertices.Add(Vertices);
+		SceneData.OccluderIndices.Add(Indices);
+		SceneData.Scene.NumOccluderTriangles += Indices->Num() / 3;
 	}
 
-	return false;
-}
+public:
+	FOcclusionSceneData& SceneData;
+	FPrimitiveComponentId CurrentPrimitiveId;
+};
 
-static bool TestFrontface(const FScreenTriangle& Tri)
+/** Whether a box is visible in any regular view of finished results, its screen rectangle grown by MarginPixels */
+static bool IsBoxVisibleInResults(const FOcclusionFrameResults& Results, const FBox& Box, const SnowOcclusion::FOrientedBox* OrientedBox, int32 MarginPixels = 0)
 {
-	if ((Tri.V[2].X - Tri.V[0].X) * (Tri.V[1].Y - Tri.V[0].Y) >= (Tri.V[2].Y - Tri.V[0].Y) * (Tri.V[1].X - Tri.V[0].X))
-	{
-		return false;
-	}
-	return true;
+	return SnowOcclusion::IsBoxVisibleInResults(Results.Frame.Views, ToCore(Box), OrientedBox, MarginPixels, GSOSIMD != 0);
 }
 
-inline bool AddTriangle(FScreenTriangle& Tri, float TriDepth, FPrimitiveComponentId PrimitiveId, uint8 MeshFlags, FOcclusionFrameData& InData)
+static void ProcessOcclusionFrame(FOcclusionSceneData& InSceneData, SnowOcclusion::FHistory* History, FOcclusionFrameResults& OutResults)
 {
-	if (MeshFlags == 1) // occluder tri
+	const SnowOcclusion::FScene& Scene = InSceneData.Scene;
+	const SnowOcclusion::FParallelFor ViewParallelFor = [](int32 Num, const std::function<void(int32)>& Body)
 	{
-		// Sort vertices by Y, assumed in rasterization
-		if (Tri.V[0].Y > Tri.V[1].Y) Swap(Tri.V[0], Tri.V[1]);
-		if (Tri.V[1].Y > Tri.V[2].Y) Swap(Tri.V[1], Tri.V[2]);
-		if (Tri.V[0].Y > Tri.V[1].Y) Swap(Tri.V[0], Tri.V[1]);
-
-		if (Tri.V[0].Y >= FRAMEBUFFER_HEIGHT || Tri.V[2].Y < 0)
-		{
-			return false;
-		}
-	}
-
-	int32 TriangleID = InData.ScreenTriangles.Add(Tri);
-	InData.ScreenTrianglesPrimID.Add(PrimitiveId);
-	InData.ScreenTrianglesFlags.Add(MeshFlags);
-
-	// bin
-	int32 MinX = FMath::Min3(Tri.V[0].X, Tri.V[1].X, Tri.V[2].X) / BIN_WIDTH;
-	int32 MaxX = FMath::Max3(Tri.V[0].X, Tri.V[1].X, Tri.V[2].X) / BIN_WIDTH;
-	int32 BinMin = FMath::Max(MinX, 0);
-	int32 BinMax = FMath::Min(MaxX, BIN_NUM - 1);
+		ParallelFor(Num, [&Body](int32 Index) { Body(Index); });
+	};
 
-	FSortedIndexDepth SortedIndexDepth;
-	SortedIndexDepth.Index = TriangleID;
-	SortedIndexDepth.Depth = TriDepth;
+	// Each view rasterizes the shared geometry into its own framebuffer
+	SnowOcclusion::ProcessOcclusionFrame(Scene, History, OutResults.Frame, ViewParallelFor, &InSceneData.FrameArena);
+	SET_MEMORY_STAT(STAT_SoftwareOcclusionArenaMemory, InSceneData.FrameArena.GetCapacity() + InSceneData.GatherArena.GetCapacity());
 
-	for (int32 BinIdx = BinMin; BinIdx <= BinMax; ++BinIdx)
+	if (InSceneData.AccuracyScale > 0)
 	{
-		InData.SortedTriangles[BinIdx].Add(SortedIndexDepth);
+		SnowOcclusion::MeasureCullingAccuracy(Scene, OutResults.Frame, InSceneData.AccuracyScale, ViewParallelFor);
+
+		const SnowOcclusion::FAccuracyStats& Accuracy = OutResults.Frame.Accuracy;
+		INC_FLOAT_STAT_BY(STAT_SoftwareOcclusionReference, Accuracy.ReferenceSeconds * 1000.0);
+		INC_DWORD_STAT_BY(STAT_SoftwareAccuracyReferenceVisible, Accuracy.NumReferenceVisible);
+		INC_DWORD_STAT_BY(STAT_SoftwareAccuracyFalseVisible, Accuracy.NumFalseVisible);
+		INC_DWORD_STAT_BY(STAT_SoftwareAccuracyFalseOccluded, Accuracy.NumFalseOccluded);
+		INC_DWORD_STAT_BY(STAT_SoftwareAccuracyFalseVisibleShadows, Accuracy.NumFalseVisibleShadows);
+		INC_DWORD_STAT_BY(STAT_SoftwareAccuracyFalseOccludedShadows, Accuracy.NumFalseOccludedShadows);
 	}
 
-	return true;
-}
+	for (const SnowOcclusion::FViewResults& View : OutResults.Frame.Views)
+	{
+		CSV_CUSTOM_STAT(SnowOcclusion, OccluderTris, (int32)View.Stats.NumRasterizedOccluderTris, ECsvCustomStatOp::Accumulate);
+		CSV_CUSTOM_STAT(SnowOcclusion, OccludeeTris, (int32)View.Stats.NumRasterizedOccludeeTris, ECsvCustomStatOp::Accumulate);
+		CSV_CUSTOM_STAT(SnowOcclusion, TaskMs, (View.Stats.OccluderSeconds + View.Stats.OccludeeSeconds + View.Stats.SortSeconds + View.Stats.RasterizeSeconds) * 1000.0, ECsvCustomStatOp::Accumulate);
+		INC_FLOAT_STAT_BY(STAT_SoftwareOcclusionProcessOccluder, View.Stats.OccluderSeconds * 1000.0);
+		INC_FLOAT_STAT_BY(STAT_SoftwareOcclusionProcessOccludee, View.Stats.OccludeeSeconds * 1000.0);
+		INC_FLOAT_STAT_BY(STAT_SoftwareOcclusionSort, View.Stats.SortSeconds * 1000.0);
+		INC_FLOAT_STAT_BY(STAT_SoftwareOcclusionRasterize, View.Stats.RasterizeSeconds * 1000.0);
+		INC_DWORD_STAT_BY(STAT_SoftwareTriangles, View.Stats.NumTriangles);
+		INC_DWORD_STAT_BY(STAT_SoftwareOccluderTris, View.Stats.NumRasterizedOccluderTris);
+		INC_DWORD_STAT_BY(STAT_SoftwareOccludeeTris, View.Stats.NumRasterizedOccludeeTris);
+		INC_DWORD_STAT_BY(STAT_SoftwareExpandedOccludeeGroups, View.Stats.NumExpandedGroups);
+		INC_DWORD_STAT_BY(STAT_SoftwareReprojectionSkippedOccluders, View.Stats.NumSkippedOccluders);
+	}
 
-static const VectorRegister vFramebufferBounds = MakeVectorRegister(FRAMEBUFFER_WIDTH - 1, FRAMEBUFFER_HEIGHT - 1, 1.0f, 1.0f);
-static const VectorRegister vXYHalf = MakeVectorRegister(0.5f, 0.5f, 0.0f, 0.0f);
+	TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_MapResults, SnowOcclusionChannel);
 
-// BEGIN Intel
-static const int32 NUM_CUBE_VTX = 8;
-// 0 = min corner, 1 = max corner
-static const uint32 sBBxInd[NUM_CUBE_VTX] = { 1, 0, 0, 1, 1, 1, 0, 0 };
-static const uint32 sBByInd[NUM_CUBE_VTX] = { 1, 1, 1, 1, 0, 0, 0, 0 };
-static const uint32 sBBzInd[NUM_CUBE_VTX] = { 1, 1, 0, 0, 0, 1, 1, 0 };
-// END Intel
+	const std::vector<uint8>& OccludeeVisible = OutResults.Frame.OccludeeVisible;
+	OutResults.OccludeePrimIds = InSceneData.OccludeeBoxPrimId;
+	for (int32 OccludeeIdx = 0; OccludeeIdx < Scene.NumPrimitiveOccludees; ++OccludeeIdx)
+	{
+		// A primitive with sub-bounds is visible if any of them is
+		bool& VisBit = OutResults.VisibilityMap.FindOrAdd(InSceneData.OccludeeBoxPrimId[OccludeeIdx]);
+		VisBit |= OccludeeVisible[OccludeeIdx] != 0;
 
-static void ProcessOccludeeGeomSIMD(const FMatrix& InMat, const FVector* InMinMax, int32 Num, int32* RESTRICT OutQuads, float* RESTRICT OutQuadDepth, int32* RESTRICT OutQuadClipped)
-{
-	const float W_CLIP = InMat.M[3][2];
-	VectorRegister vClippingW = VectorLoadFloat1(&W_CLIP);
-	VectorRegister mRow0 = VectorLoadAligned(InMat.M[0]);
-	VectorRegister mRow1 = VectorLoadAligned(InMat.M[1]);
-	VectorRegister mRow2 = VectorLoadAligned(InMat.M[2]);
-	VectorRegister mRow3 = VectorLoadAligned(InMat.M[3]);
-	VectorRegister xRow[2], yRow[2], zRow[2];
-
-	for (int32 k = 0; k < Num; ++k)
-	{
-		FVector BoxMin = *(InMinMax++);
-		FVector BoxMax = *(InMinMax++);
-
-		// BEGIN Intel
-				// Project primitive bounding box to screen
-		xRow[0] = VectorMultiply(VectorLoadFloat1(&BoxMin.X), mRow0);
-		xRow[1] = VectorMultiply(VectorLoadFloat1(&BoxMax.X), mRow0);
-		yRow[0] = VectorMultiply(VectorLoadFloat1(&BoxMin.Y), mRow1);
-		yRow[1] = VectorMultiply(VectorLoadFloat1(&BoxMax.Y), mRow1);
-		zRow[0] = VectorMultiply(VectorLoadFloat1(&BoxMin.Z), mRow2);
-		zRow[1] = VectorMultiply(VectorLoadFloat1(&BoxMax.Z), mRow2);
-
-		VectorRegister vClippedFlag = VectorZero();
-		VectorRegister vScreenMin = GlobalVectorConstants::BigNumber;
-		VectorRegister vScreenMax = VectorNegate(vScreenMin);
-
-		for (int32 i = 0; i < NUM_CUBE_VTX; ++i)
+		const int32 SubIdx = InSceneData.OccludeeBoxSubIdx[OccludeeIdx];
+		if (SubIdx != INDEX_NONE)
 		{
-			VectorRegister V;
-			V = VectorAdd(mRow3, xRow[sBBxInd[i]]);
-			V = VectorAdd(V, yRow[sBByInd[i]]);
-			V = VectorAdd(V, zRow[sBBzInd[i]]);
-
-			VectorRegister W = VectorReplicate(V, 3);
-			vClippedFlag = VectorBitwiseOr(vClippedFlag, VectorCompareLT(W, vClippingW));
-			V = VectorDivide(V, W);
-
-			vScreenMin = VectorMin(vScreenMin, V);
-			vScreenMax = VectorMax(vScreenMax, V);
+			TBitArray<>& SubVisBits = OutResults.SubVisibilityMap.FindOrAdd(InSceneData.OccludeeBoxPrimId[OccludeeIdx]);
+			if (SubVisBits.Num() <= SubIdx)
+			{
+				SubVisBits.Add(false, SubIdx + 1 - SubVisBits.Num());
+			}
+			SubVisBits[SubIdx] = OccludeeVisible[OccludeeIdx] != 0;
 		}
-		// END Intel
-
-				// For pixel snapping
-		vScreenMin = VectorAdd(vScreenMin, vXYHalf);
-		vScreenMax = VectorAdd(vScreenMax, vXYHalf);
-
-		// Clip against screen rect
-		vScreenMin = VectorMax(vScreenMin, VectorZero());
-		vScreenMax = VectorMin(vScreenMax, vFramebufferBounds); // Z should be unaffected
+	}
 
-		// Make: MinX, MinY, MaxX, MaxY
-		VectorRegister4Int IntMinMax = VectorFloatToInt(VectorCombineLow(vScreenMin, vScreenMax));
+	// Views hiding primitives on their own need what each of them found, a primitive is visible in a view if any of its boxes is
+	const int32 NumViews = (int32)OutResults.Frame.Views.size();
+	const int32 NumRegularViews = (int32)std::count_if(Scene.Views.begin(), Scene.Views.end(), [](const SnowOcclusion::FSceneView& View) { return !View.bShadowView; });
+	if (NumRegularViews > 1)
+	{
+		for (int32 OccludeeIdx = 0; OccludeeIdx < Scene.NumPrimitiveOccludees; ++OccludeeIdx)
+		{
+			if (!OccludeeVisible[OccludeeIdx])
+			{
+				continue;
+			}
 
-		// Store
-		VectorIntStoreAligned(IntMinMax, OutQuads);
-		VectorStoreFloat1(vClippedFlag, OutQuadClipped);
-		*OutQuadDepth = VectorGetComponent(vScreenMax, 2);
+			TBitArray<>& ViewVisBits = OutResults.ViewVisibilityMap.FindOrAdd(InSceneData.OccludeeBoxPrimId[OccludeeIdx]);
+			if (ViewVisBits.Num() != NumViews)
+			{
+				ViewVisBits.Init(false, NumViews);
+			}
+			for (int32 ViewIdx = 0; ViewIdx < NumViews; ++ViewIdx)
+			{
+				if (OutResults.Frame.Views[ViewIdx].OccludeeVisible[OccludeeIdx])
+				{
+					ViewVisBits[ViewIdx] = true;
+				}
+			}
+		}
+	}
 
-		OutQuads += 4;
-		OutQuadDepth++;
-		OutQuadClipped++;
+	// A caster keeps its shadow if any light sees it and the volume its shadow sweeps along that light is visible
+	for (int32 VolumeIdx = 0; VolumeIdx < (int32)Scene.ShadowVolumeCasterIdx.size(); ++VolumeIdx)
+	{
+		bool& ShadowVisBit = OutResults.ShadowVisibilityMap.FindOrAdd(InSceneData.OccludeeBoxPrimId[Scene.ShadowVolumeCasterIdx[VolumeIdx]]);
+		ShadowVisBit |= OutResults.Frame.ShadowVolumeVisible[VolumeIdx] != 0;
 	}
-}
 
-static void ProcessOccludeeGeomScalar(const FMatrix& InMat, const FVector* InMinMax, int32 Num, int32* RESTRICT OutQuads, float* RESTRICT OutQuadDepth, int32* RESTRICT OutQuadClipped)
-{
-	const float W_CLIP = InMat.M[3][2];
-	FVector4 AX = FVector4(InMat.M[0][0], InMat.M[0][1], InMat.M[0][2], InMat.M[0][3]);
-	FVector4 AY = FVector4(InMat.M[1][0], InMat.M[1][1], InMat.M[1][2], InMat.M[1][3]);
-	FVector4 AZ = FVector4(InMat.M[2][0], InMat.M[2][1], InMat.M[2][2], InMat.M[2][3]);
-	FVector4 AW = FVector4(InMat.M[3][0], InMat.M[3][1], InMat.M[3][2], InMat.M[3][3]);
-	FVector4 xRow[2], yRow[2], zRow[2];
-
-	for (int32 k = 0; k < Num; ++k)
-	{
-		FVector BoxMin = *(InMinMax++);
-		FVector BoxMax = *(InMinMax++);
-		// Project primitive bounding box to screen
-		xRow[0] = FVector4(BoxMin.X, BoxMin.X, BoxMin.X, BoxMin.X) * AX;
-		xRow[1] = FVector4(BoxMax.X, BoxMax.X, BoxMax.X, BoxMax.X) * AX;
-		yRow[0] = FVector4(BoxMin.Y, BoxMin.Y, BoxMin.Y, BoxMin.Y) * AY;
-		yRow[1] = FVector4(BoxMax.Y, BoxMax.Y, BoxMax.Y, BoxMax.Y) * AY;
-		zRow[0] = FVector4(BoxMin.Z, BoxMin.Z, BoxMin.Z, BoxMin.Z) * AZ;
-		zRow[1] = FVector4(BoxMax.Z, BoxMax.Z, BoxMax.Z, BoxMax.Z) * AZ;
-
-		FVector2D MinXY = FVector2D(MAX_flt, MAX_flt);
-		FVector2D MaxXY = FVector2D(-MAX_flt, -MAX_flt);
-		float Depth = 0.f;
-		bool bClippedNear = false;
-
-		for (int32 i = 0; i < NUM_CUBE_VTX; i++)
+	if (InSceneData.bAmortize)
+	{
+		// Occluded whole primitives whose grown rectangle is still occluded can wait a few frames before the next test
+		for (int32 OccludeeIdx = 0; OccludeeIdx < Scene.NumPrimitiveOccludees; ++OccludeeIdx)
 		{
-			FVector4 V = AW;
-			V = V + xRow[sBBxInd[i]];
-			V = V + yRow[sBByInd[i]];
-			V = V + zRow[sBBzInd[i]];
-
-			if (V.W < W_CLIP)
+			if (OccludeeVisible[OccludeeIdx] || InSceneData.OccludeeBoxSubIdx[OccludeeIdx] != INDEX_NONE)
 			{
-				bClippedNear = true;
-				break;
+				continue;
 			}
 
-			V = V / V.W;
-
-			MinXY.X = FMath::Min(MinXY.X, V.X);
-			MinXY.Y = FMath::Min(MinXY.Y, V.Y);
-			MaxXY.X = FMath::Max(MaxXY.X, V.X);
-			MaxXY.Y = FMath::Max(MaxXY.Y, V.Y);
-			Depth = FMath::Max(Depth, V.Z);
+			const int32 OrientedIdx = Scene.OccludeeBoxOrientedIdx[OccludeeIdx];
+			const SnowOcclusion::FOrientedBox* OrientedBox = OrientedIdx != INDEX_NONE ? &Scene.OccludeeOrientedBoxes[OrientedIdx] : nullptr;
+			if (!SnowOcclusion::IsBoxVisibleInResults(OutResults.Frame.Views, { Scene.OccludeeBoxMinMax[OccludeeIdx * 2], Scene.OccludeeBoxMinMax[OccludeeIdx * 2 + 1] }, OrientedBox, GSOAmortizeMarginPixels, Scene.bUseSIMD))
+			{
+				OutResults.DeeplyOccluded.Add(InSceneData.OccludeeBoxPrimId[OccludeeIdx]);
+			}
 		}
 
-		if (bClippedNear)
+		for (const FPrimitiveComponentId& PrimId : InSceneData.AmortizedOccludees)
 		{
-			OutQuadClipped[0] = 1;
-		}
-		else
-		{
-			// For pixel snapping
-			MinXY = MinXY + FVector2D(0.5f, 0.5f);
-			MaxXY = MaxXY + FVector2D(0.5f, 0.5f);
-
-			// Clip against screen rect
-			MinXY.X = FMath::Max(0.f, MinXY.X);
-			MinXY.Y = FMath::Max(0.f, MinXY.Y);
-			MaxXY.X = FMath::Min(FRAMEBUFFER_WIDTH - 1.f, MaxXY.X);
-			MaxXY.Y = FMath::Min(FRAMEBUFFER_HEIGHT - 1.f, MaxXY.Y);
-
-			// Make MinX, MinY, MaxX, MaxY
-			OutQuads[0] = (int32)MinXY.X;
-			OutQuads[1] = (int32)MinXY.Y;
-			OutQuads[2] = (int32)MaxXY.X;
-			OutQuads[3] = (int32)MaxXY.Y;
-
-			OutQuadDepth[0] = Depth;
-			OutQuadClipped[0] = 0;
+			OutResults.VisibilityMap.Add(PrimId, false);
+			OutResults.DeeplyOccluded.Add(PrimId);
 		}
+	}
 
-		OutQuads += 4;
-		OutQuadDepth++;
-		OutQuadClipped++;
+	for (const FPrimitiveComponentId& PrimId : InSceneData.PreCulledOccludees)
+	{
+		OutResults.VisibilityMap.Add(PrimId, false);
 	}
 }
 
-const FMatrix FramebufferMat(
-	FVector(0.5f * (float)FRAMEBUFFER_WIDTH, 0.0f, 0.0f),
-	FVector(0.0f, 0.5f * (float)FRAMEBUFFER_HEIGHT, 0.0f),
-	FVector(0.0f, 0.0f, 1.0f),
-	FVector(0.5f * (float)FRAMEBUFFER_WIDTH, 0.5f * (float)FRAMEBUFFER_HEIGHT, 0.0f)
-);
 
-static bool ProcessOccludeeGeom(const FOcclusionSceneData& SceneData, FOcclusionFrameData& FrameData, TMap<FPrimitiveComponentId, bool>& VisibilityMap)
+FSceneSoftwareOcclusion::FSceneSoftwareOcclusion()
+	: AvailableIndex(0)
+	, ProcessingIndex(1)
+	, ReadyState(2)
 {
-	const int32 RUN_SIZE = 512;
-	const bool bUseSIMD = GSOSIMD != 0;
-
-	int32 NumBoxes = SceneData.OccludeeBoxMinMax.Num() / 2;
-	const FVector* MinMax = SceneData.OccludeeBoxMinMax.GetData();
-	const FPrimitiveComponentId* PrimIds = SceneData.OccludeeBoxPrimId.GetData();
+	for (uint32 Index = 0; Index < NUM_RESULTS_BUFFERS; ++Index)
+	{
+		Results[Index] = MakeUnique<FOcclusionFrameResults>();
+	}
+	History = MakeUnique<SnowOcclusion::FHistory>();
+	SceneData = MakeUnique<FOcclusionSceneData>();
+	Signature = MakeUnique<FOcclusionSceneSignature>();
+	PortalGraph = MakeUnique<SnowOcclusion::FPortalGraph>();
+	PVS = MakeUnique<SnowOcclusion::FPVS>();
+}
 
-	FMatrix WorldToFB = SceneData.ViewProj * FramebufferMat;
+FSceneSoftwareOcclusion::~FSceneSoftwareOcclusion()
+{
+	// make sure async task is done
+	FlushResults();
+}
 
-	// on stack mem for each run output
-	MS_ALIGN(SIMD_ALIGNMENT) int32 Quads[RUN_SIZE * 4] GCC_ALIGN(SIMD_ALIGNMENT);
-	float QuadDepths[RUN_SIZE];
-	int32 QuadClipFlags[RUN_SIZE];
+static int32 ApplyResults(const TArray<USnowPrimitiveInfo*>& Scene, const FOcclusionFrameResults& Results)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_ApplyResults, SnowOcclusionChannel);
 
-	int32 NumRuns = NumBoxes / RUN_SIZE + 1;
-	int32 NumBoxesProcessed = 0;
+	int32 NumOccluded = 0;
+	int32 NumShadowsCulled = 0;
+	// Render cost of the occludees and what culling saved, at the LODs of this frame
+	int64 NumOccludeeTriangles = 0;
+	int64 NumCulledTriangles = 0;
+	int32 NumCulledDrawCalls = 0;
 
-	for (int32 RunIdx = 0; RunIdx < NumRuns; ++RunIdx)
+	for (USnowPrimitiveInfo* Info : Scene)
 	{
-		int32 RunSize = FMath::Min(NumBoxes - NumBoxesProcessed, RUN_SIZE);
+		// Visible by default
+		Info->bVisible = true;
+		Info->bShadowVisible = true;
 
-		// Generate quads
-		if (bUseSIMD)
-		{
-			ProcessOccludeeGeomSIMD(WorldToFB, MinMax, RunSize, Quads, QuadDepths, QuadClipFlags);
-		}
-		else
+		FPrimitiveComponentId PrimId = Info->PrimitiveComponentId;
+
+		const bool* bVisiblePtr = Results.VisibilityMap.Find(PrimId);
+		if (bVisiblePtr)
 		{
-			ProcessOccludeeGeomScalar(WorldToFB, MinMax, RunSize, Quads, QuadDepths, QuadClipFlags);
+			if (*bVisiblePtr == false)
+			{
+				Info->bVisible = false;
+				NumOccluded++;
+			}
 		}
 
-		// Triangulate generated quads
-		int32 QuadIdx = 0;
-		for (int32 i = 0; i < RunSize; ++i)
+		if (Info->SubBounds.Num() > 0)
 		{
-			int32 MinX = Quads[QuadIdx++];
-			int32 MinY = Quads[QuadIdx++];
-			int32 MaxX = Quads[QuadIdx++];
-			int32 MaxY = Quads[QuadIdx++];
-
-			FPrimitiveComponentId PrimitiveId = PrimIds[i];
+			const TBitArray<>* SubVisBits = Results.SubVisibilityMap.Find(PrimId);
+			if (SubVisBits && SubVisBits->Num() == Info->SubBounds.Num())
+			{
+				Info->SubVisible = *SubVisBits;
 
-			if (QuadClipFlags[i] != 0)
+				// Hidden clusters save their instances, the primitive is still drawn
+				if (Info->bVisible && Info->SubNumInstances.Num() == Info->SubBounds.Num())
+				{
+					for (int32 SubIdx = 0; SubIdx < SubVisBits->Num(); ++SubIdx)
+					{
+						if (!(*SubVisBits)[SubIdx])
+						{
+							NumCulledTriangles += (int64)Info->NumTriangles * Info->SubNumInstances[SubIdx];
+						}
+					}
+				}
+			}
+			else
 			{
-				// clipped by near plane, visible
-				VisibilityMap.FindOrAdd(PrimitiveId) = true;
-				continue;
+				// Results were gathered with different sub-bounds
+				Info->SubVisible.Init(true, Info->SubBounds.Num());
 			}
+		}
 
-			// Check MinX <= MaxX and MinY <= MaxY
-			if (MinX > MaxX || MinY > MaxY)
+		if (Info->bOcludee)
+		{
+			const int64 InfoTriangles = (int64)Info->NumTriangles * Info->NumInstances;
+			NumOccludeeTriangles += InfoTriangles;
+			if (!Info->bVisible)
 			{
-				// Do not rasterize if not on screen, occluded
-				VisibilityMap.FindOrAdd(PrimitiveId) = false;
-				continue;
+				NumCulledTriangles += InfoTriangles;
+				NumCulledDrawCalls += Info->NumDrawCalls;
 			}
+		}
 
-			float Depth = QuadDepths[i];
-
-			// add only first tri, rasterizer will figure out to render a quad
-			FScreenTriangle ST;
-			ST.V[0] = { MinX, MinY };
-			ST.V[1] = { MaxX, MaxY };
-			ST.V[2] = { MinX, MaxY };
-			AddTriangle(ST, Depth, PrimitiveId, 0, FrameData);
+		// Only visible primitives can be hidden in some views and not others
+		const TBitArray<>* ViewVisBits = Info->bVisible ? Results.ViewVisibilityMap.Find(PrimId) : nullptr;
+		if (ViewVisBits)
+		{
+			Info->ViewVisible = *ViewVisBits;
+		}
+		else
+		{
+			Info->ViewVisible.Reset();
 		}
 
-		MinMax += (RunSize * 2);
-		PrimIds += RunSize;
-		NumBoxesProcessed += RunSize;
+		// Visible casters keep their shadow
+		const bool* bShadowVisiblePtr = Results.ShadowVisibilityMap.Find(PrimId);
+		if (bShadowVisiblePtr && *bShadowVisiblePtr == false && !Info->bVisible)
+		{
+			Info->bShadowVisible = false;
+			NumShadowsCulled++;
+		}
+	}
 
-	} // for each run
+	INC_DWORD_STAT_BY(STAT_SoftwareCulledPrimitives, NumOccluded);
+	INC_DWORD_STAT_BY(STAT_SoftwareCulledShadows, NumShadowsCulled);
+	CSV_CUSTOM_STAT(SnowOcclusion, Culled, NumOccluded, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(SnowOcclusion, CulledShadows, NumShadowsCulled, ECsvCustomStatOp::Accumulate);
+
+	const int32 CulledTriangles = (int32)FMath::Min<int64>(NumCulledTriangles, MAX_int32);
+	const int32 OccludeeTriangles = (int32)FMath::Min<int64>(NumOccludeeTriangles, MAX_int32);
+	INC_DWORD_STAT_BY(STAT_SoftwareCulledTriangles, CulledTriangles);
+	INC_DWORD_STAT_BY(STAT_SoftwareCulledDrawCalls, NumCulledDrawCalls);
+	INC_DWORD_STAT_BY(STAT_SoftwareOccludeeRenderTriangles, OccludeeTriangles);
+	CSV_CUSTOM_STAT(SnowOcclusion, CulledTriangles, CulledTriangles, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(SnowOcclusion, CulledDrawCalls, NumCulledDrawCalls, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(SnowOcclusion, OccludeeTriangles, OccludeeTriangles, ECsvCustomStatOp::Accumulate);
 
-	return true;
+	return NumOccluded;
 }
 
-static void CollectOccludeeGeom(const FBoxSphereBounds& Bounds, FPrimitiveComponentId PrimitiveId, FOcclusionSceneData& SceneData)
+static int32 GSOThreadName = 2;
+static FAutoConsoleVariableRef CVarSOThreadName(
+	TEXT("r.so.ThreadName"),
+	GSOThreadName,
+	TEXT("0 = AnyHiPriThreadNormalTask")
+	TEXT("1 = AnyHiPriThreadHiPriTask")
+	TEXT("2 = AnyNormalThreadNormalTask (Default)")
+	TEXT("3 = AnyNormalThreadHiPriTask")
+	TEXT("4 = AnyBackgroundThreadNormalTask")
+	TEXT("5 = AnyBackgroundHiPriTask"),
+	ECVF_RenderThreadSafe
+);
+
+static const ENamedThreads::Type ThreadNameMap[] =
 {
-	const FBox Box = Bounds.GetBox();
+	ENamedThreads::AnyHiPriThreadNormalTask,
+	ENamedThreads::AnyHiPriThreadHiPriTask,
+	ENamedThreads::AnyNormalThreadNormalTask,
+	ENamedThreads::AnyNormalThreadHiPriTask,
+	ENamedThreads::AnyBackgroundThreadNormalTask,
+	ENamedThreads::AnyBackgroundHiPriTask,
+};
 
-	SceneData.OccludeeBoxMinMax.Add(Box.Min);
-	SceneData.OccludeeBoxMinMax.Add(Box.Max);
-	SceneData.OccludeeBoxPrimId.Add(PrimitiveId);
+static ENamedThreads::Type GetOcclusionThreadName()
+{
+	int32 Index = FMath::Clamp<int32>(GSOThreadName, 0, UE_ARRAY_COUNT(ThreadNameMap) - 1);
+	return ThreadNameMap[Index];
 }
 
-static bool ClippedVertexToScreen(const FVector4& XFV, FScreenPosition& OutSP, float& OutDepth)
+const static float OCCLUDER_DISTANCE_WEIGHT = 10000.f;
+static float ComputePotentialOccluderWeight(float ScreenSize, float DistanceSquared)
 {
-	checkSlow(XFV.W >= 0.f);
-
-	FVector4 FSP = XFV / XFV.W;
-	int32 X = FMath::RoundToInt((FSP.X + 1.f) * FRAMEBUFFER_WIDTH / 2.0);
-	int32 Y = FMath::RoundToInt((FSP.Y + 1.f) * FRAMEBUFFER_HEIGHT / 2.0);
+	return ScreenSize + OCCLUDER_DISTANCE_WEIGHT / DistanceSquared;
+}
 
-	OutSP.X = X;
-	OutSP.Y = Y;
-	OutDepth = FSP.Z;
-	return false;
+FMatrix FSnowViewInfo::MakeViewMatrix(const FVector& InViewOrigin, const FRotator& InViewRotation)
+{
+	return FTranslationMatrix(-InViewOrigin) * FInverseRotationMatrix(InViewRotation) * FMatrix(
+		FPlane(0, 0, 1, 0),
+		FPlane(1, 0, 0, 0),
+		FPlane(0, 1, 0, 0),
+		FPlane(0, 0, 0, 1));
 }
 
-static uint8 ProcessXFormVertex(const FVector4& XFV, float W_CLIP)
+static float WidenFactor(float ProjectionScale, float WidenAngle)
 {
-	uint8 Flags = 0;
-	float W = XFV.W;
+	// ProjectionScale is 1 / tan(HalfFOV), return the NDC scale that grows HalfFOV by WidenAngle
+	const float HalfFOV = FMath::Atan(1.0f / FMath::Max(ProjectionScale, KINDA_SMALL_NUMBER));
+	const float WidenedHalfFOV = FMath::Min(HalfFOV + WidenAngle, FMath::DegreesToRadians(85.0f));
+	return FMath::Tan(HalfFOV) / FMath::Tan(WidenedHalfFOV);
+}
 
-	if (W < W_CLIP)
+/**
+ * Builds the view projection used for rasterization. While the camera moves the view is extrapolated by the expected
+ * results latency, and while it turns the frustum is also widened to contain both the current and the predicted frusta.
+ * A still camera gets the exact view.
+ */
+static FMatrix BuildPredictedViewProjection(const FSnowViewInfo& View)
+{
+	const FMatrix ViewProj = View.ViewMatrix * View.ProjectionMatrix;
+	if (!GSOPrediction || View.PredictionTime <= 0.0f)
 	{
-		Flags |= EScreenVertexFlags::ClippedNear;
+		return ViewProj;
 	}
 
-	if (XFV.X < -W)
+	const float PredictionTime = View.PredictionTime;
+	const bool bMoving = View.LinearVelocity.SizeSquared() > FMath::Square(GSOPredictionMinLinearSpeed);
+	const FVector AngularVelocity = View.AngularVelocity.Euler();
+	const bool bTurning = AngularVelocity.SizeSquared() > FMath::Square(GSOPredictionMinAngularSpeed);
+	if (!bMoving && !bTurning)
 	{
-		Flags |= EScreenVertexFlags::ClippedLeft;
+		return ViewProj;
 	}
 
-	if (XFV.X > W)
-	{
-		Flags |= EScreenVertexFlags::ClippedRight;
-	}
+	const FVector PredictedOrigin = bMoving ? View.ViewOrigin + View.LinearVelocity * PredictionTime : View.ViewOrigin;
+	const FRotator PredictedRotation = bTurning ? (View.ViewRotation + View.AngularVelocity * PredictionTime).GetNormalized() : View.ViewRotation;
 
-	if (XFV.Y < -W)
+	FMatrix Projection = View.ProjectionMatrix;
+	if (bTurning)
 	{
-		Flags |= EScreenVertexFlags::ClippedTop;
-	}
+		const float Cos = FMath::Clamp<float>(View.ViewRotation.Vector() | PredictedRotation.Vector(), -1.0f, 1.0f);
+		const float WidenAngle = FMath::Acos(Cos) * GSOPredictionWidenScale;
 
-	if (XFV.Y > W)
-	{
-		Flags |= EScreenVertexFlags::ClippedBottom;
+		// Scale clip space X and Y, also correct for off-axis (stereo) projections
+		const float FactorX = WidenFactor(Projection.M[0][0], WidenAngle);
+		const float FactorY = WidenFactor(Projection.M[1][1], WidenAngle);
+		for (int32 Row = 0; Row < 4; ++Row)
+		{
+			Projection.M[Row][0] *= FactorX;
+			Projection.M[Row][1] *= FactorY;
+		}
 	}
 
-	return Flags;
+	return FSnowViewInfo::MakeViewMatrix(PredictedOrigin, PredictedRotation) * Projection;
 }
 
-static void ProcessOccluderGeom(const FOcclusionSceneData& SceneData, FOcclusionFrameData& OutData)
+/** Groups the primitive occludees by grid cell and fills the top level boxes tested first by every view */
+static void BuildOccludeeGroups(FOcclusionSceneData& SceneData)
 {
-	const float W_CLIP = SceneData.ViewProj.M[3][2];
-
-	const int32 NumMeshes = SceneData.OccluderData.Num();
-	const FOcclusionMeshData* MeshData = SceneData.OccluderData.GetData();
-
-	TArray<FVector4>	ClipVertexBuffer;
-	TArray<uint8>		ClipVertexFlagsBuffer;
+	SceneData.GatherArena.Reset();
+	const int32 NumGroups = SnowOcclusion::BuildOccludeeGroups(SceneData.Scene, GSOOccludeeGroupCellSize, GSOOccludeeGroupMinMembers, &SceneData.GatherArena);
+	INC_DWORD_STAT_BY(STAT_SoftwareOccludeeGroups, NumGroups);
+}
 
-	for (int32 MeshIdx = 0; MeshIdx < NumMeshes; ++MeshIdx)
+static uint32 ComputeOccludeeHash(const USnowPrimitiveInfo* Info)
+{
+	uint32 Hash = FCrc::MemCrc32(&Info->Bounds.Origin, sizeof(FVector));
+	Hash = FCrc::MemCrc32(&Info->Bounds.BoxExtent, sizeof(FVector), Hash);
+	Hash = HashCombine(Hash, GetTypeHash(Info->bShadowCaster));
+	if (Info->bOrientedBounds)
 	{
-		const FOcclusionMeshData& Mesh = MeshData[MeshIdx];
-		int32 NumVtx = Mesh.VerticesSP->Num();
-
-		ClipVertexBuffer.SetNumUninitialized(NumVtx, false);
-		ClipVertexFlagsBuffer.SetNumUninitialized(NumVtx, false);
-
-		const FVector* MeshVertices = Mesh.VerticesSP->GetData();
-		FVector4* MeshClipVertices = ClipVertexBuffer.GetData();
-		uint8* MeshClipVertexFlags = ClipVertexFlagsBuffer.GetData();
+		Hash = FCrc::MemCrc32(&Info->OrientedBoundsToWorld, sizeof(FMatrix), Hash);
+		Hash = FCrc::MemCrc32(&Info->OrientedBounds.Min, sizeof(FVector), Hash);
+		Hash = FCrc::MemCrc32(&Info->OrientedBounds.Max, sizeof(FVector), Hash);
+	}
+	for (const FBox& SubBox : Info->SubBounds)
+	{
+		Hash = FCrc::MemCrc32(&SubBox.Min, sizeof(FVector), Hash);
+		Hash = FCrc::MemCrc32(&SubBox.Max, sizeof(FVector), Hash);
+	}
+	return Hash;
+}
 
-		// Transform mesh to clip space
+static void BuildSceneSignature(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views, uint32 PortalGraphRevision, uint32 PVSRevision, FOcclusionSceneSignature& OutSignature)
+{
+	OutSignature.Views = Views;
+
+	// Order independent, the registry doesn't keep its order when objects come and go
+	const FOcclusionSettings Settings = FOcclusionSettings::Get();
+	OutSignature.OccludersHash = FCrc::MemCrc32(&Settings, sizeof(Settings));
+	OutSignature.OccludersHash = HashCombine(OutSignature.OccludersHash, HashCombine(GetTypeHash(PortalGraphRevision), GetTypeHash(PVSRevision)));
+	OutSignature.OccludeeHashes.Reset();
+	OutSignature.OccludeeHashes.Reserve(Scene.Num());
+	for (const USnowPrimitiveInfo* Info : Scene)
+	{
+		if (Info->bOccluder && Info->OccluderData)
 		{
-			const FMatrix LocalToClip = Mesh.LocalToWorld * SceneData.ViewProj;
-			VectorRegister mRow0 = VectorLoadAligned(LocalToClip.M[0]);
-			VectorRegister mRow1 = VectorLoadAligned(LocalToClip.M[1]);
-			VectorRegister mRow2 = VectorLoadAligned(LocalToClip.M[2]);
-			VectorRegister mRow3 = VectorLoadAligned(LocalToClip.M[3]);
-
-			for (int32 i = 0; i < NumVtx; ++i)
-			{
-				VectorRegister VTempX = VectorLoadFloat1(&MeshVertices[i].X);
-				VectorRegister VTempY = VectorLoadFloat1(&MeshVertices[i].Y);
-				VectorRegister VTempZ = VectorLoadFloat1(&MeshVertices[i].Z);
-				VectorRegister VTempW;
-				// Mul by the matrix
-				VTempX = VectorMultiply(VTempX, mRow0);
-				VTempY = VectorMultiply(VTempY, mRow1);
-				VTempZ = VectorMultiply(VTempZ, mRow2);
-				VTempW = VectorMultiply(GlobalVectorConstants::FloatOne, mRow3);
-				// Add them all together
-				VTempX = VectorAdd(VTempX, VTempY);
-				VTempZ = VectorAdd(VTempZ, VTempW);
-				VTempX = VectorAdd(VTempX, VTempZ);
-				// Store
-				VectorStoreAligned(VTempX, &MeshClipVertices[i]);
-
-				uint8 VertexFlags = ProcessXFormVertex(MeshClipVertices[i], W_CLIP);
-				MeshClipVertexFlags[i] = VertexFlags;
-			}
+			OutSignature.OccludersHash += HashCombine(GetTypeHash(Info->PrimitiveComponentId.PrimIDValue), FCrc::MemCrc32(&Info->LocalToWorld, sizeof(FMatrix)));
 		}
 
-		const uint16* MeshIndices = Mesh.IndicesSP->GetData();
-		int32 NumTris = Mesh.IndicesSP->Num() / 3;
-		int32 NumDataTris = OutData.ScreenTriangles.Num();
-
-		// Create triangles
-		for (int32 i = 0; i < NumTris; ++i)
+		if (Info->bOcludee)
 		{
-			uint16 I0 = MeshIndices[i * 3 + 0];
-			uint16 I1 = MeshIndices[i * 3 + 1];
-			uint16 I2 = MeshIndices[i * 3 + 2];
-
-			uint8 F0 = MeshClipVertexFlags[I0];
-			uint8 F1 = MeshClipVertexFlags[I1];
-			uint8 F2 = MeshClipVertexFlags[I2];
-
-			if ((F0 & F1) & F2)
-			{
-				// fully clipped
-				continue;
-			}
-
-			FVector4 V[3] =
-			{
-				MeshClipVertices[I0],
-				MeshClipVertices[I1],
-				MeshClipVertices[I2]
-			};
-
-			uint8 TriFlags = F0 | F1 | F2;
-
-			if (TriFlags & EScreenVertexFlags::ClippedNear)
-			{
-				static const int32 Edges[3][2] = { {0,1}, {1,2}, {2,0} };
-				FVector4 ClippedPos[4];
-				int32 NumPos = 0;
-
-				for (int32 EdgeIdx = 0; EdgeIdx < 3; EdgeIdx++)
-				{
-					int32 i0 = Edges[EdgeIdx][0];
-					int32 i1 = Edges[EdgeIdx][1];
-
-					bool dot0 = V[i0].W < W_CLIP;
-					bool dot1 = V[i1].W < W_CLIP;
-
-					if (!dot0)
-					{
-						ClippedPos[NumPos] = V[i0];
-						NumPos++;
-					}
-
-					if (dot0 != dot1)
-					{
-						float t = (W_CLIP - V[i0].W) / (V[i0].W - V[i1].W);
-						ClippedPos[NumPos] = V[i0] + t * (V[i0] - V[i1]);
-						NumPos++;
-					}
-				}
-
-				// triangulate clipped vertices
-				for (int32 j = 2; j < NumPos; j++)
-				{
-					FScreenTriangle Tri;
-					float Depths[3];
-					bool bShouldDiscard = false;
-
-					bShouldDiscard |= ClippedVertexToScreen(ClippedPos[0], Tri.V[0], Depths[0]);
-					bShouldDiscard |= ClippedVertexToScreen(ClippedPos[j - 1], Tri.V[1], Depths[1]);
-					bShouldDiscard |= ClippedVertexToScreen(ClippedPos[j], Tri.V[2], Depths[2]);
-
-					if (!bShouldDiscard && TestFrontface(Tri))
-					{
-						// Min tri depth for occluder (further from screen)
-						float TriDepth = FMath::Min3(Depths[0], Depths[1], Depths[2]);
-						AddTriangle(Tri, TriDepth, Mesh.PrimId, 1, OutData);
-					}
-				}
-			}
-			else
-			{
-				FScreenTriangle Tri;
-				float Depths[3];
-				bool bShouldDiscard = false;
-
-				for (int32 j = 0; j < 3 && !bShouldDiscard; ++j)
-				{
-					bShouldDiscard |= ClippedVertexToScreen(V[j], Tri.V[j], Depths[j]);
-				}
-
-				if (!bShouldDiscard && TestFrontface(Tri))
-				{
-					// Min tri depth for occluder (further from screen)
-					float TriDepth = FMath::Min3(Depths[0], Depths[1], Depths[2]);
-					AddTriangle(Tri, TriDepth, Mesh.PrimId, /*MeshFlags*/ 1, OutData);
-				}
-			}
-		} // for each triangle
-	}// for each mesh
+			OutSignature.OccludeeHashes.Add(Info->PrimitiveComponentId, ComputeOccludeeHash(Info));
+		}
+	}
 }
 
-class FSWOccluderElementsCollector
+static bool AreViewsCoherent(const TArray<FSnowViewInfo>& A, const TArray<FSnowViewInfo>& B)
 {
-public:
-	FSWOccluderElementsCollector(FOcclusionSceneData& InData)
-		: SceneData(InData)
+	if (A.Num() != B.Num())
 	{
-		SceneData.NumOccluderTriangles = 0;
+		return false;
 	}
 
-	void SetPrimitiveID(FPrimitiveComponentId PrimitiveId)
+	for (int32 ViewIdx = 0; ViewIdx < A.Num(); ++ViewIdx)
 	{
-		CurrentPrimitiveId = PrimitiveId;
+		const FSnowViewInfo& ViewA = A[ViewIdx];
+		const FSnowViewInfo& ViewB = B[ViewIdx];
+		if (ViewA.bShadowView != ViewB.bShadowView
+			|| ViewA.bReverseCulling != ViewB.bReverseCulling
+			|| !ViewA.ProjectionMatrix.Equals(ViewB.ProjectionMatrix, KINDA_SMALL_NUMBER)
+			|| FVector::DistSquared(ViewA.ViewOrigin, ViewB.ViewOrigin) > FMath::Square(GSOCoherencePositionTolerance)
+			|| !ViewA.ViewMatrix.RemoveTranslation().Equals(ViewB.ViewMatrix.RemoveTranslation(), GSOCoherenceRotationTolerance))
+		{
+			return false;
+		}
 	}
 
-	void AddElements(const FOccluderVertexArraySP& Vertices, const FOccluderIndexArraySP& Indices, const FMatrix& LocalToWorld)
-	{
-		SceneData.OccluderData.AddDefaulted();
-		FOcclusionMeshData& MeshData = SceneData.OccluderData.Last();
+	return true;
+}
 
-		MeshData.PrimId = CurrentPrimitiveId;
-		MeshData.LocalToWorld = LocalToWorld;
-		MeshData.VerticesSP = Vertices;
-		MeshData.IndicesSP = Indices;
+/** Tests an occludee that changed since the results were computed and updates its visibility in them */
+static void RetestOccludee(const USnowPrimitiveInfo* Info, FOcclusionFrameResults& Results)
+{
+	const FPrimitiveComponentId PrimId = Info->PrimitiveComponentId;
+	const int32 NumSubBounds = Info->SubBounds.Num();
+	const bool bHasHugeBounds = Info->Bounds.SphereRadius > HALF_WORLD_MAX / 2.0f;
 
-		SceneData.NumOccluderTriangles += Indices->Num() / 3;
+	if (NumSubBounds > 0)
+	{
+		TBitArray<>& SubVisBits = Results.SubVisibilityMap.FindOrAdd(PrimId);
+		SubVisBits.Init(false, NumSubBounds);
+		for (int32 SubIdx = 0; SubIdx < NumSubBounds; ++SubIdx)
+		{
+			SubVisBits[SubIdx] = IsBoxVisibleInResults(Results, Info->SubBounds[SubIdx], nullptr);
+		}
+		Results.VisibilityMap.Add(PrimId, SubVisBits.Contains(true));
+	}
+	else
+	{
+		Results.SubVisibilityMap.Remove(PrimId);
+		if (bHasHugeBounds)
+		{
+			Results.VisibilityMap.Remove(PrimId);
+		}
+		else
+		{
+			const SnowOcclusion::FOrientedBox OrientedBox = { ToCore(Info->OrientedBoundsToWorld), ToCore(Info->OrientedBounds.Min), ToCore(Info->OrientedBounds.Max) };
+			Results.VisibilityMap.Add(PrimId, IsBoxVisibleInResults(Results, Info->Bounds.GetBox(), Info->bOrientedBounds ? &OrientedBox : nullptr));
+		}
 	}
 
-public:
-	FOcclusionSceneData& SceneData;
-	FPrimitiveComponentId CurrentPrimitiveId;
-};
+	// Shadow volumes aren't retested, keep the shadow. Margins aren't measured, test it again next time.
+	// Only the combined visibility is retested, every view goes with it.
+	Results.ShadowVisibilityMap.Remove(PrimId);
+	Results.ViewVisibilityMap.Remove(PrimId);
+	Results.DeeplyOccluded.Remove(PrimId);
+}
 
-static void ProcessOcclusionFrame(const FOcclusionSceneData& InSceneData, FOcclusionFrameResults& OutResults)
+static SnowOcclusion::FFoveation MakeFoveation(bool bEnabled)
 {
-	FOcclusionFrameData FrameData;
-	int32 NumExpectedTriangles = InSceneData.NumOccluderTriangles + InSceneData.OccludeeBoxPrimId.Num(); // one triangle for each occludee
-	FrameData.ReserveBuffers(NumExpectedTriangles);
-
-	{
-		SCOPE_CYCLE_COUNTER(STAT_SoftwareOcclusionProcessOccluder)
-			ProcessOccluderGeom(InSceneData, FrameData);
-	}
+	return SnowOcclusion::MakeFoveation(bEnabled, GSOFoveationCenterSize, GSOFoveationCenterResolution);
+}
 
+/** Whether amortized occludees need testing this frame: no usable previous results, a camera cut, a view that jumped or turned, or a different set of views */
+static bool IsAmortizeReset(const TArray<FSnowViewInfo>& Views, const FOcclusionFrameResults* Previous)
+{
+	if (Previous == nullptr || Previous->Signature.Views.Num() != Views.Num())
 	{
-		SCOPE_CYCLE_COUNTER(STAT_SoftwareOcclusionProcessOccludee)
-			// Generate screen quads from all collected occludee bboxes
-			ProcessOccludeeGeom(InSceneData, FrameData, OutResults.VisibilityMap);
+		return true;
 	}
 
-	int32 NumRasterizedOccluderTris = 0;
-	int32 NumRasterizedOccludeeTris = 0;
+	// Turning brings occludees on screen that were only found occluded while off screen
+	const double MinForwardDot = FMath::Cos(FMath::DegreesToRadians(FMath::Clamp(GSOAmortizeCutAngle, 0.0f, 180.0f)));
+	for (int32 ViewIdx = 0; ViewIdx < Views.Num(); ++ViewIdx)
 	{
-		SCOPE_CYCLE_COUNTER(STAT_SoftwareOcclusionRasterize);
-
-		const uint8* MeshFlags = FrameData.ScreenTrianglesFlags.GetData();
-		const FPrimitiveComponentId* PrimitiveIds = FrameData.ScreenTrianglesPrimID.GetData();
-		const FScreenTriangle* Tris = FrameData.ScreenTriangles.GetData();
-
-		for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
+		const FSnowViewInfo& PrevView = Previous->Signature.Views[ViewIdx];
+		if (Views[ViewIdx].bCameraCut
+			|| Views[ViewIdx].bShadowView != PrevView.bShadowView
+			|| FVector::DistSquared(Views[ViewIdx].ViewOrigin, PrevView.ViewOrigin) > FMath::Square(GSOAmortizeCutDistance)
+			|| FVector::DotProduct(Views[ViewIdx].ViewRotation.Vector(), PrevView.ViewRotation.Vector()) < MinForwardDot)
 		{
-			// Sort triangles in the bin by depth
-			FrameData.SortedTriangles[BinIdx].Sort([](const FSortedIndexDepth& A, const FSortedIndexDepth& B) {
-				// biggerZ (closer) first 
-				return A.Depth > B.Depth;
-			});
-
-			const FSortedIndexDepth* SortedTriIndices = FrameData.SortedTriangles[BinIdx].GetData();
-			const int32 NumTris = FrameData.SortedTriangles[BinIdx].Num();
-			const int32 BinMinX = BinIdx * BIN_WIDTH;
-			FFramebufferBin& Bin = OutResults.Bins[BinIdx];
-			// TODO: add a way to check when bin is already fully rasterized, so we can skip this work
-
-			for (int32 TriIdx = 0; TriIdx < NumTris; ++TriIdx)
-			{
-				int32 TriID = SortedTriIndices[TriIdx].Index;
-				uint8 Flags = MeshFlags[TriID];
-				FPrimitiveComponentId PrimitiveId = PrimitiveIds[TriID];
-				const FScreenTriangle& Tri = Tris[TriID];
-
-				if (Flags != 0)
-				{
-					// rasterize occluder
-					RasterizeOccluderTri(Tri, Bin.Data, Bin.Type, BinMinX);
-					NumRasterizedOccluderTris++;
-				}
-				else
-				{
-					// rasterize occludee
-					bool& VisBit = OutResults.VisibilityMap.FindOrAdd(PrimitiveId);
-					bool bVisible = RasterizeOccludeeQuad(Tri, Bin.Data, Bin.Type, BinMinX);
-					VisBit |= bVisible;
-					NumRasterizedOccludeeTris++;
-				}
-			}
+			return true;
 		}
 	}
 
-	int32 NumTotalTris = FrameData.ScreenTriangles.Num();
-	INC_DWORD_STAT_BY(STAT_SoftwareTriangles, NumTotalTris);
-	INC_DWORD_STAT_BY(STAT_SoftwareOccluderTris, NumRasterizedOccluderTris);
-	INC_DWORD_STAT_BY(STAT_SoftwareOccludeeTris, NumRasterizedOccludeeTris);
-}
-
-FSceneSoftwareOcclusion::FSceneSoftwareOcclusion()
-{
+	return false;
 }
 
-FSceneSoftwareOcclusion::~FSceneSoftwareOcclusion()
+/** The eye anywhere between now and when the results are used, a camera stepping through a door sees both cells */
+static FBox GetViewerBounds(const FSnowViewInfo& View)
 {
-	// make sure async task is done
-	FlushResults();
+	FBox ViewerBounds(View.ViewOrigin, View.ViewOrigin);
+	ViewerBounds += View.ViewOrigin + View.LinearVelocity * View.PredictionTime;
+	return ViewerBounds.ExpandBy(GNearClippingPlane);
 }
 
-static int32 ApplyResults(const TArray<USnowPrimitiveInfo*> Scene, const FOcclusionFrameResults& Results)
+/**
+ * Decodes the baked sets of the cells every camera may be in into SceneData.PVSVisible. False if a camera is outside
+ * the baked cells, nothing is culled by the sets then.
+ */
+static bool FindPVSVisible(const TArray<FSnowViewInfo>& Views, const SnowOcclusion::FPVS& PVS, FOcclusionSceneData& SceneData)
 {
-	int32 NumOccluded = 0;
+	TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_PVS, SnowOcclusionChannel);
 
-	for (USnowPrimitiveInfo* Info : Scene)
+	std::vector<int32>& FoundSets = SceneData.PVSFoundSets;
+	FoundSets.clear();
+	for (const FSnowViewInfo& View : Views)
 	{
-		// Visible by default
-		Info->bVisible = true;
-
-		FPrimitiveComponentId PrimId = Info->PrimitiveComponentId;
+		if (View.bShadowView)
+		{
+			continue;
+		}
 
-		const bool* bVisiblePtr = Results.VisibilityMap.Find(PrimId);
-		if (bVisiblePtr)
+		if (!PVS.FindSets(ToCore(GetViewerBounds(View)), SceneData.PVSViewSets))
 		{
-			if (*bVisiblePtr == false)
+			return false;
+		}
+		for (int32 Set : SceneData.PVSViewSets)
+		{
+			if (std::find(FoundSets.begin(), FoundSets.end(), Set) == FoundSets.end())
 			{
-				Info->bVisible = false;
-				NumOccluded++;
+				FoundSets.push_back(Set);
 			}
 		}
 	}
+	if (FoundSets.empty())
+	{
+		return false;
+	}
 
-	INC_DWORD_STAT_BY(STAT_SoftwareCulledPrimitives, NumOccluded);
-
-	return NumOccluded;
-}
-
-static int32 GSOThreadName = 2;
-static FAutoConsoleVariableRef CVarSOThreadName(
-	TEXT("r.so.ThreadName"),
-	GSOThreadName,
-	TEXT("0 = AnyHiPriThreadNormalTask")
-	TEXT("1 = AnyHiPriThreadHiPriTask")
-	TEXT("2 = AnyNormalThreadNormalTask (Default)")
-	TEXT("3 = AnyNormalThreadHiPriTask")
-	TEXT("4 = AnyBackgroundThreadNormalTask")
-	TEXT("5 = AnyBackgroundHiPriTask"),
-	ECVF_RenderThreadSafe
-);
-
-static const ENamedThreads::Type ThreadNameMap[] =
-{
-	ENamedThreads::AnyHiPriThreadNormalTask,
-	ENamedThreads::AnyHiPriThreadHiPriTask,
-	ENamedThreads::AnyNormalThreadNormalTask,
-	ENamedThreads::AnyNormalThreadHiPriTask,
-	ENamedThreads::AnyBackgroundThreadNormalTask,
-	ENamedThreads::AnyBackgroundHiPriTask,
-};
-
-static ENamedThreads::Type GetOcclusionThreadName()
-{
-	int32 Index = FMath::Clamp<int32>(GSOThreadName, 0, UE_ARRAY_COUNT(ThreadNameMap) - 1);
-	return ThreadNameMap[Index];
+	// Cameras mostly stay in the same cells, the sets are only decoded again when they don't
+	std::sort(FoundSets.begin(), FoundSets.end());
+	if (FoundSets != SceneData.PVSDecodedSets)
+	{
+		SceneData.PVSDecodedSets = FoundSets;
+		SceneData.PVSVisible.assign(PVS.NumPrimitives, 0);
+		for (int32 Set : FoundSets)
+		{
+			PVS.AddSetVisible(Set, SceneData.PVSVisible.data());
+		}
+	}
+	return true;
 }
 
-struct FPotentialOccluderPrimitive
+/** Whether any camera sees the box through the portals, shadow views don't look through them */
+static bool IsBoxPortalVisible(const FBox& Box, const TArray<FSnowViewInfo>& Views, const FOcclusionSceneData& SceneData, const SnowOcclusion::FPortalGraph& PortalGraph)
 {
-	FPrimitiveComponentId PrimitiveComponentId;
-	const FSnowMeshOccluderData* OccluderData;
-	FMatrix LocalToWorld;
-
-	float Weight;
-};
-
-const static float OCCLUDER_DISTANCE_WEIGHT = 10000.f;
-static float ComputePotentialOccluderWeight(float ScreenSize, float DistanceSquared)
-{
-	return ScreenSize + OCCLUDER_DISTANCE_WEIGHT / DistanceSquared;
+	const SnowOcclusion::FBox3 CoreBox = ToCore(Box);
+	for (int32 ViewIdx = 0; ViewIdx < Views.Num(); ++ViewIdx)
+	{
+		if (!Views[ViewIdx].bShadowView
+			&& SnowOcclusion::IsBoxPortalVisible(PortalGraph, SceneData.PortalVisibility[ViewIdx], SceneData.Scene.Views[ViewIdx].ViewProj, CoreBox))
+		{
+			return true;
+		}
+	}
+	return false;
 }
 
-static FGraphEventRef SubmitScene(const TArray<USnowPrimitiveInfo*> Scene, FSnowViewInfo& View, FOcclusionFrameResults* Results)
+/**
+ * Submits the scene for processing. Previous are the results currently applied, if recent enough: occludees found occluded
+ * with a wide margin in them are only tested every r.so.AmortizeInterval frames. Baked primitives the sets of PVS don't
+ * hold for the camera cells, and primitives no camera sees through the portals of PortalGraph, are culled before they
+ * reach the core.
+ */
+static FGraphEventRef SubmitScene(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views, const FOcclusionFrameResults* Previous, FOcclusionFrameResults* Results, FOcclusionSceneData* SceneData, SnowOcclusion::FHistory* History, FOcclusionCapture* Capture, const SnowOcclusion::FPortalGraph* PortalGraph, const SnowOcclusion::FPVS* PVS, ENamedThreads::Type ThreadName, TFunction<void()>&& OnCompleted)
 {
 	int32 NumCollectedOccluders = 0;
 	int32 NumCollectedOccludees = 0;
 
-	const FMatrix ViewProjMat = View.ViewMatrix * View.ProjectionMatrix;
-	const FVector ViewOrigin = View.ViewOrigin;
+	// With reprojection views skip covered occluders, collect extra ones to take their place
+	const bool bReprojection = GSOReprojection != 0;
+	const int32 MaxCollectedOccluders = bReprojection ? FMath::CeilToInt(GSOMaxOccluderNum * FMath::Max(GSOReprojectionOccluderScale, 1.0f)) : GSOMaxOccluderNum;
+
 	const float MaxDistanceSquared = FMath::Square(GSOMaxDistanceForOccluder);
 
-	// Allocate occlusion scene
-	TUniquePtr<FOcclusionSceneData> SceneData = MakeUnique<FOcclusionSceneData>();
-	SceneData->ViewProj = ViewProjMat;
+	// Fill the reused occlusion scene, the task emptied it
+	SceneData->Scene.MaxRasterizedOccluders = GSOMaxOccluderNum;
+	SceneData->Scene.bReprojection = bReprojection;
+	SceneData->Scene.bUseSIMD = GSOSIMD != 0;
+	SceneData->bAmortize = GSOAmortizeInterval > 1;
+	SceneData->AccuracyScale = GSOAccuracy ? FMath::Clamp(GSOAccuracyScale, 1, SnowOcclusion::MAX_REFERENCE_SCALE) : 0;
+
+	const bool bAmortizeSkip = SceneData->bAmortize && !IsAmortizeReset(Views, Previous);
+	const bool bHasShadowViews = Views.ContainsByPredicate([](const FSnowViewInfo& View) { return View.bShadowView; });
+	const float AmortizeMinDistanceSquared = FMath::Square(GSOAmortizeMinDistance);
+	for (const FSnowViewInfo& View : Views)
+	{
+		SnowOcclusion::FSceneView& SceneView = SceneData->Scene.Views.emplace_back();
+		SceneView.ViewProj = ToCore(BuildPredictedViewProjection(View));
+		SceneView.ClipW = SnowOcclusion::ComputeClipW(SceneView.ViewProj, View.ProjectionMatrix.M[3][3] == 1.0f);
+		SceneView.bReverseCulling = View.bReverseCulling;
+		SceneView.bShadowView = View.bShadowView;
+		SceneView.Foveation = MakeFoveation(!View.bShadowView && (GSOFoveation == 2 || (GSOFoveation == 1 && View.bStereo)));
+	}
+
+	// Mirrored views look from the other side of the mirror, where the cells don't say what they see
+	const bool bMirrored = Views.ContainsByPredicate([](const FSnowViewInfo& View) { return View.bReverseCulling && !View.bShadowView; });
+	const bool bPortals = GSOPortals != 0 && PortalGraph != nullptr && !PortalGraph->IsEmpty() && !bMirrored;
+	const bool bPVS = GSOPVS != 0 && PVS != nullptr && !PVS->IsEmpty() && !bMirrored && FindPVSVisible(Views, *PVS, *SceneData);
+	const int32 NumPVSPrimitives = bPVS ? (int32)SceneData->PVSVisible.size() : 0;
+	auto IsPVSCulled = [SceneData, NumPVSPrimitives](const USnowPrimitiveInfo* Info)
+	{
+		return Info->PVSIndex >= 0 && Info->PVSIndex < NumPVSPrimitives && !SceneData->PVSVisible[Info->PVSIndex];
+	};
+	int32 NumPVSCulledOccludees = 0;
+	int32 NumPVSCulledOccluders = 0;
+	int32 NumPortalCulledOccludees = 0;
+	int32 NumPortalCulledOccluders = 0;
+	int32 NumPortalVisibleCells = 0;
+	if (bPortals)
+	{
+		TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_PortalVisibility, SnowOcclusionChannel);
+
+		SceneData->PortalVisibility.SetNum(Views.Num());
+		for (int32 ViewIdx = 0; ViewIdx < Views.Num(); ++ViewIdx)
+		{
+			const FSnowViewInfo& View = Views[ViewIdx];
+			if (View.bShadowView)
+			{
+				continue;
+			}
+
+			SnowOcclusion::FPortalVisibility& Visibility = SceneData->PortalVisibility[ViewIdx];
+			SnowOcclusion::ComputePortalVisibility(*PortalGraph, ToCore(GetViewerBounds(View)), SceneData->Scene.Views[ViewIdx].ViewProj, Visibility);
+			NumPortalVisibleCells += Visibility.NumVisibleCells;
+		}
+	}
 
 	const int32 NumReserveOccludee = 1024;
 	SceneData->OccludeeBoxPrimId.Reserve(NumReserveOccludee);
-	SceneData->OccludeeBoxMinMax.Reserve(NumReserveOccludee * 2);
-	SceneData->OccluderData.Reserve(GSOMaxOccluderNum);
+	SceneData->OccludeeBoxSubIdx.Reserve(NumReserveOccludee);
+	SceneData->Scene.OccludeeBoxMinMax.reserve(NumReserveOccludee * 2);
+	SceneData->Scene.OccludeeBoxOrientedIdx.reserve(NumReserveOccludee);
+	SceneData->Scene.Occluders.reserve(MaxCollectedOccluders);
+	SceneData->OccluderPrimIds.Reserve(MaxCollectedOccluders);
+	SceneData->OccluderVertices.Reserve(MaxCollectedOccluders);
+	SceneData->OccluderIndices.Reserve(MaxCollectedOccluders);
 
 	// Collect scene geometry: occluders, occludees
 	{
 		SCOPE_CYCLE_COUNTER(STAT_SoftwareOcclusionGather);
+		TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_Gather, SnowOcclusionChannel);
 
 		FSWOccluderElementsCollector Collector(*SceneData);
 
-		TArray<FPotentialOccluderPrimitive> PotentialOccluders;
-		PotentialOccluders.Reserve(GSOMaxOccluderNum);
+		TArray<FPotentialOccluderPrimitive>& PotentialOccluders = SceneData->PotentialOccluders;
+		PotentialOccluders.Reserve(MaxCollectedOccluders);
+
+		TArray<int32>& ShadowCasterIdx = SceneData->ShadowCasterIdx;
 
 		for (USnowPrimitiveInfo* Info : Scene)
 		{
@@ -1082,21 +1437,47 @@ static FGraphEventRef SubmitScene(const TArray<USnowPrimitiveInfo*> Scene, FSnow
 			FMatrix LocalToWorld = Info->LocalToWorld;
 
 			const bool bHasHugeBounds = Bounds.SphereRadius > HALF_WORLD_MAX / 2.0f; // big objects like skybox
-			float DistanceSquared = 0.f;
-			float ScreenSize = 0.f;
 
-			// Find out whether primitive can/should be occluder or occludee
-			bool bCanBeOccluder = !bHasHugeBounds && Info->bOccluder;
-			if (bCanBeOccluder)
+			// Find out whether primitive can/should be occluder or occludee.
+			// Occluders are shared by all views, so keep the ones relevant to any of them.
+			float Weight = 0.f;
+			bool bCanBeOccluder = false;
+			if (!bHasHugeBounds && Info->bOccluder)
 			{
-				// Size/distance requirements
-				DistanceSquared = FMath::Max(OCCLUDER_DISTANCE_WEIGHT, (Bounds.Origin - ViewOrigin).SizeSquared() - FMath::Square(Bounds.SphereRadius));
-				if (DistanceSquared < MaxDistanceSquared)
+				for (const FSnowViewInfo& View : Views)
 				{
-					ScreenSize = ComputeBoundsScreenSize(Bounds.Origin, Bounds.SphereRadius, View.ViewOrigin, View.ProjectionMatrix);
+					// Occluders are picked for what the cameras see, shadow views reuse them
+					if (View.bShadowView)
+					{
+						continue;
+					}
+
+					// Size/distance requirements
+					float ScreenSize = 0.f;
+					const float DistanceSquared = FMath::Max(OCCLUDER_DISTANCE_WEIGHT, (Bounds.Origin - View.ViewOrigin).SizeSquared() - FMath::Square(Bounds.SphereRadius));
+					if (DistanceSquared < MaxDistanceSquared)
+					{
+						ScreenSize = ComputeBoundsScreenSize(Bounds.Origin, Bounds.SphereRadius, View.ViewOrigin, View.ProjectionMatrix);
+					}
+
+					if (GSOMinScreenRadiusForOccluder < ScreenSize)
+					{
+						bCanBeOccluder = true;
+						Weight = FMath::Max(Weight, ComputePotentialOccluderWeight(ScreenSize, DistanceSquared));
+					}
 				}
 
-				bCanBeOccluder = GSOMinScreenRadiusForOccluder < ScreenSize;
+				// Walls the cells of the cameras don't see, or in rooms no camera sees through the portals, hide nothing the cameras see
+				if (bCanBeOccluder && IsPVSCulled(Info))
+				{
+					bCanBeOccluder = false;
+					NumPVSCulledOccluders++;
+				}
+				else if (bCanBeOccluder && bPortals && !IsBoxPortalVisible(Bounds.GetBox(), Views, *SceneData, *PortalGraph))
+				{
+					bCanBeOccluder = false;
+					NumPortalCulledOccluders++;
+				}
 			}
 
 			if (bCanBeOccluder)
@@ -1107,24 +1488,94 @@ static FGraphEventRef SubmitScene(const TArray<USnowPrimitiveInfo*> Scene, FSnow
 				PotentialOccluder.PrimitiveComponentId = PrimitiveComponentId;
 				PotentialOccluder.OccluderData = OccluderData;
 				PotentialOccluder.LocalToWorld = LocalToWorld;
-				PotentialOccluder.Weight = ComputePotentialOccluderWeight(ScreenSize, DistanceSquared);
+				PotentialOccluder.Bounds = Bounds.GetBox();
+				PotentialOccluder.Weight = Weight;
+			}
+
+			// Primitives with sub-bounds (instance clusters) are tested per sub-bounds, however big the primitive is
+			const int32 NumSubBounds = Info->SubBounds.Num();
+			bool bCanBeOccludee = (!bHasHugeBounds || NumSubBounds > 0) && Info->bOcludee;
+
+			// Deeply occluded primitives away from the views take turns. Casters still need their shadow volumes tested.
+			if (bCanBeOccludee && bAmortizeSkip && NumSubBounds == 0 && !(Info->bShadowCaster && bHasShadowViews)
+				&& (PrimitiveComponentId.PrimIDValue + GFrameCounter) % GSOAmortizeInterval != 0
+				&& Previous->DeeplyOccluded.Contains(PrimitiveComponentId))
+			{
+				const bool bNearView = Views.ContainsByPredicate([&Bounds, AmortizeMinDistanceSquared](const FSnowViewInfo& View) {
+					return !View.bShadowView && Bounds.ComputeSquaredDistanceFromBoxToPoint(View.ViewOrigin) < AmortizeMinDistanceSquared;
+				});
+				if (!bNearView)
+				{
+					SceneData->AmortizedOccludees.Add(PrimitiveComponentId);
+					bCanBeOccludee = false;
+				}
+			}
+
+			// Whole primitives the cells of the cameras don't see, or in rooms no camera sees through the portals, are occluded
+			// without rasterizing anything. Casters keep their shadow volume test, the light may see them.
+			if (bCanBeOccludee && NumSubBounds == 0 && !(Info->bShadowCaster && bHasShadowViews))
+			{
+				if (IsPVSCulled(Info))
+				{
+					SceneData->PreCulledOccludees.Add(PrimitiveComponentId);
+					bCanBeOccludee = false;
+					NumPVSCulledOccludees++;
+				}
+				else if (bPortals && !IsBoxPortalVisible(Bounds.GetBox(), Views, *SceneData, *PortalGraph))
+				{
+					SceneData->PreCulledOccludees.Add(PrimitiveComponentId);
+					bCanBeOccludee = false;
+					NumPortalCulledOccludees++;
+				}
 			}
 
-			bool bCanBeOccludee = !bHasHugeBounds && Info->bOcludee;
 			if (bCanBeOccludee)
 			{
-				// Collect occludee bbox
-				CollectOccludeeGeom(Bounds, PrimitiveComponentId, *SceneData);
-				NumCollectedOccludees++;
+				for (int32 SubIdx = (NumSubBounds > 0 ? 0 : INDEX_NONE); SubIdx < NumSubBounds; ++SubIdx)
+				{
+					if (Info->bShadowCaster)
+					{
+						ShadowCasterIdx.Add(NumCollectedOccludees);
+					}
+
+					// Collect occludee bbox. Rotated long objects get a much tighter screen rectangle from their oriented box.
+					const SnowOcclusion::FOrientedBox OrientedBox = { ToCore(Info->OrientedBoundsToWorld), ToCore(Info->OrientedBounds.Min), ToCore(Info->OrientedBounds.Max) };
+					const bool bOriented = SubIdx == INDEX_NONE && Info->bOrientedBounds;
+					CollectOccludeeGeom(SubIdx == INDEX_NONE ? Bounds.GetBox() : Info->SubBounds[SubIdx], bOriented ? &OrientedBox : nullptr, PrimitiveComponentId, SubIdx, *SceneData);
+					NumCollectedOccludees++;
+				}
+			}
+		}
+
+		// Sweep the bounds of every shadow caster along each light, regular views test whether the swept box is visible
+		SceneData->Scene.NumPrimitiveOccludees = NumCollectedOccludees;
+		for (int32 ViewIdx = 0; ViewIdx < Views.Num(); ++ViewIdx)
+		{
+			if (!Views[ViewIdx].bShadowView)
+			{
+				continue;
+			}
+
+			const FVector ShadowOffset = Views[ViewIdx].ViewRotation.Vector() * GSOShadowVolumeLength;
+			for (int32 CasterIdx : ShadowCasterIdx)
+			{
+				FBox ShadowVolume = FromCore(SceneData->Scene.OccludeeBoxMinMax[CasterIdx * 2], SceneData->Scene.OccludeeBoxMinMax[CasterIdx * 2 + 1]);
+				ShadowVolume += ShadowVolume.ShiftBy(ShadowOffset);
+
+				CollectOccludeeGeom(ShadowVolume, nullptr, SceneData->OccludeeBoxPrimId[CasterIdx], SceneData->OccludeeBoxSubIdx[CasterIdx], *SceneData);
+				SceneData->Scene.ShadowVolumeCasterIdx.push_back(CasterIdx);
+				SceneData->Scene.ShadowVolumeViewIdx.push_back(ViewIdx);
 			}
 		}
 
+		BuildOccludeeGroups(*SceneData);
+
 		// Sort potential occluders by weight
 		PotentialOccluders.Sort([&](const FPotentialOccluderPrimitive& A, const FPotentialOccluderPrimitive& B) {
 			return A.Weight > B.Weight;
 		});
 
-		// Add sorted occluders to scene up to GSOMaxOccluderNum
+		// Add sorted occluders to scene up to MaxCollectedOccluders
 		for (const FPotentialOccluderPrimitive& PotentialOccluder : PotentialOccluders)
 		{
 			const FPrimitiveComponentId PrimitiveComponentId = PotentialOccluder.PrimitiveComponentId;
@@ -1136,11 +1587,11 @@ static FGraphEventRef SubmitScene(const TArray<USnowPrimitiveInfo*> Scene, FSnow
 			{
 				Collector.SetPrimitiveID(PrimitiveComponentId);
 				// Collect occluder geometry
-				Collector.AddElements(OccluderData->VerticesSP, OccluderData->IndicesSP, PotentialOccluder.LocalToWorld);
+				Collector.AddElements(OccluderData->VerticesSP, OccluderData->IndicesSP, PotentialOccluder.LocalToWorld, PotentialOccluder.Bounds);
 				NumCollectedOccluders++;
 			}
 
-			if (NumCollectedOccluders >= GSOMaxOccluderNum)
+			if (NumCollectedOccluders >= MaxCollectedOccluders)
 			{
 				break;
 			}
@@ -1149,50 +1600,313 @@ static FGraphEventRef SubmitScene(const TArray<USnowPrimitiveInfo*> Scene, FSnow
 
 	INC_DWORD_STAT_BY(STAT_SoftwareOccluders, NumCollectedOccluders);
 	INC_DWORD_STAT_BY(STAT_SoftwareOccludees, NumCollectedOccludees);
+	INC_DWORD_STAT_BY(STAT_SoftwareAmortizedOccludees, SceneData->AmortizedOccludees.Num());
+	CSV_CUSTOM_STAT(SnowOcclusion, Occluders, NumCollectedOccluders, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(SnowOcclusion, Occludees, NumCollectedOccludees, ECsvCustomStatOp::Accumulate);
+	CSV_CUSTOM_STAT(SnowOcclusion, AmortizedOccludees, SceneData->AmortizedOccludees.Num(), ECsvCustomStatOp::Accumulate);
+	if (bPVS)
+	{
+		INC_DWORD_STAT_BY(STAT_SoftwarePVSCulledOccludees, NumPVSCulledOccludees);
+		INC_DWORD_STAT_BY(STAT_SoftwarePVSCulledOccluders, NumPVSCulledOccluders);
+		CSV_CUSTOM_STAT(SnowOcclusion, PVSCulledOccludees, NumPVSCulledOccludees, ECsvCustomStatOp::Accumulate);
+		CSV_CUSTOM_STAT(SnowOcclusion, PVSCulledOccluders, NumPVSCulledOccluders, ECsvCustomStatOp::Accumulate);
+	}
+	if (bPortals)
+	{
+		INC_DWORD_STAT_BY(STAT_SoftwarePortalCulledOccludees, NumPortalCulledOccludees);
+		INC_DWORD_STAT_BY(STAT_SoftwarePortalCulledOccluders, NumPortalCulledOccluders);
+		INC_DWORD_STAT_BY(STAT_SoftwarePortalVisibleCells, NumPortalVisibleCells);
+		CSV_CUSTOM_STAT(SnowOcclusion, PortalCulledOccludees, NumPortalCulledOccludees, ECsvCustomStatOp::Accumulate);
+		CSV_CUSTOM_STAT(SnowOcclusion, PortalCulledOccluders, NumPortalCulledOccluders, ECsvCustomStatOp::Accumulate);
+	}
 
 	// reserve space for occludees vis flags 
 	Results->VisibilityMap.Reserve(NumCollectedOccludees);
 
 	// Submit occlusion task
-	FOcclusionSceneData* SceneDataParam = SceneData.Release();
-	return FFunctionGraphTask::CreateAndDispatchWhenReady([SceneDataParam, Results]()
+	return FFunctionGraphTask::CreateAndDispatchWhenReady([SceneData, Results, History, Capture, OnCompleted = MoveTemp(OnCompleted)]()
 	{
-		ProcessOcclusionFrame(*SceneDataParam, *Results);
-		delete SceneDataParam;
-	}, GET_STATID(STAT_SoftwareOcclusionProcess), NULL, GetOcclusionThreadName());
+		TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_Task, SnowOcclusionChannel);
+
+		ProcessOcclusionFrame(*SceneData, History, *Results);
+
+		if (Capture && Capture->FramesLeft > 0)
+		{
+			if (!Capture->Writer.WriteFrame(Results->FrameNumber, SceneData->Scene, Results->Frame) || --Capture->FramesLeft == 0)
+			{
+				Capture->FramesLeft = 0;
+				Capture->Writer.Close();
+			}
+		}
+		SceneData->Reset();
+
+		Results->bValid = true;
+		OnCompleted();
+	}, GET_STATID(STAT_SoftwareOcclusionProcess), NULL, ThreadName);
 }
 
-int32 FSceneSoftwareOcclusion::Process(const TArray<USnowPrimitiveInfo*> Scene, FSnowViewInfo& View)
+int32 FSceneSoftwareOcclusion::Process(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views)
 {
-	// Make sure occlusion task issued last frame is completed
+	// Pick up the latest finished results, if any. Never waits on the task.
+	AcquireLatestResults();
+
+	// Only one task is in flight at a time. If last frame's task is late, skip this frame's submission
+	// and keep using the results we have rather than stalling the game thread.
+	if (TaskRef.IsValid() && !TaskRef->IsComplete())
+	{
+		INC_DWORD_STAT(STAT_SoftwareSkippedSubmissions);
+		CSV_CUSTOM_STAT(SnowOcclusion, SkippedSubmissions, 1, ECsvCustomStatOp::Accumulate);
+	}
+	else
+	{
+		// Submit occlusion scene for next frame, unless the last results still hold
+		if (!TryReuseResults(Scene, Views, *Signature))
+		{
+			SubmitTask(Scene, Views, GetOcclusionThreadName());
+		}
+	}
+
+	return ApplyAvailableResults(Scene);
+}
+
+void FSceneSoftwareOcclusion::Submit(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views)
+{
+	// Results are consumed within the frame, so nothing should be in flight here
 	FlushResults();
+	AcquireLatestResults();
+
+	if (!TryReuseResults(Scene, Views, *Signature))
+	{
+		// The task sits on the critical path of this frame, schedule it ahead of regular work
+		SubmitTask(Scene, Views, ENamedThreads::AnyHiPriThreadHiPriTask);
+	}
+}
+
+int32 FSceneSoftwareOcclusion::ApplySubmittedResults(const TArray<USnowPrimitiveInfo*>& Scene)
+{
+	FlushResults();
+	AcquireLatestResults();
+
+	return ApplyAvailableResults(Scene);
+}
+
+void FSceneSoftwareOcclusion::AcquireLatestResults()
+{
+	if (ReadyState.load(std::memory_order_relaxed) & RESULTS_FRESH_BIT)
+	{
+		const uint32 PrevReadyState = ReadyState.exchange(AvailableIndex, std::memory_order_acq_rel);
+		AvailableIndex = PrevReadyState & RESULTS_INDEX_MASK;
+	}
+}
+
+bool FSceneSoftwareOcclusion::TryReuseResults(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views, FOcclusionSceneSignature& OutSignature)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_TryReuseResults, SnowOcclusionChannel);
+
+	BuildSceneSignature(Scene, Views, PortalGraphRevision, PVSRevision, OutSignature);
+
+	FOcclusionFrameResults& Available = *Results[AvailableIndex];
+	const int32 ResultsAge = GetResultsAge();
+	if (!GSOCoherence
+		|| ResultsAge == INDEX_NONE
+		|| ResultsAge > GSOMaxResultsAge
+		|| OutSignature.OccludersHash != Available.Signature.OccludersHash
+		|| !AreViewsCoherent(Views, Available.Signature.Views))
+	{
+		return false;
+	}
+
+	TArray<const USnowPrimitiveInfo*, TInlineAllocator<64>> Changed;
+	for (const USnowPrimitiveInfo* Info : Scene)
+	{
+		const uint32* Hash = OutSignature.OccludeeHashes.Find(Info->PrimitiveComponentId);
+		const uint32* ResultsHash = Available.Signature.OccludeeHashes.Find(Info->PrimitiveComponentId);
+		if (Hash && (!ResultsHash || *ResultsHash != *Hash))
+		{
+			if (Changed.Num() >= GSOCoherenceMaxRetestedOccludees)
+			{
+				return false;
+			}
+			Changed.Add(Info);
+		}
+	}
+
+	// The buffers still hold, test what moved or appeared against them and keep the results fresh
+	for (const USnowPrimitiveInfo* Info : Changed)
+	{
+		RetestOccludee(Info, Available);
+		Available.Signature.OccludeeHashes.Add(Info->PrimitiveComponentId, OutSignature.OccludeeHashes[Info->PrimitiveComponentId]);
+	}
+	Available.FrameNumber = GFrameCounter;
+
+	INC_DWORD_STAT(STAT_SoftwareReusedResults);
+	INC_DWORD_STAT_BY(STAT_SoftwareRetestedOccludees, Changed.Num());
+	CSV_CUSTOM_STAT(SnowOcclusion, ReusedResults, 1, ECsvCustomStatOp::Accumulate);
+	return true;
+}
+
+void FSceneSoftwareOcclusion::SubmitTask(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views, ENamedThreads::Type ThreadName)
+{
+	const uint32 ResultsIndex = ProcessingIndex;
+	FOcclusionFrameResults* Processing = Results[ResultsIndex].Get();
+	Processing->Reset(GFrameCounter, Views.Num());
+	// The old signature of the buffer becomes the one built next time, its map keeps its memory
+	Swap(Processing->Signature, *Signature);
+
+	const int32 ResultsAge = GetResultsAge();
+	const FOcclusionFrameResults* Previous = ResultsAge != INDEX_NONE && ResultsAge <= GSOMaxResultsAge ? Results[AvailableIndex].Get() : nullptr;
+
+	UpdateCapture();
+
+	TaskRef = SubmitScene(Scene, Views, Previous, Processing, SceneData.Get(), History.Get(), Capture.Get(), PortalGraph.Get(), PVS.Get(), ThreadName, [this, ResultsIndex]()
+	{
+		PublishResults(ResultsIndex);
+	});
+}
+
+void FSceneSoftwareOcclusion::UpdateCapture()
+{
+	// No task is in flight here, the capture can be looked at and replaced
+	if (Capture.IsValid() && !Capture->Writer.IsOpen())
+	{
+		UE_LOG(LogTemp, Log, TEXT("SnowOcclusion: captured %d frames to %s"), Capture->Writer.GetNumFrames(), *Capture->Path);
+		Capture.Reset();
+	}
+
+	if (GSOCaptureRequestFrames <= 0 || Capture.IsValid())
+	{
+		return;
+	}
+
+	TUniquePtr<FOcclusionCapture> NewCapture = MakeUnique<FOcclusionCapture>();
+	NewCapture->Path = !GSOCaptureRequestPath.IsEmpty() ? GSOCaptureRequestPath
+		: FPaths::ProfilingDir() / TEXT("SnowOcclusion") / FString::Printf(TEXT("SnowOcclusion-%s.socap"), *FDateTime::Now().ToString());
+	NewCapture->FramesLeft = GSOCaptureRequestFrames;
+	GSOCaptureRequestFrames = 0;
 
-	// Finished processing occlusion, set results as available
-	Available = MoveTemp(Processing);
+	TSharedPtr<FArchive> File(IFileManager::Get().CreateFileWriter(*NewCapture->Path));
+	const bool bOpened = File.IsValid() && NewCapture->Writer.Open([File](const void* Data, size_t Size)
+	{
+		File->Serialize(const_cast<void*>(Data), (int64)Size);
+		return !File->IsError();
+	});
+	if (!bOpened)
+	{
+		UE_LOG(LogTemp, Error, TEXT("SnowOcclusion: can't write capture %s"), *NewCapture->Path);
+		return;
+	}
 
-	// Submit occlusion scene for next frame
-	Processing = MakeUnique<FOcclusionFrameResults>();
-	TaskRef = SubmitScene(Scene, View, Processing.Get());
+	// A replay starts without history, so must the captured frames
+	History = MakeUnique<SnowOcclusion::FHistory>();
+	Capture = MoveTemp(NewCapture);
+	UE_LOG(LogTemp, Log, TEXT("SnowOcclusion: capturing %d frames to %s"), Capture->FramesLeft, *Capture->Path);
+}
 
-	// Apply available occlusion results
+int32 FSceneSoftwareOcclusion::ApplyAvailableResults(const TArray<USnowPrimitiveInfo*>& Scene)
+{
+	// Apply available occlusion results unless they are too old to be trusted
 	int32 NumCulled = 0;
-	if (Available.IsValid())
+	const FOcclusionFrameResults& Available = *Results[AvailableIndex];
+	const int32 ResultsAge = GetResultsAge();
+	if (ResultsAge != INDEX_NONE && ResultsAge <= GSOMaxResultsAge)
 	{
-		NumCulled = ApplyResults(Scene, *Available);
+		NumCulled = ApplyResults(Scene, Available);
+		AppliedViews = Available.Signature.Views;
+		SET_DWORD_STAT(STAT_SoftwareResultsAge, ResultsAge);
+		CSV_CUSTOM_STAT(SnowOcclusion, ResultsAge, ResultsAge, ECsvCustomStatOp::Set);
+	}
+	else
+	{
+		for (USnowPrimitiveInfo* Info : Scene)
+		{
+			Info->bVisible = true;
+			Info->bShadowVisible = true;
+			Info->SubVisible.Init(true, Info->SubBounds.Num());
+			Info->ViewVisible.Reset();
+		}
+		AppliedViews.Reset();
 	}
 
 	return NumCulled;
 }
 
+void FSceneSoftwareOcclusion::PublishResults(uint32 ResultsIndex)
+{
+	// Called from the task once results are written: hand them over and take the stale ready buffer back for the next frame
+	const uint32 PrevReadyState = ReadyState.exchange(ResultsIndex | RESULTS_FRESH_BIT, std::memory_order_acq_rel);
+	ProcessingIndex = PrevReadyState & RESULTS_INDEX_MASK;
+}
+
+int32 FSceneSoftwareOcclusion::GetResultsAge() const
+{
+	const FOcclusionFrameResults& Available = *Results[AvailableIndex];
+	if (!Available.bValid)
+	{
+		return INDEX_NONE;
+	}
+
+	return (int32)FMath::Min<uint64>(GFrameCounter - Available.FrameNumber, MAX_int32);
+}
+
 void FSceneSoftwareOcclusion::FlushResults()
 {
 	if (TaskRef.IsValid())
 	{
+		TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_WaitForTask, SnowOcclusionChannel);
+
+		// Only same-frame mode and teardown wait, the time is what the game thread lost to the task
+		const double WaitStart = FPlatformTime::Seconds();
 		FTaskGraphInterface::Get().WaitUntilTaskCompletes(TaskRef);
+		CSV_CUSTOM_STAT(SnowOcclusion, WaitMs, (FPlatformTime::Seconds() - WaitStart) * 1000.0, ECsvCustomStatOp::Accumulate);
 		TaskRef = nullptr;
 	}
 }
 
+#if CPUPROFILERTRACE_ENABLED
+static bool BeginCoreScope(const char* Name)
+{
+	// Scopes of the core are dropped unless the channel is on, like the ones of the glue
+	if (!UE_TRACE_CHANNELEXPR_IS_ENABLED(SnowOcclusionChannel))
+	{
+		return false;
+	}
+	FCpuProfilerTrace::OutputBeginDynamicEvent(Name);
+	return true;
+}
+
+static void EndCoreScope()
+{
+	FCpuProfilerTrace::OutputEndEvent();
+}
+#endif
+
+void FSceneSoftwareOcclusion::SetPortalGraph(const SnowOcclusion::FPortalGraph& InPortalGraph)
+{
+	*PortalGraph = InPortalGraph;
+	PortalGraphRevision++;
+}
+
+void FSceneSoftwareOcclusion::SetPVS(const SnowOcclusion::FPVS& InPVS)
+{
+	*PVS = InPVS;
+	PVSRevision++;
+}
+
+void FSceneSoftwareOcclusion::RegisterProfilerHooks()
+{
+#if CPUPROFILERTRACE_ENABLED
+	SnowOcclusion::FProfilerHooks Hooks;
+	Hooks.BeginScope = &BeginCoreScope;
+	Hooks.EndScope = &EndCoreScope;
+	SnowOcclusion::SetProfilerHooks(Hooks);
+#endif
+}
+
+void FSceneSoftwareOcclusion::UnregisterProfilerHooks()
+{
+	SnowOcclusion::SetProfilerHooks(SnowOcclusion::FProfilerHooks());
+}
+
 inline bool BinRowTestBit(uint64 Mask, int32 Bit)
 {
 	return (Mask & (1ull << Bit)) != 0;
@@ -1201,13 +1915,15 @@ inline bool BinRowTestBit(uint64 Mask, int32 Bit)
 void FSceneSoftwareOcclusion::DebugDrawToCanvas(FCanvas* Canvas, int32 InX, int32 InY)
 {
 #if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+	using namespace SnowOcclusion;
+
 	if (GSOVisualizeBuffer == 0)
 	{
 		return;
 	}
 
-	FOcclusionFrameResults* Results = Available.Get();
-	if (Results == nullptr)
+	const FOcclusionFrameResults* Available = Results[AvailableIndex].Get();
+	if (!Available->bValid || GSOVisualizeView < 0 || GSOVisualizeView >= (int32)Available->Frame.Views.size())
 	{
 		return;
 	}
@@ -1230,7 +1946,7 @@ void FSceneSoftwareOcclusion::DebugDrawToCanvas(FCanvas* Canvas, int32 InX, int3
 		// vertical line for each bin border
 		BatchedElements->AddLine(FVector(BinStartX, BinStartY, 0.f), FVector(BinStartX, BinStartY + FRAMEBUFFER_HEIGHT, 0.f), FColor::Blue, FHitProxyId());
 
-		const FFramebufferBin& Bin = Results->Bins[i];
+		const SnowOcclusion::FFramebufferBin& Bin = Available->Frame.Views[GSOVisualizeView].Bins[i];
 		for (int32 j = 0; j < FRAMEBUFFER_HEIGHT; ++j)
 		{
 			uint64 RowData = GSOVisualizeBuffer == 1 ? Bin.Data[j] : Bin.Type[j];
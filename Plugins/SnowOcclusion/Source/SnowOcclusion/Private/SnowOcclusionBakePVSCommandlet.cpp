@@ -0,0 +1,220 @@
+// Copyright Fast Travel Games AB 2023
+
+
+#include "SnowOcclusionBakePVSCommandlet.h"
+#include "SceneSoftwareOcclusion.h"
+#include "SnowOcclusionComponent.h"
+#include "SnowOcclusionPVS.h"
+#include "SnowOcclusionPVSVolume.h"
+#include "Async/ParallelFor.h"
+#include "Components/PrimitiveComponent.h"
+#include "Engine/World.h"
+#include "EngineUtils.h"
+#include "Misc/PackageName.h"
+#include "UObject/Package.h"
+#include "UObject/SavePackage.h"
+
+static SnowOcclusion::FVec3 ToCore(const FVector& V)
+{
+	return { (float)V.X, (float)V.Y, (float)V.Z };
+}
+
+static SnowOcclusion::FBox3 ToCore(const FBox& Box)
+{
+	return { ToCore(Box.Min), ToCore(Box.Max) };
+}
+
+static SnowOcclusion::FMat4 ToCore(const FMatrix& M)
+{
+	SnowOcclusion::FMat4 Result;
+	for (int32 Row = 0; Row < 4; ++Row)
+	{
+		for (int32 Col = 0; Col < 4; ++Col)
+		{
+			Result.M[Row][Col] = (float)M.M[Row][Col];
+		}
+	}
+	return Result;
+}
+
+USnowOcclusionBakePVSCommandlet::USnowOcclusionBakePVSCommandlet()
+{
+	IsClient = false;
+	IsEditor = true;
+	IsServer = false;
+	LogToConsole = true;
+}
+
+int32 USnowOcclusionBakePVSCommandlet::Main(const FString& Params)
+{
+#if WITH_EDITOR
+	FString MapName;
+	if (!FParse::Value(*Params, TEXT("Map="), MapName))
+	{
+		UE_LOG(LogTemp, Error, TEXT("Usage: -run=SnowOcclusionBakePVS -Map=/Game/Maps/Level [-CellSize=400] [-Samples=2] [-Margin=50]"));
+		return 1;
+	}
+
+	SnowOcclusion::FPVSBakeSettings Settings;
+	FParse::Value(*Params, TEXT("CellSize="), Settings.CellSize);
+	FParse::Value(*Params, TEXT("Samples="), Settings.SamplesPerEdge);
+	FParse::Value(*Params, TEXT("Margin="), Settings.BoxMargin);
+
+	UPackage* MapPackage = LoadPackage(nullptr, *MapName, LOAD_None);
+	UWorld* World = MapPackage != nullptr ? UWorld::FindWorldInPackage(MapPackage) : nullptr;
+	if (World == nullptr)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Can't load map %s"), *MapName);
+		return 1;
+	}
+
+	// Components are registered for their bounds, the streamed levels are baked with the persistent one
+	World->WorldType = EWorldType::Editor;
+	World->AddToRoot();
+	if (!World->bIsWorldInitialized)
+	{
+		World->InitWorld(UWorld::InitializationValues()
+			.AllowAudioPlayback(false)
+			.CreatePhysicsScene(false)
+			.RequiresHitProxies(false)
+			.CreateNavigation(false)
+			.CreateAISystem(false)
+			.ShouldSimulatePhysics(false)
+			.SetTransactional(false));
+	}
+	World->LoadSecondaryLevels(true);
+	World->UpdateWorldComponents(true, true);
+
+	TArray<ASnowOcclusionPVSVolume*> Volumes;
+	TArray<FBox> VolumeBounds;
+	FBox Bounds(ForceInit);
+	for (TActorIterator<ASnowOcclusionPVSVolume> It(World); It; ++It)
+	{
+		Volumes.Add(*It);
+		Bounds += VolumeBounds.Add_GetRef(It->GetPVSBounds());
+	}
+	if (Volumes.IsEmpty())
+	{
+		UE_LOG(LogTemp, Error, TEXT("%s has no ASnowOcclusionPVSVolume, nothing to bake"), *MapName);
+		return 1;
+	}
+
+	// Static primitives in the order the sets index them, anything that moves could leave its set
+	TArray<FString> PrimitiveKeys;
+	std::vector<SnowOcclusion::FVec3> BoxMinMax;
+	std::vector<SnowOcclusion::FOccluderMesh> Occluders;
+	auto AddPrimitive = [&PrimitiveKeys, &BoxMinMax](const UPrimitiveComponent* Primitive, const USnowPrimitiveInfo* Info)
+	{
+		const FBox Box = Info->Bounds.GetBox();
+		PrimitiveKeys.Add(USnowOcclusionPVSData::MakePrimitiveKey(Primitive));
+		BoxMinMax.push_back(ToCore(Box.Min));
+		BoxMinMax.push_back(ToCore(Box.Max));
+	};
+
+	for (TActorIterator<AActor> It(World); It; ++It)
+	{
+		TInlineComponentArray<USnowOcclusionComponent*> Components(*It);
+		for (USnowOcclusionComponent* Component : Components)
+		{
+			if ((!Component->bUseAsOccluder && !Component->bCanBeOccludee) || !Component->InitInfo()
+				|| Component->PrimitiveComponent->Mobility != EComponentMobility::Static)
+			{
+				continue;
+			}
+
+			// The infos and their occluder data are kept alive by the components until the bake is done
+			const USnowPrimitiveInfo* Info = Component->Info;
+			if (Info->bOccluder)
+			{
+				const FSnowMeshOccluderData& OccluderData = *Info->OccluderData;
+				SnowOcclusion::FOccluderMesh& Mesh = Occluders.emplace_back();
+				Mesh.LocalToWorld = ToCore(Info->LocalToWorld);
+				Mesh.WorldBounds = ToCore(Info->Bounds.GetBox());
+				Mesh.Vertices = reinterpret_cast<const SnowOcclusion::FVec3*>(OccluderData.VerticesSP->GetData());
+				Mesh.NumVertices = OccluderData.VerticesSP->Num();
+				Mesh.Indices = OccluderData.IndicesSP->GetData();
+				Mesh.NumIndices = OccluderData.IndicesSP->Num();
+			}
+
+			// Instance clusters are always rasterized, only whole primitives are baked
+			if (Info->SubBounds.IsEmpty())
+			{
+				AddPrimitive(Component->PrimitiveComponent, Info);
+			}
+			for (int32 PrimitiveIdx = 0; PrimitiveIdx < Component->PrimitiveInfos.Num(); ++PrimitiveIdx)
+			{
+				const UPrimitiveComponent* Primitive = Component->OccludeePrimitives[PrimitiveIdx];
+				if (Primitive != nullptr && Primitive->Mobility == EComponentMobility::Static)
+				{
+					AddPrimitive(Primitive, Component->PrimitiveInfos[PrimitiveIdx]);
+				}
+			}
+		}
+	}
+
+	// Only the cells the volumes touch get a set, the camera goes nowhere else
+	auto IsCellUsed = [&VolumeBounds](const SnowOcclusion::FBox3& Cell)
+	{
+		const FBox CellBox(FVector(Cell.Min.X, Cell.Min.Y, Cell.Min.Z), FVector(Cell.Max.X, Cell.Max.Y, Cell.Max.Z));
+		return VolumeBounds.ContainsByPredicate([&CellBox](const FBox& Volume) { return Volume.Intersect(CellBox); });
+	};
+	const SnowOcclusion::FParallelFor BakeParallelFor = [](int32 Num, const std::function<void(int32)>& Body)
+	{
+		ParallelFor(Num, [&Body](int32 Index) { Body(Index); });
+	};
+
+	SnowOcclusion::FPVS PVS;
+	SnowOcclusion::FPVSBakeStats Stats;
+	SnowOcclusion::BakePVS(Occluders, BoxMinMax.data(), PrimitiveKeys.Num(), ToCore(Bounds), Settings, IsCellUsed, PVS, &Stats, BakeParallelFor);
+	UE_LOG(LogTemp, Display, TEXT("%s: %d occluders, %d primitives, %d of %d cells from %d samples, %d sets, %.1f visible per cell, %.1f KB, %.1f s"),
+		*MapName, (int32)Occluders.size(), PrimitiveKeys.Num(), Stats.NumBakedCells, Stats.NumCells, Stats.NumSamples, Stats.NumSets,
+		Stats.NumBakedCells > 0 ? (double)Stats.NumVisible / Stats.NumBakedCells : 0.0, Stats.NumBytes / 1024.0, Stats.Seconds);
+
+	// The asset goes next to the map, baked again in place
+	const FString AssetName = FPackageName::GetShortName(MapPackage) + TEXT("_SnowPVS");
+	UPackage* AssetPackage = CreatePackage(*(FPackageName::GetLongPackagePath(MapPackage->GetName()) / AssetName));
+	AssetPackage->FullyLoad();
+	USnowOcclusionPVSData* Data = FindObject<USnowOcclusionPVSData>(AssetPackage, *AssetName);
+	if (Data == nullptr)
+	{
+		Data = NewObject<USnowOcclusionPVSData>(AssetPackage, *AssetName, RF_Public | RF_Standalone);
+	}
+
+	std::vector<uint8> Bytes;
+	PVS.Serialize(Bytes);
+	Data->Data = TArray<uint8>(Bytes.data(), (int32)Bytes.size());
+	Data->PrimitiveKeys = MoveTemp(PrimitiveKeys);
+	Data->NumCells = Stats.NumBakedCells;
+	Data->NumSets = Stats.NumSets;
+	Data->MarkPackageDirty();
+
+	TSet<UPackage*> Packages = { AssetPackage };
+	for (ASnowOcclusionPVSVolume* Volume : Volumes)
+	{
+		Volume->Modify();
+		Volume->PVSData = Data;
+		Packages.Add(Volume->GetPackage());
+	}
+
+	for (UPackage* Package : Packages)
+	{
+		const bool bMap = Package->ContainsMap();
+		const FString FileName = FPackageName::LongPackageNameToFilename(Package->GetName(),
+			bMap ? FPackageName::GetMapPackageExtension() : FPackageName::GetAssetPackageExtension());
+		FSavePackageArgs SaveArgs;
+		SaveArgs.TopLevelFlags = bMap ? RF_NoFlags : RF_Public | RF_Standalone;
+		SaveArgs.SaveFlags = SAVE_NoError;
+		if (!UPackage::SavePackage(Package, bMap ? UWorld::FindWorldInPackage(Package) : nullptr, *FileName, SaveArgs))
+		{
+			UE_LOG(LogTemp, Error, TEXT("Can't save %s"), *FileName);
+			return 1;
+		}
+	}
+
+	World->RemoveFromRoot();
+	return 0;
+#else
+	UE_LOG(LogTemp, Error, TEXT("Visible sets are only baked by the editor"));
+	return 1;
+#endif
+}
@@ -4,11 +4,22 @@
 #include "SnowOcclusionComponent.h"
 #include "SnowOcclusionSubsystem.h"
 #include "SceneSoftwareOcclusion.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "HAL/IConsoleManager.h"
 #include "Kismet/KismetSystemLibrary.h"
 
 /** Factor by which to grow occlusion tests **/
 #define OCCLUSION_SLOP (1.0f)
 
+static int32 GSOInstanceVisibilityInterval = 4;
+static FAutoConsoleVariableRef CVarSOInstanceVisibilityInterval(
+	TEXT("ftg.so.InstanceVisibilityInterval"),
+	GSOInstanceVisibilityInterval,
+	TEXT("Minimum number of frames between two render state updates of an instanced component for clusters that got occluded.\n")
+	TEXT("Clusters that got visible are updated at once. 1 updates every frame"),
+	ECVF_Default
+);
+
 USnowOcclusionComponent::USnowOcclusionComponent()
 {
 	PrimaryComponentTick.bCanEverTick = false;
@@ -16,7 +27,121 @@ USnowOcclusionComponent::USnowOcclusionComponent()
 
 void USnowOcclusionComponent::HandleOcclusionVisibility(bool bVisible)
 {
-	GetOwner()->SetActorHiddenInGame(!bVisible);
+	if (bPerPrimitiveOcclusion && PrimitiveComponent != nullptr)
+	{
+		if (bHiddenByOcclusion != !bVisible)
+		{
+			PrimitiveComponent->SetHiddenInGame(!bVisible);
+		}
+	}
+	else
+	{
+		GetOwner()->SetActorHiddenInGame(!bVisible);
+	}
+	bHiddenByOcclusion = !bVisible;
+}
+
+void USnowOcclusionComponent::HandlePrimitiveVisibility(const USnowPrimitiveInfo* PrimitiveInfo, bool bVisible)
+{
+	const int32 PrimitiveIdx = PrimitiveInfos.IndexOfByKey(PrimitiveInfo);
+	if (PrimitiveIdx == INDEX_NONE || PrimitivesHiddenByOcclusion[PrimitiveIdx] == !bVisible)
+	{
+		return;
+	}
+
+	if (UPrimitiveComponent* Primitive = OccludeePrimitives[PrimitiveIdx])
+	{
+		Primitive->SetHiddenInGame(!bVisible);
+	}
+	PrimitivesHiddenByOcclusion[PrimitiveIdx] = !bVisible;
+}
+
+void USnowOcclusionComponent::HandleOcclusionShadow(bool bShadowVisible, bool bCastWhileHidden)
+{
+	if (PrimitiveComponent == nullptr)
+	{
+		return;
+	}
+
+	const bool bOverride = !bShadowVisible || bCastWhileHidden;
+	if (!bOverride)
+	{
+		if (bShadowOverridden)
+		{
+			PrimitiveComponent->SetCastShadow(bOriginalCastShadow);
+			PrimitiveComponent->SetCastHiddenShadow(bOriginalCastHiddenShadow);
+			bShadowOverridden = false;
+		}
+		return;
+	}
+
+	if (!bShadowOverridden)
+	{
+		bOriginalCastShadow = PrimitiveComponent->CastShadow;
+		bOriginalCastHiddenShadow = PrimitiveComponent->bCastHiddenShadow;
+		bShadowOverridden = true;
+	}
+
+	// Only touch the render state on changes
+	const bool bCastShadow = bShadowVisible && bOriginalCastShadow;
+	const bool bCastHiddenShadow = bOriginalCastHiddenShadow || (bShadowVisible && bCastWhileHidden);
+	if (PrimitiveComponent->CastShadow != bCastShadow)
+	{
+		PrimitiveComponent->SetCastShadow(bCastShadow);
+	}
+	if (PrimitiveComponent->bCastHiddenShadow != bCastHiddenShadow)
+	{
+		PrimitiveComponent->SetCastHiddenShadow(bCastHiddenShadow);
+	}
+}
+
+void USnowOcclusionComponent::HandleInstanceVisibility(const TBitArray<>& ClusterVisible)
+{
+	UInstancedStaticMeshComponent* InstancedComponent = Cast<UInstancedStaticMeshComponent>(PrimitiveComponent);
+	if (InstancedComponent == nullptr || !bWriteInstanceVisibility || ClusterVisible.Num() != InstanceClusters.Num())
+	{
+		return;
+	}
+
+	// Only write the clusters that changed, everything starts out visible
+	if (AppliedClusterVisible.Num() != ClusterVisible.Num())
+	{
+		AppliedClusterVisible.Init(true, ClusterVisible.Num());
+		for (int32 InstanceIdx = 0; InstanceIdx < InstancedComponent->GetInstanceCount(); ++InstanceIdx)
+		{
+			InstancedComponent->SetCustomDataValue(InstanceIdx, InstanceVisibilityCustomDataIndex, 1.0f, false);
+		}
+		InstancedComponent->MarkRenderStateDirty();
+		InstanceVisibilityUpdateFrame = GFrameCounter;
+		bInstanceVisibilityPending = false;
+	}
+
+	bool bRevealed = false;
+	for (int32 ClusterIdx = 0; ClusterIdx < ClusterVisible.Num(); ++ClusterIdx)
+	{
+		const bool bVisible = ClusterVisible[ClusterIdx];
+		if (AppliedClusterVisible[ClusterIdx] == bVisible)
+		{
+			continue;
+		}
+
+		AppliedClusterVisible[ClusterIdx] = bVisible;
+		for (int32 InstanceIdx : InstanceClusters[ClusterIdx])
+		{
+			InstancedComponent->SetCustomDataValue(InstanceIdx, InstanceVisibilityCustomDataIndex, bVisible ? 1.0f : 0.0f, false);
+		}
+		bRevealed |= bVisible;
+		bInstanceVisibilityPending = true;
+	}
+
+	// Every update recreates the proxy: what got visible can't wait, the flips to occluded are coalesced over a few frames
+	const bool bIntervalElapsed = GFrameCounter - InstanceVisibilityUpdateFrame >= (uint64)FMath::Max(GSOInstanceVisibilityInterval, 1);
+	if (bInstanceVisibilityPending && (bRevealed || bIntervalElapsed))
+	{
+		InstancedComponent->MarkRenderStateDirty();
+		InstanceVisibilityUpdateFrame = GFrameCounter;
+		bInstanceVisibilityPending = false;
+	}
 }
 
 void USnowOcclusionComponent::ReplacePrimitiveComponent(UPrimitiveComponent* InPrimitiveComponent)
@@ -26,10 +151,13 @@ void USnowOcclusionComponent::ReplacePrimitiveComponent(UPrimitiveComponent* InP
 		return;
 	}
 
+	HandleOcclusionShadow(true, false);
 	PrimitiveComponent = InPrimitiveComponent;
+	InitInstanceVisibility();
 	
 	if (Info != nullptr)
 	{
+		Info->bShadowCaster = PrimitiveComponent->CastShadow;
 		Info->MaxDrawDistance = PrimitiveComponent->CachedMaxDrawDistance > 0 ? PrimitiveComponent->CachedMaxDrawDistance : PrimitiveComponent->LDMaxDrawDistance;
 	}
 
@@ -53,6 +181,16 @@ void USnowOcclusionComponent::BeginPlay()
 	USnowOcclusionSubsystem* Occlusion = GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>();
 	checkf(Occlusion, TEXT("USnowOcclusionComponent used without a USnowOcclusionSubsystem present! Make sure the WorldFoundation plugin is enabled"));
 
+	if (!InitInfo())
+	{
+		return;
+	}
+
+	Occlusion->RegisterOccluder(this, Info);
+}
+
+bool USnowOcclusionComponent::InitInfo()
+{
 	if (PrimitiveComponent == nullptr)
 	{
 		PrimitiveComponent = GetOwner()->FindComponentByClass<UPrimitiveComponent>();
@@ -61,13 +199,14 @@ void USnowOcclusionComponent::BeginPlay()
     if (PrimitiveComponent == nullptr)
     {
         UE_LOG(LogTemp, Error, TEXT("%s has no primitive component. SnowOcclusion requires on! Will not be used as occluder or occludee"), *GetNameSafe(GetOwner()));
-        return;
+        return false;
     }
 
 	Info = NewObject<USnowPrimitiveInfo>();
 	Info->PrimitiveComponentId = PrimitiveComponent->GetPrimitiveSceneId();
 	Info->bOccluder = bUseAsOccluder && OccluderMesh != nullptr;
 	Info->bOcludee = bCanBeOccludee;
+	Info->bShadowCaster = PrimitiveComponent->CastShadow;
 	Info->MaxDrawDistance = PrimitiveComponent->CachedMaxDrawDistance > 0 ? PrimitiveComponent->CachedMaxDrawDistance : PrimitiveComponent->LDMaxDrawDistance;
 	if (Info->bOccluder)
 	{
@@ -75,13 +214,69 @@ void USnowOcclusionComponent::BeginPlay()
 		if (Info->OccluderData.IsValid() == false)
 		{
 			UE_LOG(LogTemp, Error, TEXT("Failed Building Occlusion Data for Actor: %s"), *GetNameSafe(GetOwner()));
-			return;
+			return false;
 		}
 	}
 
+	// The other primitives of the actor get occludee only infos of their own
+	if (bPerPrimitiveOcclusion && bCanBeOccludee)
+	{
+		TArray<UPrimitiveComponent*> Primitives;
+		GetOwner()->GetComponents<UPrimitiveComponent>(Primitives);
+		for (UPrimitiveComponent* Primitive : Primitives)
+		{
+			if (Primitive == PrimitiveComponent || !Primitive->IsRegistered() || !Primitive->IsVisible())
+			{
+				continue;
+			}
+
+			USnowPrimitiveInfo* PrimitiveInfo = NewObject<USnowPrimitiveInfo>();
+			PrimitiveInfo->PrimitiveComponentId = Primitive->GetPrimitiveSceneId();
+			PrimitiveInfo->bOccluder = false;
+			PrimitiveInfo->bOcludee = true;
+			PrimitiveInfo->MaxDrawDistance = Primitive->CachedMaxDrawDistance > 0 ? Primitive->CachedMaxDrawDistance : Primitive->LDMaxDrawDistance;
+
+			PrimitiveInfos.Add(PrimitiveInfo);
+			OccludeePrimitives.Add(Primitive);
+		}
+		PrimitivesHiddenByOcclusion.Init(false, PrimitiveInfos.Num());
+	}
+
+	InitInstanceVisibility();
 	UpdateInfo();
+	return true;
+}
 
-	Occlusion->RegisterOccluder(this, Info);
+void USnowOcclusionComponent::InitInstanceVisibility()
+{
+	bWriteInstanceVisibility = false;
+	AppliedClusterVisible.Reset();
+
+	UInstancedStaticMeshComponent* InstancedComponent = Cast<UInstancedStaticMeshComponent>(PrimitiveComponent);
+	if (InstancedComponent == nullptr || !bPerInstanceOcclusion || !bCanBeOccludee || InstanceVisibilityCustomDataIndex < 0)
+	{
+		return;
+	}
+
+	// The material reads the custom data with the component's stride, resizing it would wipe and shift what is there.
+	// Only a component without any custom data gets the float added.
+	if (InstancedComponent->NumCustomDataFloats == 0)
+	{
+		InstancedComponent->SetNumCustomDataFloats(InstanceVisibilityCustomDataIndex + 1);
+		for (int32 InstanceIdx = 0; InstanceIdx < InstancedComponent->GetInstanceCount(); ++InstanceIdx)
+		{
+			InstancedComponent->SetCustomDataValue(InstanceIdx, InstanceVisibilityCustomDataIndex, 1.0f, false);
+		}
+		InstancedComponent->MarkRenderStateDirty();
+	}
+	else if (InstancedComponent->NumCustomDataFloats <= InstanceVisibilityCustomDataIndex)
+	{
+		UE_LOG(LogTemp, Error, TEXT("%s: Instance Visibility Custom Data Index %d is past the %d Num Custom Data Floats of %s, add the float to the component. Instances will only be hidden with the whole component"),
+			*GetNameSafe(GetOwner()), InstanceVisibilityCustomDataIndex, InstancedComponent->NumCustomDataFloats, *InstancedComponent->GetName());
+		return;
+	}
+
+	bWriteInstanceVisibility = true;
 }
 
 void USnowOcclusionComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
@@ -92,6 +287,14 @@ void USnowOcclusionComponent::EndPlay(const EEndPlayReason::Type EndPlayReason)
 	Occlusion->UnregisterOccluder(this);
 }
 
+static void UpdateOrientedBounds(USnowPrimitiveInfo* PrimitiveInfo, const FTransform& Transform, const FBox& LocalBox)
+{
+	// World aligned bounds are already tight for objects that aren't rotated
+	PrimitiveInfo->bOrientedBounds = !Transform.GetRotation().IsIdentity(KINDA_SMALL_NUMBER);
+	PrimitiveInfo->OrientedBounds = LocalBox.ExpandBy(OCCLUSION_SLOP);
+	PrimitiveInfo->OrientedBoundsToWorld = Transform.ToMatrixWithScale();
+}
+
 void USnowOcclusionComponent::UpdateInfo()
 {
 	FMatrix LocalToWorld = PrimitiveComponent->GetComponentTransform().ToMatrixWithScale();
@@ -112,6 +315,43 @@ void USnowOcclusionComponent::UpdateInfo()
 
 	Info->LocalToWorld = LocalToWorld;
 	Info->Bounds = OcclusionBounds;
+	Info->BuildRenderCost(PrimitiveComponent);
+
+	if (bUseCustomBounds)
+	{
+		UpdateOrientedBounds(Info, PrimitiveComponent->GetComponentTransform(), FBox::BuildAABB(CustomBoundsOffset, CustomBounds));
+	}
+	else
+	{
+		UpdateOrientedBounds(Info, PrimitiveComponent->GetComponentTransform(), PrimitiveComponent->CalcLocalBounds().GetBox());
+	}
+
+	for (int32 PrimitiveIdx = 0; PrimitiveIdx < PrimitiveInfos.Num(); ++PrimitiveIdx)
+	{
+		if (const UPrimitiveComponent* Primitive = OccludeePrimitives[PrimitiveIdx])
+		{
+			FBoxSphereBounds PrimitiveBounds = Primitive->Bounds;
+			PrimitiveBounds.BoxExtent += FVector(OCCLUSION_SLOP);
+			PrimitiveBounds.SphereRadius += OCCLUSION_SLOP;
+
+			PrimitiveInfos[PrimitiveIdx]->LocalToWorld = Primitive->GetComponentTransform().ToMatrixWithScale();
+			PrimitiveInfos[PrimitiveIdx]->Bounds = PrimitiveBounds;
+			UpdateOrientedBounds(PrimitiveInfos[PrimitiveIdx], Primitive->GetComponentTransform(), Primitive->CalcLocalBounds().GetBox());
+			PrimitiveInfos[PrimitiveIdx]->BuildRenderCost(Primitive);
+		}
+	}
+
+	const UInstancedStaticMeshComponent* InstancedComponent = Cast<UInstancedStaticMeshComponent>(PrimitiveComponent);
+	if (bPerInstanceOcclusion && bCanBeOccludee && InstancedComponent != nullptr)
+	{
+		UpdateInstanceClusters(InstancedComponent);
+	}
+	else
+	{
+		Info->SubBounds.Reset();
+		Info->SubNumInstances.Reset();
+		InstanceClusters.Reset();
+	}
 
 	if (!Info->bOccluder)
 	{
@@ -142,3 +382,62 @@ void USnowOcclusionComponent::UpdateInfo()
 		Info->LocalToWorld = FScaleMatrix::Make(UnitCubeScale) * Info->LocalToWorld;
 	}
 }
+
+void USnowOcclusionComponent::UpdateInstanceClusters(const UInstancedStaticMeshComponent* InstancedComponent)
+{
+	const UStaticMesh* Mesh = InstancedComponent->GetStaticMesh();
+	const int32 NumInstances = InstancedComponent->GetInstanceCount();
+	if (Mesh == nullptr || NumInstances == 0)
+	{
+		Info->SubBounds.Reset();
+		Info->SubNumInstances.Reset();
+		InstanceClusters.Reset();
+		return;
+	}
+
+	// Cluster membership only changes with the instances, bounds follow the component every update
+	if (NumInstances != NumClusteredInstances)
+	{
+		NumClusteredInstances = NumInstances;
+		InstanceClusters.Reset();
+		AppliedClusterVisible.Reset();
+
+		TMap<FIntVector, int32> CellToCluster;
+		for (int32 InstanceIdx = 0; InstanceIdx < NumInstances; ++InstanceIdx)
+		{
+			FTransform InstanceTransform;
+			InstancedComponent->GetInstanceTransform(InstanceIdx, InstanceTransform, /*bWorldSpace*/ false);
+
+			int32 ClusterIdx = INDEX_NONE;
+			if (InstanceClusterSize > 0.0f)
+			{
+				const FVector Cell = InstanceTransform.GetLocation() / InstanceClusterSize;
+				const FIntVector CellKey(FMath::FloorToInt(Cell.X), FMath::FloorToInt(Cell.Y), FMath::FloorToInt(Cell.Z));
+				int32* ExistingCluster = CellToCluster.Find(CellKey);
+				ClusterIdx = ExistingCluster ? *ExistingCluster : CellToCluster.Add(CellKey, InstanceClusters.AddDefaulted());
+			}
+			else
+			{
+				ClusterIdx = InstanceClusters.AddDefaulted();
+			}
+
+			InstanceClusters[ClusterIdx].Add(InstanceIdx);
+		}
+	}
+
+	const FBox MeshBox = Mesh->GetBounds().GetBox();
+	Info->SubBounds.SetNum(InstanceClusters.Num());
+	Info->SubNumInstances.SetNum(InstanceClusters.Num());
+	for (int32 ClusterIdx = 0; ClusterIdx < InstanceClusters.Num(); ++ClusterIdx)
+	{
+		FBox ClusterBox(ForceInit);
+		for (int32 InstanceIdx : InstanceClusters[ClusterIdx])
+		{
+			FTransform InstanceTransform;
+			InstancedComponent->GetInstanceTransform(InstanceIdx, InstanceTransform, /*bWorldSpace*/ true);
+			ClusterBox += MeshBox.TransformBy(InstanceTransform);
+		}
+		Info->SubBounds[ClusterIdx] = ClusterBox.ExpandBy(OCCLUSION_SLOP);
+		Info->SubNumInstances[ClusterIdx] = InstanceClusters[ClusterIdx].Num();
+	}
+}
@@ -0,0 +1,49 @@
+// Copyright Fast Travel Games AB 2023
+
+
+#include "SnowOcclusionPVSVolume.h"
+#include "SnowOcclusionSubsystem.h"
+#include "Components/BrushComponent.h"
+#include "Components/PrimitiveComponent.h"
+#include "Engine/World.h"
+#include "Kismet/KismetSystemLibrary.h"
+
+FString USnowOcclusionPVSData::MakePrimitiveKey(const UPrimitiveComponent* Primitive)
+{
+	// Streamed levels are worlds of their own, the path within the level's world doesn't depend on the PIE prefix
+	const FString LevelPackage = UWorld::RemovePIEPrefix(Primitive->GetOutermost()->GetName());
+	return LevelPackage + TEXT(":") + Primitive->GetPathName(Primitive->GetTypedOuter<UWorld>());
+}
+
+ASnowOcclusionPVSVolume::ASnowOcclusionPVSVolume(const FObjectInitializer& ObjectInitializer)
+	: Super(ObjectInitializer)
+{
+	// Only the bounds are used, the volume neither collides nor renders
+	GetBrushComponent()->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+	bColored = true;
+	BrushColor = FColor(255, 200, 100, 255);
+}
+
+FBox ASnowOcclusionPVSVolume::GetPVSBounds() const
+{
+	return GetBrushComponent()->Bounds.GetBox();
+}
+
+void ASnowOcclusionPVSVolume::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (UKismetSystemLibrary::IsDedicatedServer(this))
+	{
+		return;
+	}
+
+	GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>()->RegisterPVSVolume(this);
+}
+
+void ASnowOcclusionPVSVolume::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	Super::EndPlay(EndPlayReason);
+
+	GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>()->UnregisterPVSVolume(this);
+}
@@ -0,0 +1,91 @@
+// Copyright Fast Travel Games AB 2023
+
+
+#include "SnowOcclusionPortal.h"
+#include "SnowOcclusionSubsystem.h"
+#include "Components/BrushComponent.h"
+#include "Components/SceneComponent.h"
+#include "Kismet/KismetSystemLibrary.h"
+
+ASnowOcclusionCell::ASnowOcclusionCell(const FObjectInitializer& ObjectInitializer)
+	: Super(ObjectInitializer)
+{
+	// Only the bounds are used, the volume neither collides nor renders
+	GetBrushComponent()->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+	bColored = true;
+	BrushColor = FColor(100, 200, 255, 255);
+}
+
+FBox ASnowOcclusionCell::GetCellBounds() const
+{
+	return GetBrushComponent()->Bounds.GetBox();
+}
+
+void ASnowOcclusionCell::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (UKismetSystemLibrary::IsDedicatedServer(this))
+	{
+		return;
+	}
+
+	GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>()->RegisterPortalCell(this);
+}
+
+void ASnowOcclusionCell::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	Super::EndPlay(EndPlayReason);
+
+	GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>()->UnregisterPortalCell(this);
+}
+
+ASnowOcclusionPortal::ASnowOcclusionPortal()
+{
+	PrimaryActorTick.bCanEverTick = false;
+	RootComponent = CreateDefaultSubobject<USceneComponent>(TEXT("Root"));
+}
+
+void ASnowOcclusionPortal::SetOpen(bool bInOpen)
+{
+	if (bOpen != bInOpen)
+	{
+		bOpen = bInOpen;
+		GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>()->MarkPortalsDirty(GetWorld());
+	}
+}
+
+void ASnowOcclusionPortal::GetCorners(FVector OutCorners[4]) const
+{
+	const FTransform& Transform = GetActorTransform();
+	OutCorners[0] = Transform.TransformPosition(FVector(0.0, -Extent.X, -Extent.Y));
+	OutCorners[1] = Transform.TransformPosition(FVector(0.0, Extent.X, -Extent.Y));
+	OutCorners[2] = Transform.TransformPosition(FVector(0.0, Extent.X, Extent.Y));
+	OutCorners[3] = Transform.TransformPosition(FVector(0.0, -Extent.X, Extent.Y));
+}
+
+void ASnowOcclusionPortal::GetSidePoints(FVector& OutFront, FVector& OutBack) const
+{
+	const FVector Offset = GetActorForwardVector() * SideDistance;
+	OutFront = GetActorLocation() + Offset;
+	OutBack = GetActorLocation() - Offset;
+}
+
+void ASnowOcclusionPortal::BeginPlay()
+{
+	Super::BeginPlay();
+
+	if (UKismetSystemLibrary::IsDedicatedServer(this))
+	{
+		return;
+	}
+
+	GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>()->RegisterPortal(this);
+}
+
+void ASnowOcclusionPortal::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	Super::EndPlay(EndPlayReason);
+
+	GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>()->UnregisterPortal(this);
+}
@@ -3,14 +3,29 @@
 
 #include "SnowOcclusionSubsystem.h"
 #include "SnowOcclusionComponent.h"
+#include "SnowOcclusionPortal.h"
+#include "SnowOcclusionPortals.h"
+#include "SnowOcclusionPVS.h"
+#include "SnowOcclusionPVSVolume.h"
 
 #include "IXRTrackingSystem.h"
 #include "IHeadMountedDisplay.h"
 
+#include "Components/DirectionalLightComponent.h"
+#include "Components/PlanarReflectionComponent.h"
+#include "Components/PrimitiveComponent.h"
+#include "Components/SceneCaptureComponent2D.h"
 #include "Engine/Canvas.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "Engine/WorldSettings.h"
+#include "GameFramework/PlayerController.h"
+#include "Engine/Level.h"
+#include "Engine/World.h"
 #include "Engine/LocalPlayer.h"
 #include "Kismet/GameplayStatics.h"
 #include "Kismet/KismetMathLibrary.h"
+#include "Misc/App.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
 
 #if WITH_EDITOR
 #include "Editor.h"
@@ -48,6 +63,41 @@ static FAutoConsoleVariableRef CVarSOOptimizationsEnable(
 	ECVF_Cheat
 );
 
+static int32 GSOSameFrame = 0;
+static FAutoConsoleVariableRef CVarSOSameFrame(
+	TEXT("ftg.so.SameFrame"),
+	GSOSameFrame,
+	TEXT("0 = Occlusion results are applied one frame late (Default)\n")
+	TEXT("1 = Occlusion is kicked off once the camera is final (TG_PostUpdateWork) and applied at the end of the world tick of the same frame"),
+	ECVF_Default
+);
+
+static int32 GSOCullingMethod = 0;
+static FAutoConsoleVariableRef CVarSOCullingMethod(
+	TEXT("ftg.so.CullingMethod"),
+	GSOCullingMethod,
+	TEXT("0 = Occluded actors are hidden in game (Default)\n")
+	TEXT("1 = Occluded primitives are hidden in the views of their world by a scene view extension, actors are left untouched"),
+	ECVF_Default
+);
+
+static int32 GSOShadowCulling = 0;
+static FAutoConsoleVariableRef CVarSOShadowCulling(
+	TEXT("ftg.so.ShadowCulling"),
+	GSOShadowCulling,
+	TEXT("0 = Occluded casters lose their shadow with the actor (Default)\n")
+	TEXT("1 = Registered directional lights get a light space occlusion view, the shadow of an occluded caster is culled separately, only when it can't reach a visible receiver"),
+	ECVF_Default
+);
+
+static float GSOShadowViewRadius = 5000.0f;
+static FAutoConsoleVariableRef CVarSOShadowViewRadius(
+	TEXT("ftg.so.ShadowViewRadius"),
+	GSOShadowViewRadius,
+	TEXT("Half size, in cm, of the orthographic light views around the first player view"),
+	ECVF_Default
+);
+
 static float GSOCullingDot = -0.4f;
 static FAutoConsoleVariableRef CVarSOCullingDot(
 	TEXT("ftg.so.CullingDot"),
@@ -56,17 +106,54 @@ static FAutoConsoleVariableRef CVarSOCullingDot(
 	ECVF_Default
 );
 
+static FAutoConsoleCommand CmdSOLogVisibleCost(
+	TEXT("ftg.so.LogVisibleCost"),
+	TEXT("Logs the occludees visible after the last occlusion results with the most triangles at their current LOD, candidates for extra occluders.\n")
+	TEXT("Usage: ftg.so.LogVisibleCost [NumPrimitives], 20 by default"),
+	FConsoleCommandWithArgsDelegate::CreateLambda([](const TArray<FString>& Args)
+	{
+		if (const USnowOcclusionSubsystem* Occlusion = GEngine ? GEngine->GetEngineSubsystem<USnowOcclusionSubsystem>() : nullptr)
+		{
+			Occlusion->LogVisibleRenderCost(Args.Num() > 0 ? FMath::Max(FCString::Atoi(*Args[0]), 1) : 20);
+		}
+	})
+);
+
 //#pragma optimize("", off)
+void FSnowOcclusionKickOffTickFunction::ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent)
+{
+	if (Subsystem && Context)
+	{
+		Subsystem->KickOffSameFrame(*Context, DeltaTime);
+	}
+}
+
+FString FSnowOcclusionKickOffTickFunction::DiagnosticMessage()
+{
+	return TEXT("FSnowOcclusionKickOffTickFunction");
+}
+
 void USnowOcclusionSubsystem::Initialize(FSubsystemCollectionBase& Collection)
 {
 	Super::Initialize(Collection);
+
+	WorldTickEndHandle = FWorldDelegates::OnWorldTickEnd.AddUObject(this, &USnowOcclusionSubsystem::OnWorldTickEnd);
+	WorldCleanupHandle = FWorldDelegates::OnWorldCleanup.AddUObject(this, &USnowOcclusionSubsystem::OnWorldCleanup);
 }
 
 void USnowOcclusionSubsystem::Deinitialize()
 {
 	Super::Deinitialize();
 
-	OcclusionSystem.FlushResults();
+	FWorldDelegates::OnWorldTickEnd.Remove(WorldTickEndHandle);
+	FWorldDelegates::OnWorldCleanup.Remove(WorldCleanupHandle);
+
+	for (auto& Pair : Contexts)
+	{
+		Pair.Value->KickOffTickFunction.UnRegisterTickFunction();
+		Pair.Value->OcclusionSystem.FlushResults();
+	}
+	Contexts.Empty();
 }
 
 bool USnowOcclusionSubsystem::IsAllowedToTick() const
@@ -163,85 +250,369 @@ void DrawCameraFrustum(const APlayerCameraManager* CameraManager, const FColor&
 
 void USnowOcclusionSubsystem::Tick(float DeltaTime)
 {
-	if (PlayerCameraManager == nullptr && Occluders.Num() > 0)
+	if (!GEngine)
+	{
+		return;
+	}
+
+	// Worlds don't share anything, each one gathers its own scene and runs its own occlusion task
+	for (auto& Pair : Contexts)
 	{
-		USnowOcclusionComponent* Comp = Occluders.begin()->Key;
-		PlayerCameraManager = UGameplayStatics::GetPlayerCameraManager(Comp->GetWorld(), 0);
+		TickContext(*Pair.Value, DeltaTime);
 	}
+}
 
-	if (!PlayerCameraManager.IsValid())
+void USnowOcclusionSubsystem::TickContext(FSnowOcclusionContext& Context, float DeltaTime)
+{
+	UWorld* World = Context.World.Get();
+	if (World == nullptr)
 	{
 		return;
 	}
 
-	if (!GEngine)
+	if (!Context.PlayerCameraManager.IsValid())
 	{
+		Context.PlayerCameraManager = UGameplayStatics::GetPlayerCameraManager(World, 0);
+	}
+
+	if (!Context.PlayerCameraManager.IsValid())
+	{
+		Context.KickOffTickFunction.UnRegisterTickFunction();
+		return;
+	}
+
+	if (GSOSameFrame)
+	{
+		// The camera isn't final yet at this point, occlusion is kicked off from TG_PostUpdateWork instead
+		if (!Context.KickOffTickFunction.IsTickFunctionRegistered())
+		{
+			Context.KickOffTickFunction.RegisterTickFunction(World->PersistentLevel);
+		}
 		return;
 	}
 
-	FSnowViewInfo View;
+	Context.KickOffTickFunction.UnRegisterTickFunction();
 
-	const FMinimalViewInfo MinimalView = PlayerCameraManager->GetCameraCacheView();
-	FMatrix VP;
-	FMatrix P;
-	UGameplayStatics::GetViewProjectionMatrix(MinimalView, View.ViewMatrix, P, VP);
-	View.ViewOrigin = MinimalView.Location;
+	BuildViews(Context, DeltaTime, true);
+	if (Context.FrameViews.IsEmpty())
+	{
+		return;
+	}
+	GatherScene(Context);
+	UpdatePortalGraph(Context);
+	UpdatePVS(Context);
+
+	Context.OcclusionSystem.Process(Context.FrameScene, Context.FrameViews);
+
+	ApplyVisibility(Context);
+}
+
+void USnowOcclusionSubsystem::KickOffSameFrame(FSnowOcclusionContext& Context, float DeltaTime)
+{
+	if (!GSOSameFrame || !IsAllowedToTick() || !Context.PlayerCameraManager.IsValid())
+	{
+		return;
+	}
+
+	// Camera managers have been updated for this frame, the view is final
+	BuildViews(Context, DeltaTime, false);
+	if (Context.FrameViews.IsEmpty())
+	{
+		return;
+	}
+	GatherScene(Context);
+	UpdatePortalGraph(Context);
+	UpdatePVS(Context);
+
+	Context.OcclusionSystem.Submit(Context.FrameScene, Context.FrameViews);
+	Context.bSameFrameSubmitted = true;
+}
+
+void USnowOcclusionSubsystem::OnWorldTickEnd(UWorld* World, ELevelTick TickType, float DeltaTime)
+{
+	FSnowOcclusionContext* Context = FindContext(World);
+	if (Context == nullptr || !Context->bSameFrameSubmitted)
+	{
+		return;
+	}
+
+	// Last chance before the frame is handed to the renderer
+	Context->bSameFrameSubmitted = false;
+	Context->OcclusionSystem.ApplySubmittedResults(Context->FrameScene);
+
+	ApplyVisibility(*Context);
+}
+
+void USnowOcclusionSubsystem::OnWorldCleanup(UWorld* World, bool bSessionEnded, bool bCleanupResources)
+{
+	if (FSnowOcclusionContext* Context = FindContext(World))
+	{
+		Context->KickOffTickFunction.UnRegisterTickFunction();
+		Context->OcclusionSystem.FlushResults();
+		Contexts.Remove(World);
+	}
+}
+
+FSnowOcclusionContext* USnowOcclusionSubsystem::FindContext(const UWorld* World) const
+{
+	const TUniquePtr<FSnowOcclusionContext>* Context = Contexts.Find(World);
+	return Context ? Context->Get() : nullptr;
+}
+
+FSnowOcclusionContext& USnowOcclusionSubsystem::FindOrAddContext(UWorld* World)
+{
+	TUniquePtr<FSnowOcclusionContext>& Context = Contexts.FindOrAdd(World);
+	if (!Context.IsValid())
+	{
+		Context = MakeUnique<FSnowOcclusionContext>();
+		Context->World = World;
+		Context->KickOffTickFunction.Subsystem = this;
+		Context->KickOffTickFunction.Context = Context.Get();
+		Context->KickOffTickFunction.TickGroup = TG_PostUpdateWork;
+		Context->KickOffTickFunction.bCanEverTick = true;
+		Context->KickOffTickFunction.bStartWithTickEnabled = true;
+	}
+	return *Context;
+}
+
+void USnowOcclusionSubsystem::BuildViews(FSnowOcclusionContext& Context, float DeltaTime, bool bPredict)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_BuildViews, SnowOcclusionChannel);
+
+	TArray<FSnowViewInfo>& Views = Context.FrameViews;
+	Views.Reset();
+
+	UWorld* World = Context.World.Get();
 
 	bool bStereoRendering = GEngine->StereoRenderingDevice.IsValid() && 
 		GEngine->StereoRenderingDevice->IsStereoEnabled() && 
 		GEngine->XRSystem.IsValid() && 
 		GEngine->XRSystem->GetHMDDevice();
 
-	// When using stereo we use a "center eye"
-	View.ProjectionMatrix = bStereoRendering ? GEngine->StereoRenderingDevice->GetStereoProjectionMatrix(EStereoscopicEye::eSSE_MONOSCOPIC) : P;
-
 #if WITH_EDITOR
 	if (GEditor && !GEditor->IsVRPreviewActive())
 	{
-		View.ProjectionMatrix = P;
+		bStereoRendering = false;
 	}
 #endif
 
+	// One view per local player, or one per eye when rendering in stereo
+	for (FConstPlayerControllerIterator It = World->GetPlayerControllerIterator(); It; ++It)
+	{
+		APlayerController* PlayerController = It->Get();
+		if (PlayerController == nullptr || !PlayerController->IsLocalController() || PlayerController->PlayerCameraManager == nullptr)
+		{
+			continue;
+		}
+
+		APlayerCameraManager* CameraManager = PlayerController->PlayerCameraManager;
+		const FMinimalViewInfo MinimalView = CameraManager->GetCameraCacheView();
+
+		FSnowViewInfo View;
+		const ULocalPlayer* LocalPlayer = PlayerController->GetLocalPlayer();
+		View.PlayerIndex = LocalPlayer != nullptr ? LocalPlayer->GetControllerId() : INDEX_NONE;
+		FMatrix VP;
+		UGameplayStatics::GetViewProjectionMatrix(MinimalView, View.ViewMatrix, View.ProjectionMatrix, VP);
+		View.ViewOrigin = MinimalView.Location;
+		View.ViewRotation = MinimalView.Rotation;
+
+		// Camera motion since the last frame, ignored across camera cuts
+		FSnowCameraHistory* History = Context.CameraHistory.Find(CameraManager);
+		if (History && DeltaTime > 0.0f && !CameraManager->bGameCameraCutThisFrame)
+		{
+			View.LinearVelocity = (MinimalView.Location - History->Location) / DeltaTime;
+			View.AngularVelocity = (MinimalView.Rotation - History->Rotation).GetNormalized() * (1.0f / DeltaTime);
+		}
+		View.bCameraCut = History == nullptr || CameraManager->bGameCameraCutThisFrame;
+		Context.CameraHistory.Add(CameraManager, { MinimalView.Location, MinimalView.Rotation });
+
+		// Results are applied next frame unless running in same-frame mode
+		View.PredictionTime = bPredict ? DeltaTime : 0.0f;
+
+		if (bStereoRendering)
+		{
+			const float WorldToMeters = World->GetWorldSettings()->WorldToMeters;
+			for (const EStereoscopicEye Eye : { EStereoscopicEye::eSSE_LEFT_EYE, EStereoscopicEye::eSSE_RIGHT_EYE })
+			{
+				FSnowViewInfo& EyeView = Views.Add_GetRef(View);
+				GEngine->StereoRenderingDevice->CalculateStereoViewOffset(Eye, EyeView.ViewRotation, WorldToMeters, EyeView.ViewOrigin);
+				EyeView.ViewMatrix = FSnowViewInfo::MakeViewMatrix(EyeView.ViewOrigin, EyeView.ViewRotation);
+				EyeView.ProjectionMatrix = GEngine->StereoRenderingDevice->GetStereoProjectionMatrix(Eye);
+				EyeView.bStereo = true;
+				EyeView.StereoViewIndex = Eye == EStereoscopicEye::eSSE_LEFT_EYE ? 0 : 1;
+			}
+		}
+		else
+		{
+			Views.Add(View);
+		}
+	}
+
+	// Drop history of camera managers that are gone
+	for (auto It = Context.CameraHistory.CreateIterator(); It; ++It)
+	{
+		if (!It.Key().IsValid())
+		{
+			It.RemoveCurrent();
+		}
+	}
+
+	const int32 NumPlayerViews = Views.Num();
+	for (const TWeakObjectPtr<USceneCaptureComponent>& CapturePtr : Context.SceneCaptures)
+	{
+		const USceneCaptureComponent* Capture = CapturePtr.Get();
+		if (Capture == nullptr || Capture->GetWorld() != World || !Capture->IsActive())
+		{
+			continue;
+		}
+
+		if (const UPlanarReflectionComponent* PlanarReflection = Cast<UPlanarReflectionComponent>(Capture))
+		{
+			// Planar reflections render every player view mirrored by the reflection plane
+			const FPlane MirrorPlane(PlanarReflection->GetComponentLocation(), PlanarReflection->GetUpVector());
+			for (int32 ViewIdx = 0; ViewIdx < NumPlayerViews; ++ViewIdx)
+			{
+				FSnowViewInfo MirrorView = Views[ViewIdx];
+				MirrorView.ViewMatrix = FMirrorMatrix(MirrorPlane) * MirrorView.ViewMatrix;
+				MirrorView.ViewOrigin = MirrorView.ViewOrigin.MirrorByPlane(MirrorPlane);
+				MirrorView.ViewRotation = MirrorView.ViewRotation.Vector().MirrorByVector(MirrorPlane.GetNormal()).Rotation();
+				// The view matrix can't be rebuilt from origin and rotation, so no prediction
+				MirrorView.LinearVelocity = FVector::ZeroVector;
+				MirrorView.AngularVelocity = FRotator::ZeroRotator;
+				MirrorView.PredictionTime = 0.0f;
+				MirrorView.bReverseCulling = true;
+				MirrorView.PlayerIndex = INDEX_NONE;
+				MirrorView.StereoViewIndex = INDEX_NONE;
+				Views.Add(MirrorView);
+			}
+		}
+		else if (const USceneCaptureComponent2D* Capture2D = Cast<USceneCaptureComponent2D>(Capture))
+		{
+			if (!Capture2D->bCaptureEveryFrame || Capture2D->ProjectionType != ECameraProjectionMode::Perspective)
+			{
+				continue;
+			}
+
+			const UTextureRenderTarget2D* Target = Capture2D->TextureTarget;
+			const float Width = Target ? Target->SizeX : 1.0f;
+			const float Height = Target ? Target->SizeY : 1.0f;
+
+			FSnowViewInfo& CaptureView = Views.AddDefaulted_GetRef();
+			CaptureView.ViewOrigin = Capture2D->GetComponentLocation();
+			CaptureView.ViewRotation = Capture2D->GetComponentRotation();
+			CaptureView.ViewMatrix = FSnowViewInfo::MakeViewMatrix(CaptureView.ViewOrigin, CaptureView.ViewRotation);
+			CaptureView.ProjectionMatrix = FReversedZPerspectiveMatrix(FMath::DegreesToRadians(Capture2D->FOVAngle) * 0.5f, Width, Height, GNearClippingPlane);
+		}
+	}
+
+	if (!GSOShadowCulling || NumPlayerViews == 0)
+	{
+		return;
+	}
+
+	// Orthographic light views centered on the first player, looking down the light direction
+	const FVector ShadowCenter = Views[0].ViewOrigin;
+	const float Radius = GSOShadowViewRadius;
+	for (const TWeakObjectPtr<UDirectionalLightComponent>& LightPtr : Context.ShadowLights)
+	{
+		const UDirectionalLightComponent* Light = LightPtr.Get();
+		if (Light == nullptr || Light->GetWorld() != World || !Light->IsVisible() || !Light->CastShadows)
+		{
+			continue;
+		}
+
+		FSnowViewInfo& LightView = Views.AddDefaulted_GetRef();
+		LightView.ViewRotation = Light->GetDirection().Rotation();
+		LightView.ViewOrigin = ShadowCenter - Light->GetDirection() * Radius;
+		LightView.ViewMatrix = FSnowViewInfo::MakeViewMatrix(LightView.ViewOrigin, LightView.ViewRotation);
+		LightView.ProjectionMatrix = FReversedZOrthoMatrix(Radius, Radius, 0.5f / Radius, 0.0f);
+		LightView.bShadowView = true;
+	}
+}
+
+/** An object is skipped only if every view skips it */
+static bool IsInAnyView(const TArray<FSnowViewInfo>& Views, const USnowPrimitiveInfo* Info)
+{
+	for (const FSnowViewInfo& View : Views)
+	{
+		if (View.bShadowView)
+		{
+			continue;
+		}
+
+		// Skip objects where the bounds center is beyond the draw distance
+		if (Info->MaxDrawDistance > 0.0f &&
+			FVector::Distance(View.ViewOrigin, Info->Bounds.Origin) > Info->MaxDrawDistance)
+		{
+			continue;
+		}
+
+		// Skip objects behind the player
+		FVector CameraForward = View.ViewRotation.Vector();
+		FVector DirToOccluder = (Info->Bounds.Origin - View.ViewOrigin).GetSafeNormal();
+		if (!View.bReverseCulling && CameraForward.Dot(DirToOccluder) < GSOCullingDot)
+		{
+			const bool bInsideOccluder = UKismetMathLibrary::IsPointInBox(View.ViewOrigin, Info->Bounds.Origin, Info->Bounds.BoxExtent);
+			if (!bInsideOccluder)
+			{
+				continue;
+			}
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+void USnowOcclusionSubsystem::GatherScene(FSnowOcclusionContext& Context)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_GatherScene, SnowOcclusionChannel);
+
+	const TArray<FSnowViewInfo>& Views = Context.FrameViews;
+	TArray<USnowPrimitiveInfo*>& Scene = Context.FrameScene;
+
 	if (GSOVisualizeBounds && !GEngine->StereoRenderingDevice.IsValid())
 	{
-		DrawCameraFrustum(PlayerCameraManager.Get(), FColor::Cyan);
+		DrawCameraFrustum(Context.PlayerCameraManager.Get(), FColor::Cyan);
 	}
 
-	TArray<USnowPrimitiveInfo*> Scene;
-	for (auto Pair : Occluders)
+	Scene.Reset();
+	for (auto Pair : Context.Occluders)
 	{
 		if (Pair.Key->bUpdateBounds)
 		{
 			Pair.Key->UpdateInfo();
 		}
 
-		if (GSOOptimizationsEnable)
+		// Simple "frustrum" culling
+		const bool bInAnyView = !GSOOptimizationsEnable || IsInAnyView(Views, Pair.Value);
+		if (bInAnyView)
+		{
+			Scene.Add(Pair.Value);
+		}
+		else
 		{
-			// Simple "frustrum" culling
-			FVector CameraForward = PlayerCameraManager->GetCameraRotation().Vector();
-			FVector DirToOccluder = (Pair.Value->Bounds.Origin - PlayerCameraManager->GetCameraLocation()).GetSafeNormal();
+			Pair.Key->HandleOcclusionVisibility(true);
+			Pair.Key->HandleOcclusionShadow(true, false);
+		}
 
-			// Skip objects where the bounds center is beyond the draw distance
-			if (Pair.Value->MaxDrawDistance > 0.0f &&
-				FVector::Distance(PlayerCameraManager->GetCameraLocation(), Pair.Value->Bounds.Origin) > Pair.Value->MaxDrawDistance)
+		for (USnowPrimitiveInfo* PrimitiveInfo : Pair.Key->PrimitiveInfos)
+		{
+			if (GSOOptimizationsEnable && !IsInAnyView(Views, PrimitiveInfo))
 			{
-				Pair.Key->HandleOcclusionVisibility(true);
-				continue;
+				Pair.Key->HandlePrimitiveVisibility(PrimitiveInfo, true);
 			}
-
-			// Skip objects behind the player
-			if (CameraForward.Dot(DirToOccluder) < GSOCullingDot)
+			else
 			{
-				const bool bInsideOccluder = UKismetMathLibrary::IsPointInBox(PlayerCameraManager->GetCameraLocation(), Pair.Value->Bounds.Origin, Pair.Value->Bounds.BoxExtent);
-				if (!bInsideOccluder)
-				{
-					Pair.Key->HandleOcclusionVisibility(true);
-					continue;
-				}
+				Scene.Add(PrimitiveInfo);
 			}
 		}
 
-		Scene.Add(Pair.Value);
+		if (!bInAnyView)
+		{
+			continue;
+		}
 
 		if (GSOVisualizeBounds)
 		{
@@ -263,11 +634,77 @@ void USnowOcclusionSubsystem::Tick(float DeltaTime)
 				bNeedForeground = Bounds.SphereRadius < Pair.Value->Bounds.SphereRadius;
 			}
 
-			DrawDebugBox(PlayerCameraManager->GetWorld(), Bounds.Origin, Bounds.BoxExtent, FQuat::Identity, BoundsColor, false, 0, bNeedForeground ? SDPG_Foreground : SDPG_World);
+			DrawDebugBox(Context.World.Get(), Bounds.Origin, Bounds.BoxExtent, FQuat::Identity, BoundsColor, false, 0, bNeedForeground ? SDPG_Foreground : SDPG_World);
+		}
+	}
+
+	// What culling each occludee would save at this frame's LOD
+	for (USnowPrimitiveInfo* Info : Scene)
+	{
+		if (Info->bOcludee)
+		{
+			Info->UpdateRenderCost(Views);
 		}
 	}
+}
 
-	OcclusionSystem.Process(Scene, View);
+void USnowOcclusionSubsystem::ApplyVisibility(FSnowOcclusionContext& Context)
+{
+	TRACE_CPUPROFILER_EVENT_SCOPE_ON_CHANNEL(SnowOcclusion_ApplyVisibility, SnowOcclusionChannel);
+
+	const TArray<USnowPrimitiveInfo*>& Scene = Context.FrameScene;
+	const TMap<uint32, USnowOcclusionComponent*>& InfoToComp = Context.InfoToComp;
+
+	const bool bUseViewExtension = GSOCullingMethod == 1;
+	// Without an RHI (-nullrhi, servers) no view is ever set up, nothing would read the hidden sets
+	const bool bHideInViews = bUseViewExtension && FApp::CanEverRender();
+	if (bHideInViews && !Context.ViewExtension.IsValid())
+	{
+		Context.ViewExtension = FSceneViewExtensions::NewExtension<FSnowOcclusionViewExtension>(Context.World.Get());
+	}
+	if (Context.ViewExtension.IsValid())
+	{
+		Context.ViewExtension->SetActive(bHideInViews);
+	}
+
+	// Hidden in every view, and in each player view of the applied results what only that view found occluded
+	TSet<FPrimitiveComponentId> HiddenPrimitives;
+	TArray<FSnowOcclusionViewExtension::FViewHiddenPrimitives> ViewHiddenPrimitives;
+	TArray<int32, TInlineAllocator<8>> ViewSlots;
+	if (bHideInViews)
+	{
+		for (const FSnowViewInfo& View : Context.OcclusionSystem.GetAppliedViews())
+		{
+			ViewSlots.Add(View.PlayerIndex != INDEX_NONE ? ViewHiddenPrimitives.Num() : INDEX_NONE);
+			if (View.PlayerIndex != INDEX_NONE)
+			{
+				FSnowOcclusionViewExtension::FViewHiddenPrimitives& ViewHidden = ViewHiddenPrimitives.AddDefaulted_GetRef();
+				ViewHidden.PlayerIndex = View.PlayerIndex;
+				ViewHidden.StereoViewIndex = View.StereoViewIndex;
+			}
+		}
+	}
+	auto AddHiddenPrimitive = [&HiddenPrimitives, &ViewHiddenPrimitives, &ViewSlots](const USnowPrimitiveInfo* Info)
+	{
+		if (!Info->bVisible)
+		{
+			HiddenPrimitives.Add(Info->PrimitiveComponentId);
+			return;
+		}
+		if (Info->ViewVisible.Num() != ViewSlots.Num())
+		{
+			return;
+		}
+		for (int32 ViewIdx = 0; ViewIdx < ViewSlots.Num(); ++ViewIdx)
+		{
+			if (ViewSlots[ViewIdx] != INDEX_NONE && !Info->ViewVisible[ViewIdx])
+			{
+				ViewHiddenPrimitives[ViewSlots[ViewIdx]].HiddenPrimitives.Add(Info->PrimitiveComponentId);
+			}
+		}
+	};
+
+	const bool bShadowCulling = Context.FrameViews.ContainsByPredicate([](const FSnowViewInfo& View) { return View.bShadowView; });
 
 	//ParallelFor(Scene.Num(), [this, &Scene](int32 Index)
 	//{
@@ -290,7 +727,43 @@ void USnowOcclusionSubsystem::Tick(float DeltaTime)
 		}
 
 		USnowOcclusionComponent* Comp = InfoToComp[Info->PrimitiveComponentId.PrimIDValue];
-		Comp->HandleOcclusionVisibility(Info->bVisible);
+		if (Info != Comp->Info)
+		{
+			// Other primitives of a per primitive occlusion actor
+			Comp->HandlePrimitiveVisibility(Info, Info->bVisible || bUseViewExtension);
+			if (bHideInViews)
+			{
+				AddHiddenPrimitive(Info);
+			}
+			continue;
+		}
+
+		if (bUseViewExtension)
+		{
+			// Don't leave actors hidden when switching methods at runtime
+			if (Comp->bHiddenByOcclusion)
+			{
+				Comp->HandleOcclusionVisibility(true);
+			}
+			if (bHideInViews)
+			{
+				AddHiddenPrimitive(Info);
+			}
+		}
+		else
+		{
+			Comp->HandleOcclusionVisibility(Info->bVisible);
+		}
+
+		// Clusters of instanced components, the whole component goes with bVisible once every cluster is occluded
+		if (Info->SubBounds.Num() > 0)
+		{
+			Comp->HandleInstanceVisibility(Info->SubVisible);
+		}
+
+		// Hidden actors need bCastHiddenShadow to keep a shadow that is still needed
+		const bool bShadowVisible = !bShadowCulling || Info->bVisible || Info->bShadowVisible;
+		Comp->HandleOcclusionShadow(bShadowVisible, bShadowCulling && Comp->bHiddenByOcclusion);
 
 		if (GSOVisualizeResultsBounds)
 		{
@@ -301,30 +774,353 @@ void USnowOcclusionSubsystem::Tick(float DeltaTime)
 			{
 				Bounds = Comp->OccluderMesh.Get()->GetBounds().TransformBy(Info->LocalToWorld);
 			}
-			DrawDebugBox(PlayerCameraManager->GetWorld(), Bounds.Origin, Bounds.BoxExtent * 0.99, FQuat::Identity, Color, false, 0, SDPG_Foreground);
+			DrawDebugBox(Context.World.Get(), Bounds.Origin, Bounds.BoxExtent * 0.99, FQuat::Identity, Color, false, 0, SDPG_Foreground);
 		}
 	}
+
+	if (bHideInViews)
+	{
+		Context.ViewExtension->SetHiddenPrimitives(MoveTemp(HiddenPrimitives), MoveTemp(ViewHiddenPrimitives));
+	}
 }
 
 void USnowOcclusionSubsystem::RegisterOccluder(USnowOcclusionComponent* Occluder, USnowPrimitiveInfo* Info)
 {
-	Occluders.Add(Occluder, Info);
-	InfoToComp.Add(Info->PrimitiveComponentId.PrimIDValue, Occluder);
+	FSnowOcclusionContext& Context = FindOrAddContext(Occluder->GetWorld());
+	Context.Occluders.Add(Occluder, Info);
+	Context.InfoToComp.Add(Info->PrimitiveComponentId.PrimIDValue, Occluder);
+	for (USnowPrimitiveInfo* PrimitiveInfo : Occluder->PrimitiveInfos)
+	{
+		Context.InfoToComp.Add(PrimitiveInfo->PrimitiveComponentId.PrimIDValue, Occluder);
+	}
+	ResolvePVSIndices(Context, Occluder);
 }
 
 void USnowOcclusionSubsystem::UnregisterOccluder(USnowOcclusionComponent* Occluder)
 {
-	if (Occluders.Contains(Occluder))
+	for (auto& Pair : Contexts)
+	{
+		FSnowOcclusionContext& Context = *Pair.Value;
+		if (Context.Occluders.Contains(Occluder))
+		{
+			USnowPrimitiveInfo* Info = Context.Occluders[Occluder];
+			Context.Occluders.Remove(Occluder);
+			Context.InfoToComp.Remove(Info->PrimitiveComponentId.PrimIDValue);
+
+			// Don't leave a dangling pointer in a same-frame submission that hasn't been applied yet
+			Context.FrameScene.Remove(Info);
+			for (USnowPrimitiveInfo* PrimitiveInfo : Occluder->PrimitiveInfos)
+			{
+				Context.InfoToComp.Remove(PrimitiveInfo->PrimitiveComponentId.PrimIDValue);
+				Context.FrameScene.Remove(PrimitiveInfo);
+			}
+			return;
+		}
+	}
+}
+
+void USnowOcclusionSubsystem::RegisterSceneCapture(USceneCaptureComponent* SceneCapture)
+{
+	if (SceneCapture != nullptr)
 	{
-		USnowPrimitiveInfo* Info = Occluders[Occluder];
-		Occluders.Remove(Occluder);
-		InfoToComp.Remove(Info->PrimitiveComponentId.PrimIDValue);
+		FindOrAddContext(SceneCapture->GetWorld()).SceneCaptures.AddUnique(SceneCapture);
+	}
+}
+
+void USnowOcclusionSubsystem::UnregisterSceneCapture(USceneCaptureComponent* SceneCapture)
+{
+	for (auto& Pair : Contexts)
+	{
+		Pair.Value->SceneCaptures.Remove(SceneCapture);
+		Pair.Value->SceneCaptures.RemoveAll([](const TWeakObjectPtr<USceneCaptureComponent>& Capture) { return !Capture.IsValid(); });
+	}
+}
+
+void USnowOcclusionSubsystem::RegisterShadowLight(UDirectionalLightComponent* Light)
+{
+	if (Light != nullptr)
+	{
+		FindOrAddContext(Light->GetWorld()).ShadowLights.AddUnique(Light);
+	}
+}
+
+void USnowOcclusionSubsystem::UnregisterShadowLight(UDirectionalLightComponent* Light)
+{
+	for (auto& Pair : Contexts)
+	{
+		Pair.Value->ShadowLights.Remove(Light);
+		Pair.Value->ShadowLights.RemoveAll([](const TWeakObjectPtr<UDirectionalLightComponent>& ShadowLight) { return !ShadowLight.IsValid(); });
+	}
+}
+
+void USnowOcclusionSubsystem::RegisterPortalCell(ASnowOcclusionCell* Cell)
+{
+	if (Cell != nullptr)
+	{
+		FSnowOcclusionContext& Context = FindOrAddContext(Cell->GetWorld());
+		Context.PortalCells.AddUnique(Cell);
+		Context.bPortalGraphDirty = true;
+	}
+}
+
+void USnowOcclusionSubsystem::UnregisterPortalCell(ASnowOcclusionCell* Cell)
+{
+	for (auto& Pair : Contexts)
+	{
+		if (Pair.Value->PortalCells.Remove(Cell) > 0)
+		{
+			Pair.Value->bPortalGraphDirty = true;
+		}
+	}
+}
+
+void USnowOcclusionSubsystem::RegisterPortal(ASnowOcclusionPortal* Portal)
+{
+	if (Portal != nullptr)
+	{
+		FSnowOcclusionContext& Context = FindOrAddContext(Portal->GetWorld());
+		Context.Portals.AddUnique(Portal);
+		Context.bPortalGraphDirty = true;
+	}
+}
+
+void USnowOcclusionSubsystem::UnregisterPortal(ASnowOcclusionPortal* Portal)
+{
+	for (auto& Pair : Contexts)
+	{
+		if (Pair.Value->Portals.Remove(Portal) > 0)
+		{
+			Pair.Value->bPortalGraphDirty = true;
+		}
+	}
+}
+
+void USnowOcclusionSubsystem::MarkPortalsDirty(UWorld* World)
+{
+	if (FSnowOcclusionContext* Context = FindContext(World))
+	{
+		Context->bPortalGraphDirty = true;
+	}
+}
+
+void USnowOcclusionSubsystem::RegisterPVSVolume(ASnowOcclusionPVSVolume* Volume)
+{
+	if (Volume != nullptr)
+	{
+		FSnowOcclusionContext& Context = FindOrAddContext(Volume->GetWorld());
+		Context.PVSVolumes.AddUnique(Volume);
+		Context.bPVSDirty = true;
+	}
+}
+
+void USnowOcclusionSubsystem::UnregisterPVSVolume(ASnowOcclusionPVSVolume* Volume)
+{
+	for (auto& Pair : Contexts)
+	{
+		if (Pair.Value->PVSVolumes.Remove(Volume) > 0)
+		{
+			Pair.Value->bPVSDirty = true;
+		}
+	}
+}
+
+/** Smallest cell holding the point, nested cells take precedence over the ones around them */
+static int32 FindPortalCell(const SnowOcclusion::FPortalGraph& Graph, const FVector& Point)
+{
+	int32 BestCell = SnowOcclusion::PORTAL_EXTERIOR;
+	double BestVolume = DBL_MAX;
+	for (int32 CellIdx = 0; CellIdx < (int32)Graph.Cells.size(); ++CellIdx)
+	{
+		const SnowOcclusion::FBox3& Cell = Graph.Cells[CellIdx];
+		if (Point.X >= Cell.Min.X && Point.Y >= Cell.Min.Y && Point.Z >= Cell.Min.Z && Point.X <= Cell.Max.X && Point.Y <= Cell.Max.Y && Point.Z <= Cell.Max.Z)
+		{
+			const double Volume = double(Cell.Max.X - Cell.Min.X) * double(Cell.Max.Y - Cell.Min.Y) * double(Cell.Max.Z - Cell.Min.Z);
+			if (Volume < BestVolume)
+			{
+				BestCell = CellIdx;
+				BestVolume = Volume;
+			}
+		}
+	}
+	return BestCell;
+}
+
+void USnowOcclusionSubsystem::UpdatePortalGraph(FSnowOcclusionContext& Context)
+{
+	if (!Context.bPortalGraphDirty)
+	{
+		return;
+	}
+	Context.bPortalGraphDirty = false;
+
+	TRACE_CPUPROFILER_EVENT_SCOPE(SnowOcclusion_UpdatePortalGraph);
+
+	SnowOcclusion::FPortalGraph Graph;
+	Context.PortalCells.RemoveAll([](const TWeakObjectPtr<ASnowOcclusionCell>& Cell) { return !Cell.IsValid(); });
+	for (const TWeakObjectPtr<ASnowOcclusionCell>& Cell : Context.PortalCells)
+	{
+		const FBox Bounds = Cell->GetCellBounds();
+		Graph.Cells.push_back({ { (float)Bounds.Min.X, (float)Bounds.Min.Y, (float)Bounds.Min.Z }, { (float)Bounds.Max.X, (float)Bounds.Max.Y, (float)Bounds.Max.Z } });
+	}
+
+	Context.Portals.RemoveAll([](const TWeakObjectPtr<ASnowOcclusionPortal>& Portal) { return !Portal.IsValid(); });
+	for (const TWeakObjectPtr<ASnowOcclusionPortal>& Portal : Context.Portals)
+	{
+		// Closed portals are left out, nothing is seen through them
+		if (!Portal->IsOpen())
+		{
+			continue;
+		}
+
+		FVector Front, Back;
+		Portal->GetSidePoints(Front, Back);
+		const int32 FrontCell = FindPortalCell(Graph, Front);
+		const int32 BackCell = FindPortalCell(Graph, Back);
+		if (FrontCell == BackCell)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("SnowOcclusion: portal %s doesn't lead from one cell to another, ignored"), *GetNameSafe(Portal.Get()));
+			continue;
+		}
+
+		FVector Corners[4];
+		Portal->GetCorners(Corners);
+
+		SnowOcclusion::FPortal& CorePortal = Graph.Portals.emplace_back();
+		for (int32 CornerIdx = 0; CornerIdx < 4; ++CornerIdx)
+		{
+			CorePortal.Corners[CornerIdx] = { (float)Corners[CornerIdx].X, (float)Corners[CornerIdx].Y, (float)Corners[CornerIdx].Z };
+		}
+		// The exterior always goes on the second side
+		CorePortal.Cells[0] = FrontCell != SnowOcclusion::PORTAL_EXTERIOR ? FrontCell : BackCell;
+		CorePortal.Cells[1] = FrontCell != SnowOcclusion::PORTAL_EXTERIOR ? BackCell : FrontCell;
+	}
+
+	if (!Graph.IsEmpty())
+	{
+		Graph.LinkPortals();
+	}
+	Context.OcclusionSystem.SetPortalGraph(Graph);
+}
+
+void USnowOcclusionSubsystem::UpdatePVS(FSnowOcclusionContext& Context)
+{
+	if (!Context.bPVSDirty)
+	{
+		return;
+	}
+	Context.bPVSDirty = false;
+
+	// Every volume of the world holds the same sets
+	Context.PVSVolumes.RemoveAll([](const TWeakObjectPtr<ASnowOcclusionPVSVolume>& Volume) { return !Volume.IsValid(); });
+	USnowOcclusionPVSData* Data = nullptr;
+	for (const TWeakObjectPtr<ASnowOcclusionPVSVolume>& Volume : Context.PVSVolumes)
+	{
+		if (Volume->PVSData != nullptr)
+		{
+			Data = Volume->PVSData;
+			break;
+		}
+	}
+	if (Data == Context.PVSData.Get())
+	{
+		return;
+	}
+
+	TRACE_CPUPROFILER_EVENT_SCOPE(SnowOcclusion_UpdatePVS);
+
+	Context.PVSData = Data;
+	Context.PVSPrimitiveIndices.Reset();
+	SnowOcclusion::FPVS PVS;
+	if (Data != nullptr)
+	{
+		if (PVS.Deserialize(Data->Data.GetData(), Data->Data.Num()) && PVS.NumPrimitives == Data->PrimitiveKeys.Num())
+		{
+			Context.PVSPrimitiveIndices.Reserve(Data->PrimitiveKeys.Num());
+			for (int32 PrimitiveIdx = 0; PrimitiveIdx < Data->PrimitiveKeys.Num(); ++PrimitiveIdx)
+			{
+				Context.PVSPrimitiveIndices.Add(Data->PrimitiveKeys[PrimitiveIdx], PrimitiveIdx);
+			}
+		}
+		else
+		{
+			UE_LOG(LogTemp, Warning, TEXT("SnowOcclusion: baked visible sets %s can't be read, bake them again"), *GetNameSafe(Data));
+			PVS = SnowOcclusion::FPVS();
+		}
+	}
+
+	for (const auto& Pair : Context.Occluders)
+	{
+		ResolvePVSIndices(Context, Pair.Key);
+	}
+	Context.OcclusionSystem.SetPVS(PVS);
+}
+
+void USnowOcclusionSubsystem::ResolvePVSIndices(const FSnowOcclusionContext& Context, USnowOcclusionComponent* Occluder) const
+{
+	// Only static primitives are baked, anything that moves could have moved out of its set
+	auto Resolve = [&Context](USnowPrimitiveInfo* Info, const UPrimitiveComponent* Primitive)
+	{
+		const int32* Index = !Context.PVSPrimitiveIndices.IsEmpty() && Primitive != nullptr && Primitive->Mobility == EComponentMobility::Static
+			? Context.PVSPrimitiveIndices.Find(USnowOcclusionPVSData::MakePrimitiveKey(Primitive)) : nullptr;
+		Info->PVSIndex = Index != nullptr ? *Index : INDEX_NONE;
+	};
+
+	Resolve(Occluder->Info, Occluder->PrimitiveComponent);
+	for (int32 PrimitiveIdx = 0; PrimitiveIdx < Occluder->PrimitiveInfos.Num(); ++PrimitiveIdx)
+	{
+		Resolve(Occluder->PrimitiveInfos[PrimitiveIdx], Occluder->OccludeePrimitives[PrimitiveIdx]);
 	}
 }
 
 void USnowOcclusionSubsystem::DrawToCanvas(UCanvas* Canvas, int32 Width, int32 Height)
 {
-	OcclusionSystem.DebugDrawToCanvas(Canvas->Canvas, 20, 20);
+	// Debug draw the first game world, this is what is being played in PIE
+	for (auto& Pair : Contexts)
+	{
+		const UWorld* World = Pair.Value->World.Get();
+		if (World && World->IsGameWorld())
+		{
+			Pair.Value->OcclusionSystem.DebugDrawToCanvas(Canvas->Canvas, 20, 20);
+			return;
+		}
+	}
+}
+
+void USnowOcclusionSubsystem::LogVisibleRenderCost(int32 MaxPrimitives) const
+{
+	for (const auto& Pair : Contexts)
+	{
+		const FSnowOcclusionContext& Context = *Pair.Value;
+		const UWorld* World = Context.World.Get();
+		if (World == nullptr)
+		{
+			continue;
+		}
+
+		auto GetTriangles = [](const USnowPrimitiveInfo& Info) { return (int64)Info.NumTriangles * Info.NumInstances; };
+
+		TArray<const USnowPrimitiveInfo*> Visible;
+		int64 NumVisibleTriangles = 0;
+		for (const USnowPrimitiveInfo* Info : Context.FrameScene)
+		{
+			if (Info->bOcludee && Info->bVisible && Info->NumTriangles > 0)
+			{
+				Visible.Add(Info);
+				NumVisibleTriangles += GetTriangles(*Info);
+			}
+		}
+
+		Visible.Sort([&GetTriangles](const USnowPrimitiveInfo& A, const USnowPrimitiveInfo& B) { return GetTriangles(A) > GetTriangles(B); });
+
+		UE_LOG(LogTemp, Log, TEXT("SnowOcclusion: %s, %d visible occludees, %lld triangles"), *World->GetName(), Visible.Num(), NumVisibleTriangles);
+		for (int32 Idx = 0; Idx < FMath::Min(Visible.Num(), MaxPrimitives); ++Idx)
+		{
+			const USnowPrimitiveInfo* Info = Visible[Idx];
+			USnowOcclusionComponent* const* Comp = Context.InfoToComp.Find(Info->PrimitiveComponentId.PrimIDValue);
+			const AActor* Owner = Comp ? (*Comp)->GetOwner() : nullptr;
+			UE_LOG(LogTemp, Log, TEXT("  %lld triangles, %d draw calls, %d instances: %s"), GetTriangles(*Info), Info->NumDrawCalls, Info->NumInstances, *GetNameSafe(Owner));
+		}
+	}
 }
 
 //#pragma optimize("", on)
@@ -0,0 +1,55 @@
+// Copyright Fast Travel Games AB 2023
+
+
+#include "SnowOcclusionViewExtension.h"
+#include "SceneView.h"
+
+FSnowOcclusionViewExtension::FSnowOcclusionViewExtension(const FAutoRegister& AutoRegister, UWorld* InWorld)
+	: FWorldSceneViewExtension(AutoRegister, InWorld)
+{
+}
+
+void FSnowOcclusionViewExtension::SetHiddenPrimitives(TSet<FPrimitiveComponentId>&& InHiddenPrimitives, TArray<FViewHiddenPrimitives>&& InViewHiddenPrimitives)
+{
+	check(IsInGameThread());
+	HiddenPrimitives = MoveTemp(InHiddenPrimitives);
+	ViewHiddenPrimitives = MoveTemp(InViewHiddenPrimitives);
+}
+
+void FSnowOcclusionViewExtension::SetActive(bool bInActive)
+{
+	check(IsInGameThread());
+	bActive = bInActive;
+	if (!bActive)
+	{
+		HiddenPrimitives.Reset();
+		ViewHiddenPrimitives.Reset();
+	}
+}
+
+void FSnowOcclusionViewExtension::SetupView(FSceneViewFamily& InViewFamily, FSceneView& InView)
+{
+	// Views are set up on the game thread (CalcSceneView, scene captures), same as where the results are applied
+	check(IsInGameThread());
+	InView.HiddenPrimitives.Append(HiddenPrimitives);
+
+	// Captures and reflections aren't the view of a player even when they render for one
+	if (InView.PlayerIndex == INDEX_NONE || InView.bIsSceneCapture || InView.bIsReflectionCapture || InView.bIsPlanarReflection)
+	{
+		return;
+	}
+
+	for (const FViewHiddenPrimitives& View : ViewHiddenPrimitives)
+	{
+		if (View.PlayerIndex == InView.PlayerIndex && View.StereoViewIndex == InView.StereoViewIndex)
+		{
+			InView.HiddenPrimitives.Append(View.HiddenPrimitives);
+			break;
+		}
+	}
+}
+
+bool FSnowOcclusionViewExtension::IsActiveThisFrame_Internal(const FSceneViewExtensionContext& Context) const
+{
+	return bActive && FWorldSceneViewExtension::IsActiveThisFrame_Internal(Context);
+}
@@ -0,0 +1,101 @@
+// Copyright Fast Travel Games AB 2023
+
+
+#include "SnowOcclusionComponent.h"
+#include "Components/InstancedStaticMeshComponent.h"
+#include "Engine/StaticMesh.h"
+#include "Misc/AutomationTest.h"
+#include "UObject/Package.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSnowOcclusionInstanceCustomDataTest, "SnowOcclusion.Component.InstanceCustomData",
+	EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+/** Three instances on their own clusters, each with the custom data the material already reads */
+static UInstancedStaticMeshComponent* CreateInstances(int32 NumCustomDataFloats)
+{
+	UInstancedStaticMeshComponent* InstancedComponent = NewObject<UInstancedStaticMeshComponent>(GetTransientPackage());
+	InstancedComponent->SetStaticMesh(LoadObject<UStaticMesh>(nullptr, TEXT("/Engine/BasicShapes/Cube.Cube")));
+	InstancedComponent->SetNumCustomDataFloats(NumCustomDataFloats);
+	for (int32 InstanceIdx = 0; InstanceIdx < 3; ++InstanceIdx)
+	{
+		InstancedComponent->AddInstance(FTransform(FVector(InstanceIdx * 1000.0f, 0.0f, 0.0f)));
+		for (int32 DataIdx = 0; DataIdx < NumCustomDataFloats; ++DataIdx)
+		{
+			InstancedComponent->SetCustomDataValue(InstanceIdx, DataIdx, InstanceIdx + DataIdx * 0.25f);
+		}
+	}
+	return InstancedComponent;
+}
+
+static float GetCustomData(const UInstancedStaticMeshComponent* InstancedComponent, int32 InstanceIdx, int32 DataIdx)
+{
+	return InstancedComponent->PerInstanceSMCustomData[InstanceIdx * InstancedComponent->NumCustomDataFloats + DataIdx];
+}
+
+bool FSnowOcclusionInstanceCustomDataTest::RunTest(const FString& Parameters)
+{
+	auto CreateComponent = [](UInstancedStaticMeshComponent* InstancedComponent, int32 CustomDataIndex)
+	{
+		USnowOcclusionComponent* Component = NewObject<USnowOcclusionComponent>(GetTransientPackage());
+		Component->PrimitiveComponent = InstancedComponent;
+		Component->bUseAsOccluder = false;
+		Component->bPerInstanceOcclusion = true;
+		Component->InstanceClusterSize = 0.0f;
+		Component->InstanceVisibilityCustomDataIndex = CustomDataIndex;
+		return Component;
+	};
+
+	TBitArray<> ClusterVisible(true, 3);
+	ClusterVisible[1] = false;
+
+	// An index past the existing floats is an error, the layout the material reads stays as it is
+	{
+		UInstancedStaticMeshComponent* InstancedComponent = CreateInstances(2);
+		USnowOcclusionComponent* Component = CreateComponent(InstancedComponent, 2);
+		AddExpectedError(TEXT("Instance Visibility Custom Data Index"), EAutomationExpectedErrorFlags::Contains, 1);
+		TestTrue(TEXT("InitInfo"), Component->InitInfo());
+		Component->HandleInstanceVisibility(ClusterVisible);
+
+		TestEqual(TEXT("Floats past the layout"), InstancedComponent->NumCustomDataFloats, 2);
+		for (int32 InstanceIdx = 0; InstanceIdx < 3; ++InstanceIdx)
+		{
+			TestEqual(TEXT("Float 0 past the layout"), GetCustomData(InstancedComponent, InstanceIdx, 0), (float)InstanceIdx);
+			TestEqual(TEXT("Float 1 past the layout"), GetCustomData(InstancedComponent, InstanceIdx, 1), InstanceIdx + 0.25f);
+		}
+	}
+
+	// An index inside the existing floats only writes its own float
+	{
+		UInstancedStaticMeshComponent* InstancedComponent = CreateInstances(2);
+		USnowOcclusionComponent* Component = CreateComponent(InstancedComponent, 1);
+		TestTrue(TEXT("InitInfo"), Component->InitInfo());
+		Component->HandleInstanceVisibility(ClusterVisible);
+
+		TestEqual(TEXT("Floats inside the layout"), InstancedComponent->NumCustomDataFloats, 2);
+		for (int32 InstanceIdx = 0; InstanceIdx < 3; ++InstanceIdx)
+		{
+			TestEqual(TEXT("Float 0 inside the layout"), GetCustomData(InstancedComponent, InstanceIdx, 0), (float)InstanceIdx);
+			TestEqual(TEXT("Visibility inside the layout"), GetCustomData(InstancedComponent, InstanceIdx, 1), InstanceIdx == 1 ? 0.0f : 1.0f);
+		}
+	}
+
+	// Without any custom data the float is added
+	{
+		UInstancedStaticMeshComponent* InstancedComponent = CreateInstances(0);
+		USnowOcclusionComponent* Component = CreateComponent(InstancedComponent, 0);
+		TestTrue(TEXT("InitInfo"), Component->InitInfo());
+		Component->HandleInstanceVisibility(ClusterVisible);
+
+		TestEqual(TEXT("Floats added"), InstancedComponent->NumCustomDataFloats, 1);
+		for (int32 InstanceIdx = 0; InstanceIdx < 3; ++InstanceIdx)
+		{
+			TestEqual(TEXT("Visibility added"), GetCustomData(InstancedComponent, InstanceIdx, 0), InstanceIdx == 1 ? 0.0f : 1.0f);
+		}
+	}
+
+	return true;
+}
+
+#endif
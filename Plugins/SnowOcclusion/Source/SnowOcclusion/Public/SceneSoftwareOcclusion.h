@@ -5,16 +5,34 @@
 
 #include "CoreMinimal.h"
 #include "Async/TaskGraphInterfaces.h"
+#include "Trace/Trace.h"
+#include <atomic>
 #include "SceneSoftwareOcclusion.generated.h"
 
+class UPrimitiveComponent;
 class USnowOcclusionComponent;
+class FSnowViewInfo;
+
+// Insights channel of the occlusion scopes, on with -trace=cpu,SnowOcclusion
+UE_TRACE_CHANNEL_EXTERN(SnowOcclusionChannel);
 
 class FRHICommandListImmediate;
 class FScene;
 class FViewInfo;
 struct FOcclusionFrameResults;
+struct FOcclusionSceneSignature;
+struct FOcclusionSceneData;
+struct FOcclusionCapture;
+
+namespace SnowOcclusion
+{
+	struct FHistory;
+	struct FPortalGraph;
+	struct FPVS;
+}
 
-typedef TArray<FVector> FOccluderVertexArray;
+// Occluder vertices are kept in single precision, the occlusion core reads them in place
+typedef TArray<FVector3f> FOccluderVertexArray;
 typedef TArray<uint16> FOccluderIndexArray;
 typedef TSharedPtr<FOccluderVertexArray, ESPMode::ThreadSafe> FOccluderVertexArraySP;
 typedef TSharedPtr<FOccluderIndexArray, ESPMode::ThreadSafe> FOccluderIndexArraySP;
@@ -30,6 +48,16 @@ public:
 	static TUniquePtr<FSnowMeshOccluderData> Build(UStaticMesh* Owner);
 };
 
+/** What drawing one LOD of a primitive costs, what culling the primitive saves */
+struct FSnowLODRenderCost
+{
+	// Screen size from which the LOD is drawn, as in the LOD settings of the mesh
+	float ScreenSize = 0.0f;
+	int32 NumTriangles = 0;
+	// Mesh sections, one draw call each in the base pass
+	int32 NumDrawCalls = 0;
+};
+
 UCLASS()
 class USnowPrimitiveInfo : public UObject
 {
@@ -41,10 +69,39 @@ public:
 	TUniquePtr<FSnowMeshOccluderData> OccluderData;
 	FBoxSphereBounds Bounds;
 	FMatrix LocalToWorld;
+	// Optional oriented occludee bounds: a local box and its transform, projected instead of the world aligned Bounds
+	bool bOrientedBounds = false;
+	FBox OrientedBounds = FBox(ForceInit);
+	FMatrix OrientedBoundsToWorld = FMatrix::Identity;
 	bool bOccluder;
 	bool bOcludee;
 	bool bVisible;
+	// Casts a shadow that shadow views may cull separately, and whether that shadow can reach a visible receiver
+	bool bShadowCaster;
+	bool bShadowVisible;
 	float MaxDrawDistance;
+	// Primitive of the baked potentially visible sets of the world, INDEX_NONE for primitives not baked
+	int32 PVSIndex = INDEX_NONE;
+
+	// World space sub-bounds (instance clusters) tested as separate occludees in place of Bounds, and their visibility
+	TArray<FBox> SubBounds;
+	TBitArray<> SubVisible;
+	// Visibility in each view of the applied results, indexed like FSceneSoftwareOcclusion::GetAppliedViews. Empty when every view goes with bVisible.
+	TBitArray<> ViewVisible;
+
+	// Render cost of each LOD, most detailed first. Empty for primitives that aren't meshes, they count as free.
+	TArray<FSnowLODRenderCost, TInlineAllocator<4>> LODCosts;
+	// Instances drawn by the primitive and by each sub-bounds, 1 and empty for regular primitives
+	int32 NumInstances = 1;
+	TArray<int32> SubNumInstances;
+	// Triangles of one instance and draw calls at the LOD the views pick this frame
+	int32 NumTriangles = 0;
+	int32 NumDrawCalls = 0;
+
+	/** Reads the LODs of the mesh the primitive draws, refreshed with the bounds as the mesh and its streamed LODs may change */
+	void BuildRenderCost(const UPrimitiveComponent* Primitive);
+	/** Picks the most detailed LOD any view draws the bounds with */
+	void UpdateRenderCost(const TArray<FSnowViewInfo>& Views);
 };
 
 class FSnowViewInfo
@@ -53,6 +110,27 @@ public:
 	FMatrix ViewMatrix;
 	FMatrix ProjectionMatrix;
 	FVector ViewOrigin;
+	FRotator ViewRotation = FRotator::ZeroRotator;
+
+	// Camera motion, in cm/s and deg/s
+	FVector LinearVelocity = FVector::ZeroVector;
+	FRotator AngularVelocity = FRotator::ZeroRotator;
+	// How far in the future, in seconds, the results are expected to be used
+	float PredictionTime = 0.0f;
+	// Mirrored views (planar reflections) flip the triangle winding
+	bool bReverseCulling = false;
+	// One eye of a stereo pair, may use a variable resolution buffer
+	bool bStereo = false;
+	// Orthographic directional light view, only decides whether occluded shadow casters still need their shadow
+	bool bShadowView = false;
+	// The camera jumped this frame, occludees tested on a schedule are all tested again
+	bool bCameraCut = false;
+	// Local player and stereo eye (0 left, 1 right) the view is rendered for, to find its FSceneView. INDEX_NONE for the other views.
+	int32 PlayerIndex = INDEX_NONE;
+	int32 StereoViewIndex = INDEX_NONE;
+
+	/** UE world space to view space, matches FMinimalViewInfo::CalculateViewRotationMatrix */
+	static FMatrix MakeViewMatrix(const FVector& InViewOrigin, const FRotator& InViewRotation);
 };
 
 class FSceneSoftwareOcclusion
@@ -61,13 +139,76 @@ public:
 	FSceneSoftwareOcclusion();
 	~FSceneSoftwareOcclusion();
 
-	int32 Process(const TArray<USnowPrimitiveInfo*> Scene, FSnowViewInfo& View);
+	/**
+	 * Applies the latest finished results and submits the scene to be used in upcoming frames. Never waits on the task.
+	 * Occluder geometry is shared by all views, each view gets its own framebuffer and an occludee is visible if any view sees it.
+	 */
+	int32 Process(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views);
+
+	/** Same-frame mode: submits the scene on a high priority task once the view is final for the frame */
+	void Submit(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views);
+	/** Same-frame mode: waits for the task issued by Submit and applies its results */
+	int32 ApplySubmittedResults(const TArray<USnowPrimitiveInfo*>& Scene);
+
 	void FlushResults();
 
+	/** Cells and portals the cameras look through, an empty graph turns portal culling off. Results using the old one aren't reused. */
+	void SetPortalGraph(const SnowOcclusion::FPortalGraph& InPortalGraph);
+
+	/** Baked visible sets the primitives with a PVSIndex are culled by, empty sets turn it off. Results using the old ones aren't reused. */
+	void SetPVS(const SnowOcclusion::FPVS& InPVS);
+
+	/** Number of frames between the gathering of the currently applied results and now, INDEX_NONE if there are none */
+	int32 GetResultsAge() const;
+
+	/** Views the applied results were computed for, empty if none were applied */
+	const TArray<FSnowViewInfo>& GetAppliedViews() const { return AppliedViews; }
+
 	void DebugDrawToCanvas(FCanvas* Canvas, int32 InX, int32 InY);
 
+	/** Routes the stage scopes of the occlusion core to Insights on SnowOcclusionChannel, for the lifetime of the module */
+	static void RegisterProfilerHooks();
+	static void UnregisterProfilerHooks();
+
 private:
+	void AcquireLatestResults();
+	/** Keeps the available results when the views and occluders haven't changed, only changed occludees are retested */
+	bool TryReuseResults(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views, FOcclusionSceneSignature& OutSignature);
+	/** Submits the scene with the signature TryReuseResults built */
+	void SubmitTask(const TArray<USnowPrimitiveInfo*>& Scene, const TArray<FSnowViewInfo>& Views, ENamedThreads::Type ThreadName);
+	/** Starts a capture asked for with r.so.Capture, and ends the one that wrote all its frames */
+	void UpdateCapture();
+	int32 ApplyAvailableResults(const TArray<USnowPrimitiveInfo*>& Scene);
+	void PublishResults(uint32 ResultsIndex);
+
+	static const uint32 NUM_RESULTS_BUFFERS = 3;
+	static const uint32 RESULTS_INDEX_MASK = 0x3;
+	static const uint32 RESULTS_FRESH_BIT = 0x4;
+
 	FGraphEventRef TaskRef;
-	TUniquePtr<FOcclusionFrameResults> Available;
-	TUniquePtr<FOcclusionFrameResults> Processing;
+	TUniquePtr<FOcclusionFrameResults> Results[NUM_RESULTS_BUFFERS];
+	TArray<FSnowViewInfo> AppliedViews;
+
+	// Triple buffer: the game thread owns AvailableIndex, the task owns ProcessingIndex while in flight
+	// and hands finished results over through ReadyState (index of the ready buffer | RESULTS_FRESH_BIT)
+	uint32 AvailableIndex;
+	uint32 ProcessingIndex;
+	std::atomic<uint32> ReadyState;
+
+	// Coverage of the last processed frame, for reprojection. Only the task touches it, one is in flight at a time.
+	TUniquePtr<SnowOcclusion::FHistory> History;
+
+	// Scene handed to the task and the signature of the next submission, reused every frame so steady frames don't allocate.
+	// The task owns SceneData while in flight.
+	TUniquePtr<FOcclusionSceneData> SceneData;
+	TUniquePtr<FOcclusionSceneSignature> Signature;
+
+	// Capture being written by r.so.Capture, only the task writes to it while in flight
+	TUniquePtr<FOcclusionCapture> Capture;
+
+	// Only read by the gather on the game thread, the task never sees it
+	TUniquePtr<SnowOcclusion::FPortalGraph> PortalGraph;
+	uint32 PortalGraphRevision = 0;
+	TUniquePtr<SnowOcclusion::FPVS> PVS;
+	uint32 PVSRevision = 0;
 };
@@ -0,0 +1,24 @@
+// Copyright Fast Travel Games AB 2023
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "SnowOcclusionBakePVSCommandlet.generated.h"
+
+/**
+ * Bakes the potentially visible sets of a map without the editor UI, on the build farm:
+ *   UnrealEditor-Cmd Game.uproject -run=SnowOcclusionBakePVS -Map=/Game/Maps/Level [-CellSize=400] [-Samples=2] [-Margin=50]
+ * The static occluders are rasterized from points over the ASnowOcclusionPVSVolumes of the map, the sets of the static
+ * primitives go to a <Map>_SnowPVS asset next to the map and the volumes point to it.
+ */
+UCLASS()
+class SNOWOCCLUSION_API USnowOcclusionBakePVSCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	USnowOcclusionBakePVSCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+};
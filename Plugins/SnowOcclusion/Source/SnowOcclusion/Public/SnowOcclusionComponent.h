@@ -6,6 +6,7 @@
 #include "Components/ActorComponent.h"
 #include "SnowOcclusionComponent.generated.h"
 
+class UInstancedStaticMeshComponent;
 class USnowPrimitiveInfo;
 
 UCLASS(Blueprintable, ClassGroup = (Custom), meta = (BlueprintSpawnableComponent))
@@ -17,6 +18,12 @@ public:
 	USnowOcclusionComponent();
 
 	void HandleOcclusionVisibility(bool bVisible);
+	/** Per primitive occlusion: hides one of the other primitives of the actor */
+	void HandlePrimitiveVisibility(const USnowPrimitiveInfo* PrimitiveInfo, bool bVisible);
+	/** Culls the shadow of the primitive, or keeps it while the actor is hidden, restores the original settings otherwise */
+	void HandleOcclusionShadow(bool bShadowVisible, bool bCastWhileHidden);
+	/** Writes the visibility of each instance cluster to the instances' custom data */
+	void HandleInstanceVisibility(const TBitArray<>& ClusterVisible);
 	void ReplacePrimitiveComponent(UPrimitiveComponent* InPrimitiveComponent);
 
 protected:
@@ -24,7 +31,14 @@ protected:
 	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 
 	friend class USnowOcclusionSubsystem;
+	friend class USnowOcclusionBakePVSCommandlet;
+	friend class FSnowOcclusionInstanceCustomDataTest;
+	/** Creates the infos of the primitives and their occluder data, false if the component can't take part in occlusion */
+	bool InitInfo();
 	void UpdateInfo();
+	void UpdateInstanceClusters(const UInstancedStaticMeshComponent* InstancedComponent);
+	/** Checks the instance visibility float against the custom data of the primitive, which is never resized once it has floats */
+	void InitInstanceVisibility();
 
 	UPROPERTY(EditDefaultsOnly, BlueprintReadWrite, Category = "Snow Occlusion|Occluder")
 	bool bUseAsOccluder = true;
@@ -44,6 +58,9 @@ protected:
 
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee")
 	bool bCanBeOccludee = true;
+	// Every primitive of the actor is its own occludee and is hidden on its own, instead of hiding the whole actor
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee", Meta = (EditCondition = "bCanBeOccludee"))
+	bool bPerPrimitiveOcclusion = false;
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee", Meta = (EditCondition = "bCanBeOccludee"))
 	bool bUseCustomBounds = false;
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee", meta = (EditCondition = "bCanBeOccludee && bUseCustomBounds"))
@@ -51,10 +68,45 @@ protected:
 	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee", meta = (EditCondition = "bCanBeOccludee && bUseCustomBounds"))
 	FVector CustomBoundsOffset = FVector::ZeroVector;
 
+	// Instanced (and hierarchical instanced) static meshes: test instances in clusters instead of the whole component
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee", Meta = (EditCondition = "bCanBeOccludee"))
+	bool bPerInstanceOcclusion = false;
+	// Size of the grid cells instances are clustered by, 0 tests every instance on its own
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee", Meta = (EditCondition = "bCanBeOccludee && bPerInstanceOcclusion", ClampMin = "0"))
+	float InstanceClusterSize = 2000.0f;
+	// Per instance custom data float set to 0 when the instance's cluster is occluded and 1 when visible,
+	// the material is expected to hide the instance. INDEX_NONE only hides the component once every cluster is occluded.
+	UPROPERTY(EditAnywhere, BlueprintReadWrite, Category = "Snow Occlusion|Occludee", Meta = (EditCondition = "bCanBeOccludee && bPerInstanceOcclusion"))
+	int32 InstanceVisibilityCustomDataIndex = INDEX_NONE;
+
 	UPROPERTY(BlueprintReadWrite, Category = "Snow Occlusion")
 	TObjectPtr<UPrimitiveComponent> PrimitiveComponent;
 
 
 	UPROPERTY(Transient)
 	USnowPrimitiveInfo* Info;
+
+	// Per primitive occlusion: occludees of the other primitives of the actor, PrimitiveComponent uses Info
+	UPROPERTY(Transient)
+	TArray<TObjectPtr<USnowPrimitiveInfo>> PrimitiveInfos;
+	UPROPERTY(Transient)
+	TArray<TObjectPtr<UPrimitiveComponent>> OccludeePrimitives;
+	TBitArray<> PrimitivesHiddenByOcclusion;
+
+	// Whether the owner is currently hidden in game by occlusion
+	bool bHiddenByOcclusion = false;
+
+	// Shadow settings of the primitive before occlusion overrode them
+	bool bShadowOverridden = false;
+	bool bOriginalCastShadow = true;
+	bool bOriginalCastHiddenShadow = false;
+
+	// Instance indices of each cluster, and the cluster visibility last written to the custom data
+	TArray<TArray<int32>> InstanceClusters;
+	TBitArray<> AppliedClusterVisible;
+	int32 NumClusteredInstances = INDEX_NONE;
+	bool bWriteInstanceVisibility = false;
+	// Frame the custom data last went to the render state, and whether occluded clusters were written since
+	uint64 InstanceVisibilityUpdateFrame = 0;
+	bool bInstanceVisibilityPending = false;
 };
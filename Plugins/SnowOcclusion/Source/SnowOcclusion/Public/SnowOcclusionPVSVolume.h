@@ -0,0 +1,56 @@
+// Copyright Fast Travel Games AB 2023
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Volume.h"
+#include "SnowOcclusionPVSVolume.generated.h"
+
+class UPrimitiveComponent;
+
+/** Potentially visible sets baked for a map by the SnowOcclusionBakePVS commandlet */
+UCLASS(BlueprintType)
+class SNOWOCCLUSION_API USnowOcclusionPVSData : public UObject
+{
+	GENERATED_BODY()
+
+public:
+	/** Key of a primitive in the baked sets, the same in the editor, in PIE and in a cooked game */
+	static FString MakePrimitiveKey(const UPrimitiveComponent* Primitive);
+
+	// Sets of the cells as written by the occlusion core
+	UPROPERTY()
+	TArray<uint8> Data;
+
+	// Key of each primitive of the sets, in the order the sets index them
+	UPROPERTY()
+	TArray<FString> PrimitiveKeys;
+
+	UPROPERTY(VisibleAnywhere, Category = "Snow Occlusion")
+	int32 NumCells = 0;
+	UPROPERTY(VisibleAnywhere, Category = "Snow Occlusion")
+	int32 NumSets = 0;
+};
+
+/**
+ * Where the camera can go, cells of the baked grid over the volume get a potentially visible set. Every volume of a map
+ * shares the same baked data, cells outside all of them don't cull anything.
+ */
+UCLASS(ClassGroup = (Custom))
+class SNOWOCCLUSION_API ASnowOcclusionPVSVolume : public AVolume
+{
+	GENERATED_BODY()
+
+public:
+	ASnowOcclusionPVSVolume(const FObjectInitializer& ObjectInitializer);
+
+	FBox GetPVSBounds() const;
+
+	// Written by the bake
+	UPROPERTY(VisibleAnywhere, Category = "Snow Occlusion")
+	TObjectPtr<USnowOcclusionPVSData> PVSData;
+
+protected:
+	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+};
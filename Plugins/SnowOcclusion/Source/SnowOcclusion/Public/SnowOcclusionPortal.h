@@ -0,0 +1,63 @@
+// Copyright Fast Travel Games AB 2023
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+#include "GameFramework/Volume.h"
+#include "SnowOcclusionPortal.generated.h"
+
+/** Room of an interior for portal culling, the axis aligned bounds of the volume are the cell */
+UCLASS(ClassGroup = (Custom))
+class SNOWOCCLUSION_API ASnowOcclusionCell : public AVolume
+{
+	GENERATED_BODY()
+
+public:
+	ASnowOcclusionCell(const FObjectInitializer& ObjectInitializer);
+
+	FBox GetCellBounds() const;
+
+protected:
+	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+};
+
+/**
+ * Opening between two cells, or between a cell and the outside: a rectangle on the local YZ plane of the actor.
+ * The cells on either side are the ones found a little along the actor's forward and backward axis.
+ */
+UCLASS(Blueprintable, ClassGroup = (Custom))
+class SNOWOCCLUSION_API ASnowOcclusionPortal : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	ASnowOcclusionPortal();
+
+	/** Closed portals, shut doors, hide what lies behind them */
+	UFUNCTION(BlueprintCallable, Category = "Snow Occlusion")
+	void SetOpen(bool bInOpen);
+	UFUNCTION(BlueprintPure, Category = "Snow Occlusion")
+	bool IsOpen() const { return bOpen; }
+
+	/** World space corners of the opening, in order around it */
+	void GetCorners(FVector OutCorners[4]) const;
+	/** Points on either side of the opening the cells are looked up with */
+	void GetSidePoints(FVector& OutFront, FVector& OutBack) const;
+
+protected:
+	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	// Half width and half height of the opening, along the local Y and Z axes
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Snow Occlusion", Meta = (ClampMin = "0"))
+	FVector2D Extent = FVector2D(60.0, 110.0);
+
+	// How far from the opening the cells on either side are looked for, at least the thickness of the wall
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Snow Occlusion", Meta = (ClampMin = "1"))
+	float SideDistance = 30.0f;
+
+	UPROPERTY(EditAnywhere, BlueprintReadOnly, Category = "Snow Occlusion")
+	bool bOpen = true;
+};
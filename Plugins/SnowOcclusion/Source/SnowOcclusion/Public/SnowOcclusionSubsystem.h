@@ -3,14 +3,88 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Engine/EngineBaseTypes.h"
 #include "SceneSoftwareOcclusion.h"
+#include "SnowOcclusionViewExtension.h"
 #include "Subsystems/WorldSubsystem.h"
+#include "UObject/ObjectKey.h"
 
 #include "SnowOcclusionSubsystem.generated.h"
 
 class APlayerCameraManager;
+class ASnowOcclusionCell;
+class ASnowOcclusionPortal;
+class ASnowOcclusionPVSVolume;
+class UDirectionalLightComponent;
+class USceneCaptureComponent;
 class USnowOcclusionComponent;
+class USnowOcclusionPVSData;
+class USnowOcclusionSubsystem;
 class USnowPrimitiveInfo;
+struct FSnowOcclusionContext;
+
+/** Kicks off same-frame occlusion once the camera is final for the frame */
+USTRUCT()
+struct FSnowOcclusionKickOffTickFunction : public FTickFunction
+{
+	GENERATED_BODY()
+
+	USnowOcclusionSubsystem* Subsystem = nullptr;
+	FSnowOcclusionContext* Context = nullptr;
+
+	virtual void ExecuteTick(float DeltaTime, ELevelTick TickType, ENamedThreads::Type CurrentThread, const FGraphEventRef& MyCompletionGraphEvent) override;
+	virtual FString DiagnosticMessage() override;
+};
+
+template<>
+struct TStructOpsTypeTraits<FSnowOcclusionKickOffTickFunction> : public TStructOpsTypeTraitsBase2<FSnowOcclusionKickOffTickFunction>
+{
+	enum
+	{
+		WithCopy = false
+	};
+};
+
+/** Camera transform of the previous frame, used to derive the camera motion */
+struct FSnowCameraHistory
+{
+	FVector Location;
+	FRotator Rotation;
+};
+
+/** Everything occlusion needs for a single world, worlds are processed independently of each other */
+struct FSnowOcclusionContext
+{
+	TWeakObjectPtr<UWorld> World;
+
+	FSceneSoftwareOcclusion OcclusionSystem;
+	TMap<USnowOcclusionComponent*, USnowPrimitiveInfo*> Occluders;
+	TMap<uint32, USnowOcclusionComponent*> InfoToComp;
+	TWeakObjectPtr<APlayerCameraManager> PlayerCameraManager;
+	TArray<TWeakObjectPtr<USceneCaptureComponent>> SceneCaptures;
+	TArray<TWeakObjectPtr<UDirectionalLightComponent>> ShadowLights;
+	TMap<TWeakObjectPtr<APlayerCameraManager>, FSnowCameraHistory> CameraHistory;
+
+	// Cells and portals of the interiors, the graph of the occlusion system is rebuilt before the next submission when they change
+	TArray<TWeakObjectPtr<ASnowOcclusionCell>> PortalCells;
+	TArray<TWeakObjectPtr<ASnowOcclusionPortal>> Portals;
+	bool bPortalGraphDirty = false;
+
+	// Volumes of the baked visible sets, the sets and the baked primitive of every info are looked up again when they change
+	TArray<TWeakObjectPtr<ASnowOcclusionPVSVolume>> PVSVolumes;
+	TWeakObjectPtr<USnowOcclusionPVSData> PVSData;
+	TMap<FString, int32> PVSPrimitiveIndices;
+	bool bPVSDirty = false;
+
+	// Scene and views submitted this frame, kept around until the results are applied
+	TArray<USnowPrimitiveInfo*> FrameScene;
+	TArray<FSnowViewInfo> FrameViews;
+	FSnowOcclusionKickOffTickFunction KickOffTickFunction;
+	bool bSameFrameSubmitted = false;
+
+	// Render-side culling, created on first use
+	TSharedPtr<FSnowOcclusionViewExtension, ESPMode::ThreadSafe> ViewExtension;
+};
 
 /**
  *
@@ -31,15 +105,60 @@ public:
 
 	void RegisterOccluder(USnowOcclusionComponent* Occluder, USnowPrimitiveInfo* Info);
 	void UnregisterOccluder(USnowOcclusionComponent* Occluder);
+
+	// Scene captures rendered every frame get their own occlusion view, planar reflections mirror the player views
+	UFUNCTION(BlueprintCallable, Category = "Snow Occlusion")
+	void RegisterSceneCapture(USceneCaptureComponent* SceneCapture);
+	UFUNCTION(BlueprintCallable, Category = "Snow Occlusion")
+	void UnregisterSceneCapture(USceneCaptureComponent* SceneCapture);
+
+	// Directional lights get a light space occlusion view that decides whether occluded casters still need their shadow
+	UFUNCTION(BlueprintCallable, Category = "Snow Occlusion")
+	void RegisterShadowLight(UDirectionalLightComponent* Light);
+	UFUNCTION(BlueprintCallable, Category = "Snow Occlusion")
+	void UnregisterShadowLight(UDirectionalLightComponent* Light);
+
+	// Cells and portals register themselves, occludees and occluders in cells no camera sees through the portals are culled
+	void RegisterPortalCell(ASnowOcclusionCell* Cell);
+	void UnregisterPortalCell(ASnowOcclusionCell* Cell);
+	void RegisterPortal(ASnowOcclusionPortal* Portal);
+	void UnregisterPortal(ASnowOcclusionPortal* Portal);
+	/** Rebuilds the portal graph of the world before the next submission, after portals opened, closed or moved */
+	void MarkPortalsDirty(UWorld* World);
+
+	// Volumes with baked sets register themselves, static primitives the sets of the camera cells don't hold are culled
+	void RegisterPVSVolume(ASnowOcclusionPVSVolume* Volume);
+	void UnregisterPVSVolume(ASnowOcclusionPVSVolume* Volume);
+
 	UFUNCTION(BlueprintCallable, Category = "Snow Occlusion")
 	void DrawToCanvas(UCanvas* Canvas, int32 Width, int32 Height);
 
+	/** Logs the visible occludees that cost the most triangles, where extra occluders would pay off */
+	void LogVisibleRenderCost(int32 MaxPrimitives) const;
+
 protected:
+	friend struct FSnowOcclusionKickOffTickFunction;
+	void TickContext(FSnowOcclusionContext& Context, float DeltaTime);
+	void KickOffSameFrame(FSnowOcclusionContext& Context, float DeltaTime);
+	void OnWorldTickEnd(UWorld* World, ELevelTick TickType, float DeltaTime);
+	void OnWorldCleanup(UWorld* World, bool bSessionEnded, bool bCleanupResources);
+
+	FSnowOcclusionContext* FindContext(const UWorld* World) const;
+	FSnowOcclusionContext& FindOrAddContext(UWorld* World);
+
+	void BuildViews(FSnowOcclusionContext& Context, float DeltaTime, bool bPredict);
+	void GatherScene(FSnowOcclusionContext& Context);
+	void UpdatePortalGraph(FSnowOcclusionContext& Context);
+	void UpdatePVS(FSnowOcclusionContext& Context);
+	/** Finds the primitives of the component in the baked sets of the world */
+	void ResolvePVSIndices(const FSnowOcclusionContext& Context, USnowOcclusionComponent* Occluder) const;
+	void ApplyVisibility(FSnowOcclusionContext& Context);
+
 	UPROPERTY(Config)
 	bool bEnabled = true;
 
-	FSceneSoftwareOcclusion OcclusionSystem;
-	TMap<USnowOcclusionComponent*, USnowPrimitiveInfo*> Occluders;
-	TMap<uint32, USnowOcclusionComponent*> InfoToComp;
-	TWeakObjectPtr<APlayerCameraManager> PlayerCameraManager;
+	// One context per world with registered occluders, PIE clients and editor preview worlds don't fight over the camera
+	TMap<TObjectKey<UWorld>, TUniquePtr<FSnowOcclusionContext>> Contexts;
+	FDelegateHandle WorldTickEndHandle;
+	FDelegateHandle WorldCleanupHandle;
 };
@@ -0,0 +1,41 @@
+// Copyright Fast Travel Games AB 2023
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "SceneViewExtension.h"
+
+/**
+ * Hides occluded primitives in the views of a single world through FSceneView::HiddenPrimitives.
+ * Nothing on the actors or components is touched, the primitive is only skipped by the renderer for that view.
+ * Every view hides what all views found occluded, a player view also hides what only it found occluded.
+ */
+class SNOWOCCLUSION_API FSnowOcclusionViewExtension : public FWorldSceneViewExtension
+{
+public:
+	FSnowOcclusionViewExtension(const FAutoRegister& AutoRegister, UWorld* InWorld);
+
+	/** What a player view found occluded on top of what every view did, matched by player and stereo eye */
+	struct FViewHiddenPrimitives
+	{
+		int32 PlayerIndex = INDEX_NONE;
+		int32 StereoViewIndex = INDEX_NONE;
+		TSet<FPrimitiveComponentId> HiddenPrimitives;
+	};
+
+	/** Game thread: replaces the sets of primitives hidden in upcoming views */
+	void SetHiddenPrimitives(TSet<FPrimitiveComponentId>&& InHiddenPrimitives, TArray<FViewHiddenPrimitives>&& InViewHiddenPrimitives);
+	void SetActive(bool bInActive);
+
+	virtual void SetupViewFamily(FSceneViewFamily& InViewFamily) override {}
+	virtual void SetupView(FSceneViewFamily& InViewFamily, FSceneView& InView) override;
+	virtual void BeginRenderViewFamily(FSceneViewFamily& InViewFamily) override {}
+
+protected:
+	virtual bool IsActiveThisFrame_Internal(const FSceneViewExtensionContext& Context) const override;
+
+private:
+	TSet<FPrimitiveComponentId> HiddenPrimitives;
+	TArray<FViewHiddenPrimitives> ViewHiddenPrimitives;
+	bool bActive = false;
+};
@@ -25,6 +25,7 @@ public class SnowOcclusion : ModuleRules
 			"Core",
 			"CoreUObject",
 			"HeadMountedDisplay",
+			"SnowOcclusionCore",
 		});
 
 		if (Target.bBuildEditor)
@@ -1,14 +1,18 @@
 // Copyright Fast Travel Games. All rights reserved.
 
 #include "SnowOcclusion.h"
+#include "SceneSoftwareOcclusion.h"
 #include "Modules/ModuleManager.h"
 
 void FSnowOcclusionModule::StartupModule()
 {
+	FSceneSoftwareOcclusion::RegisterProfilerHooks();
 }
 
 void FSnowOcclusionModule::ShutdownModule()
 {
+	// The hooks point into this module
+	FSceneSoftwareOcclusion::UnregisterProfilerHooks();
 }
 
 IMPLEMENT_MODULE(FSnowOcclusionModule, SnowOcclusion);
@@ -0,0 +1,78 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "SnowOcclusionArena.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace SnowOcclusion
+{
+	namespace
+	{
+		const size_t MIN_BLOCK_SIZE = 64 * 1024;
+		// Blocks are aligned for any type the core allocates, FVec4 and FMat4 need 16
+		const size_t BLOCK_ALIGNMENT = 64;
+
+		uint8* AllocBlock(size_t Size)
+		{
+			void* Data = ::operator new(Size, std::align_val_t(BLOCK_ALIGNMENT));
+			return (uint8*)Data;
+		}
+
+		void FreeBlock(uint8* Data)
+		{
+			::operator delete(Data, std::align_val_t(BLOCK_ALIGNMENT));
+		}
+	}
+
+	FLinearArena::~FLinearArena()
+	{
+		for (const FBlock& Block : Blocks)
+		{
+			FreeBlock(Block.Data);
+		}
+	}
+
+	void* FLinearArena::Alloc(size_t Size, size_t Alignment)
+	{
+		size_t Start = Blocks.empty() ? 0 : (Offset + Alignment - 1) & ~(Alignment - 1);
+		if (Blocks.empty() || Start + Size > Blocks.back().Size)
+		{
+			AddBlock(Size + Alignment);
+			Start = 0;
+		}
+
+		Used += Start - Offset + Size;
+		Offset = Start + Size;
+		return Blocks.back().Data + Start;
+	}
+
+	void FLinearArena::Reset()
+	{
+		if (Blocks.size() > 1)
+		{
+			// One block for all of it next time, with some room for the frame to grow
+			const size_t Size = Used + Used / 4;
+			for (const FBlock& Block : Blocks)
+			{
+				FreeBlock(Block.Data);
+			}
+			Blocks.clear();
+			Capacity = 0;
+			AddBlock(Size);
+		}
+
+		Offset = 0;
+		Used = 0;
+	}
+
+	void FLinearArena::AddBlock(size_t MinSize)
+	{
+		// Geometric growth keeps the number of blocks of a frame small
+		const size_t Size = std::max(std::max(MinSize, MIN_BLOCK_SIZE), Capacity);
+		Blocks.push_back({ AllocBlock(Size), Size });
+		Capacity += Size;
+		Offset = 0;
+		NumHeapAllocs++;
+	}
+}
@@ -0,0 +1,588 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "SnowOcclusionCapture.h"
+#include "SnowOcclusionProfiler.h"
+#include <cstring>
+
+/*
+ * File layout, little endian: a header (magic, version) followed by chunks, each a tag, a payload size and the payload.
+ * MESH chunks hold occluder geometry and come before the first frame using them, FRAM chunks hold a scene and its results.
+ * Readers skip chunks they don't know, new data goes in new chunks or at the end of existing ones with a version bump.
+ */
+
+namespace SnowOcclusion
+{
+	namespace
+	{
+		const uint32 CAPTURE_MAGIC = 0x50434F53; // "SOCP"
+		const uint32 CAPTURE_VERSION = 2;
+		// Version 2 added the culling accuracy at the end of FRAM
+		const uint32 CAPTURE_MIN_VERSION = 1;
+		const uint32 CHUNK_MESH = 0x4853454D; // "MESH"
+		const uint32 CHUNK_FRAME = 0x4D415246; // "FRAM"
+
+		uint64 HashBytes(const void* Data, size_t Size, uint64 Hash = 0xcbf29ce484222325ull)
+		{
+			// FNV-1a
+			const uint8* Bytes = (const uint8*)Data;
+			for (size_t Idx = 0; Idx < Size; ++Idx)
+			{
+				Hash = (Hash ^ Bytes[Idx]) * 0x100000001b3ull;
+			}
+			return Hash;
+		}
+
+		struct FChunkWriter
+		{
+			std::vector<uint8>& Bytes;
+
+			void WriteBytes(const void* Data, size_t Size)
+			{
+				const uint8* Begin = (const uint8*)Data;
+				Bytes.insert(Bytes.end(), Begin, Begin + Size);
+			}
+
+			template<typename T>
+			void Write(const T& Value)
+			{
+				WriteBytes(&Value, sizeof(T));
+			}
+
+			template<typename T>
+			void WriteVector(const std::vector<T>& Values)
+			{
+				Write((int32)Values.size());
+				WriteBytes(Values.data(), Values.size() * sizeof(T));
+			}
+
+			void Write(const FMat4& Value)
+			{
+				WriteBytes(Value.M, sizeof(Value.M));
+			}
+
+			void Write(const FFoveation& Value)
+			{
+				Write((uint8)Value.bEnabled);
+				WriteBytes(Value.Size, sizeof(Value.Size));
+				WriteBytes(Value.LinearMin, sizeof(Value.LinearMin));
+				WriteBytes(Value.LinearMax, sizeof(Value.LinearMax));
+				WriteBytes(Value.WarpedMin, sizeof(Value.WarpedMin));
+				WriteBytes(Value.WarpedMax, sizeof(Value.WarpedMax));
+			}
+
+			void Write(const FOrientedBox& Value)
+			{
+				Write(Value.BoxToWorld);
+				Write(Value.Min);
+				Write(Value.Max);
+			}
+
+			void Write(const FViewStats& Value)
+			{
+				Write(Value.NumTriangles);
+				Write(Value.NumOccluderSetupTris);
+				Write(Value.NumRasterizedOccluderTris);
+				Write(Value.NumRasterizedOccludeeTris);
+				Write(Value.NumExpandedGroups);
+				Write(Value.NumSkippedOccluders);
+				Write(Value.OccluderSeconds);
+				Write(Value.OccludeeSeconds);
+				Write(Value.SortSeconds);
+				Write(Value.RasterizeSeconds);
+			}
+
+			void Write(const FAccuracyStats& Value)
+			{
+				Write((uint8)Value.bMeasured);
+				Write(Value.NumReferenceVisible);
+				Write(Value.NumFalseVisible);
+				Write(Value.NumFalseOccluded);
+				Write(Value.NumFalseVisibleShadows);
+				Write(Value.NumFalseOccludedShadows);
+				Write(Value.ReferenceSeconds);
+			}
+		};
+
+		/** Reads a chunk payload, any read past its end marks the cursor failed and reads zeroes */
+		struct FChunkReader
+		{
+			const std::vector<uint8>& Bytes;
+			size_t Offset = 0;
+			bool bFailed = false;
+
+			void ReadBytes(void* Data, size_t Size)
+			{
+				// Empty vectors have no storage to copy into
+				if (Size == 0)
+				{
+					return;
+				}
+				if (bFailed || Size > Bytes.size() - Offset)
+				{
+					bFailed = true;
+					std::memset(Data, 0, Size);
+					return;
+				}
+				std::memcpy(Data, Bytes.data() + Offset, Size);
+				Offset += Size;
+			}
+
+			template<typename T>
+			void Read(T& Value)
+			{
+				ReadBytes(&Value, sizeof(T));
+			}
+
+			template<typename T>
+			void ReadVector(std::vector<T>& Values)
+			{
+				int32 Num = 0;
+				Read(Num);
+				if (Num < 0 || (size_t)Num * sizeof(T) > Bytes.size() - Offset)
+				{
+					bFailed = true;
+					Num = 0;
+				}
+				Values.resize(Num);
+				ReadBytes(Values.data(), Num * sizeof(T));
+			}
+
+			void Read(FMat4& Value)
+			{
+				ReadBytes(Value.M, sizeof(Value.M));
+			}
+
+			void Read(FFoveation& Value)
+			{
+				uint8 bEnabled = 0;
+				Read(bEnabled);
+				Value.bEnabled = bEnabled != 0;
+				ReadBytes(Value.Size, sizeof(Value.Size));
+				ReadBytes(Value.LinearMin, sizeof(Value.LinearMin));
+				ReadBytes(Value.LinearMax, sizeof(Value.LinearMax));
+				ReadBytes(Value.WarpedMin, sizeof(Value.WarpedMin));
+				ReadBytes(Value.WarpedMax, sizeof(Value.WarpedMax));
+			}
+
+			void Read(FOrientedBox& Value)
+			{
+				Read(Value.BoxToWorld);
+				Read(Value.Min);
+				Read(Value.Max);
+			}
+
+			void Read(FViewStats& Value)
+			{
+				Read(Value.NumTriangles);
+				Read(Value.NumOccluderSetupTris);
+				Read(Value.NumRasterizedOccluderTris);
+				Read(Value.NumRasterizedOccludeeTris);
+				Read(Value.NumExpandedGroups);
+				Read(Value.NumSkippedOccluders);
+				Read(Value.OccluderSeconds);
+				Read(Value.OccludeeSeconds);
+				Read(Value.SortSeconds);
+				Read(Value.RasterizeSeconds);
+			}
+
+			void Read(FAccuracyStats& Value)
+			{
+				Value.bMeasured = ReadBool();
+				Read(Value.NumReferenceVisible);
+				Read(Value.NumFalseVisible);
+				Read(Value.NumFalseOccluded);
+				Read(Value.NumFalseVisibleShadows);
+				Read(Value.NumFalseOccludedShadows);
+				Read(Value.ReferenceSeconds);
+			}
+
+			bool ReadBool()
+			{
+				uint8 Value = 0;
+				Read(Value);
+				return Value != 0;
+			}
+		};
+
+		void BeginChunk(std::vector<uint8>& Bytes, uint32 Tag)
+		{
+			Bytes.clear();
+			FChunkWriter Writer{ Bytes };
+			Writer.Write(Tag);
+			Writer.Write((uint32)0);
+		}
+
+		void EndChunk(std::vector<uint8>& Bytes)
+		{
+			const uint32 Size = (uint32)(Bytes.size() - 8);
+			std::memcpy(Bytes.data() + 4, &Size, sizeof(Size));
+		}
+	}
+
+	uint64 HashViewBins(const FViewResults& View)
+	{
+		uint64 Hash = 0xcbf29ce484222325ull;
+		for (const FFramebufferBin& Bin : View.Bins)
+		{
+			Hash = HashBytes(Bin.Data, sizeof(Bin.Data), Hash);
+		}
+		return Hash;
+	}
+
+	bool FCaptureWriter::Open(FCaptureSink&& InSink)
+	{
+		Close();
+		if (!InSink)
+		{
+			return false;
+		}
+
+		const uint32 Header[2] = { CAPTURE_MAGIC, CAPTURE_VERSION };
+		if (!InSink(Header, sizeof(Header)))
+		{
+			return false;
+		}
+
+		Sink = std::move(InSink);
+		return true;
+	}
+
+	void FCaptureWriter::Close()
+	{
+		Sink = nullptr;
+		MeshIds.clear();
+		NumFrames = 0;
+	}
+
+	bool FCaptureWriter::WriteFrame(uint64 FrameNumber, const FScene& Scene, const FFrameResults& Results)
+	{
+		if (!Sink)
+		{
+			return false;
+		}
+
+		const FProfilerScope ProfilerScope("SnowOcclusion_WriteCaptureFrame");
+
+		// New meshes first, the frame refers to them by id
+		std::vector<int32> OccluderMeshIds;
+		OccluderMeshIds.reserve(Scene.Occluders.size());
+		for (const FOccluderMesh& Mesh : Scene.Occluders)
+		{
+			uint64 Hash = HashBytes(Mesh.Vertices, Mesh.NumVertices * sizeof(FVec3));
+			Hash = HashBytes(Mesh.Indices, Mesh.NumIndices * sizeof(uint16), Hash);
+
+			const std::pair<std::unordered_map<uint64, int32>::iterator, bool> Found = MeshIds.emplace(Hash, (int32)MeshIds.size());
+			OccluderMeshIds.push_back(Found.first->second);
+			if (Found.second)
+			{
+				BeginChunk(Buffer, CHUNK_MESH);
+				FChunkWriter Writer{ Buffer };
+				Writer.Write(Found.first->second);
+				Writer.Write(Mesh.NumVertices);
+				Writer.WriteBytes(Mesh.Vertices, Mesh.NumVertices * sizeof(FVec3));
+				Writer.Write(Mesh.NumIndices);
+				Writer.WriteBytes(Mesh.Indices, Mesh.NumIndices * sizeof(uint16));
+				EndChunk(Buffer);
+				if (!Sink(Buffer.data(), Buffer.size()))
+				{
+					Close();
+					return false;
+				}
+			}
+		}
+
+		BeginChunk(Buffer, CHUNK_FRAME);
+		FChunkWriter Writer{ Buffer };
+		Writer.Write(FrameNumber);
+
+		Writer.Write((int32)Scene.Views.size());
+		for (const FSceneView& View : Scene.Views)
+		{
+			Writer.Write(View.ViewProj);
+			Writer.Write(View.Foveation);
+			Writer.Write(View.ClipW);
+			Writer.Write((uint8)View.bReverseCulling);
+			Writer.Write((uint8)View.bShadowView);
+		}
+
+		Writer.Write((int32)Scene.Occluders.size());
+		for (size_t OccluderIdx = 0; OccluderIdx < Scene.Occluders.size(); ++OccluderIdx)
+		{
+			Writer.Write(OccluderMeshIds[OccluderIdx]);
+			Writer.Write(Scene.Occluders[OccluderIdx].LocalToWorld);
+			Writer.Write(Scene.Occluders[OccluderIdx].WorldBounds);
+		}
+		Writer.Write(Scene.NumOccluderTriangles);
+		Writer.Write(Scene.MaxRasterizedOccluders);
+		Writer.Write((uint8)Scene.bReprojection);
+		Writer.Write((uint8)Scene.bUseSIMD);
+
+		Writer.WriteVector(Scene.OccludeeBoxMinMax);
+		Writer.WriteVector(Scene.OccludeeBoxOrientedIdx);
+		Writer.Write((int32)Scene.OccludeeOrientedBoxes.size());
+		for (const FOrientedBox& OrientedBox : Scene.OccludeeOrientedBoxes)
+		{
+			Writer.Write(OrientedBox);
+		}
+		Writer.Write(Scene.NumPrimitiveOccludees);
+		Writer.WriteVector(Scene.ShadowVolumeCasterIdx);
+		Writer.WriteVector(Scene.ShadowVolumeViewIdx);
+		Writer.WriteVector(Scene.OccludeeGroupMembers);
+		Writer.WriteVector(Scene.OccludeeGroupFirstMember);
+		Writer.WriteVector(Scene.TopLevelBoxMinMax);
+		Writer.WriteVector(Scene.TopLevelBoxId);
+		Writer.WriteVector(Scene.TopLevelBoxOrientedIdx);
+		Writer.Write(Scene.NumTopLevelPrimitiveBoxes);
+
+		Writer.Write((int32)Results.Views.size());
+		for (const FViewResults& View : Results.Views)
+		{
+			Writer.Write(HashViewBins(View));
+			Writer.Write(View.Stats);
+			Writer.WriteVector(View.OccludeeVisible);
+		}
+		Writer.WriteVector(Results.OccludeeVisible);
+		Writer.WriteVector(Results.ShadowVolumeVisible);
+		Writer.Write(Results.Accuracy);
+		EndChunk(Buffer);
+
+		if (!Sink(Buffer.data(), Buffer.size()))
+		{
+			Close();
+			return false;
+		}
+
+		NumFrames++;
+		return true;
+	}
+
+	FCaptureReader::~FCaptureReader()
+	{
+		if (File)
+		{
+			std::fclose(File);
+		}
+	}
+
+	bool FCaptureReader::Open(const char* Path)
+	{
+		File = std::fopen(Path, "rb");
+		if (!File)
+		{
+			Error = std::string("can't open ") + Path;
+			return false;
+		}
+
+		uint32 Header[2] = { 0, 0 };
+		if (std::fread(Header, sizeof(Header), 1, File) != 1 || Header[0] != CAPTURE_MAGIC)
+		{
+			Error = std::string(Path) + " is not an occlusion capture";
+			return false;
+		}
+		if (Header[1] < CAPTURE_MIN_VERSION || Header[1] > CAPTURE_VERSION)
+		{
+			Error = std::string(Path) + " has capture version " + std::to_string(Header[1]) + ", expected " + std::to_string(CAPTURE_MIN_VERSION) + " to " + std::to_string(CAPTURE_VERSION);
+			return false;
+		}
+		Version = Header[1];
+
+		return true;
+	}
+
+	bool FCaptureReader::ReadMesh(const std::vector<uint8>& InChunk)
+	{
+		FChunkReader Reader{ InChunk };
+		int32 MeshId = 0;
+		Reader.Read(MeshId);
+		if (MeshId != (int32)Meshes.size())
+		{
+			return false;
+		}
+
+		std::unique_ptr<FMesh> Mesh(new FMesh);
+		Reader.ReadVector(Mesh->Vertices);
+		Reader.ReadVector(Mesh->Indices);
+		for (uint16 Index : Mesh->Indices)
+		{
+			Reader.bFailed |= Index >= Mesh->Vertices.size();
+		}
+
+		Meshes.push_back(std::move(Mesh));
+		return !Reader.bFailed;
+	}
+
+	bool FCaptureReader::ReadFrame(FCapturedFrame& OutFrame)
+	{
+		if (!File || !Error.empty())
+		{
+			return false;
+		}
+
+		for (;;)
+		{
+			uint32 ChunkHeader[2];
+			if (std::fread(ChunkHeader, sizeof(ChunkHeader), 1, File) != 1)
+			{
+				return false;
+			}
+
+			Chunk.resize(ChunkHeader[1]);
+			if (!Chunk.empty() && std::fread(Chunk.data(), Chunk.size(), 1, File) != 1)
+			{
+				Error = "truncated capture";
+				return false;
+			}
+
+			if (ChunkHeader[0] == CHUNK_MESH)
+			{
+				if (!ReadMesh(Chunk))
+				{
+					Error = "malformed mesh";
+					return false;
+				}
+			}
+			else if (ChunkHeader[0] == CHUNK_FRAME)
+			{
+				break;
+			}
+		}
+
+		OutFrame = FCapturedFrame();
+		FScene& Scene = OutFrame.Scene;
+		FChunkReader Reader{ Chunk };
+		Reader.Read(OutFrame.FrameNumber);
+
+		int32 NumViews = 0;
+		Reader.Read(NumViews);
+		Reader.bFailed |= NumViews < 0 || NumViews > 64;
+		Scene.Views.resize(Reader.bFailed ? 0 : NumViews);
+		for (FSceneView& View : Scene.Views)
+		{
+			Reader.Read(View.ViewProj);
+			Reader.Read(View.Foveation);
+			Reader.Read(View.ClipW);
+			View.bReverseCulling = Reader.ReadBool();
+			View.bShadowView = Reader.ReadBool();
+		}
+
+		int32 NumOccluders = 0;
+		Reader.Read(NumOccluders);
+		Reader.bFailed |= NumOccluders < 0 || (size_t)NumOccluders > Chunk.size();
+		Scene.Occluders.resize(Reader.bFailed ? 0 : NumOccluders);
+		for (FOccluderMesh& Occluder : Scene.Occluders)
+		{
+			int32 MeshId = 0;
+			Reader.Read(MeshId);
+			Reader.Read(Occluder.LocalToWorld);
+			Reader.Read(Occluder.WorldBounds);
+			if (MeshId < 0 || MeshId >= (int32)Meshes.size())
+			{
+				Reader.bFailed = true;
+				break;
+			}
+
+			const FMesh& Mesh = *Meshes[MeshId];
+			Occluder.Vertices = Mesh.Vertices.data();
+			Occluder.NumVertices = (int32)Mesh.Vertices.size();
+			Occluder.Indices = Mesh.Indices.data();
+			Occluder.NumIndices = (int32)Mesh.Indices.size();
+		}
+		Reader.Read(Scene.NumOccluderTriangles);
+		Reader.Read(Scene.MaxRasterizedOccluders);
+		Scene.bReprojection = Reader.ReadBool();
+		Scene.bUseSIMD = Reader.ReadBool();
+
+		Reader.ReadVector(Scene.OccludeeBoxMinMax);
+		Reader.ReadVector(Scene.OccludeeBoxOrientedIdx);
+		int32 NumOrientedBoxes = 0;
+		Reader.Read(NumOrientedBoxes);
+		Reader.bFailed |= NumOrientedBoxes < 0 || (size_t)NumOrientedBoxes > Chunk.size();
+		Scene.OccludeeOrientedBoxes.resize(Reader.bFailed ? 0 : NumOrientedBoxes);
+		for (FOrientedBox& OrientedBox : Scene.OccludeeOrientedBoxes)
+		{
+			Reader.Read(OrientedBox);
+		}
+		Reader.Read(Scene.NumPrimitiveOccludees);
+		Reader.ReadVector(Scene.ShadowVolumeCasterIdx);
+		Reader.ReadVector(Scene.ShadowVolumeViewIdx);
+		Reader.ReadVector(Scene.OccludeeGroupMembers);
+		Reader.ReadVector(Scene.OccludeeGroupFirstMember);
+		Reader.ReadVector(Scene.TopLevelBoxMinMax);
+		Reader.ReadVector(Scene.TopLevelBoxId);
+		Reader.ReadVector(Scene.TopLevelBoxOrientedIdx);
+		Reader.Read(Scene.NumTopLevelPrimitiveBoxes);
+
+		int32 NumResultViews = 0;
+		Reader.Read(NumResultViews);
+		Reader.bFailed |= NumResultViews != NumViews;
+		OutFrame.Results.Views.resize(Reader.bFailed ? 0 : NumResultViews);
+		for (FCapturedResults::FView& View : OutFrame.Results.Views)
+		{
+			Reader.Read(View.BinsHash);
+			Reader.Read(View.Stats);
+			Reader.ReadVector(View.OccludeeVisible);
+		}
+		Reader.ReadVector(OutFrame.Results.OccludeeVisible);
+		Reader.ReadVector(OutFrame.Results.ShadowVolumeVisible);
+		if (Version >= 2)
+		{
+			Reader.Read(OutFrame.Results.Accuracy);
+		}
+
+		// The core indexes with these without checking, a damaged file must not get that far
+		const int32 NumOccludees = Scene.NumOccludees();
+		Reader.bFailed |= Scene.OccludeeBoxMinMax.size() != (size_t)NumOccludees * 2;
+		Reader.bFailed |= Scene.NumPrimitiveOccludees < 0 || Scene.NumPrimitiveOccludees > NumOccludees;
+		Reader.bFailed |= Scene.ShadowVolumeCasterIdx.size() != Scene.ShadowVolumeViewIdx.size();
+		Reader.bFailed |= Scene.TopLevelBoxMinMax.size() != Scene.TopLevelBoxId.size() * 2 || Scene.TopLevelBoxOrientedIdx.size() != Scene.TopLevelBoxId.size();
+		Reader.bFailed |= OutFrame.Results.OccludeeVisible.size() != (size_t)NumOccludees;
+		for (int32 OrientedIdx : Scene.OccludeeBoxOrientedIdx)
+		{
+			Reader.bFailed |= OrientedIdx < -1 || OrientedIdx >= (int32)Scene.OccludeeOrientedBoxes.size();
+		}
+		for (int32 OrientedIdx : Scene.TopLevelBoxOrientedIdx)
+		{
+			Reader.bFailed |= OrientedIdx < -1 || OrientedIdx >= (int32)Scene.OccludeeOrientedBoxes.size();
+		}
+		for (int32 Member : Scene.OccludeeGroupMembers)
+		{
+			Reader.bFailed |= Member < 0 || Member >= NumOccludees;
+		}
+		for (int32 First : Scene.OccludeeGroupFirstMember)
+		{
+			Reader.bFailed |= First < 0 || First > (int32)Scene.OccludeeGroupMembers.size();
+		}
+		for (int32 BoxId : Scene.TopLevelBoxId)
+		{
+			Reader.bFailed |= BoxId >= NumOccludees || (BoxId < 0 && -1 - BoxId >= (int32)Scene.OccludeeGroupFirstMember.size() - 1);
+		}
+		for (size_t VolumeIdx = 0; VolumeIdx < Scene.ShadowVolumeCasterIdx.size() && !Reader.bFailed; ++VolumeIdx)
+		{
+			Reader.bFailed |= Scene.ShadowVolumeCasterIdx[VolumeIdx] < 0 || Scene.ShadowVolumeCasterIdx[VolumeIdx] >= NumOccludees;
+			Reader.bFailed |= Scene.ShadowVolumeViewIdx[VolumeIdx] < 0 || Scene.ShadowVolumeViewIdx[VolumeIdx] >= NumViews;
+		}
+
+		if (Reader.bFailed)
+		{
+			Error = "malformed frame";
+			return false;
+		}
+
+		return true;
+	}
+
+	FCaptureSink MakeFileCaptureSink(const char* Path)
+	{
+		FILE* File = std::fopen(Path, "wb");
+		if (!File)
+		{
+			return nullptr;
+		}
+
+		std::shared_ptr<FILE> SharedFile(File, [](FILE* InFile) { std::fclose(InFile); });
+		return [SharedFile](const void* Data, size_t Size)
+		{
+			return std::fwrite(Data, 1, Size, SharedFile.get()) == Size;
+		};
+	}
+}
@@ -0,0 +1,1884 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+/*=============================================================================
+	SnowOcclusionCore.cpp
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+#include "SnowOcclusionProfiler.h"
+#include "SnowOcclusionSimd.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <climits>
+#include <cstring>
+#include <float.h>
+#include <memory>
+#include <unordered_map>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+// Occludee quads are also written to the Type buffer for the debug view, builds without it can compile it out
+#ifndef SNOWOCCLUSION_DEBUG_BUFFER
+#define SNOWOCCLUSION_DEBUG_BUFFER 1
+#endif
+
+namespace SnowOcclusion
+{
+	namespace EScreenVertexFlags
+	{
+		const uint8 None = 0;
+		const uint8 ClippedLeft = 1 << 0;	// Vertex is clipped by left plane
+		const uint8 ClippedRight = 1 << 1;	// Vertex is clipped by right plane
+		const uint8 ClippedTop = 1 << 2;	// Vertex is clipped by top plane
+		const uint8 ClippedBottom = 1 << 3;	// Vertex is clipped by bottom plane
+		const uint8 ClippedNear = 1 << 4;   // Vertex is clipped by near plane
+		const uint8 Discard = 1 << 5;	// Polygon using this vertex should be discarded
+	}
+
+	struct FScreenPosition
+	{
+		int32 X, Y;
+	};
+
+	struct FScreenTriangle
+	{
+		FScreenPosition V[3];
+	};
+
+	struct FSortedIndexDepth
+	{
+		int32 Index;
+		float Depth;
+	};
+
+	struct FFrameData
+	{
+		FLinearArena& Arena;
+
+		// binned tris
+		TArenaVector<FSortedIndexDepth> SortedTriangles[BIN_NUM];
+
+		// tris data
+		TArenaVector<FScreenTriangle> ScreenTriangles;
+		TArenaVector<int32> ScreenTrianglesID; // occluder mesh index or occludee index, depending on flags
+		TArenaVector<uint8> ScreenTrianglesFlags;
+
+		explicit FFrameData(FLinearArena& InArena)
+			: Arena(InArena)
+			, ScreenTriangles(InArena)
+			, ScreenTrianglesID(InArena)
+			, ScreenTrianglesFlags(InArena)
+		{
+			for (TArenaVector<FSortedIndexDepth>& BinTriangles : SortedTriangles)
+			{
+				BinTriangles = TArenaVector<FSortedIndexDepth>(InArena);
+			}
+		}
+
+		void ReserveBuffers(int32 NumTriangles)
+		{
+			const int32 NumTrianglesPerBin = NumTriangles / BIN_NUM + 1;
+			for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
+			{
+				SortedTriangles[BinIdx].reserve(NumTrianglesPerBin);
+			}
+
+			ScreenTriangles.reserve(NumTriangles);
+			ScreenTrianglesID.reserve(NumTriangles);
+			ScreenTrianglesFlags.reserve(NumTriangles);
+		}
+	};
+
+	/** Previous frame's covered tiles reprojected into the current view */
+	struct FReprojectedSeed
+	{
+		uint64 Data[BIN_NUM][FRAMEBUFFER_HEIGHT];
+		// Farthest depth of the reprojected tiles overlapping each tile, FLT_MAX where there are none
+		float TileDepth[TILES_Y][TILES_X];
+	};
+
+	// Triangle flags: occludee quad, occluder triangle, occludee group quad
+	static const uint8 TRI_FLAG_OCCLUDEE = 0;
+	static const uint8 TRI_FLAG_OCCLUDER = 1;
+	static const uint8 TRI_FLAG_OCCLUDEE_GROUP = 2;
+
+	typedef std::chrono::steady_clock FClock;
+
+	inline double SecondsSince(FClock::time_point Start)
+	{
+		return std::chrono::duration<double>(FClock::now() - Start).count();
+	}
+
+	template<typename T> inline T Min3(T A, T B, T C) { return std::min(A, std::min(B, C)); }
+	template<typename T> inline T Max3(T A, T B, T C) { return std::max(A, std::max(B, C)); }
+
+	inline int32 RoundToInt(float F) { return (int32)std::floor(F + 0.5f); }
+	inline int32 FloorToInt(float F) { return (int32)std::floor(F); }
+	inline int32 CeilToInt(float F) { return (int32)std::ceil(F); }
+
+	inline int32 CountTrailingZeros64(uint64 Value)
+	{
+#if defined(_MSC_VER) && !defined(__clang__)
+		unsigned long Index;
+		_BitScanForward64(&Index, Value);
+		return (int32)Index;
+#else
+		return __builtin_ctzll(Value);
+#endif
+	}
+
+	static const FMat4 FramebufferMat = []()
+	{
+		FMat4 Result = FMat4::Identity();
+		Result.M[0][0] = 0.5f * (float)FRAMEBUFFER_WIDTH;
+		Result.M[1][1] = 0.5f * (float)FRAMEBUFFER_HEIGHT;
+		Result.M[3][0] = 0.5f * (float)FRAMEBUFFER_WIDTH;
+		Result.M[3][1] = 0.5f * (float)FRAMEBUFFER_HEIGHT;
+		return Result;
+	}();
+
+	inline uint64 ComputeBinRowMask(int32 BinMinX, float fX0, float fX1)
+	{
+		int32 X0 = RoundToInt(fX0) - BinMinX;
+		int32 X1 = RoundToInt(fX1) - BinMinX;
+		if (X0 >= BIN_WIDTH || X1 < 0)
+		{
+			// not in bin
+			return 0ull;
+		}
+		else
+		{
+			X0 = std::max(0, X0);
+			X1 = std::min(BIN_WIDTH - 1, X1);
+			int32 Num = (X1 - X0) + 1;
+			return (Num == BIN_WIDTH) ? ~0ull : ((1ull << Num) - 1) << X0;
+		}
+	}
+
+	inline void RasterizeHalf(float X0, float X1, float DX0, float DX1, int32 Row0, int32 Row1, uint64* BinData, uint64* BinType, int32 BinMinX, float* BinTileDepth, float TriDepth)
+	{
+		assert(Row0 <= Row1);
+		assert(Row0 >= 0 && Row1 < FRAMEBUFFER_HEIGHT);
+
+		for (int32 Row = Row0; Row <= Row1; Row++, X0 += DX0, X1 += DX1)
+		{
+			uint64 FrameBufferMask = BinData[Row];
+			if (FrameBufferMask != ~0ull) // whether this row is already fully rasterized
+			{
+				*BinType = 0;
+				uint64 RowMask = ComputeBinRowMask(BinMinX, X0, X1);
+				if (RowMask)
+				{
+					BinData[Row] = (FrameBufferMask | RowMask);
+
+					// Triangles come front to back, the last one adding pixels to a tile is the farthest
+					uint64 NewBits = RowMask & ~FrameBufferMask;
+					float* RowTileDepth = BinTileDepth + (Row / TILE_SIZE) * TILES_PER_BIN;
+					while (NewBits)
+					{
+						const int32 Tile = CountTrailingZeros64(NewBits) / TILE_SIZE;
+						RowTileDepth[Tile] = TriDepth;
+						NewBits &= ~(((1ull << TILE_SIZE) - 1) << (Tile * TILE_SIZE));
+					}
+				}
+			}
+		}
+	}
+
+	static void RasterizeOccluderTri(const FScreenTriangle& Tri, uint64* BinData, uint64* BinType, int32 BinMinX, float* BinTileDepth, float TriDepth)
+	{
+		FScreenPosition A = Tri.V[0];
+		FScreenPosition B = Tri.V[1];
+		FScreenPosition C = Tri.V[2];
+
+		int32 RowMin = std::max<int32>(A.Y, 0);
+		int32 RowMax = std::min<int32>(FRAMEBUFFER_HEIGHT - 1, C.Y);
+
+		bool bRasterized = false;
+
+		int32 RowS = RowMin;
+		if ((B.Y - RowMin) > 0)
+		{
+			// A -> B
+			int32 RowE = std::min<int32>(RowMax, B.Y);
+			// Edge gradients
+			float dX0 = float(B.X - A.X) / (B.Y - A.Y);
+			float dX1 = float(C.X - A.X) / (C.Y - A.Y);
+			if (dX0 > dX1)
+			{
+				std::swap(dX0, dX1);
+			}
+			float X0 = A.X + dX0 * (RowS - A.Y);
+			float X1 = A.X + dX1 * (RowS - A.Y);
+			RasterizeHalf(X0, X1, dX0, dX1, RowS, RowE, BinData, BinType, BinMinX, BinTileDepth, TriDepth);
+			bRasterized |= true;
+			RowS = RowE + 1;
+		}
+
+		if ((RowMax - RowS) > 0)
+		{
+			// B -> C
+			// Edge gradients
+			float dX0 = float(C.X - A.X) / (C.Y - A.Y);
+			float dX1 = float(C.X - B.X) / (C.Y - B.Y);
+			float X0 = A.X + dX0 * (RowS - A.Y);
+			float X1 = B.X + dX1 * (RowS - B.Y);
+			if (X0 > X1)
+			{
+				std::swap(X0, X1);
+				std::swap(dX0, dX1);
+			}
+			RasterizeHalf(X0, X1, dX0, dX1, RowS, RowMax, BinData, BinType, BinMinX, BinTileDepth, TriDepth);
+			bRasterized |= true;
+		}
+
+		// one line triangle
+		if (!bRasterized)
+		{
+			float X0 = (float)Min3(A.X, B.X, C.X);
+			float X1 = (float)Max3(A.X, B.X, C.X);
+			RasterizeHalf(X0, X1, 0.0f, 0.0f, RowS, RowS, BinData, BinType, BinMinX, BinTileDepth, TriDepth);
+		}
+	}
+
+	static bool RasterizeOccludeeQuad(const FScreenTriangle& Tri, uint64* BinData, uint64* BinType, int32 BinMinX)
+	{
+		int32 RowMin = Tri.V[0].Y; // Quad MinY
+		int32 RowMax = Tri.V[2].Y; // Quad MaxY
+		// occludee expected to be clipped to screen
+		assert(RowMin >= 0);
+		assert(RowMax < FRAMEBUFFER_HEIGHT);
+
+		// clip X to bin bounds
+		int32 X0 = std::max(Tri.V[0].X - BinMinX, 0); // MinX
+		int32 X1 = std::min(Tri.V[1].X - BinMinX, BIN_WIDTH - 1); //MaxX
+		assert(X0 <= X1);
+
+		int32 NumBits = (X1 - X0) + 1;
+		uint64 RowMask = (NumBits == BIN_WIDTH) ? ~0ull : ((1ull << NumBits) - 1) << X0;
+
+#if SNOWOCCLUSION_DEBUG_BUFFER
+		for (int32 Row = RowMin; Row <= RowMax; ++Row)
+		{
+			BinType[Row] |= RowMask;
+		}
+#endif
+
+		for (int32 Row = RowMin; Row <= RowMax; ++Row)
+		{
+			uint64 FrameBufferMask = BinData[Row];
+			if ((~FrameBufferMask & RowMask))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	static bool TestFrontface(const FScreenTriangle& Tri, bool bReverseCulling)
+	{
+		const int32 Cross0 = (Tri.V[2].X - Tri.V[0].X) * (Tri.V[1].Y - Tri.V[0].Y);
+		const int32 Cross1 = (Tri.V[2].Y - Tri.V[0].Y) * (Tri.V[1].X - Tri.V[0].X);
+		if (bReverseCulling ? Cross0 <= Cross1 : Cross0 >= Cross1)
+		{
+			return false;
+		}
+		return true;
+	}
+
+	inline bool AddTriangle(FScreenTriangle& Tri, float TriDepth, int32 TriangleOwnerId, uint8 MeshFlags, FFrameData& InData)
+	{
+		if (MeshFlags == TRI_FLAG_OCCLUDER)
+		{
+			// Sort vertices by Y, assumed in rasterization
+			if (Tri.V[0].Y > Tri.V[1].Y) std::swap(Tri.V[0], Tri.V[1]);
+			if (Tri.V[1].Y > Tri.V[2].Y) std::swap(Tri.V[1], Tri.V[2]);
+			if (Tri.V[0].Y > Tri.V[1].Y) std::swap(Tri.V[0], Tri.V[1]);
+
+			if (Tri.V[0].Y >= FRAMEBUFFER_HEIGHT || Tri.V[2].Y < 0)
+			{
+				return false;
+			}
+		}
+
+		const int32 TriangleID = (int32)InData.ScreenTriangles.size();
+		InData.ScreenTriangles.push_back(Tri);
+		InData.ScreenTrianglesID.push_back(TriangleOwnerId);
+		InData.ScreenTrianglesFlags.push_back(MeshFlags);
+
+		// bin
+		int32 MinX = Min3(Tri.V[0].X, Tri.V[1].X, Tri.V[2].X) / BIN_WIDTH;
+		int32 MaxX = Max3(Tri.V[0].X, Tri.V[1].X, Tri.V[2].X) / BIN_WIDTH;
+		int32 BinMin = std::max(MinX, 0);
+		int32 BinMax = std::min(MaxX, BIN_NUM - 1);
+
+		FSortedIndexDepth SortedIndexDepth;
+		SortedIndexDepth.Index = TriangleID;
+		SortedIndexDepth.Depth = TriDepth;
+
+		for (int32 BinIdx = BinMin; BinIdx <= BinMax; ++BinIdx)
+		{
+			InData.SortedTriangles[BinIdx].push_back(SortedIndexDepth);
+		}
+
+		return true;
+	}
+
+	// BEGIN Intel
+	static const int32 NUM_CUBE_VTX = 8;
+	// 0 = min corner, 1 = max corner
+	static const uint32 sBBxInd[NUM_CUBE_VTX] = { 1, 0, 0, 1, 1, 1, 0, 0 };
+	static const uint32 sBByInd[NUM_CUBE_VTX] = { 1, 1, 1, 1, 0, 0, 0, 0 };
+	static const uint32 sBBzInd[NUM_CUBE_VTX] = { 1, 1, 0, 0, 0, 1, 1, 0 };
+	// END Intel
+
+	static void ProcessOccludeeGeomSIMD(const FMat4& InMat, float W_CLIP, const FVec3* InMinMax, int32 Num, int32* OutQuads, float* OutQuadDepth, int32* OutQuadClipped)
+	{
+		const VecReg vFramebufferBounds = VecSet(FRAMEBUFFER_WIDTH - 1, FRAMEBUFFER_HEIGHT - 1, 1.0f, 1.0f);
+		const VecReg vXYHalf = VecSet(0.5f, 0.5f, 0.0f, 0.0f);
+		VecReg vClippingW = VecSet1(W_CLIP);
+		VecReg mRow0 = VecLoadAligned(InMat.M[0]);
+		VecReg mRow1 = VecLoadAligned(InMat.M[1]);
+		VecReg mRow2 = VecLoadAligned(InMat.M[2]);
+		VecReg mRow3 = VecLoadAligned(InMat.M[3]);
+		VecReg xRow[2], yRow[2], zRow[2];
+
+		for (int32 k = 0; k < Num; ++k)
+		{
+			FVec3 BoxMin = *(InMinMax++);
+			FVec3 BoxMax = *(InMinMax++);
+
+			// BEGIN Intel
+			// Project primitive bounding box to screen
+			xRow[0] = VecMul(VecSet1(BoxMin.X), mRow0);
+			xRow[1] = VecMul(VecSet1(BoxMax.X), mRow0);
+			yRow[0] = VecMul(VecSet1(BoxMin.Y), mRow1);
+			yRow[1] = VecMul(VecSet1(BoxMax.Y), mRow1);
+			zRow[0] = VecMul(VecSet1(BoxMin.Z), mRow2);
+			zRow[1] = VecMul(VecSet1(BoxMax.Z), mRow2);
+
+			VecReg vClippedFlag = VecZero();
+			VecReg vScreenMin = VecSet1(FLT_MAX);
+			VecReg vScreenMax = VecSet1(-FLT_MAX);
+
+			for (int32 i = 0; i < NUM_CUBE_VTX; ++i)
+			{
+				VecReg V;
+				V = VecAdd(mRow3, xRow[sBBxInd[i]]);
+				V = VecAdd(V, yRow[sBByInd[i]]);
+				V = VecAdd(V, zRow[sBBzInd[i]]);
+
+				VecReg W = VecReplicateW(V);
+				vClippedFlag = VecOr(vClippedFlag, VecCompareLT(W, vClippingW));
+				V = VecDiv(V, W);
+
+				vScreenMin = VecMin(vScreenMin, V);
+				vScreenMax = VecMax(vScreenMax, V);
+			}
+			// END Intel
+
+			// For pixel snapping
+			vScreenMin = VecAdd(vScreenMin, vXYHalf);
+			vScreenMax = VecAdd(vScreenMax, vXYHalf);
+
+			// Clip against screen rect
+			vScreenMin = VecMax(vScreenMin, VecZero());
+			vScreenMax = VecMin(vScreenMax, vFramebufferBounds); // Z should be unaffected
+
+			// Make: MinX, MinY, MaxX, MaxY
+			VecStoreIntAligned(VecCombineLow(vScreenMin, vScreenMax), OutQuads);
+			*OutQuadClipped = VecAnyBitSet(vClippedFlag) ? 1 : 0;
+			*OutQuadDepth = VecGetZ(vScreenMax);
+
+			OutQuads += 4;
+			OutQuadDepth++;
+			OutQuadClipped++;
+		}
+	}
+
+	static void ProcessOccludeeGeomScalar(const FMat4& InMat, float W_CLIP, const FVec3* InMinMax, int32 Num, int32* OutQuads, float* OutQuadDepth, int32* OutQuadClipped)
+	{
+		FVec4 AX = { InMat.M[0][0], InMat.M[0][1], InMat.M[0][2], InMat.M[0][3] };
+		FVec4 AY = { InMat.M[1][0], InMat.M[1][1], InMat.M[1][2], InMat.M[1][3] };
+		FVec4 AZ = { InMat.M[2][0], InMat.M[2][1], InMat.M[2][2], InMat.M[2][3] };
+		FVec4 AW = { InMat.M[3][0], InMat.M[3][1], InMat.M[3][2], InMat.M[3][3] };
+		FVec4 xRow[2], yRow[2], zRow[2];
+
+		for (int32 k = 0; k < Num; ++k)
+		{
+			FVec3 BoxMin = *(InMinMax++);
+			FVec3 BoxMax = *(InMinMax++);
+			// Project primitive bounding box to screen
+			xRow[0] = AX * BoxMin.X;
+			xRow[1] = AX * BoxMax.X;
+			yRow[0] = AY * BoxMin.Y;
+			yRow[1] = AY * BoxMax.Y;
+			zRow[0] = AZ * BoxMin.Z;
+			zRow[1] = AZ * BoxMax.Z;
+
+			FVec2 MinXY = { FLT_MAX, FLT_MAX };
+			FVec2 MaxXY = { -FLT_MAX, -FLT_MAX };
+			float Depth = 0.f;
+			bool bClippedNear = false;
+
+			for (int32 i = 0; i < NUM_CUBE_VTX; i++)
+			{
+				FVec4 V = AW;
+				V = V + xRow[sBBxInd[i]];
+				V = V + yRow[sBByInd[i]];
+				V = V + zRow[sBBzInd[i]];
+
+				if (V.W < W_CLIP)
+				{
+					bClippedNear = true;
+					break;
+				}
+
+				V = V / V.W;
+
+				MinXY.X = std::min(MinXY.X, V.X);
+				MinXY.Y = std::min(MinXY.Y, V.Y);
+				MaxXY.X = std::max(MaxXY.X, V.X);
+				MaxXY.Y = std::max(MaxXY.Y, V.Y);
+				Depth = std::max(Depth, V.Z);
+			}
+
+			if (bClippedNear)
+			{
+				OutQuadClipped[0] = 1;
+			}
+			else
+			{
+				// For pixel snapping
+				MinXY = MinXY + FVec2{ 0.5f, 0.5f };
+				MaxXY = MaxXY + FVec2{ 0.5f, 0.5f };
+
+				// Clip against screen rect
+				MinXY.X = std::max(0.f, MinXY.X);
+				MinXY.Y = std::max(0.f, MinXY.Y);
+				MaxXY.X = std::min(FRAMEBUFFER_WIDTH - 1.f, MaxXY.X);
+				MaxXY.Y = std::min(FRAMEBUFFER_HEIGHT - 1.f, MaxXY.Y);
+
+				// Make MinX, MinY, MaxX, MaxY
+				OutQuads[0] = (int32)MinXY.X;
+				OutQuads[1] = (int32)MinXY.Y;
+				OutQuads[2] = (int32)MaxXY.X;
+				OutQuads[3] = (int32)MaxXY.Y;
+
+				OutQuadDepth[0] = Depth;
+				OutQuadClipped[0] = 0;
+			}
+
+			OutQuads += 4;
+			OutQuadDepth++;
+			OutQuadClipped++;
+		}
+	}
+
+	static void ProjectOccludeeBoxes(const FMat4& WorldToFB, float ClipW, const FVec3* MinMax, int32 Num, bool bUseSIMD, int32* OutQuads, float* OutQuadDepth, int32* OutQuadClipped)
+	{
+		if (bUseSIMD)
+		{
+			ProcessOccludeeGeomSIMD(WorldToFB, ClipW, MinMax, Num, OutQuads, OutQuadDepth, OutQuadClipped);
+		}
+		else
+		{
+			ProcessOccludeeGeomScalar(WorldToFB, ClipW, MinMax, Num, OutQuads, OutQuadDepth, OutQuadClipped);
+		}
+	}
+
+	/** Same as ProjectOccludeeBoxes, oriented boxes are projected with their own transform. Runs of world aligned boxes stay batched. */
+	static void ProjectOccludeeBoxes(const FMat4& WorldToFB, float ClipW, const FVec3* MinMax, const int32* OrientedIndices, const FOrientedBox* OrientedBoxes, int32 Num, bool bUseSIMD, int32* OutQuads, float* OutQuadDepth, int32* OutQuadClipped)
+	{
+		int32 First = 0;
+		while (First < Num)
+		{
+			if (OrientedIndices[First] != -1)
+			{
+				const FOrientedBox& OrientedBox = OrientedBoxes[OrientedIndices[First]];
+				const FMat4 BoxToFB = OrientedBox.BoxToWorld * WorldToFB;
+				ProjectOccludeeBoxes(BoxToFB, ClipW, &OrientedBox.Min, 1, bUseSIMD, OutQuads + First * 4, OutQuadDepth + First, OutQuadClipped + First);
+				++First;
+				continue;
+			}
+
+			int32 Last = First + 1;
+			while (Last < Num && OrientedIndices[Last] == -1)
+			{
+				++Last;
+			}
+
+			ProjectOccludeeBoxes(WorldToFB, ClipW, MinMax + First * 2, Last - First, bUseSIMD, OutQuads + First * 4, OutQuadDepth + First, OutQuadClipped + First);
+			First = Last;
+		}
+	}
+
+	/** Maps projected quads to the variable resolution buffer, growing them to whole pixels */
+	static void WarpQuads(const FFoveation& Foveation, int32* Quads, int32 Num)
+	{
+		if (!Foveation.bEnabled)
+		{
+			return;
+		}
+
+		for (int32 QuadIdx = 0; QuadIdx < Num; ++QuadIdx, Quads += 4)
+		{
+			// Off screen quads stay empty
+			if (Quads[0] > Quads[2] || Quads[1] > Quads[3])
+			{
+				continue;
+			}
+
+			Quads[0] = std::max(FloorToInt(Foveation.Warp(0, (float)Quads[0])), 0);
+			Quads[1] = std::max(FloorToInt(Foveation.Warp(1, (float)Quads[1])), 0);
+			Quads[2] = std::min(CeilToInt(Foveation.Warp(0, (float)Quads[2])), FRAMEBUFFER_WIDTH - 1);
+			Quads[3] = std::min(CeilToInt(Foveation.Warp(1, (float)Quads[3])), FRAMEBUFFER_HEIGHT - 1);
+		}
+	}
+
+	// Pending triangles are a max heap on depth, the closest one on top
+	inline bool PendingHeapPredicate(const FSortedIndexDepth& A, const FSortedIndexDepth& B)
+	{
+		return A.Depth < B.Depth;
+	}
+
+	/**
+	 * Projects the members of a group found visible while rasterizing bin CurrentBin. Members can't be closer than their group,
+	 * so in the current bin they go to the pending heap merged into the sweep, later bins sort them in as usual.
+	 * Earlier bins are skipped, the group was fully occluded there. CurrentBin is -1 before rasterization.
+	 */
+	static void ExpandOccludeeGroup(const FScene& Scene, const FSceneView& View, int32 GroupIdx, int32 CurrentBin, FFrameData& FrameData, TArenaVector<FSortedIndexDepth>& PendingTriangles, std::vector<uint8>& OccludeeVisible)
+	{
+		const FMat4 WorldToFB = View.ViewProj * FramebufferMat;
+
+		for (int32 MemberIdx = Scene.OccludeeGroupFirstMember[GroupIdx]; MemberIdx < Scene.OccludeeGroupFirstMember[GroupIdx + 1]; ++MemberIdx)
+		{
+			const int32 OccludeeIdx = Scene.OccludeeGroupMembers[MemberIdx];
+			alignas(16) int32 Quad[4];
+			float Depth;
+			int32 Clipped;
+			ProjectOccludeeBoxes(WorldToFB, View.ClipW, &Scene.OccludeeBoxMinMax[OccludeeIdx * 2], &Scene.OccludeeBoxOrientedIdx[OccludeeIdx], Scene.OccludeeOrientedBoxes.data(), 1, Scene.bUseSIMD, Quad, &Depth, &Clipped);
+			WarpQuads(View.Foveation, Quad, 1);
+
+			if (Clipped != 0)
+			{
+				OccludeeVisible[OccludeeIdx] = 1;
+				continue;
+			}
+
+			const int32 BinMin = std::max(Quad[0] / BIN_WIDTH, CurrentBin);
+			const int32 BinMax = std::min(Quad[2] / BIN_WIDTH, BIN_NUM - 1);
+			if (Quad[0] > Quad[2] || Quad[1] > Quad[3] || BinMin > BinMax)
+			{
+				continue;
+			}
+
+			FScreenTriangle ST;
+			ST.V[0] = { Quad[0], Quad[1] };
+			ST.V[1] = { Quad[2], Quad[3] };
+			ST.V[2] = { Quad[0], Quad[3] };
+
+			FSortedIndexDepth SortedIndexDepth;
+			SortedIndexDepth.Index = (int32)FrameData.ScreenTriangles.size();
+			SortedIndexDepth.Depth = Depth;
+			FrameData.ScreenTriangles.push_back(ST);
+			FrameData.ScreenTrianglesID.push_back(OccludeeIdx);
+			FrameData.ScreenTrianglesFlags.push_back(TRI_FLAG_OCCLUDEE);
+
+			for (int32 BinIdx = BinMin; BinIdx <= BinMax; ++BinIdx)
+			{
+				if (BinIdx == CurrentBin)
+				{
+					PendingTriangles.push_back(SortedIndexDepth);
+					std::push_heap(PendingTriangles.begin(), PendingTriangles.end(), PendingHeapPredicate);
+				}
+				else
+				{
+					FrameData.SortedTriangles[BinIdx].push_back(SortedIndexDepth);
+				}
+			}
+		}
+	}
+
+	// Occludee boxes projected at once, also the size of the occludee setup chunks run in parallel
+	static const int32 RUN_SIZE = 512;
+	// Occluder triangles set up by one chunk run in parallel, roughly
+	static const int32 OCCLUDER_CHUNK_TRIANGLES = 1024;
+
+	static int32 GetNumTopLevelBoxes(const FScene& Scene, const FSceneView& View)
+	{
+		// Shadow views only care about the primitives, not their shadow volumes
+		return View.bShadowView ? Scene.NumTopLevelPrimitiveBoxes : (int32)Scene.TopLevelBoxId.size();
+	}
+
+	/** Projects the top level occludee boxes from FirstBox to EndBox and adds their quads */
+	static void ProcessOccludeeGeom(const FScene& Scene, const FSceneView& View, int32 FirstBox, int32 EndBox, FFrameData& FrameData, std::vector<uint8>& OccludeeVisible)
+	{
+		int32 NumBoxes = EndBox - FirstBox;
+		const FVec3* MinMax = Scene.TopLevelBoxMinMax.data() + FirstBox * 2;
+		const int32* BoxIds = Scene.TopLevelBoxId.data() + FirstBox;
+		const int32* OrientedIndices = Scene.TopLevelBoxOrientedIdx.data() + FirstBox;
+
+		FMat4 WorldToFB = View.ViewProj * FramebufferMat;
+
+		// on stack mem for each run output
+		alignas(16) int32 Quads[RUN_SIZE * 4];
+		float QuadDepths[RUN_SIZE];
+		int32 QuadClipFlags[RUN_SIZE];
+
+		int32 NumRuns = NumBoxes / RUN_SIZE + 1;
+		int32 NumBoxesProcessed = 0;
+
+		for (int32 RunIdx = 0; RunIdx < NumRuns; ++RunIdx)
+		{
+			int32 RunSize = std::min(NumBoxes - NumBoxesProcessed, RUN_SIZE);
+
+			// Generate quads
+			ProjectOccludeeBoxes(WorldToFB, View.ClipW, MinMax, OrientedIndices, Scene.OccludeeOrientedBoxes.data(), RunSize, Scene.bUseSIMD, Quads, QuadDepths, QuadClipFlags);
+			WarpQuads(View.Foveation, Quads, RunSize);
+
+			// Triangulate generated quads
+			int32 QuadIdx = 0;
+			for (int32 i = 0; i < RunSize; ++i)
+			{
+				int32 MinX = Quads[QuadIdx++];
+				int32 MinY = Quads[QuadIdx++];
+				int32 MaxX = Quads[QuadIdx++];
+				int32 MaxY = Quads[QuadIdx++];
+
+				const int32 BoxId = BoxIds[NumBoxesProcessed + i];
+				const bool bGroup = BoxId < 0;
+
+				if (QuadClipFlags[i] != 0)
+				{
+					if (bGroup)
+					{
+						// clipped by near plane, test the members on their own
+						TArenaVector<FSortedIndexDepth> NoPendingTriangles(FrameData.Arena);
+						ExpandOccludeeGroup(Scene, View, EncodeOccludeeGroup(BoxId), -1, FrameData, NoPendingTriangles, OccludeeVisible);
+					}
+					else
+					{
+						// clipped by near plane, visible
+						OccludeeVisible[BoxId] = 1;
+					}
+					continue;
+				}
+
+				// Check MinX <= MaxX and MinY <= MaxY
+				if (MinX > MaxX || MinY > MaxY)
+				{
+					// Do not rasterize if not on screen, occluded
+					continue;
+				}
+
+				float Depth = QuadDepths[i];
+
+				// add only first tri, rasterizer will figure out to render a quad
+				FScreenTriangle ST;
+				ST.V[0] = { MinX, MinY };
+				ST.V[1] = { MaxX, MaxY };
+				ST.V[2] = { MinX, MaxY };
+				AddTriangle(ST, Depth, bGroup ? EncodeOccludeeGroup(BoxId) : BoxId, bGroup ? TRI_FLAG_OCCLUDEE_GROUP : TRI_FLAG_OCCLUDEE, FrameData);
+			}
+
+			MinMax += (RunSize * 2);
+			OrientedIndices += RunSize;
+			NumBoxesProcessed += RunSize;
+
+		} // for each run
+	}
+
+	static bool ClippedVertexToScreen(const FVec4& XFV, FScreenPosition& OutSP, float& OutDepth)
+	{
+		assert(XFV.W >= 0.f);
+
+		FVec4 FSP = XFV / XFV.W;
+		int32 X = RoundToInt((FSP.X + 1.f) * FRAMEBUFFER_WIDTH / 2.0f);
+		int32 Y = RoundToInt((FSP.Y + 1.f) * FRAMEBUFFER_HEIGHT / 2.0f);
+
+		OutSP.X = X;
+		OutSP.Y = Y;
+		OutDepth = FSP.Z;
+		return false;
+	}
+
+	/**
+	 * Adds an occluder polygon, in linear buffer positions, to the variable resolution buffer. The polygon is split at the edges of
+	 * the center region, LineIdx is the next edge to split at, and each piece is warped on its own where the mapping is linear.
+	 */
+	static void AddFoveatedOccluderPolygon(const FVec2* Poly, int32 NumPoly, int32 LineIdx, float TriDepth, int32 MeshIdx, const FSceneView& View, FFrameData& OutData)
+	{
+		const FFoveation& Foveation = View.Foveation;
+		if (LineIdx == 4)
+		{
+			FScreenPosition Warped[8];
+			for (int32 i = 0; i < NumPoly; ++i)
+			{
+				Warped[i].X = RoundToInt(Foveation.Warp(0, Poly[i].X));
+				Warped[i].Y = RoundToInt(Foveation.Warp(1, Poly[i].Y));
+			}
+
+			for (int32 j = 2; j < NumPoly; ++j)
+			{
+				FScreenTriangle Tri;
+				Tri.V[0] = Warped[0];
+				Tri.V[1] = Warped[j - 1];
+				Tri.V[2] = Warped[j];
+
+				// Drops the slivers that round to nothing
+				if (TestFrontface(Tri, View.bReverseCulling))
+				{
+					AddTriangle(Tri, TriDepth, MeshIdx, TRI_FLAG_OCCLUDER, OutData);
+				}
+			}
+			return;
+		}
+
+		const int32 Axis = LineIdx / 2;
+		const float Line = (LineIdx & 1) ? Foveation.LinearMax[Axis] : Foveation.LinearMin[Axis];
+
+		int32 NumBelow = 0;
+		for (int32 i = 0; i < NumPoly; ++i)
+		{
+			NumBelow += Poly[i][Axis] < Line ? 1 : 0;
+		}
+
+		if (NumBelow == 0 || NumBelow == NumPoly)
+		{
+			AddFoveatedOccluderPolygon(Poly, NumPoly, LineIdx + 1, TriDepth, MeshIdx, View, OutData);
+			return;
+		}
+
+		// Each side gets at most one more vertex than the polygon
+		FVec2 Below[8];
+		FVec2 Above[8];
+		int32 NumBelowPoly = 0;
+		int32 NumAbovePoly = 0;
+		for (int32 i = 0; i < NumPoly; ++i)
+		{
+			const FVec2& P0 = Poly[i];
+			const FVec2& P1 = Poly[(i + 1) % NumPoly];
+			const bool bBelow0 = P0[Axis] < Line;
+			const bool bBelow1 = P1[Axis] < Line;
+
+			if (bBelow0)
+			{
+				Below[NumBelowPoly++] = P0;
+			}
+			else
+			{
+				Above[NumAbovePoly++] = P0;
+			}
+
+			if (bBelow0 != bBelow1)
+			{
+				const float T = (Line - P0[Axis]) / (P1[Axis] - P0[Axis]);
+				const FVec2 Intersection = P0 + (P1 - P0) * T;
+				Below[NumBelowPoly++] = Intersection;
+				Above[NumAbovePoly++] = Intersection;
+			}
+		}
+
+		AddFoveatedOccluderPolygon(Below, NumBelowPoly, LineIdx + 1, TriDepth, MeshIdx, View, OutData);
+		AddFoveatedOccluderPolygon(Above, NumAbovePoly, LineIdx + 1, TriDepth, MeshIdx, View, OutData);
+	}
+
+	/** Adds an occluder triangle given by clip space vertices in front of the near plane */
+	static void AddOccluderTriangle(const FVec4& V0, const FVec4& V1, const FVec4& V2, int32 MeshIdx, const FSceneView& View, FFrameData& OutData)
+	{
+		FScreenTriangle Tri;
+		float Depths[3];
+		bool bShouldDiscard = false;
+
+		bShouldDiscard |= ClippedVertexToScreen(V0, Tri.V[0], Depths[0]);
+		bShouldDiscard |= ClippedVertexToScreen(V1, Tri.V[1], Depths[1]);
+		bShouldDiscard |= ClippedVertexToScreen(V2, Tri.V[2], Depths[2]);
+
+		if (bShouldDiscard || !TestFrontface(Tri, View.bReverseCulling))
+		{
+			return;
+		}
+
+		// Min tri depth for occluder (further from screen)
+		const float TriDepth = Min3(Depths[0], Depths[1], Depths[2]);
+		if (!View.Foveation.bEnabled)
+		{
+			AddTriangle(Tri, TriDepth, MeshIdx, TRI_FLAG_OCCLUDER, OutData);
+			return;
+		}
+
+		const FVec2 Poly[3] =
+		{
+			{ (V0.X / V0.W + 1.f) * FRAMEBUFFER_WIDTH / 2.0f, (V0.Y / V0.W + 1.f) * FRAMEBUFFER_HEIGHT / 2.0f },
+			{ (V1.X / V1.W + 1.f) * FRAMEBUFFER_WIDTH / 2.0f, (V1.Y / V1.W + 1.f) * FRAMEBUFFER_HEIGHT / 2.0f },
+			{ (V2.X / V2.W + 1.f) * FRAMEBUFFER_WIDTH / 2.0f, (V2.Y / V2.W + 1.f) * FRAMEBUFFER_HEIGHT / 2.0f }
+		};
+		AddFoveatedOccluderPolygon(Poly, 3, 0, TriDepth, MeshIdx, View, OutData);
+	}
+
+	static uint8 ProcessXFormVertex(const FVec4& XFV, float W_CLIP)
+	{
+		uint8 Flags = 0;
+		float W = XFV.W;
+
+		if (W < W_CLIP)
+		{
+			Flags |= EScreenVertexFlags::ClippedNear;
+		}
+
+		if (XFV.X < -W)
+		{
+			Flags |= EScreenVertexFlags::ClippedLeft;
+		}
+
+		if (XFV.X > W)
+		{
+			Flags |= EScreenVertexFlags::ClippedRight;
+		}
+
+		if (XFV.Y < -W)
+		{
+			Flags |= EScreenVertexFlags::ClippedTop;
+		}
+
+		if (XFV.Y > W)
+		{
+			Flags |= EScreenVertexFlags::ClippedBottom;
+		}
+
+		return Flags;
+	}
+
+	/** Transforms and sets up the triangles of the occluders from FirstMesh to EndMesh not skipped, returns how many triangles that was */
+	static int32 ProcessOccluderGeom(const FScene& Scene, const FSceneView& View, const TArenaVector<uint8>& SkipOccluder, int32 FirstMesh, int32 EndMesh, FFrameData& OutData)
+	{
+		const float W_CLIP = View.ClipW;
+		int32 NumSetupTris = 0;
+
+		const FOccluderMesh* MeshData = Scene.Occluders.data();
+
+		TArenaVector<FVec4> ClipVertexBuffer(OutData.Arena);
+		TArenaVector<uint8> ClipVertexFlagsBuffer(OutData.Arena);
+
+		for (int32 MeshIdx = FirstMesh; MeshIdx < EndMesh; ++MeshIdx)
+		{
+			if (!SkipOccluder.empty() && SkipOccluder[MeshIdx])
+			{
+				continue;
+			}
+
+			const FOccluderMesh& Mesh = MeshData[MeshIdx];
+			int32 NumVtx = Mesh.NumVertices;
+
+			if ((int32)ClipVertexBuffer.size() < NumVtx)
+			{
+				ClipVertexBuffer.resize(NumVtx);
+				ClipVertexFlagsBuffer.resize(NumVtx);
+			}
+
+			const FVec3* MeshVertices = Mesh.Vertices;
+			FVec4* MeshClipVertices = ClipVertexBuffer.data();
+			uint8* MeshClipVertexFlags = ClipVertexFlagsBuffer.data();
+
+			// Transform mesh to clip space
+			{
+				const FMat4 LocalToClip = Mesh.LocalToWorld * View.ViewProj;
+				VecReg mRow0 = VecLoadAligned(LocalToClip.M[0]);
+				VecReg mRow1 = VecLoadAligned(LocalToClip.M[1]);
+				VecReg mRow2 = VecLoadAligned(LocalToClip.M[2]);
+				VecReg mRow3 = VecLoadAligned(LocalToClip.M[3]);
+
+				for (int32 i = 0; i < NumVtx; ++i)
+				{
+					VecReg VTempX = VecSet1(MeshVertices[i].X);
+					VecReg VTempY = VecSet1(MeshVertices[i].Y);
+					VecReg VTempZ = VecSet1(MeshVertices[i].Z);
+					// Mul by the matrix
+					VTempX = VecMul(VTempX, mRow0);
+					VTempY = VecMul(VTempY, mRow1);
+					VTempZ = VecMul(VTempZ, mRow2);
+					// Add them all together
+					VTempX = VecAdd(VTempX, VTempY);
+					VTempZ = VecAdd(VTempZ, mRow3);
+					VTempX = VecAdd(VTempX, VTempZ);
+					// Store
+					VecStoreAligned(VTempX, &MeshClipVertices[i].X);
+
+					uint8 VertexFlags = ProcessXFormVertex(MeshClipVertices[i], W_CLIP);
+					MeshClipVertexFlags[i] = VertexFlags;
+				}
+			}
+
+			const uint16* MeshIndices = Mesh.Indices;
+			int32 NumTris = Mesh.NumIndices / 3;
+			NumSetupTris += NumTris;
+
+			// Create triangles
+			for (int32 i = 0; i < NumTris; ++i)
+			{
+				uint16 I0 = MeshIndices[i * 3 + 0];
+				uint16 I1 = MeshIndices[i * 3 + 1];
+				uint16 I2 = MeshIndices[i * 3 + 2];
+
+				uint8 F0 = MeshClipVertexFlags[I0];
+				uint8 F1 = MeshClipVertexFlags[I1];
+				uint8 F2 = MeshClipVertexFlags[I2];
+
+				if ((F0 & F1) & F2)
+				{
+					// fully clipped
+					continue;
+				}
+
+				FVec4 V[3] =
+				{
+					MeshClipVertices[I0],
+					MeshClipVertices[I1],
+					MeshClipVertices[I2]
+				};
+
+				uint8 TriFlags = F0 | F1 | F2;
+
+				if (TriFlags & EScreenVertexFlags::ClippedNear)
+				{
+					static const int32 Edges[3][2] = { {0,1}, {1,2}, {2,0} };
+					FVec4 ClippedPos[4];
+					int32 NumPos = 0;
+
+					for (int32 EdgeIdx = 0; EdgeIdx < 3; EdgeIdx++)
+					{
+						int32 i0 = Edges[EdgeIdx][0];
+						int32 i1 = Edges[EdgeIdx][1];
+
+						bool dot0 = V[i0].W < W_CLIP;
+						bool dot1 = V[i1].W < W_CLIP;
+
+						if (!dot0)
+						{
+							ClippedPos[NumPos] = V[i0];
+							NumPos++;
+						}
+
+						if (dot0 != dot1)
+						{
+							float t = (W_CLIP - V[i0].W) / (V[i0].W - V[i1].W);
+							ClippedPos[NumPos] = V[i0] + (V[i0] - V[i1]) * t;
+							NumPos++;
+						}
+					}
+
+					// triangulate clipped vertices
+					for (int32 j = 2; j < NumPos; j++)
+					{
+						AddOccluderTriangle(ClippedPos[0], ClippedPos[j - 1], ClippedPos[j], MeshIdx, View, OutData);
+					}
+				}
+				else
+				{
+					AddOccluderTriangle(V[0], V[1], V[2], MeshIdx, View, OutData);
+				}
+			} // for each triangle
+		}// for each mesh
+
+		return NumSetupTris;
+	}
+
+	/** Reprojects the covered tiles of the previous frame into the view. Returns false if nothing lands on screen. */
+	static bool BuildReprojectedSeed(const FHistoryView& Prev, const FSceneView& View, FReprojectedSeed& OutSeed)
+	{
+		std::memset(OutSeed.Data, 0, sizeof(OutSeed.Data));
+		for (int32 TileY = 0; TileY < TILES_Y; ++TileY)
+		{
+			for (int32 TileX = 0; TileX < TILES_X; ++TileX)
+			{
+				OutSeed.TileDepth[TileY][TileX] = FLT_MAX;
+			}
+		}
+
+		const FMat4 PrevFBToWorld = (Prev.ViewProj * FramebufferMat).Inverse();
+		const FMat4 WorldToFB = View.ViewProj * FramebufferMat;
+
+		bool bAnyCovered = false;
+		for (int32 TileY = 0; TileY < TILES_Y; ++TileY)
+		{
+			for (int32 TileX = 0; TileX < TILES_X; ++TileX)
+			{
+				const float PrevDepth = Prev.TileDepth[TileY * TILES_X + TileX];
+				if (PrevDepth <= 0.0f)
+				{
+					continue;
+				}
+
+				// Corners of the tile at its farthest depth: 0 = min X min Y, 1 = max X min Y, 2 = min X max Y, 3 = max X max Y
+				FVec4 Corners[4];
+				bool bClipped = false;
+				float Depth = FLT_MAX;
+				for (int32 CornerIdx = 0; CornerIdx < 4 && !bClipped; ++CornerIdx)
+				{
+					const float X = Prev.Foveation.Unwarp(0, (float)(TileX * TILE_SIZE + (CornerIdx & 1) * (TILE_SIZE - 1)));
+					const float Y = Prev.Foveation.Unwarp(1, (float)(TileY * TILE_SIZE + (CornerIdx >> 1) * (TILE_SIZE - 1)));
+					FVec4 World = PrevFBToWorld.TransformVec4({ X, Y, PrevDepth, 1.0f });
+					World = World / World.W;
+					Corners[CornerIdx] = WorldToFB.TransformVec4({ World.X, World.Y, World.Z, 1.0f });
+					bClipped = Corners[CornerIdx].W < std::max(View.ClipW, 1.e-4f);
+					Corners[CornerIdx] = Corners[CornerIdx] / Corners[CornerIdx].W;
+					Depth = std::min(Depth, Corners[CornerIdx].Z);
+				}
+
+				if (bClipped)
+				{
+					continue;
+				}
+
+				// Keep the rectangle inside the reprojected quad, eroded by a pixel for the rounding of the rasterizer
+				const FFoveation& Foveation = View.Foveation;
+				const int32 MinX = std::max(CeilToInt(Foveation.Warp(0, std::max(Corners[0].X, Corners[2].X))) + 1, 0);
+				const int32 MaxX = std::min(FloorToInt(Foveation.Warp(0, std::min(Corners[1].X, Corners[3].X))) - 1, FRAMEBUFFER_WIDTH - 1);
+				const int32 MinY = std::max(CeilToInt(Foveation.Warp(1, std::max(Corners[0].Y, Corners[1].Y))) + 1, 0);
+				const int32 MaxY = std::min(FloorToInt(Foveation.Warp(1, std::min(Corners[2].Y, Corners[3].Y))) - 1, FRAMEBUFFER_HEIGHT - 1);
+				if (MinX > MaxX || MinY > MaxY || Depth <= 0.0f)
+				{
+					continue;
+				}
+
+				for (int32 BinIdx = MinX / BIN_WIDTH; BinIdx <= MaxX / BIN_WIDTH; ++BinIdx)
+				{
+					const uint64 RowMask = ComputeBinRowMask(BinIdx * BIN_WIDTH, (float)MinX, (float)MaxX);
+					for (int32 Row = MinY; Row <= MaxY; ++Row)
+					{
+						OutSeed.Data[BinIdx][Row] |= RowMask;
+					}
+				}
+
+				for (int32 SeedTileY = MinY / TILE_SIZE; SeedTileY <= MaxY / TILE_SIZE; ++SeedTileY)
+				{
+					for (int32 SeedTileX = MinX / TILE_SIZE; SeedTileX <= MaxX / TILE_SIZE; ++SeedTileX)
+					{
+						float& SeedDepth = OutSeed.TileDepth[SeedTileY][SeedTileX];
+						SeedDepth = std::min(SeedDepth, Depth);
+					}
+				}
+
+				bAnyCovered = true;
+			}
+		}
+
+		return bAnyCovered;
+	}
+
+	/** Whether the seed covers the whole quad with tiles closer than Depth */
+	static bool IsCoveredBySeed(const FReprojectedSeed& Seed, int32 MinX, int32 MinY, int32 MaxX, int32 MaxY, float Depth)
+	{
+		for (int32 TileY = MinY / TILE_SIZE; TileY <= MaxY / TILE_SIZE; ++TileY)
+		{
+			for (int32 TileX = MinX / TILE_SIZE; TileX <= MaxX / TILE_SIZE; ++TileX)
+			{
+				if (Seed.TileDepth[TileY][TileX] <= Depth)
+				{
+					return false;
+				}
+			}
+		}
+
+		for (int32 BinIdx = MinX / BIN_WIDTH; BinIdx <= MaxX / BIN_WIDTH; ++BinIdx)
+		{
+			const uint64 RowMask = ComputeBinRowMask(BinIdx * BIN_WIDTH, (float)MinX, (float)MaxX);
+			for (int32 Row = MinY; Row <= MaxY; ++Row)
+			{
+				if ((Seed.Data[BinIdx][Row] & RowMask) != RowMask)
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Picks the occluders the view rasterizes, in weight order up to the budget. With a seed, occluders hidden behind the
+	 * reprojected coverage or off screen are skipped and don't count against the budget. Returns the number skipped by the seed.
+	 */
+	static int32 SelectOccluders(const FScene& Scene, const FSceneView& View, const FReprojectedSeed* Seed, TArenaVector<uint8>& OutSkipOccluder)
+	{
+		const int32 NumMeshes = (int32)Scene.Occluders.size();
+		const FMat4 WorldToFB = View.ViewProj * FramebufferMat;
+
+		OutSkipOccluder.assign(NumMeshes, 0);
+		int32 NumRasterized = 0;
+		int32 NumSkippedBySeed = 0;
+
+		for (int32 MeshIdx = 0; MeshIdx < NumMeshes; ++MeshIdx)
+		{
+			if (NumRasterized >= Scene.MaxRasterizedOccluders)
+			{
+				OutSkipOccluder[MeshIdx] = 1;
+				continue;
+			}
+
+			if (Seed)
+			{
+				const FBox3& Bounds = Scene.Occluders[MeshIdx].WorldBounds;
+				alignas(16) int32 Quad[4];
+				float Depth;
+				int32 Clipped;
+				ProjectOccludeeBoxes(WorldToFB, View.ClipW, &Bounds.Min, 1, Scene.bUseSIMD, Quad, &Depth, &Clipped);
+				WarpQuads(View.Foveation, Quad, 1);
+
+				if (Clipped == 0 && (Quad[0] > Quad[2] || Quad[1] > Quad[3] || IsCoveredBySeed(*Seed, Quad[0], Quad[1], Quad[2], Quad[3], Depth)))
+				{
+					OutSkipOccluder[MeshIdx] = 1;
+					NumSkippedBySeed++;
+					continue;
+				}
+			}
+
+			NumRasterized++;
+		}
+
+		return NumSkippedBySeed;
+	}
+
+	/** Keeps the farthest depth of the fully covered tiles of the view for the next frame */
+	static void StoreOcclusionHistory(const FSceneView& View, const FViewResults& Results, FHistoryView& OutHistory)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_StoreHistory");
+		OutHistory.ViewProj = View.ViewProj;
+		OutHistory.Foveation = View.Foveation;
+		OutHistory.bShadowView = View.bShadowView;
+		OutHistory.TileDepth.resize(TILES_X * TILES_Y);
+
+		for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
+		{
+			const FFramebufferBin& Bin = Results.Bins[BinIdx];
+			for (int32 TileY = 0; TileY < TILES_Y; ++TileY)
+			{
+				for (int32 Tile = 0; Tile < TILES_PER_BIN; ++Tile)
+				{
+					const uint64 TileMask = ((1ull << TILE_SIZE) - 1) << (Tile * TILE_SIZE);
+					bool bCovered = true;
+					for (int32 Row = TileY * TILE_SIZE; Row < (TileY + 1) * TILE_SIZE && bCovered; ++Row)
+					{
+						bCovered = (Bin.Data[Row] & TileMask) == TileMask;
+					}
+
+					OutHistory.TileDepth[TileY * TILES_X + BinIdx * TILES_PER_BIN + Tile] = bCovered ? Bin.TileDepth[TileY][Tile] : 0.0f;
+				}
+			}
+		}
+	}
+
+	/**
+	 * Tests a quad against a finished occlusion buffer. Pixels only count as covered in tiles whose farthest occluder
+	 * is in front of the quad, bits of tiles also covered by farther occluders can't be trusted once sorting is gone.
+	 */
+	static bool IsQuadVisibleInBuffer(const FViewResults& View, int32 MinX, int32 MinY, int32 MaxX, int32 MaxY, float Depth)
+	{
+		for (int32 BinIdx = MinX / BIN_WIDTH; BinIdx <= MaxX / BIN_WIDTH; ++BinIdx)
+		{
+			const FFramebufferBin& Bin = View.Bins[BinIdx];
+			const uint64 RowMask = ComputeBinRowMask(BinIdx * BIN_WIDTH, (float)MinX, (float)MaxX);
+			for (int32 TileY = MinY / TILE_SIZE; TileY <= MaxY / TILE_SIZE; ++TileY)
+			{
+				uint64 TrustedMask = 0;
+				for (int32 Tile = 0; Tile < TILES_PER_BIN; ++Tile)
+				{
+					if (Bin.TileDepth[TileY][Tile] > Depth)
+					{
+						TrustedMask |= ((1ull << TILE_SIZE) - 1) << (Tile * TILE_SIZE);
+					}
+				}
+
+				for (int32 Row = std::max(MinY, TileY * TILE_SIZE); Row <= std::min(MaxY, TileY * TILE_SIZE + TILE_SIZE - 1); ++Row)
+				{
+					if ((Bin.Data[Row] & TrustedMask & RowMask) != RowMask)
+					{
+						return true;
+					}
+				}
+			}
+		}
+
+		return false;
+	}
+
+	void FFrameResults::Reset(int32 NumViews)
+	{
+		Views.resize(NumViews);
+		for (FViewResults& View : Views)
+		{
+			std::memset(View.Bins, 0, sizeof(View.Bins));
+			View.OccludeeVisible.clear();
+			View.Stats = FViewStats();
+		}
+		OccludeeVisible.clear();
+		ShadowVolumeVisible.clear();
+		Accuracy = FAccuracyStats();
+	}
+
+	const char* GetSimdName()
+	{
+#if SNOWOCCLUSION_SIMD_SSE
+		return "SSE2";
+#elif SNOWOCCLUSION_SIMD_NEON
+		return "NEON";
+#else
+		return "scalar";
+#endif
+	}
+
+	float ComputeClipW(const FMat4& ViewProj, bool bOrthographic)
+	{
+		return bOrthographic ? 0.0f : ViewProj.M[3][2];
+	}
+
+	bool IsBoxInsideView(const FSceneView& View, const FBox3& Box)
+	{
+		for (int32 CornerIdx = 0; CornerIdx < 8; ++CornerIdx)
+		{
+			const FVec4 Clip = View.ViewProj.TransformVec4({
+				(CornerIdx & 1) ? Box.Max.X : Box.Min.X,
+				(CornerIdx & 2) ? Box.Max.Y : Box.Min.Y,
+				(CornerIdx & 4) ? Box.Max.Z : Box.Min.Z,
+				1.0f });
+			// Reversed Z, depth goes from the far plane at 0 to the near plane at W
+			if (Clip.W <= 0.0f || Clip.W < View.ClipW || std::fabs(Clip.X) > Clip.W || std::fabs(Clip.Y) > Clip.W || Clip.Z < 0.0f || Clip.Z > Clip.W)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	FFoveation MakeFoveation(bool bEnabled, float CenterSize, float CenterResolution)
+	{
+		FFoveation Foveation;
+		CenterSize = std::min(std::max(CenterSize, 0.05f), 0.95f);
+		CenterResolution = std::min(std::max(CenterResolution, 0.05f), 0.95f);
+		Foveation.bEnabled = bEnabled && CenterSize != CenterResolution;
+
+		for (int32 Axis = 0; Axis < 2; ++Axis)
+		{
+			const float Size = Foveation.Size[Axis];
+			Foveation.LinearMin[Axis] = Size * (1.0f - CenterSize) * 0.5f;
+			Foveation.LinearMax[Axis] = Size * (1.0f + CenterSize) * 0.5f;
+			Foveation.WarpedMin[Axis] = Size * (1.0f - CenterResolution) * 0.5f;
+			Foveation.WarpedMax[Axis] = Size * (1.0f + CenterResolution) * 0.5f;
+		}
+
+		return Foveation;
+	}
+
+	int32 BuildOccludeeGroups(FScene& Scene, float CellSize, int32 MinMembers, FLinearArena* Arena)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_BuildOccludeeGroups");
+		FLinearArena LocalArena;
+		FLinearArena& Scratch = Arena ? *Arena : LocalArena;
+
+		const int32 NumOccludees = Scene.NumOccludees();
+		const FVec3* MinMax = Scene.OccludeeBoxMinMax.data();
+
+		Scene.OccludeeGroupMembers.clear();
+		Scene.OccludeeGroupFirstMember.clear();
+		Scene.OccludeeGroupFirstMember.push_back(0);
+		Scene.TopLevelBoxMinMax.clear();
+		Scene.TopLevelBoxMinMax.reserve(NumOccludees * 2);
+		Scene.TopLevelBoxId.clear();
+		Scene.TopLevelBoxId.reserve(NumOccludees);
+		Scene.TopLevelBoxOrientedIdx.clear();
+		Scene.TopLevelBoxOrientedIdx.reserve(NumOccludees);
+
+		TArenaVector<uint8> Grouped(NumOccludees, 0, Scratch);
+		if (CellSize > 0.0f)
+		{
+			// Occludees bigger than a cell stay on their own, they would only blow up the group box.
+			// Cells are kept in the order they are first seen so groups come out the same every frame.
+			struct FCellKeyHash
+			{
+				size_t operator()(const uint64 Key) const { return (size_t)(Key * 0x9E3779B97F4A7C15ull); }
+			};
+			using FCellIndices = std::unordered_map<uint64, int32, FCellKeyHash, std::equal_to<uint64>, TArenaAllocator<std::pair<const uint64, int32>>>;
+			FCellIndices CellIndices(0, FCellKeyHash(), std::equal_to<uint64>(), Scratch);
+			TArenaVector<TArenaVector<int32>> Cells(Scratch);
+			for (int32 OccludeeIdx = 0; OccludeeIdx < Scene.NumPrimitiveOccludees; ++OccludeeIdx)
+			{
+				const FVec3 BoxMin = MinMax[OccludeeIdx * 2];
+				const FVec3 BoxMax = MinMax[OccludeeIdx * 2 + 1];
+				const FVec3 Size = BoxMax - BoxMin;
+				if (Max3(Size.X, Size.Y, Size.Z) > CellSize)
+				{
+					continue;
+				}
+
+				const FVec3 Cell = (BoxMin + BoxMax) * (0.5f / CellSize);
+				const uint64 Key = ((uint64)(uint32)(FloorToInt(Cell.X) & 0x1fffff) << 42) | ((uint64)(uint32)(FloorToInt(Cell.Y) & 0x1fffff) << 21) | (uint64)(uint32)(FloorToInt(Cell.Z) & 0x1fffff);
+				auto Found = CellIndices.emplace(Key, (int32)Cells.size());
+				if (Found.second)
+				{
+					Cells.emplace_back(Scratch);
+				}
+				Cells[Found.first->second].push_back(OccludeeIdx);
+			}
+
+			for (const TArenaVector<int32>& Cell : Cells)
+			{
+				if ((int32)Cell.size() < std::max(MinMembers, 2))
+				{
+					continue;
+				}
+
+				FBox3 GroupBox = { MinMax[Cell[0] * 2], MinMax[Cell[0] * 2 + 1] };
+				for (int32 OccludeeIdx : Cell)
+				{
+					const FVec3& BoxMin = MinMax[OccludeeIdx * 2];
+					const FVec3& BoxMax = MinMax[OccludeeIdx * 2 + 1];
+					GroupBox.Min = { std::min(GroupBox.Min.X, BoxMin.X), std::min(GroupBox.Min.Y, BoxMin.Y), std::min(GroupBox.Min.Z, BoxMin.Z) };
+					GroupBox.Max = { std::max(GroupBox.Max.X, BoxMax.X), std::max(GroupBox.Max.Y, BoxMax.Y), std::max(GroupBox.Max.Z, BoxMax.Z) };
+					Grouped[OccludeeIdx] = 1;
+				}
+
+				const int32 GroupIdx = (int32)Scene.OccludeeGroupFirstMember.size() - 1;
+				Scene.OccludeeGroupMembers.insert(Scene.OccludeeGroupMembers.end(), Cell.begin(), Cell.end());
+				Scene.OccludeeGroupFirstMember.push_back((int32)Scene.OccludeeGroupMembers.size());
+				Scene.TopLevelBoxMinMax.push_back(GroupBox.Min);
+				Scene.TopLevelBoxMinMax.push_back(GroupBox.Max);
+				Scene.TopLevelBoxId.push_back(EncodeOccludeeGroup(GroupIdx));
+				Scene.TopLevelBoxOrientedIdx.push_back(-1);
+			}
+		}
+
+		// Ungrouped primitives, then the shadow volumes
+		for (int32 OccludeeIdx = 0; OccludeeIdx < NumOccludees; ++OccludeeIdx)
+		{
+			if (OccludeeIdx == Scene.NumPrimitiveOccludees)
+			{
+				Scene.NumTopLevelPrimitiveBoxes = (int32)Scene.TopLevelBoxId.size();
+			}
+
+			if (!Grouped[OccludeeIdx])
+			{
+				Scene.TopLevelBoxMinMax.push_back(MinMax[OccludeeIdx * 2]);
+				Scene.TopLevelBoxMinMax.push_back(MinMax[OccludeeIdx * 2 + 1]);
+				Scene.TopLevelBoxId.push_back(OccludeeIdx);
+				Scene.TopLevelBoxOrientedIdx.push_back(Scene.OccludeeBoxOrientedIdx[OccludeeIdx]);
+			}
+		}
+		if (Scene.NumPrimitiveOccludees == NumOccludees)
+		{
+			Scene.NumTopLevelPrimitiveBoxes = (int32)Scene.TopLevelBoxId.size();
+		}
+
+		return (int32)Scene.OccludeeGroupFirstMember.size() - 1;
+	}
+
+	/** Work of one view carried from stage to stage of ProcessOcclusionFrame */
+	struct FViewWork
+	{
+		FFrameData FrameData;
+		FReprojectedSeed* Seed = nullptr;
+		TArenaVector<uint8> SkipOccluder;
+
+		explicit FViewWork(FLinearArena& Arena)
+			: FrameData(Arena)
+			, SkipOccluder(Arena)
+		{
+		}
+	};
+
+	/** Occluders or top level occludee boxes of a view set up into their own triangle lists, merged into the view's in order */
+	struct FSetupChunk
+	{
+		FFrameData FrameData;
+		int32 ViewIdx;
+		bool bOccluders;
+		int32 First;
+		int32 End;
+		int32 NumSetupTris = 0;
+		double Seconds = 0.0;
+
+		FSetupChunk(FLinearArena& Arena, int32 InViewIdx, bool bInOccluders, int32 InFirst, int32 InEnd)
+			: FrameData(Arena)
+			, ViewIdx(InViewIdx)
+			, bOccluders(bInOccluders)
+			, First(InFirst)
+			, End(InEnd)
+		{
+		}
+	};
+
+	/** Starts a view: clears its results and picks the occluders to rasterize, with last frame's coverage if there is any */
+	static void BeginOcclusionView(const FScene& Scene, int32 ViewIdx, const FHistoryView* PrevHistory, FViewWork& Work, FViewResults& OutResults)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_SelectOccluders");
+		const FClock::time_point Start = FClock::now();
+		const FSceneView& View = Scene.Views[ViewIdx];
+		FViewStats& Stats = OutResults.Stats;
+		Stats = FViewStats();
+
+		OutResults.ViewProj = View.ViewProj;
+		OutResults.Foveation = View.Foveation;
+		OutResults.ClipW = View.ClipW;
+		OutResults.bShadowView = View.bShadowView;
+		OutResults.OccludeeVisible.assign(Scene.NumOccludees(), 0);
+
+		// The seed only decides which occluders are worth rasterizing, occludees are tested against rasterized geometry alone
+		if (PrevHistory)
+		{
+			Work.Seed = Work.FrameData.Arena.New<FReprojectedSeed>();
+			if (!BuildReprojectedSeed(*PrevHistory, View, *Work.Seed))
+			{
+				Work.Seed = nullptr;
+			}
+		}
+
+		if (Work.Seed || (int32)Scene.Occluders.size() > Scene.MaxRasterizedOccluders)
+		{
+			Stats.NumSkippedOccluders = SelectOccluders(Scene, View, Work.Seed, Work.SkipOccluder);
+		}
+		Stats.OccluderSeconds = SecondsSince(Start);
+	}
+
+	/** Sets up the triangles of a chunk, chunks of all views run in parallel */
+	static void ProcessSetupChunk(const FScene& Scene, const FViewWork& Work, FSetupChunk& Chunk, std::vector<uint8>& OccludeeVisible)
+	{
+		const FProfilerScope ProfilerScope(Chunk.bOccluders ? "SnowOcclusion_SetupOccluders" : "SnowOcclusion_SetupOccludees");
+		const FClock::time_point Start = FClock::now();
+		const FSceneView& View = Scene.Views[Chunk.ViewIdx];
+		if (Chunk.bOccluders)
+		{
+			Chunk.NumSetupTris = ProcessOccluderGeom(Scene, View, Work.SkipOccluder, Chunk.First, Chunk.End, Chunk.FrameData);
+		}
+		else
+		{
+			// Chunks touch the visibility of different occludees
+			ProcessOccludeeGeom(Scene, View, Chunk.First, Chunk.End, Chunk.FrameData, OccludeeVisible);
+		}
+		Chunk.Seconds = SecondsSince(Start);
+	}
+
+	/** Appends the triangles of a chunk to a view's lists, its bin lists keep their order */
+	static void MergeSetupChunk(const FFrameData& Chunk, FFrameData& OutData)
+	{
+		const int32 FirstTriangle = (int32)OutData.ScreenTriangles.size();
+		OutData.ScreenTriangles.insert(OutData.ScreenTriangles.end(), Chunk.ScreenTriangles.begin(), Chunk.ScreenTriangles.end());
+		OutData.ScreenTrianglesID.insert(OutData.ScreenTrianglesID.end(), Chunk.ScreenTrianglesID.begin(), Chunk.ScreenTrianglesID.end());
+		OutData.ScreenTrianglesFlags.insert(OutData.ScreenTrianglesFlags.end(), Chunk.ScreenTrianglesFlags.begin(), Chunk.ScreenTrianglesFlags.end());
+
+		for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
+		{
+			TArenaVector<FSortedIndexDepth>& BinTriangles = OutData.SortedTriangles[BinIdx];
+			for (const FSortedIndexDepth& Sorted : Chunk.SortedTriangles[BinIdx])
+			{
+				BinTriangles.push_back({ Sorted.Index + FirstTriangle, Sorted.Depth });
+			}
+		}
+	}
+
+	/** Merges the setup chunks of a view in order, and adds up their stats. Merging the bin lists counts as sorting. */
+	static void MergeSetupChunks(const FSetupChunk* Chunks, int32 NumChunks, FFrameData& OutData, FViewStats& Stats)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_MergeChunks");
+		const FClock::time_point Start = FClock::now();
+
+		int32 NumTriangles = 0;
+		int32 NumBinTriangles[BIN_NUM] = {};
+		for (int32 ChunkIdx = 0; ChunkIdx < NumChunks; ++ChunkIdx)
+		{
+			const FSetupChunk& Chunk = Chunks[ChunkIdx];
+			NumTriangles += (int32)Chunk.FrameData.ScreenTriangles.size();
+			for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
+			{
+				NumBinTriangles[BinIdx] += (int32)Chunk.FrameData.SortedTriangles[BinIdx].size();
+			}
+
+			// Chunk times are summed, they measure the work rather than the time it took with the chunks in parallel
+			if (Chunk.bOccluders)
+			{
+				Stats.NumOccluderSetupTris += Chunk.NumSetupTris;
+				Stats.OccluderSeconds += Chunk.Seconds;
+			}
+			else
+			{
+				Stats.OccludeeSeconds += Chunk.Seconds;
+			}
+		}
+
+		// Groups expanded while rasterizing add to the lists, leave them a little room
+		OutData.ScreenTriangles.reserve(NumTriangles + NumTriangles / 8);
+		OutData.ScreenTrianglesID.reserve(NumTriangles + NumTriangles / 8);
+		OutData.ScreenTrianglesFlags.reserve(NumTriangles + NumTriangles / 8);
+		for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
+		{
+			OutData.SortedTriangles[BinIdx].reserve(NumBinTriangles[BinIdx]);
+		}
+		for (int32 ChunkIdx = 0; ChunkIdx < NumChunks; ++ChunkIdx)
+		{
+			MergeSetupChunk(Chunks[ChunkIdx].FrameData, OutData);
+		}
+		Stats.SortSeconds = SecondsSince(Start);
+	}
+
+	/** Sorts the binned triangles of a view by depth and rasterizes them, testing the occludees on the way */
+	static void RasterizeOcclusionView(const FScene& Scene, int32 ViewIdx, FFrameData& FrameData, FViewResults& OutResults)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_Rasterize");
+		const FSceneView& View = Scene.Views[ViewIdx];
+		FViewStats& Stats = OutResults.Stats;
+		const FClock::time_point Start = FClock::now();
+		double SortSeconds = 0.0;
+
+		const uint8* MeshFlags = FrameData.ScreenTrianglesFlags.data();
+		const int32* TriangleOwnerIds = FrameData.ScreenTrianglesID.data();
+		const FScreenTriangle* Tris = FrameData.ScreenTriangles.data();
+
+		// Groups are expanded at most once, members of a group found visible in the current bin are merged in by depth
+		TArenaVector<uint8> GroupExpanded(Scene.OccludeeGroupFirstMember.size(), 0, FrameData.Arena);
+		TArenaVector<FSortedIndexDepth> PendingTriangles(FrameData.Arena);
+		auto DepthPredicate = [](const FSortedIndexDepth& A, const FSortedIndexDepth& B) {
+			// biggerZ (closer) first
+			return A.Depth > B.Depth;
+		};
+
+		for (int32 BinIdx = 0; BinIdx < BIN_NUM; ++BinIdx)
+		{
+			// Sort triangles in the bin by depth
+			const FClock::time_point SortStart = FClock::now();
+			TArenaVector<FSortedIndexDepth>& BinTriangles = FrameData.SortedTriangles[BinIdx];
+			std::sort(BinTriangles.begin(), BinTriangles.end(), DepthPredicate);
+			SortSeconds += SecondsSince(SortStart);
+
+			const FSortedIndexDepth* SortedTriIndices = BinTriangles.data();
+			const int32 NumTris = (int32)BinTriangles.size();
+			const int32 BinMinX = BinIdx * BIN_WIDTH;
+			FFramebufferBin& Bin = OutResults.Bins[BinIdx];
+			// TODO: add a way to check when bin is already fully rasterized, so we can skip this work
+
+			int32 TriIdx = 0;
+			while (TriIdx < NumTris || !PendingTriangles.empty())
+			{
+				int32 TriID;
+				float TriDepth;
+				if (!PendingTriangles.empty() && (TriIdx == NumTris || PendingTriangles.front().Depth > SortedTriIndices[TriIdx].Depth))
+				{
+					std::pop_heap(PendingTriangles.begin(), PendingTriangles.end(), PendingHeapPredicate);
+					const FSortedIndexDepth Pending = PendingTriangles.back();
+					PendingTriangles.pop_back();
+					TriID = Pending.Index;
+					TriDepth = Pending.Depth;
+				}
+				else
+				{
+					TriID = SortedTriIndices[TriIdx].Index;
+					TriDepth = SortedTriIndices[TriIdx].Depth;
+					TriIdx++;
+				}
+
+				uint8 Flags = MeshFlags[TriID];
+				const FScreenTriangle& Tri = Tris[TriID];
+
+				if (Flags == TRI_FLAG_OCCLUDER)
+				{
+					// rasterize occluder
+					RasterizeOccluderTri(Tri, Bin.Data, Bin.Type, BinMinX, &Bin.TileDepth[0][0], TriDepth);
+					Stats.NumRasterizedOccluderTris++;
+				}
+				else if (Flags == TRI_FLAG_OCCLUDEE_GROUP)
+				{
+					// rasterize group, a group fully occluded in this bin hides its members in this bin
+					const int32 GroupIdx = TriangleOwnerIds[TriID];
+					if (!GroupExpanded[GroupIdx] && RasterizeOccludeeQuad(Tri, Bin.Data, Bin.Type, BinMinX))
+					{
+						GroupExpanded[GroupIdx] = 1;
+						Stats.NumExpandedGroups++;
+						ExpandOccludeeGroup(Scene, View, GroupIdx, BinIdx, FrameData, PendingTriangles, OutResults.OccludeeVisible);
+
+						MeshFlags = FrameData.ScreenTrianglesFlags.data();
+						TriangleOwnerIds = FrameData.ScreenTrianglesID.data();
+						Tris = FrameData.ScreenTriangles.data();
+					}
+					Stats.NumRasterizedOccludeeTris++;
+				}
+				else
+				{
+					// rasterize occludee
+					const int32 OccludeeIdx = TriangleOwnerIds[TriID];
+					bool bVisible = RasterizeOccludeeQuad(Tri, Bin.Data, Bin.Type, BinMinX);
+					if (bVisible)
+					{
+						OutResults.OccludeeVisible[OccludeeIdx] = 1;
+					}
+					Stats.NumRasterizedOccludeeTris++;
+				}
+			}
+		}
+
+		Stats.SortSeconds += SortSeconds;
+		Stats.RasterizeSeconds = SecondsSince(Start) - SortSeconds;
+		Stats.NumTriangles = (int32)FrameData.ScreenTriangles.size();
+	}
+
+	void ProcessOcclusionView(const FScene& Scene, int32 ViewIdx, const FHistoryView* PrevHistory, FHistoryView* OutHistory, FViewResults& OutResults, FLinearArena* Arena)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_ProcessOcclusionView");
+		const FSceneView& View = Scene.Views[ViewIdx];
+		FViewStats& Stats = OutResults.Stats;
+
+		FLinearArena LocalArena;
+		FViewWork Work(Arena ? *Arena : LocalArena);
+		BeginOcclusionView(Scene, ViewIdx, PrevHistory, Work, OutResults);
+
+		const int32 NumTopLevelBoxes = GetNumTopLevelBoxes(Scene, View);
+		int32 NumExpectedTriangles = Scene.NumOccluderTriangles + Scene.NumOccludees() + (int32)Scene.OccludeeGroupFirstMember.size(); // one triangle for each occludee and group
+		Work.FrameData.ReserveBuffers(NumExpectedTriangles);
+
+		{
+			const FClock::time_point Start = FClock::now();
+			Stats.NumOccluderSetupTris = ProcessOccluderGeom(Scene, View, Work.SkipOccluder, 0, (int32)Scene.Occluders.size(), Work.FrameData);
+			Stats.OccluderSeconds += SecondsSince(Start);
+		}
+
+		{
+			const FClock::time_point Start = FClock::now();
+			// Generate screen quads from all collected occludee bboxes
+			ProcessOccludeeGeom(Scene, View, 0, NumTopLevelBoxes, Work.FrameData, OutResults.OccludeeVisible);
+			Stats.OccludeeSeconds = SecondsSince(Start);
+		}
+
+		RasterizeOcclusionView(Scene, ViewIdx, Work.FrameData, OutResults);
+
+		if (OutHistory)
+		{
+			StoreOcclusionHistory(View, OutResults, *OutHistory);
+		}
+	}
+
+	FProfilerHooks GProfilerHooks;
+
+	void SetProfilerHooks(const FProfilerHooks& Hooks)
+	{
+		GProfilerHooks = Hooks;
+	}
+
+	/** Runs Body for 0 to Num - 1, in parallel if there is a ParallelFor */
+	static void RunParallel(const FParallelFor& ParallelFor, int32 Num, const std::function<void(int32)>& Body)
+	{
+		if (ParallelFor && Num > 1)
+		{
+			ParallelFor(Num, Body);
+		}
+		else
+		{
+			for (int32 Index = 0; Index < Num; ++Index)
+			{
+				Body(Index);
+			}
+		}
+	}
+
+	void ProcessOcclusionFrame(const FScene& Scene, FHistory* History, FFrameResults& OutResults, const FParallelFor& ParallelFor, FFrameArena* Arena)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_ProcessOcclusionFrame");
+		const int32 NumViews = (int32)Scene.Views.size();
+		const int32 NumOccludees = Scene.NumOccludees();
+		const int32 NumOccluders = (int32)Scene.Occluders.size();
+		OutResults.Views.resize(NumViews);
+
+		// Views are matched with last frame's by index, a different set of views starts over
+		const bool bReprojection = History && Scene.bReprojection;
+		const bool bHasHistory = bReprojection && (int32)History->Views.size() == NumViews;
+		std::vector<FHistoryView> LocalHistory;
+		std::vector<FHistoryView>& NewHistory = History ? History->NextViews : LocalHistory;
+		NewHistory.resize(bReprojection ? NumViews : 0);
+
+		// Arena 0 holds the work of the frame, then one per view and one per setup chunk
+		FFrameArena LocalArena;
+		FFrameArena& FrameArena = Arena ? *Arena : LocalArena;
+		FrameArena.Reset();
+		FrameArena.Reserve(1 + NumViews);
+		FLinearArena& WorkArena = FrameArena.Get(0);
+
+		// The setup of the triangles is split in chunks of occluders and occludees, the chunks of all views run at the same time.
+		// Each writes its own triangle lists, a view merges the lists of its chunks in order before sorting and rasterizing,
+		// so the results don't depend on the chunking. Each stage waits for the previous one.
+		TArenaVector<FViewWork> Works(WorkArena);
+		Works.reserve(NumViews);
+		for (int32 ViewIdx = 0; ViewIdx < NumViews; ++ViewIdx)
+		{
+			Works.emplace_back(FrameArena.Get(1 + ViewIdx));
+		}
+
+		// Stage 1: pick the occluders of each view
+		RunParallel(ParallelFor, NumViews, [&Scene, &OutResults, &Works, History, bHasHistory](int32 ViewIdx)
+		{
+			const FSceneView& View = Scene.Views[ViewIdx];
+			const FHistoryView* PrevHistory = bHasHistory && History->Views[ViewIdx].bShadowView == View.bShadowView ? &History->Views[ViewIdx] : nullptr;
+			BeginOcclusionView(Scene, ViewIdx, PrevHistory, Works[ViewIdx], OutResults.Views[ViewIdx]);
+		});
+
+		// Chunks only pay off when they can run in parallel, otherwise each view sets up in one occluder and one occludee chunk
+		const int32 ChunkTriangles = ParallelFor ? OCCLUDER_CHUNK_TRIANGLES : INT32_MAX;
+		const int32 ChunkBoxes = ParallelFor ? RUN_SIZE : INT32_MAX;
+		struct FChunkRange
+		{
+			int32 ViewIdx;
+			bool bOccluders;
+			int32 First;
+			int32 End;
+		};
+		TArenaVector<FChunkRange> Ranges(WorkArena);
+		TArenaVector<int32> FirstViewChunk(WorkArena);
+		for (int32 ViewIdx = 0; ViewIdx < NumViews; ++ViewIdx)
+		{
+			FirstViewChunk.push_back((int32)Ranges.size());
+
+			const TArenaVector<uint8>& SkipOccluder = Works[ViewIdx].SkipOccluder;
+			int32 FirstMesh = 0;
+			int32 NumTris = 0;
+			for (int32 MeshIdx = 0; MeshIdx < NumOccluders; ++MeshIdx)
+			{
+				NumTris += !SkipOccluder.empty() && SkipOccluder[MeshIdx] ? 0 : Scene.Occluders[MeshIdx].NumIndices / 3;
+				if (NumTris >= ChunkTriangles || MeshIdx == NumOccluders - 1)
+				{
+					Ranges.push_back({ ViewIdx, true, FirstMesh, MeshIdx + 1 });
+					FirstMesh = MeshIdx + 1;
+					NumTris = 0;
+				}
+			}
+
+			const int32 NumBoxes = GetNumTopLevelBoxes(Scene, Scene.Views[ViewIdx]);
+			for (int32 FirstBox = 0; FirstBox < NumBoxes; FirstBox += std::min(NumBoxes - FirstBox, ChunkBoxes))
+			{
+				Ranges.push_back({ ViewIdx, false, FirstBox, FirstBox + std::min(NumBoxes - FirstBox, ChunkBoxes) });
+			}
+		}
+		FirstViewChunk.push_back((int32)Ranges.size());
+
+		const int32 NumChunks = (int32)Ranges.size();
+		FrameArena.Reserve(1 + NumViews + NumChunks);
+		TArenaVector<FSetupChunk> Chunks(WorkArena);
+		Chunks.reserve(NumChunks);
+		for (int32 ChunkIdx = 0; ChunkIdx < NumChunks; ++ChunkIdx)
+		{
+			const FChunkRange& Range = Ranges[ChunkIdx];
+			Chunks.emplace_back(FrameArena.Get(1 + NumViews + ChunkIdx), Range.ViewIdx, Range.bOccluders, Range.First, Range.End);
+		}
+
+		// Stage 2: transform and set up the occluders, project the occludees
+		RunParallel(ParallelFor, NumChunks, [&Scene, &OutResults, &Works, &Chunks](int32 ChunkIdx)
+		{
+			FSetupChunk& Chunk = Chunks[ChunkIdx];
+			int32 NumExpectedTriangles = Chunk.End - Chunk.First;
+			if (Chunk.bOccluders)
+			{
+				NumExpectedTriangles = 0;
+				for (int32 MeshIdx = Chunk.First; MeshIdx < Chunk.End; ++MeshIdx)
+				{
+					NumExpectedTriangles += Scene.Occluders[MeshIdx].NumIndices / 3;
+				}
+			}
+			Chunk.FrameData.ReserveBuffers(NumExpectedTriangles);
+			ProcessSetupChunk(Scene, Works[Chunk.ViewIdx], Chunk, OutResults.Views[Chunk.ViewIdx].OccludeeVisible);
+		});
+
+		// Stage 3: merge the chunks of each view, sort and rasterize
+		RunParallel(ParallelFor, NumViews, [&Scene, &OutResults, &Works, &Chunks, &FirstViewChunk, bReprojection, &NewHistory](int32 ViewIdx)
+		{
+			FViewResults& ViewResults = OutResults.Views[ViewIdx];
+			FFrameData& FrameData = Works[ViewIdx].FrameData;
+			MergeSetupChunks(Chunks.data() + FirstViewChunk[ViewIdx], FirstViewChunk[ViewIdx + 1] - FirstViewChunk[ViewIdx], FrameData, ViewResults.Stats);
+
+			RasterizeOcclusionView(Scene, ViewIdx, FrameData, ViewResults);
+
+			if (bReprojection)
+			{
+				StoreOcclusionHistory(Scene.Views[ViewIdx], ViewResults, NewHistory[ViewIdx]);
+			}
+		});
+
+		if (History)
+		{
+			History->Views.swap(History->NextViews);
+		}
+
+		const FProfilerScope CombineScope("SnowOcclusion_CombineViews");
+		// An occludee is visible if it is visible in any regular view
+		OutResults.OccludeeVisible.assign(NumOccludees, 0);
+		for (int32 ViewIdx = 0; ViewIdx < NumViews; ++ViewIdx)
+		{
+			if (!Scene.Views[ViewIdx].bShadowView)
+			{
+				const std::vector<uint8>& ViewVisible = OutResults.Views[ViewIdx].OccludeeVisible;
+				for (int32 OccludeeIdx = 0; OccludeeIdx < NumOccludees; ++OccludeeIdx)
+				{
+					OutResults.OccludeeVisible[OccludeeIdx] |= ViewVisible[OccludeeIdx];
+				}
+			}
+		}
+
+		// A shadow is needed if the caster is lit by a light (not hidden from it by occluders)
+		// and the volume its shadow sweeps along that light is visible, so it may land on a visible receiver.
+		// A light view only covers a window around the cameras, it knows nothing of the casters it doesn't hold.
+		const int32 NumShadowVolumes = (int32)Scene.ShadowVolumeCasterIdx.size();
+		OutResults.ShadowVolumeVisible.assign(NumShadowVolumes, 0);
+		for (int32 VolumeIdx = 0; VolumeIdx < NumShadowVolumes; ++VolumeIdx)
+		{
+			const int32 CasterIdx = Scene.ShadowVolumeCasterIdx[VolumeIdx];
+			const int32 LightViewIdx = Scene.ShadowVolumeViewIdx[VolumeIdx];
+			const FBox3 CasterBox = { Scene.OccludeeBoxMinMax[CasterIdx * 2], Scene.OccludeeBoxMinMax[CasterIdx * 2 + 1] };
+			const bool bLit = !IsBoxInsideView(Scene.Views[LightViewIdx], CasterBox) || OutResults.Views[LightViewIdx].OccludeeVisible[CasterIdx] != 0;
+			const bool bReachesVisible = OutResults.OccludeeVisible[Scene.NumPrimitiveOccludees + VolumeIdx] != 0;
+			OutResults.ShadowVolumeVisible[VolumeIdx] = bLit && bReachesVisible;
+		}
+	}
+
+	bool IsBoxVisibleInResults(const std::vector<FViewResults>& Views, const FBox3& Box, const FOrientedBox* OrientedBox, int32 MarginPixels, bool bUseSIMD)
+	{
+		for (const FViewResults& View : Views)
+		{
+			if (View.bShadowView)
+			{
+				continue;
+			}
+
+			const FMat4 WorldToFB = View.ViewProj * FramebufferMat;
+			alignas(16) int32 Quad[4];
+			float Depth;
+			int32 Clipped;
+			if (OrientedBox)
+			{
+				ProjectOccludeeBoxes(OrientedBox->BoxToWorld * WorldToFB, View.ClipW, &OrientedBox->Min, 1, bUseSIMD, Quad, &Depth, &Clipped);
+			}
+			else
+			{
+				ProjectOccludeeBoxes(WorldToFB, View.ClipW, &Box.Min, 1, bUseSIMD, Quad, &Depth, &Clipped);
+			}
+			WarpQuads(View.Foveation, Quad, 1);
+
+			if (Clipped != 0)
+			{
+				return true;
+			}
+
+			if (Quad[0] > Quad[2] || Quad[1] > Quad[3])
+			{
+				continue;
+			}
+
+			const int32 MinX = std::max(Quad[0] - MarginPixels, 0);
+			const int32 MinY = std::max(Quad[1] - MarginPixels, 0);
+			const int32 MaxX = std::min(Quad[2] + MarginPixels, FRAMEBUFFER_WIDTH - 1);
+			const int32 MaxY = std::min(Quad[3] + MarginPixels, FRAMEBUFFER_HEIGHT - 1);
+			if (IsQuadVisibleInBuffer(View, MinX, MinY, MaxX, MaxY, Depth))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+}
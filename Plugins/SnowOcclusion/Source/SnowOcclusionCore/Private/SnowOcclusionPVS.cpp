@@ -0,0 +1,520 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "SnowOcclusionPVS.h"
+#include "SnowOcclusionProfiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace SnowOcclusion
+{
+	namespace
+	{
+		const uint32 PVS_MAGIC = 0x53565053; // "SPVS"
+		const uint32 PVS_VERSION = 1;
+
+		// Sample points rasterized together, their cube views make up one frame of the core
+		const int32 PVS_BATCH_SAMPLES = 16;
+		const int32 PVS_CUBE_FACES = 6;
+
+		/** World to clip space of one face of a cube around Origin, a square 90 degree reversed Z perspective like MakeViewProjection */
+		FMat4 MakeCubeFaceViewProjection(const FVec3& Origin, int32 Face, float Near)
+		{
+			// Forward, right and up of each face, right handed like the regular views
+			static const FVec3 Axes[PVS_CUBE_FACES][3] = {
+				{ { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } },
+				{ { -1, 0, 0 }, { 0, -1, 0 }, { 0, 0, 1 } },
+				{ { 0, 1, 0 }, { -1, 0, 0 }, { 0, 0, 1 } },
+				{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },
+				{ { 0, 0, 1 }, { 0, 1, 0 }, { -1, 0, 0 } },
+				{ { 0, 0, -1 }, { 0, 1, 0 }, { 1, 0, 0 } },
+			};
+			const FVec3& Forward = Axes[Face][0];
+			const FVec3& Right = Axes[Face][1];
+			const FVec3& Up = Axes[Face][2];
+			auto Dot = [](const FVec3& A, const FVec3& B) { return A.X * B.X + A.Y * B.Y + A.Z * B.Z; };
+
+			FMat4 View = FMat4::Identity();
+			View.M[0][0] = Right.X; View.M[0][1] = Up.X; View.M[0][2] = Forward.X;
+			View.M[1][0] = Right.Y; View.M[1][1] = Up.Y; View.M[1][2] = Forward.Y;
+			View.M[2][0] = Right.Z; View.M[2][1] = Up.Z; View.M[2][2] = Forward.Z;
+			View.M[3][0] = -Dot(Origin, Right); View.M[3][1] = -Dot(Origin, Up); View.M[3][2] = -Dot(Origin, Forward);
+
+			// The buffer isn't square, its pixels are stretched so each face covers exactly its side of the cube
+			FMat4 Projection = {};
+			Projection.M[0][0] = 1.0f;
+			Projection.M[1][1] = 1.0f;
+			Projection.M[2][3] = 1.0f;
+			Projection.M[3][2] = Near;
+			return View * Projection;
+		}
+
+		/**
+		 * Whether part of the box is inside the frustum of a perspective view, in front of its near plane. The core finds boxes
+		 * crossing the near plane visible, behind the eye included, so each face only says what is in front of it.
+		 */
+		bool IsBoxInFrustum(const FMat4& ViewProj, float ClipW, const FVec3& Min, const FVec3& Max)
+		{
+			// Clip space X, Y and W of a world position are dot products with the columns of the matrix
+			auto GetColumn = [&ViewProj](int32 Column, float* Out) { for (int32 Row = 0; Row < 4; ++Row) { Out[Row] = ViewProj.M[Row][Column]; } };
+			float X[4], Y[4], W[4];
+			GetColumn(0, X);
+			GetColumn(1, Y);
+			GetColumn(3, W);
+
+			// W - X, W + X, W - Y, W + Y and W - ClipW are all positive inside, the box is out if one is negative at its farthest corner
+			const float Sign[5][2] = { { -1.0f, 0.0f }, { 1.0f, 0.0f }, { 0.0f, -1.0f }, { 0.0f, 1.0f }, { 0.0f, 0.0f } };
+			for (int32 Plane = 0; Plane < 5; ++Plane)
+			{
+				float Coefs[4];
+				for (int32 Idx = 0; Idx < 4; ++Idx)
+				{
+					Coefs[Idx] = W[Idx] + Sign[Plane][0] * X[Idx] + Sign[Plane][1] * Y[Idx];
+				}
+				const float Farthest = std::max(Coefs[0] * Min.X, Coefs[0] * Max.X) + std::max(Coefs[1] * Min.Y, Coefs[1] * Max.Y)
+					+ std::max(Coefs[2] * Min.Z, Coefs[2] * Max.Z) + Coefs[3] - (Plane == 4 ? ClipW : 0.0f);
+				if (Farthest < 0.0f)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void WriteVarInt(std::vector<uint8>& Out, uint32 Value)
+		{
+			while (Value >= 0x80)
+			{
+				Out.push_back((uint8)(Value | 0x80));
+				Value >>= 7;
+			}
+			Out.push_back((uint8)Value);
+		}
+
+		uint32 ReadVarInt(const uint8*& Pos, const uint8* End)
+		{
+			uint32 Value = 0;
+			for (int32 Shift = 0; Pos < End && Shift < 32; Shift += 7)
+			{
+				const uint8 Byte = *Pos++;
+				Value |= (uint32)(Byte & 0x7f) << Shift;
+				if (!(Byte & 0x80))
+				{
+					break;
+				}
+			}
+			return Value;
+		}
+
+		/** Appends the runs of a bitset of NumBits primitives, hidden first */
+		void EncodeSet(const std::vector<uint64>& Bits, int32 NumBits, std::vector<uint8>& Out)
+		{
+			bool bVisibleRun = false;
+			int32 RunStart = 0;
+			for (int32 Bit = 0; Bit <= NumBits; ++Bit)
+			{
+				const bool bVisible = Bit < NumBits && ((Bits[Bit >> 6] >> (Bit & 63)) & 1);
+				if (Bit == NumBits || bVisible != bVisibleRun)
+				{
+					WriteVarInt(Out, (uint32)(Bit - RunStart));
+					bVisibleRun = bVisible;
+					RunStart = Bit;
+				}
+			}
+		}
+
+		uint64 HashBytes(const uint8* Data, size_t Size)
+		{
+			// FNV-1a
+			uint64 Hash = 0xcbf29ce484222325ull;
+			for (size_t Idx = 0; Idx < Size; ++Idx)
+			{
+				Hash = (Hash ^ Data[Idx]) * 0x100000001b3ull;
+			}
+			return Hash;
+		}
+
+		struct FByteReader
+		{
+			const uint8* Pos;
+			const uint8* End;
+
+			template<typename T>
+			bool Read(T& Value)
+			{
+				if ((size_t)(End - Pos) < sizeof(T))
+				{
+					return false;
+				}
+				std::memcpy(&Value, Pos, sizeof(T));
+				Pos += sizeof(T);
+				return true;
+			}
+
+			template<typename T>
+			bool ReadVector(std::vector<T>& Values)
+			{
+				int32 Num = 0;
+				if (!Read(Num) || Num < 0 || (size_t)(End - Pos) / sizeof(T) < (size_t)Num)
+				{
+					return false;
+				}
+				Values.resize(Num);
+				// Empty vectors have no storage to copy into
+				if (Num > 0)
+				{
+					std::memcpy(Values.data(), Pos, Num * sizeof(T));
+					Pos += Num * sizeof(T);
+				}
+				return true;
+			}
+		};
+
+		template<typename T>
+		void WriteValue(std::vector<uint8>& Out, const T& Value)
+		{
+			const uint8* Bytes = (const uint8*)&Value;
+			Out.insert(Out.end(), Bytes, Bytes + sizeof(T));
+		}
+
+		template<typename T>
+		void WriteVector(std::vector<uint8>& Out, const std::vector<T>& Values)
+		{
+			WriteValue(Out, (int32)Values.size());
+			const uint8* Bytes = (const uint8*)Values.data();
+			Out.insert(Out.end(), Bytes, Bytes + Values.size() * sizeof(T));
+		}
+	}
+
+	bool FPVS::FindSets(const FBox3& ViewerBounds, std::vector<int32>& OutSets) const
+	{
+		OutSets.clear();
+		if (IsEmpty())
+		{
+			return false;
+		}
+
+		const float Min[3] = { ViewerBounds.Min.X - Origin.X, ViewerBounds.Min.Y - Origin.Y, ViewerBounds.Min.Z - Origin.Z };
+		const float Max[3] = { ViewerBounds.Max.X - Origin.X, ViewerBounds.Max.Y - Origin.Y, ViewerBounds.Max.Z - Origin.Z };
+		int32 CellMin[3], CellMax[3];
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			if (Min[Axis] < 0.0f || Max[Axis] >= GridSize[Axis] * CellSize)
+			{
+				return false;
+			}
+			CellMin[Axis] = std::min((int32)(Min[Axis] / CellSize), GridSize[Axis] - 1);
+			CellMax[Axis] = std::min((int32)(Max[Axis] / CellSize), GridSize[Axis] - 1);
+		}
+
+		for (int32 Z = CellMin[2]; Z <= CellMax[2]; ++Z)
+		{
+			for (int32 Y = CellMin[1]; Y <= CellMax[1]; ++Y)
+			{
+				for (int32 X = CellMin[0]; X <= CellMax[0]; ++X)
+				{
+					const int32 Set = CellSets[((size_t)Z * GridSize[1] + Y) * GridSize[0] + X];
+					if (Set == PVS_NO_SET)
+					{
+						return false;
+					}
+					if (std::find(OutSets.begin(), OutSets.end(), Set) == OutSets.end())
+					{
+						OutSets.push_back(Set);
+					}
+				}
+			}
+		}
+		return true;
+	}
+
+	void FPVS::AddSetVisible(int32 SetIdx, uint8* InOutVisible) const
+	{
+		const uint8* Pos = SetData.data() + SetFirstByte[SetIdx];
+		const uint8* End = SetData.data() + SetFirstByte[SetIdx + 1];
+		int32 Primitive = 0;
+		while (Pos < End)
+		{
+			Primitive += (int32)ReadVarInt(Pos, End);
+			if (Pos >= End)
+			{
+				break;
+			}
+			const int32 RunEnd = std::min(Primitive + (int32)ReadVarInt(Pos, End), NumPrimitives);
+			for (; Primitive < RunEnd; ++Primitive)
+			{
+				InOutVisible[Primitive] = 1;
+			}
+		}
+	}
+
+	void FPVS::Serialize(std::vector<uint8>& OutBytes) const
+	{
+		OutBytes.clear();
+		WriteValue(OutBytes, PVS_MAGIC);
+		WriteValue(OutBytes, PVS_VERSION);
+		WriteValue(OutBytes, Origin);
+		WriteValue(OutBytes, CellSize);
+		WriteValue(OutBytes, GridSize);
+		WriteValue(OutBytes, NumPrimitives);
+		WriteVector(OutBytes, CellSets);
+		WriteVector(OutBytes, SetFirstByte);
+		WriteVector(OutBytes, SetData);
+	}
+
+	bool FPVS::Deserialize(const uint8* Bytes, size_t Size)
+	{
+		*this = FPVS();
+		FByteReader Reader = { Bytes, Bytes + Size };
+		uint32 Magic = 0, Version = 0;
+		FPVS Read;
+		const bool bOk = Reader.Read(Magic) && Magic == PVS_MAGIC && Reader.Read(Version) && Version == PVS_VERSION
+			&& Reader.Read(Read.Origin) && Reader.Read(Read.CellSize) && Reader.Read(Read.GridSize) && Reader.Read(Read.NumPrimitives)
+			&& Reader.ReadVector(Read.CellSets) && Reader.ReadVector(Read.SetFirstByte) && Reader.ReadVector(Read.SetData);
+		if (!bOk || Read.CellSize <= 0.0f
+			|| (size_t)Read.GridSize[0] * Read.GridSize[1] * Read.GridSize[2] != Read.CellSets.size()
+			|| (!Read.SetFirstByte.empty() && Read.SetFirstByte.back() != Read.SetData.size()))
+		{
+			return false;
+		}
+		// Every set is a range of the run data, a corrupt offset would silently decode an empty set
+		for (size_t SetIdx = 1; SetIdx < Read.SetFirstByte.size(); ++SetIdx)
+		{
+			if (Read.SetFirstByte[SetIdx] < Read.SetFirstByte[SetIdx - 1])
+			{
+				return false;
+			}
+		}
+		if (!Read.SetFirstByte.empty() && Read.SetFirstByte[0] != 0)
+		{
+			return false;
+		}
+		for (int32 Set : Read.CellSets)
+		{
+			if (Set != PVS_NO_SET && (Set < 0 || Set >= Read.NumSets()))
+			{
+				return false;
+			}
+		}
+		*this = std::move(Read);
+		return true;
+	}
+
+	void BakePVS(const std::vector<FOccluderMesh>& Occluders, const FVec3* BoxMinMax, int32 NumBoxes, const FBox3& Bounds,
+		const FPVSBakeSettings& Settings, const FPVSCellFilter& IsCellUsed, FPVS& Out, FPVSBakeStats* OutStats, const FParallelFor& ParallelFor)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_BakePVS");
+		const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+
+		// Cells grow for bounds too big for the grid
+		const float Extent[3] = { Bounds.Max.X - Bounds.Min.X, Bounds.Max.Y - Bounds.Min.Y, Bounds.Max.Z - Bounds.Min.Z };
+		float CellSize = std::max(Settings.CellSize, 1.0f);
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			CellSize = std::max(CellSize, Extent[Axis] / MAX_PVS_GRID_SIZE);
+		}
+
+		Out = FPVS();
+		Out.Origin = Bounds.Min;
+		Out.CellSize = CellSize;
+		Out.NumPrimitives = NumBoxes;
+		for (int32 Axis = 0; Axis < 3; ++Axis)
+		{
+			Out.GridSize[Axis] = std::min(std::max((int32)std::ceil(Extent[Axis] / CellSize), 1), MAX_PVS_GRID_SIZE);
+		}
+		const int32* GridSize = Out.GridSize;
+		const size_t NumCells = (size_t)GridSize[0] * GridSize[1] * GridSize[2];
+		Out.CellSets.assign(NumCells, PVS_NO_SET);
+
+		// Sample points form a lattice over the grid, the ones on the sides of a cell are shared with its neighbours
+		const int32 Steps = std::max(Settings.SamplesPerEdge, 2) - 1;
+		const int32 LatticeSize[3] = { GridSize[0] * Steps + 1, GridSize[1] * Steps + 1, GridSize[2] * Steps + 1 };
+		const float SampleSpacing = CellSize / Steps;
+		auto GetCellBox = [&Out, CellSize](int32 X, int32 Y, int32 Z) -> FBox3
+		{
+			const FVec3 Min = { Out.Origin.X + X * CellSize, Out.Origin.Y + Y * CellSize, Out.Origin.Z + Z * CellSize };
+			return { Min, { Min.X + CellSize, Min.Y + CellSize, Min.Z + CellSize } };
+		};
+		auto GetLatticeIdx = [&LatticeSize](int32 X, int32 Y, int32 Z) { return ((size_t)Z * LatticeSize[1] + Y) * LatticeSize[0] + X; };
+
+		std::vector<uint8> CellUsed(NumCells, 0);
+		std::vector<int32> SampleOfLattice((size_t)LatticeSize[0] * LatticeSize[1] * LatticeSize[2], -1);
+		std::vector<FVec3> Samples;
+		for (int32 Z = 0; Z < GridSize[2]; ++Z)
+		{
+			for (int32 Y = 0; Y < GridSize[1]; ++Y)
+			{
+				for (int32 X = 0; X < GridSize[0]; ++X)
+				{
+					const size_t CellIdx = ((size_t)Z * GridSize[1] + Y) * GridSize[0] + X;
+					if (IsCellUsed && !IsCellUsed(GetCellBox(X, Y, Z)))
+					{
+						continue;
+					}
+					CellUsed[CellIdx] = 1;
+					for (int32 SZ = Z * Steps; SZ <= (Z + 1) * Steps; ++SZ)
+					{
+						for (int32 SY = Y * Steps; SY <= (Y + 1) * Steps; ++SY)
+						{
+							for (int32 SX = X * Steps; SX <= (X + 1) * Steps; ++SX)
+							{
+								int32& Sample = SampleOfLattice[GetLatticeIdx(SX, SY, SZ)];
+								if (Sample < 0)
+								{
+									Sample = (int32)Samples.size();
+									Samples.push_back({ Out.Origin.X + SX * SampleSpacing, Out.Origin.Y + SY * SampleSpacing, Out.Origin.Z + SZ * SampleSpacing });
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+
+		// The core rasterizes the occluders and tests the grown boxes, every occluder in every view
+		FScene Scene;
+		Scene.Occluders = Occluders;
+		for (const FOccluderMesh& Occluder : Occluders)
+		{
+			Scene.NumOccluderTriangles += Occluder.NumIndices / 3;
+		}
+		Scene.bUseSIMD = Settings.bUseSIMD;
+		const float Margin = std::max(Settings.BoxMargin, 0.0f);
+		for (int32 BoxIdx = 0; BoxIdx < NumBoxes; ++BoxIdx)
+		{
+			const FVec3& Min = BoxMinMax[BoxIdx * 2];
+			const FVec3& Max = BoxMinMax[BoxIdx * 2 + 1];
+			Scene.AddOccludee({ { Min.X - Margin, Min.Y - Margin, Min.Z - Margin }, { Max.X + Margin, Max.Y + Margin, Max.Z + Margin } });
+		}
+		Scene.NumPrimitiveOccludees = NumBoxes;
+		BuildOccludeeGroups(Scene, Settings.GroupCellSize, 4);
+
+		// What each sample point sees, a bit per primitive
+		const size_t NumWords = ((size_t)NumBoxes + 63) / 64;
+		std::vector<uint64> SampleBits(Samples.size() * NumWords, 0);
+		FFrameResults Results;
+		FFrameArena Arena;
+		for (size_t FirstSample = 0; FirstSample < Samples.size(); FirstSample += PVS_BATCH_SAMPLES)
+		{
+			const int32 NumBatchSamples = (int32)std::min(Samples.size() - FirstSample, (size_t)PVS_BATCH_SAMPLES);
+			Scene.Views.resize(NumBatchSamples * PVS_CUBE_FACES);
+			for (int32 ViewIdx = 0; ViewIdx < (int32)Scene.Views.size(); ++ViewIdx)
+			{
+				FSceneView& View = Scene.Views[ViewIdx];
+				View.ViewProj = MakeCubeFaceViewProjection(Samples[FirstSample + ViewIdx / PVS_CUBE_FACES], ViewIdx % PVS_CUBE_FACES, Settings.Near);
+				View.ClipW = ComputeClipW(View.ViewProj, false);
+			}
+
+			Results.Reset((int32)Scene.Views.size());
+			ProcessOcclusionFrame(Scene, nullptr, Results, ParallelFor, &Arena);
+
+			const std::function<void(int32)> AddSampleVisible = [&](int32 BatchSample)
+			{
+				uint64* Bits = SampleBits.data() + (FirstSample + BatchSample) * NumWords;
+				for (int32 ViewIdx = BatchSample * PVS_CUBE_FACES; ViewIdx < (BatchSample + 1) * PVS_CUBE_FACES; ++ViewIdx)
+				{
+					const FSceneView& View = Scene.Views[ViewIdx];
+					const std::vector<uint8>& Visible = Results.Views[ViewIdx].OccludeeVisible;
+					for (int32 BoxIdx = 0; BoxIdx < NumBoxes; ++BoxIdx)
+					{
+						if (Visible[BoxIdx] && !((Bits[BoxIdx >> 6] >> (BoxIdx & 63)) & 1)
+							&& IsBoxInFrustum(View.ViewProj, View.ClipW, Scene.OccludeeBoxMinMax[BoxIdx * 2], Scene.OccludeeBoxMinMax[BoxIdx * 2 + 1]))
+						{
+							Bits[BoxIdx >> 6] |= 1ull << (BoxIdx & 63);
+						}
+					}
+				}
+			};
+			if (ParallelFor)
+			{
+				ParallelFor(NumBatchSamples, AddSampleVisible);
+			}
+			else
+			{
+				for (int32 BatchSample = 0; BatchSample < NumBatchSamples; ++BatchSample)
+				{
+					AddSampleVisible(BatchSample);
+				}
+			}
+		}
+
+		// A cell sees what its sample points see. Cells seeing the same share their set.
+		std::unordered_map<uint64, std::vector<int32>> SetsByHash;
+		std::vector<uint64> CellBits(NumWords);
+		std::vector<uint8> Encoded;
+		FPVSBakeStats Stats;
+		Out.SetFirstByte.push_back(0);
+		for (int32 Z = 0; Z < GridSize[2]; ++Z)
+		{
+			for (int32 Y = 0; Y < GridSize[1]; ++Y)
+			{
+				for (int32 X = 0; X < GridSize[0]; ++X)
+				{
+					const size_t CellIdx = ((size_t)Z * GridSize[1] + Y) * GridSize[0] + X;
+					if (!CellUsed[CellIdx])
+					{
+						continue;
+					}
+
+					std::fill(CellBits.begin(), CellBits.end(), 0);
+					for (int32 SZ = Z * Steps; SZ <= (Z + 1) * Steps; ++SZ)
+					{
+						for (int32 SY = Y * Steps; SY <= (Y + 1) * Steps; ++SY)
+						{
+							for (int32 SX = X * Steps; SX <= (X + 1) * Steps; ++SX)
+							{
+								const uint64* Bits = SampleBits.data() + SampleOfLattice[GetLatticeIdx(SX, SY, SZ)] * NumWords;
+								for (size_t Word = 0; Word < NumWords; ++Word)
+								{
+									CellBits[Word] |= Bits[Word];
+								}
+							}
+						}
+					}
+					for (uint64 Word : CellBits)
+					{
+						for (; Word != 0; Word &= Word - 1)
+						{
+							Stats.NumVisible++;
+						}
+					}
+
+					Encoded.clear();
+					EncodeSet(CellBits, NumBoxes, Encoded);
+					std::vector<int32>& SameHash = SetsByHash[HashBytes(Encoded.data(), Encoded.size())];
+					int32 Set = PVS_NO_SET;
+					for (int32 Candidate : SameHash)
+					{
+						const uint32 First = Out.SetFirstByte[Candidate];
+						if (Out.SetFirstByte[Candidate + 1] - First == Encoded.size() && std::equal(Encoded.begin(), Encoded.end(), Out.SetData.begin() + First))
+						{
+							Set = Candidate;
+							break;
+						}
+					}
+					if (Set == PVS_NO_SET)
+					{
+						Set = Out.NumSets();
+						SameHash.push_back(Set);
+						Out.SetData.insert(Out.SetData.end(), Encoded.begin(), Encoded.end());
+						Out.SetFirstByte.push_back((uint32)Out.SetData.size());
+					}
+					Out.CellSets[CellIdx] = Set;
+					Stats.NumBakedCells++;
+				}
+			}
+		}
+
+		if (OutStats)
+		{
+			Stats.NumCells = (int32)NumCells;
+			Stats.NumSamples = (int32)Samples.size();
+			Stats.NumSets = Out.NumSets();
+			Stats.NumBytes = Out.SetData.size() + Out.SetFirstByte.size() * sizeof(uint32) + Out.CellSets.size() * sizeof(int32);
+			Stats.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+			*OutStats = Stats;
+		}
+	}
+}
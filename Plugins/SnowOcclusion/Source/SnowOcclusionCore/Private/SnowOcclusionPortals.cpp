@@ -0,0 +1,396 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "SnowOcclusionPortals.h"
+#include "SnowOcclusionProfiler.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace SnowOcclusion
+{
+	namespace
+	{
+		// Clip W below which a point counts as on or behind the eye
+		const float PORTAL_NEAR_W = 1e-3f;
+
+		bool Overlaps(const FBox3& A, const FBox3& B)
+		{
+			return A.Min.X <= B.Max.X && A.Max.X >= B.Min.X
+				&& A.Min.Y <= B.Max.Y && A.Max.Y >= B.Min.Y
+				&& A.Min.Z <= B.Max.Z && A.Max.Z >= B.Min.Z;
+		}
+
+		bool Contains(const FBox3& Box, const FVec3& Point)
+		{
+			return Point.X >= Box.Min.X && Point.X <= Box.Max.X
+				&& Point.Y >= Box.Min.Y && Point.Y <= Box.Max.Y
+				&& Point.Z >= Box.Min.Z && Point.Z <= Box.Max.Z;
+		}
+
+		bool Contains(const FPortalRect& Outer, const FPortalRect& Inner)
+		{
+			return !Outer.IsEmpty() && Inner.MinX >= Outer.MinX && Inner.MaxX <= Outer.MaxX && Inner.MinY >= Outer.MinY && Inner.MaxY <= Outer.MaxY;
+		}
+
+		FPortalRect Intersect(const FPortalRect& A, const FPortalRect& B)
+		{
+			return { std::max(A.MinX, B.MinX), std::max(A.MinY, B.MinY), std::min(A.MaxX, B.MaxX), std::min(A.MaxY, B.MaxY) };
+		}
+
+		FPortalRect Union(const FPortalRect& A, const FPortalRect& B)
+		{
+			if (A.IsEmpty())
+			{
+				return B;
+			}
+			return { std::min(A.MinX, B.MinX), std::min(A.MinY, B.MinY), std::max(A.MaxX, B.MaxX), std::max(A.MaxY, B.MaxY) };
+		}
+
+		/** Screen rectangle of clip space points, not clipped to the screen. The full screen if some are behind the eye, empty if all are. */
+		FPortalRect ProjectClipPoints(const FVec4* Points, int32 NumPoints)
+		{
+			FPortalRect Rect = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+			int32 NumBehind = 0;
+			for (int32 PointIdx = 0; PointIdx < NumPoints; ++PointIdx)
+			{
+				const FVec4& Clip = Points[PointIdx];
+				if (Clip.W <= PORTAL_NEAR_W)
+				{
+					NumBehind++;
+					continue;
+				}
+
+				const float InvW = 1.0f / Clip.W;
+				Rect.MinX = std::min(Rect.MinX, Clip.X * InvW);
+				Rect.MinY = std::min(Rect.MinY, Clip.Y * InvW);
+				Rect.MaxX = std::max(Rect.MaxX, Clip.X * InvW);
+				Rect.MaxY = std::max(Rect.MaxY, Clip.Y * InvW);
+			}
+
+			if (NumBehind == NumPoints)
+			{
+				return FPortalRect();
+			}
+			if (NumBehind > 0)
+			{
+				// Crosses the eye plane, its projection wraps around: anything on screen may be seen through it
+				return FPortalRect::Full();
+			}
+			return Rect;
+		}
+
+		FPortalRect ProjectPortal(const FMat4& ViewProj, const FPortal& Portal)
+		{
+			FVec4 Clip[4];
+			for (int32 CornerIdx = 0; CornerIdx < 4; ++CornerIdx)
+			{
+				Clip[CornerIdx] = ViewProj.TransformVec4({ Portal.Corners[CornerIdx].X, Portal.Corners[CornerIdx].Y, Portal.Corners[CornerIdx].Z, 1.0f });
+			}
+			return ProjectClipPoints(Clip, 4);
+		}
+
+		/** Clip space column of ViewProj, dotted with a world position and 1 */
+		FVec4 GetClipColumn(const FMat4& ViewProj, int32 Column)
+		{
+			return { ViewProj.M[0][Column], ViewProj.M[1][Column], ViewProj.M[2][Column], ViewProj.M[3][Column] };
+		}
+
+		/** Largest value of the plane over the box, at the corner furthest along its normal */
+		float GetMaxOverBox(const FVec4& Plane, const FBox3& Box)
+		{
+			return (Plane.X > 0.0f ? Box.Max.X : Box.Min.X) * Plane.X + (Plane.Y > 0.0f ? Box.Max.Y : Box.Min.Y) * Plane.Y + (Plane.Z > 0.0f ? Box.Max.Z : Box.Min.Z) * Plane.Z + Plane.W;
+		}
+
+		/** Range of grid squares Box touches, false if it is outside the grid */
+		bool GetGridRange(const FPortalGraph& Graph, const FBox3& Box, int32 OutMin[2], int32 OutMax[2])
+		{
+			if (Graph.GridFirstCell.empty() || !Overlaps(Graph.CellBounds, Box))
+			{
+				return false;
+			}
+
+			const float BoxMin[2] = { Box.Min.X - Graph.CellBounds.Min.X, Box.Min.Y - Graph.CellBounds.Min.Y };
+			const float BoxMax[2] = { Box.Max.X - Graph.CellBounds.Min.X, Box.Max.Y - Graph.CellBounds.Min.Y };
+			for (int32 Axis = 0; Axis < 2; ++Axis)
+			{
+				OutMin[Axis] = std::min(std::max((int32)(BoxMin[Axis] * Graph.GridSquaresPerUnit[Axis]), 0), Graph.GridSize[Axis] - 1);
+				OutMax[Axis] = std::min(std::max((int32)(BoxMax[Axis] * Graph.GridSquaresPerUnit[Axis]), 0), Graph.GridSize[Axis] - 1);
+			}
+			return true;
+		}
+
+		struct FPortalStep
+		{
+			int32 Cell;
+			FPortalRect Rect;
+			int32 Depth;
+		};
+
+		/** Box visibility through the portals in one view, planes instead of the projected box: no division */
+		struct FPortalBoxTest
+		{
+			const FPortalGraph& Graph;
+			const FPortalVisibility& Visibility;
+			FVec4 ClipX;
+			FVec4 ClipY;
+			FVec4 ClipW;
+			// Planes through the edges of the screen and the near plane, positive inside
+			FVec4 ScreenPlanes[5];
+
+			FPortalBoxTest(const FPortalGraph& InGraph, const FPortalVisibility& InVisibility, const FMat4& ViewProj)
+				: Graph(InGraph)
+				, Visibility(InVisibility)
+				, ClipX(GetClipColumn(ViewProj, 0))
+				, ClipY(GetClipColumn(ViewProj, 1))
+				, ClipW(GetClipColumn(ViewProj, 3))
+			{
+				ScreenPlanes[0] = ClipX + ClipW;
+				ScreenPlanes[1] = ClipW - ClipX;
+				ScreenPlanes[2] = ClipY + ClipW;
+				ScreenPlanes[3] = ClipW - ClipY;
+				ScreenPlanes[4] = ClipW - FVec4{ 0.0f, 0.0f, 0.0f, PORTAL_NEAR_W };
+			}
+
+			/** Whether a box in front of the eye may be seen in the screen rectangle, tested against the four planes from the eye through its edges */
+			bool IsInRect(const FPortalRect& Rect, const FBox3& Box) const
+			{
+				return !Rect.IsEmpty()
+					&& GetMaxOverBox(ClipX - ClipW * Rect.MinX, Box) >= 0.0f
+					&& GetMaxOverBox(ClipW * Rect.MaxX - ClipX, Box) >= 0.0f
+					&& GetMaxOverBox(ClipY - ClipW * Rect.MinY, Box) >= 0.0f
+					&& GetMaxOverBox(ClipW * Rect.MaxY - ClipY, Box) >= 0.0f;
+			}
+
+			bool IsVisible(const FBox3& Box) const
+			{
+				// Like the rasterizer, leaves what is off screen to the frustum culling and keeps what crosses the near plane
+				if (-GetMaxOverBox(ScreenPlanes[4] * -1.0f, Box) <= 0.0f)
+				{
+					return true;
+				}
+				for (int32 PlaneIdx = 0; PlaneIdx < 4; ++PlaneIdx)
+				{
+					if (GetMaxOverBox(ScreenPlanes[PlaneIdx], Box) < 0.0f)
+					{
+						return true;
+					}
+				}
+
+				// Cells over several squares are tested again, it changes nothing
+				bool bInsideCell = false;
+				int32 Min[2], Max[2];
+				if (GetGridRange(Graph, Box, Min, Max))
+				{
+					for (int32 Y = Min[1]; Y <= Max[1]; ++Y)
+					{
+						for (int32 X = Min[0]; X <= Max[0]; ++X)
+						{
+							const int32 Square = Y * Graph.GridSize[0] + X;
+							for (int32 GridIdx = Graph.GridFirstCell[Square]; GridIdx < Graph.GridFirstCell[Square + 1]; ++GridIdx)
+							{
+								const int32 CellIdx = Graph.GridCells[GridIdx];
+								const FBox3& Cell = Graph.Cells[CellIdx];
+								if (!Overlaps(Cell, Box))
+								{
+									continue;
+								}
+								if (IsInRect(Visibility.CellRects[CellIdx], Box))
+								{
+									return true;
+								}
+								bInsideCell |= Contains(Cell, Box.Min) && Contains(Cell, Box.Max);
+							}
+						}
+					}
+				}
+
+				// Not inside a single cell, part of it may be out of them and seen from the exterior
+				return !bInsideCell && IsInRect(Visibility.ExteriorRect, Box);
+			}
+		};
+	}
+
+	void FPortalGraph::LinkPortals()
+	{
+		const int32 NumCells = (int32)Cells.size();
+		CellFirstPortal.assign(NumCells + 1, 0);
+		ExteriorPortals.clear();
+		for (const FPortal& Portal : Portals)
+		{
+			for (int32 Cell : Portal.Cells)
+			{
+				if (Cell >= 0 && Cell < NumCells)
+				{
+					CellFirstPortal[Cell + 1]++;
+				}
+			}
+		}
+		for (int32 CellIdx = 0; CellIdx < NumCells; ++CellIdx)
+		{
+			CellFirstPortal[CellIdx + 1] += CellFirstPortal[CellIdx];
+		}
+
+		CellPortals.resize(CellFirstPortal[NumCells]);
+		std::vector<int32> Next(CellFirstPortal.begin(), CellFirstPortal.end() - 1);
+		for (int32 PortalIdx = 0; PortalIdx < (int32)Portals.size(); ++PortalIdx)
+		{
+			for (int32 Cell : Portals[PortalIdx].Cells)
+			{
+				if (Cell >= 0 && Cell < NumCells)
+				{
+					CellPortals[Next[Cell]++] = PortalIdx;
+				}
+				else
+				{
+					ExteriorPortals.push_back(PortalIdx);
+				}
+			}
+		}
+
+		// About one square per cell, sized like the average cell
+		GridCells.clear();
+		GridFirstCell.clear();
+		if (Cells.empty())
+		{
+			GridSize[0] = GridSize[1] = 0;
+			return;
+		}
+		CellBounds = Cells[0];
+		float AverageSize[2] = { 0.0f, 0.0f };
+		for (const FBox3& Cell : Cells)
+		{
+			CellBounds.Min = { std::min(CellBounds.Min.X, Cell.Min.X), std::min(CellBounds.Min.Y, Cell.Min.Y), std::min(CellBounds.Min.Z, Cell.Min.Z) };
+			CellBounds.Max = { std::max(CellBounds.Max.X, Cell.Max.X), std::max(CellBounds.Max.Y, Cell.Max.Y), std::max(CellBounds.Max.Z, Cell.Max.Z) };
+			AverageSize[0] += (Cell.Max.X - Cell.Min.X) / NumCells;
+			AverageSize[1] += (Cell.Max.Y - Cell.Min.Y) / NumCells;
+		}
+		const float BoundsSize[2] = { CellBounds.Max.X - CellBounds.Min.X, CellBounds.Max.Y - CellBounds.Min.Y };
+		for (int32 Axis = 0; Axis < 2; ++Axis)
+		{
+			const float Squares = AverageSize[Axis] > 0.0f ? std::ceil(BoundsSize[Axis] / AverageSize[Axis]) : 1.0f;
+			GridSize[Axis] = (int32)std::min(std::max(Squares, 1.0f), (float)MAX_PORTAL_GRID_SIZE);
+			GridSquaresPerUnit[Axis] = GridSize[Axis] / std::max(BoundsSize[Axis], 1e-3f);
+		}
+
+		// Counts the cells over each square, then lists them
+		GridFirstCell.assign(GridSize[0] * GridSize[1] + 1, 0);
+		for (int32 Pass = 0; Pass < 2; ++Pass)
+		{
+			std::vector<int32> NextGridSlot(GridFirstCell.begin(), GridFirstCell.end() - 1);
+			for (int32 CellIdx = 0; CellIdx < NumCells; ++CellIdx)
+			{
+				int32 Min[2], Max[2];
+				GetGridRange(*this, Cells[CellIdx], Min, Max);
+				for (int32 Y = Min[1]; Y <= Max[1]; ++Y)
+				{
+					for (int32 X = Min[0]; X <= Max[0]; ++X)
+					{
+						const int32 Square = Y * GridSize[0] + X;
+						if (Pass == 0)
+						{
+							GridFirstCell[Square + 1]++;
+						}
+						else
+						{
+							GridCells[NextGridSlot[Square]++] = CellIdx;
+						}
+					}
+				}
+			}
+
+			if (Pass == 0)
+			{
+				for (size_t Square = 1; Square < GridFirstCell.size(); ++Square)
+				{
+					GridFirstCell[Square] += GridFirstCell[Square - 1];
+				}
+				GridCells.resize(GridFirstCell.back());
+			}
+		}
+	}
+
+	void ComputePortalVisibility(const FPortalGraph& Graph, const FBox3& ViewerBounds, const FMat4& ViewProj, FPortalVisibility& Out)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_PortalTraversal");
+		const int32 NumCells = (int32)Graph.Cells.size();
+		auto GetSide = [NumCells](int32 Cell) { return Cell >= 0 && Cell < NumCells ? Cell : PORTAL_EXTERIOR; };
+		Out.CellRects.assign(NumCells, FPortalRect());
+		Out.ExteriorRect = FPortalRect();
+		Out.NumVisibleCells = 0;
+		Out.NumSteps = 0;
+
+		std::vector<FPortalStep> Stack;
+		for (int32 CellIdx = 0; CellIdx < NumCells; ++CellIdx)
+		{
+			if (Overlaps(Graph.Cells[CellIdx], ViewerBounds))
+			{
+				Stack.push_back({ CellIdx, FPortalRect::Full(), 0 });
+			}
+		}
+		if (Stack.empty())
+		{
+			Stack.push_back({ PORTAL_EXTERIOR, FPortalRect::Full(), 0 });
+		}
+
+		while (!Stack.empty())
+		{
+			const FPortalStep Step = Stack.back();
+			Stack.pop_back();
+			Out.NumSteps++;
+
+			// A cell reached again is only walked again when it is seen somewhere new, and then with everything seen of it
+			// so far: what the bounding rectangle contains was walked, however the views into the cell are split.
+			FPortalRect& Seen = Step.Cell == PORTAL_EXTERIOR ? Out.ExteriorRect : Out.CellRects[Step.Cell];
+			if (Contains(Seen, Step.Rect))
+			{
+				continue;
+			}
+			if (Seen.IsEmpty() && Step.Cell != PORTAL_EXTERIOR)
+			{
+				Out.NumVisibleCells++;
+			}
+			Seen = Union(Seen, Step.Rect);
+
+			if (Step.Depth >= MAX_PORTAL_DEPTH)
+			{
+				continue;
+			}
+
+			const int32* FirstPortal = Step.Cell == PORTAL_EXTERIOR ? Graph.ExteriorPortals.data() : Graph.CellPortals.data() + Graph.CellFirstPortal[Step.Cell];
+			const int32* EndPortal = Step.Cell == PORTAL_EXTERIOR ? FirstPortal + Graph.ExteriorPortals.size() : Graph.CellPortals.data() + Graph.CellFirstPortal[Step.Cell + 1];
+			for (const int32* PortalIt = FirstPortal; PortalIt != EndPortal; ++PortalIt)
+			{
+				const FPortal& Portal = Graph.Portals[*PortalIt];
+				const FPortalRect Through = Intersect(Seen, ProjectPortal(ViewProj, Portal));
+				if (Through.IsEmpty())
+				{
+					continue;
+				}
+
+				const int32 NextCell = GetSide(Portal.Cells[0]) == Step.Cell ? GetSide(Portal.Cells[1]) : GetSide(Portal.Cells[0]);
+				if (NextCell != Step.Cell)
+				{
+					Stack.push_back({ NextCell, Through, Step.Depth + 1 });
+				}
+			}
+		}
+	}
+
+	bool IsBoxPortalVisible(const FPortalGraph& Graph, const FPortalVisibility& Visibility, const FMat4& ViewProj, const FBox3& Box)
+	{
+		return FPortalBoxTest(Graph, Visibility, ViewProj).IsVisible(Box);
+	}
+
+	void TestBoxesPortalVisible(const FPortalGraph& Graph, const FPortalVisibility& Visibility, const FMat4& ViewProj, const FVec3* BoxMinMax, int32 NumBoxes, uint8* InOutVisible)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_PortalBoxes");
+		const FPortalBoxTest Test(Graph, Visibility, ViewProj);
+		for (int32 BoxIdx = 0; BoxIdx < NumBoxes; ++BoxIdx)
+		{
+			if (!InOutVisible[BoxIdx])
+			{
+				InOutVisible[BoxIdx] = Test.IsVisible({ BoxMinMax[BoxIdx * 2], BoxMinMax[BoxIdx * 2 + 1] }) ? 1 : 0;
+			}
+		}
+	}
+}
@@ -0,0 +1,38 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionProfiler.h: stage scopes of the core, reported through the
+	hooks set with SetProfilerHooks.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+
+namespace SnowOcclusion
+{
+	extern FProfilerHooks GProfilerHooks;
+
+	class FProfilerScope
+	{
+	public:
+		explicit FProfilerScope(const char* Name)
+			: EndScope(GProfilerHooks.BeginScope && GProfilerHooks.BeginScope(Name) ? GProfilerHooks.EndScope : nullptr)
+		{
+		}
+
+		~FProfilerScope()
+		{
+			if (EndScope)
+			{
+				EndScope();
+			}
+		}
+
+		FProfilerScope(const FProfilerScope&) = delete;
+		FProfilerScope& operator=(const FProfilerScope&) = delete;
+
+	private:
+		void (*EndScope)();
+	};
+}
@@ -0,0 +1,318 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "SnowOcclusionReference.h"
+#include "SnowOcclusionProfiler.h"
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+
+namespace SnowOcclusion
+{
+	namespace
+	{
+		/** Position in occlusion buffer pixels, pixel centers are at whole numbers. Z is the device depth, bigger is closer. */
+		struct FRefVertex
+		{
+			float X, Y, Z;
+		};
+
+		// Corner I of a box takes Max on the axes whose bit is set: X = 1, Y = 2, Z = 4
+		const int32 BOX_TRIS[12][3] =
+		{
+			{ 0, 2, 6 }, { 0, 6, 4 }, { 1, 3, 7 }, { 1, 7, 5 },
+			{ 0, 1, 5 }, { 0, 5, 4 }, { 2, 3, 7 }, { 2, 7, 6 },
+			{ 0, 1, 3 }, { 0, 3, 2 }, { 4, 5, 7 }, { 4, 7, 6 },
+		};
+
+		FRefVertex ClipToBuffer(const FVec4& V)
+		{
+			return { (V.X / V.W + 1.0f) * FRAMEBUFFER_WIDTH / 2.0f, (V.Y / V.W + 1.0f) * FRAMEBUFFER_HEIGHT / 2.0f, V.Z / V.W };
+		}
+
+		class FReferenceBuffer
+		{
+		public:
+			explicit FReferenceBuffer(int32 InScale)
+				: Scale(InScale)
+				, Width(FRAMEBUFFER_WIDTH * InScale)
+				, Height(FRAMEBUFFER_HEIGHT * InScale)
+				, Depth((size_t)Width * Height, 0.0f)
+			{
+			}
+
+			/** Keeps the closest depth of each sample a front facing triangle covers */
+			void DrawOccluder(const FRefVertex& V0, const FRefVertex& V1, const FRefVertex& V2, bool bReverseCulling)
+			{
+				// Same winding test as the core's TestFrontface
+				const float Area = (V1.X - V0.X) * (V2.Y - V0.Y) - (V1.Y - V0.Y) * (V2.X - V0.X);
+				if (bReverseCulling ? Area >= 0.0f : Area <= 0.0f)
+				{
+					return;
+				}
+
+				ForEachSample(V0, V1, V2, [this](int32 SampleIdx, float Z)
+				{
+					Depth[SampleIdx] = std::max(Depth[SampleIdx], Z);
+					return false;
+				});
+			}
+
+			/** Whether any sample of a triangle is in front of the occluders, either winding */
+			bool TestTriangle(const FRefVertex& V0, const FRefVertex& V1, const FRefVertex& V2, bool& bOutAnySample) const
+			{
+				return ForEachSample(V0, V1, V2, [this, &bOutAnySample](int32 SampleIdx, float Z)
+				{
+					bOutAnySample = true;
+					return Z >= Depth[SampleIdx];
+				});
+			}
+
+			/** Tests the sample closest to a point, for boxes too small to cover any sample */
+			bool TestPoint(float X, float Y, float Z) const
+			{
+				const int32 SampleX = ToSample(X, Width);
+				const int32 SampleY = ToSample(Y, Height);
+				return Z >= Depth[(size_t)SampleY * Width + SampleX];
+			}
+
+			bool IsOnScreen(float MinX, float MinY, float MaxX, float MaxY) const
+			{
+				return MaxX >= -0.5f && MinX <= FRAMEBUFFER_WIDTH - 0.5f && MaxY >= -0.5f && MinY <= FRAMEBUFFER_HEIGHT - 0.5f;
+			}
+
+		private:
+			int32 ToSample(float P, int32 Size) const
+			{
+				return (int32)std::floor(std::min(std::max((P + 0.5f) * Scale, 0.0f), (float)(Size - 1)));
+			}
+
+			// First and last sample at or inside a position, clamped before converting as vertices can be far off screen
+			int32 FirstSample(float P, int32 Size) const
+			{
+				return (int32)std::ceil(std::min(std::max((P + 0.5f) * Scale - 0.5f, 0.0f), (float)Size));
+			}
+
+			int32 LastSample(float P, int32 Size) const
+			{
+				return (int32)std::floor(std::min(std::max((P + 0.5f) * Scale - 0.5f, -1.0f), (float)(Size - 1)));
+			}
+
+			/** Calls Func for each sample inside the triangle with its depth until it returns true, returns whether it did */
+			template<typename FuncType>
+			bool ForEachSample(const FRefVertex& V0, const FRefVertex& V1, const FRefVertex& V2, FuncType&& Func) const
+			{
+				const float Area = (V1.X - V0.X) * (V2.Y - V0.Y) - (V1.Y - V0.Y) * (V2.X - V0.X);
+				if (Area == 0.0f || !std::isfinite(Area))
+				{
+					return false;
+				}
+				const float InvArea = 1.0f / Area;
+
+				// Sample J of the reference buffer sits at (J + 0.5) / Scale - 0.5 in occlusion buffer pixels
+				const float InvScale = 1.0f / Scale;
+				const int32 MinX = FirstSample(std::min(V0.X, std::min(V1.X, V2.X)), Width);
+				const int32 MaxX = LastSample(std::max(V0.X, std::max(V1.X, V2.X)), Width);
+				const int32 MinY = FirstSample(std::min(V0.Y, std::min(V1.Y, V2.Y)), Height);
+				const int32 MaxY = LastSample(std::max(V0.Y, std::max(V1.Y, V2.Y)), Height);
+
+				for (int32 SampleY = MinY; SampleY <= MaxY; ++SampleY)
+				{
+					const float PY = (SampleY + 0.5f) * InvScale - 0.5f;
+					for (int32 SampleX = MinX; SampleX <= MaxX; ++SampleX)
+					{
+						const float PX = (SampleX + 0.5f) * InvScale - 0.5f;
+						const float W0 = ((V2.X - V1.X) * (PY - V1.Y) - (V2.Y - V1.Y) * (PX - V1.X)) * InvArea;
+						const float W1 = ((V0.X - V2.X) * (PY - V2.Y) - (V0.Y - V2.Y) * (PX - V2.X)) * InvArea;
+						const float W2 = 1.0f - W0 - W1;
+						if (W0 < 0.0f || W1 < 0.0f || W2 < 0.0f)
+						{
+							continue;
+						}
+
+						if (Func(SampleY * Width + SampleX, W0 * V0.Z + W1 * V1.Z + W2 * V2.Z))
+						{
+							return true;
+						}
+					}
+				}
+
+				return false;
+			}
+
+			int32 Scale;
+			int32 Width;
+			int32 Height;
+			std::vector<float> Depth;
+		};
+
+		/** Draws every occluder of the scene, clipped at the near plane like the core does */
+		void DrawOccluders(const FScene& Scene, const FSceneView& View, FReferenceBuffer& Buffer)
+		{
+			std::vector<FVec4> ClipVertices;
+			for (const FOccluderMesh& Mesh : Scene.Occluders)
+			{
+				const FMat4 LocalToClip = Mesh.LocalToWorld * View.ViewProj;
+				ClipVertices.resize(Mesh.NumVertices);
+				for (int32 VertexIdx = 0; VertexIdx < Mesh.NumVertices; ++VertexIdx)
+				{
+					const FVec3& V = Mesh.Vertices[VertexIdx];
+					ClipVertices[VertexIdx] = LocalToClip.TransformVec4({ V.X, V.Y, V.Z, 1.0f });
+				}
+
+				for (int32 Index = 0; Index + 2 < Mesh.NumIndices; Index += 3)
+				{
+					const FVec4 V[3] = { ClipVertices[Mesh.Indices[Index]], ClipVertices[Mesh.Indices[Index + 1]], ClipVertices[Mesh.Indices[Index + 2]] };
+
+					FVec4 Clipped[4];
+					int32 NumClipped = 0;
+					for (int32 EdgeIdx = 0; EdgeIdx < 3; ++EdgeIdx)
+					{
+						const FVec4& P0 = V[EdgeIdx];
+						const FVec4& P1 = V[(EdgeIdx + 1) % 3];
+						const bool bBehind0 = P0.W < View.ClipW;
+						const bool bBehind1 = P1.W < View.ClipW;
+						if (!bBehind0)
+						{
+							Clipped[NumClipped++] = P0;
+						}
+						if (bBehind0 != bBehind1)
+						{
+							Clipped[NumClipped++] = P0 + (P1 - P0) * ((View.ClipW - P0.W) / (P1.W - P0.W));
+						}
+					}
+
+					for (int32 FanIdx = 2; FanIdx < NumClipped; ++FanIdx)
+					{
+						Buffer.DrawOccluder(ClipToBuffer(Clipped[0]), ClipToBuffer(Clipped[FanIdx - 1]), ClipToBuffer(Clipped[FanIdx]), View.bReverseCulling);
+					}
+				}
+			}
+		}
+
+		bool IsOccludeeVisible(const FScene& Scene, const FSceneView& View, int32 OccludeeIdx, const FReferenceBuffer& Buffer)
+		{
+			const int32 OrientedIdx = Scene.OccludeeBoxOrientedIdx[OccludeeIdx];
+			const FOrientedBox* OrientedBox = OrientedIdx >= 0 ? &Scene.OccludeeOrientedBoxes[OrientedIdx] : nullptr;
+			const FMat4 BoxToClip = OrientedBox ? OrientedBox->BoxToWorld * View.ViewProj : View.ViewProj;
+			const FVec3& BoxMin = OrientedBox ? OrientedBox->Min : Scene.OccludeeBoxMinMax[OccludeeIdx * 2];
+			const FVec3& BoxMax = OrientedBox ? OrientedBox->Max : Scene.OccludeeBoxMinMax[OccludeeIdx * 2 + 1];
+
+			FRefVertex Corners[8];
+			float MinX = FLT_MAX, MinY = FLT_MAX, MaxX = -FLT_MAX, MaxY = -FLT_MAX, MaxZ = -FLT_MAX;
+			for (int32 CornerIdx = 0; CornerIdx < 8; ++CornerIdx)
+			{
+				const FVec4 Clip = BoxToClip.TransformVec4({
+					(CornerIdx & 1) ? BoxMax.X : BoxMin.X,
+					(CornerIdx & 2) ? BoxMax.Y : BoxMin.Y,
+					(CornerIdx & 4) ? BoxMax.Z : BoxMin.Z,
+					1.0f });
+				if (Clip.W < View.ClipW)
+				{
+					return true;
+				}
+
+				Corners[CornerIdx] = ClipToBuffer(Clip);
+				MinX = std::min(MinX, Corners[CornerIdx].X);
+				MinY = std::min(MinY, Corners[CornerIdx].Y);
+				MaxX = std::max(MaxX, Corners[CornerIdx].X);
+				MaxY = std::max(MaxY, Corners[CornerIdx].Y);
+				MaxZ = std::max(MaxZ, Corners[CornerIdx].Z);
+			}
+
+			if (!Buffer.IsOnScreen(MinX, MinY, MaxX, MaxY))
+			{
+				return false;
+			}
+
+			bool bAnySample = false;
+			for (const int32* Tri : BOX_TRIS)
+			{
+				if (Buffer.TestTriangle(Corners[Tri[0]], Corners[Tri[1]], Corners[Tri[2]], bAnySample))
+				{
+					return true;
+				}
+			}
+
+			return !bAnySample && Buffer.TestPoint((MinX + MaxX) * 0.5f, (MinY + MaxY) * 0.5f, MaxZ);
+		}
+	}
+
+	void ComputeReferenceVisibility(const FScene& Scene, int32 ViewIdx, int32 Scale, std::vector<uint8>& OutOccludeeVisible)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_ReferenceView");
+		const FSceneView& View = Scene.Views[ViewIdx];
+		FReferenceBuffer Buffer(std::min(std::max(Scale, 1), MAX_REFERENCE_SCALE));
+		DrawOccluders(Scene, View, Buffer);
+
+		const int32 NumTested = View.bShadowView ? Scene.NumPrimitiveOccludees : Scene.NumOccludees();
+		OutOccludeeVisible.assign(Scene.NumOccludees(), 0);
+		for (int32 OccludeeIdx = 0; OccludeeIdx < NumTested; ++OccludeeIdx)
+		{
+			OutOccludeeVisible[OccludeeIdx] = IsOccludeeVisible(Scene, View, OccludeeIdx, Buffer) ? 1 : 0;
+		}
+	}
+
+	void MeasureCullingAccuracy(const FScene& Scene, FFrameResults& Results, int32 Scale, const FParallelFor& ParallelFor)
+	{
+		const FProfilerScope ProfilerScope("SnowOcclusion_MeasureCullingAccuracy");
+		const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+		const int32 NumViews = (int32)Scene.Views.size();
+		const int32 NumOccludees = Scene.NumOccludees();
+
+		std::vector<std::vector<uint8>> ViewVisible(NumViews);
+		auto ProcessView = [&Scene, Scale, &ViewVisible](int32 ViewIdx)
+		{
+			ComputeReferenceVisibility(Scene, ViewIdx, Scale, ViewVisible[ViewIdx]);
+		};
+		if (ParallelFor && NumViews > 1)
+		{
+			ParallelFor(NumViews, ProcessView);
+		}
+		else
+		{
+			for (int32 ViewIdx = 0; ViewIdx < NumViews; ++ViewIdx)
+			{
+				ProcessView(ViewIdx);
+			}
+		}
+
+		// Combined over the regular views, like ProcessOcclusionFrame
+		std::vector<uint8> Visible(NumOccludees, 0);
+		for (int32 ViewIdx = 0; ViewIdx < NumViews; ++ViewIdx)
+		{
+			if (!Scene.Views[ViewIdx].bShadowView)
+			{
+				for (int32 OccludeeIdx = 0; OccludeeIdx < NumOccludees; ++OccludeeIdx)
+				{
+					Visible[OccludeeIdx] |= ViewVisible[ViewIdx][OccludeeIdx];
+				}
+			}
+		}
+
+		FAccuracyStats& Accuracy = Results.Accuracy;
+		Accuracy = FAccuracyStats();
+		Accuracy.bMeasured = true;
+		for (int32 OccludeeIdx = 0; OccludeeIdx < Scene.NumPrimitiveOccludees; ++OccludeeIdx)
+		{
+			const bool bVisible = Results.OccludeeVisible[OccludeeIdx] != 0;
+			Accuracy.NumReferenceVisible += Visible[OccludeeIdx];
+			Accuracy.NumFalseVisible += bVisible && !Visible[OccludeeIdx];
+			Accuracy.NumFalseOccluded += !bVisible && Visible[OccludeeIdx];
+		}
+
+		for (int32 VolumeIdx = 0; VolumeIdx < (int32)Scene.ShadowVolumeCasterIdx.size(); ++VolumeIdx)
+		{
+			const int32 CasterIdx = Scene.ShadowVolumeCasterIdx[VolumeIdx];
+			const int32 LightViewIdx = Scene.ShadowVolumeViewIdx[VolumeIdx];
+			const FBox3 CasterBox = { Scene.OccludeeBoxMinMax[CasterIdx * 2], Scene.OccludeeBoxMinMax[CasterIdx * 2 + 1] };
+			const bool bLit = !IsBoxInsideView(Scene.Views[LightViewIdx], CasterBox) || ViewVisible[LightViewIdx][CasterIdx] != 0;
+			const bool bReferenceVisible = bLit && Visible[Scene.NumPrimitiveOccludees + VolumeIdx];
+			const bool bVisible = Results.ShadowVolumeVisible[VolumeIdx] != 0;
+			Accuracy.NumFalseVisibleShadows += bVisible && !bReferenceVisible;
+			Accuracy.NumFalseOccludedShadows += !bVisible && bReferenceVisible;
+		}
+
+		Accuracy.ReferenceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	}
+}
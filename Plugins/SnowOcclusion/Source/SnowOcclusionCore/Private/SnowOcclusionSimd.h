@@ -0,0 +1,103 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionSimd.h: the few 4-wide float operations the core kernels use.
+	SSE2 and NEON where available, plain scalar code otherwise.
+	SNOWOCCLUSION_FORCE_SCALAR=1 builds the scalar code everywhere, to compare.
+=============================================================================*/
+
+#include "SnowOcclusionMath.h"
+
+#ifndef SNOWOCCLUSION_FORCE_SCALAR
+#define SNOWOCCLUSION_FORCE_SCALAR 0
+#endif
+
+#if SNOWOCCLUSION_FORCE_SCALAR
+// Neither SSE nor NEON
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SNOWOCCLUSION_SIMD_SSE 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define SNOWOCCLUSION_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifndef SNOWOCCLUSION_SIMD_SSE
+#define SNOWOCCLUSION_SIMD_SSE 0
+#endif
+#ifndef SNOWOCCLUSION_SIMD_NEON
+#define SNOWOCCLUSION_SIMD_NEON 0
+#endif
+
+namespace SnowOcclusion
+{
+#if SNOWOCCLUSION_SIMD_SSE
+	typedef __m128 VecReg;
+
+	inline VecReg VecLoadAligned(const float* Ptr) { return _mm_load_ps(Ptr); }
+	inline VecReg VecSet1(float Value) { return _mm_set1_ps(Value); }
+	inline VecReg VecSet(float X, float Y, float Z, float W) { return _mm_setr_ps(X, Y, Z, W); }
+	inline VecReg VecZero() { return _mm_setzero_ps(); }
+	inline VecReg VecAdd(VecReg A, VecReg B) { return _mm_add_ps(A, B); }
+	inline VecReg VecMul(VecReg A, VecReg B) { return _mm_mul_ps(A, B); }
+	inline VecReg VecDiv(VecReg A, VecReg B) { return _mm_div_ps(A, B); }
+	inline VecReg VecMin(VecReg A, VecReg B) { return _mm_min_ps(A, B); }
+	inline VecReg VecMax(VecReg A, VecReg B) { return _mm_max_ps(A, B); }
+	inline VecReg VecCompareLT(VecReg A, VecReg B) { return _mm_cmplt_ps(A, B); }
+	inline VecReg VecOr(VecReg A, VecReg B) { return _mm_or_ps(A, B); }
+	inline VecReg VecReplicateW(VecReg A) { return _mm_shuffle_ps(A, A, _MM_SHUFFLE(3, 3, 3, 3)); }
+	/** X and Y of A, then X and Y of B */
+	inline VecReg VecCombineLow(VecReg A, VecReg B) { return _mm_movelh_ps(A, B); }
+	inline void VecStoreAligned(VecReg A, float* Ptr) { _mm_store_ps(Ptr, A); }
+	/** Truncates towards zero */
+	inline void VecStoreIntAligned(VecReg A, int32* Ptr) { _mm_store_si128((__m128i*)Ptr, _mm_cvttps_epi32(A)); }
+	inline bool VecAnyBitSet(VecReg A) { return _mm_movemask_ps(A) != 0; }
+	inline float VecGetZ(VecReg A) { return _mm_cvtss_f32(_mm_shuffle_ps(A, A, _MM_SHUFFLE(2, 2, 2, 2))); }
+#elif SNOWOCCLUSION_SIMD_NEON
+	typedef float32x4_t VecReg;
+
+	inline VecReg VecLoadAligned(const float* Ptr) { return vld1q_f32(Ptr); }
+	inline VecReg VecSet1(float Value) { return vdupq_n_f32(Value); }
+	inline VecReg VecSet(float X, float Y, float Z, float W) { const float Values[4] = { X, Y, Z, W }; return vld1q_f32(Values); }
+	inline VecReg VecZero() { return vdupq_n_f32(0.0f); }
+	inline VecReg VecAdd(VecReg A, VecReg B) { return vaddq_f32(A, B); }
+	inline VecReg VecMul(VecReg A, VecReg B) { return vmulq_f32(A, B); }
+	inline VecReg VecDiv(VecReg A, VecReg B) { return vdivq_f32(A, B); }
+	inline VecReg VecMin(VecReg A, VecReg B) { return vminq_f32(A, B); }
+	inline VecReg VecMax(VecReg A, VecReg B) { return vmaxq_f32(A, B); }
+	inline VecReg VecCompareLT(VecReg A, VecReg B) { return vreinterpretq_f32_u32(vcltq_f32(A, B)); }
+	inline VecReg VecOr(VecReg A, VecReg B) { return vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(A), vreinterpretq_u32_f32(B))); }
+	inline VecReg VecReplicateW(VecReg A) { return vdupq_laneq_f32(A, 3); }
+	inline VecReg VecCombineLow(VecReg A, VecReg B) { return vcombine_f32(vget_low_f32(A), vget_low_f32(B)); }
+	inline void VecStoreAligned(VecReg A, float* Ptr) { vst1q_f32(Ptr, A); }
+	inline void VecStoreIntAligned(VecReg A, int32* Ptr) { vst1q_s32(Ptr, vcvtq_s32_f32(A)); }
+	inline bool VecAnyBitSet(VecReg A) { return vmaxvq_u32(vreinterpretq_u32_f32(A)) != 0; }
+	inline float VecGetZ(VecReg A) { return vgetq_lane_f32(A, 2); }
+#else
+	struct alignas(16) VecReg
+	{
+		float V[4];
+	};
+
+	inline VecReg VecLoadAligned(const float* Ptr) { return { { Ptr[0], Ptr[1], Ptr[2], Ptr[3] } }; }
+	inline VecReg VecSet1(float Value) { return { { Value, Value, Value, Value } }; }
+	inline VecReg VecSet(float X, float Y, float Z, float W) { return { { X, Y, Z, W } }; }
+	inline VecReg VecZero() { return VecSet1(0.0f); }
+	inline VecReg VecAdd(VecReg A, VecReg B) { return { { A.V[0] + B.V[0], A.V[1] + B.V[1], A.V[2] + B.V[2], A.V[3] + B.V[3] } }; }
+	inline VecReg VecMul(VecReg A, VecReg B) { return { { A.V[0] * B.V[0], A.V[1] * B.V[1], A.V[2] * B.V[2], A.V[3] * B.V[3] } }; }
+	inline VecReg VecDiv(VecReg A, VecReg B) { return { { A.V[0] / B.V[0], A.V[1] / B.V[1], A.V[2] / B.V[2], A.V[3] / B.V[3] } }; }
+	inline VecReg VecMin(VecReg A, VecReg B) { return { { A.V[0] < B.V[0] ? A.V[0] : B.V[0], A.V[1] < B.V[1] ? A.V[1] : B.V[1], A.V[2] < B.V[2] ? A.V[2] : B.V[2], A.V[3] < B.V[3] ? A.V[3] : B.V[3] } }; }
+	inline VecReg VecMax(VecReg A, VecReg B) { return { { A.V[0] > B.V[0] ? A.V[0] : B.V[0], A.V[1] > B.V[1] ? A.V[1] : B.V[1], A.V[2] > B.V[2] ? A.V[2] : B.V[2], A.V[3] > B.V[3] ? A.V[3] : B.V[3] } }; }
+	// Lanes are 1 where A < B, only ever tested with VecAnyBitSet
+	inline VecReg VecCompareLT(VecReg A, VecReg B) { return { { A.V[0] < B.V[0] ? 1.0f : 0.0f, A.V[1] < B.V[1] ? 1.0f : 0.0f, A.V[2] < B.V[2] ? 1.0f : 0.0f, A.V[3] < B.V[3] ? 1.0f : 0.0f } }; }
+	inline VecReg VecOr(VecReg A, VecReg B) { return VecMax(A, B); }
+	inline VecReg VecReplicateW(VecReg A) { return VecSet1(A.V[3]); }
+	inline VecReg VecCombineLow(VecReg A, VecReg B) { return { { A.V[0], A.V[1], B.V[0], B.V[1] } }; }
+	inline void VecStoreAligned(VecReg A, float* Ptr) { Ptr[0] = A.V[0]; Ptr[1] = A.V[1]; Ptr[2] = A.V[2]; Ptr[3] = A.V[3]; }
+	inline void VecStoreIntAligned(VecReg A, int32* Ptr) { Ptr[0] = (int32)A.V[0]; Ptr[1] = (int32)A.V[1]; Ptr[2] = (int32)A.V[2]; Ptr[3] = (int32)A.V[3]; }
+	inline bool VecAnyBitSet(VecReg A) { return A.V[0] != 0.0f || A.V[1] != 0.0f || A.V[2] != 0.0f || A.V[3] != 0.0f; }
+	inline float VecGetZ(VecReg A) { return A.V[2]; }
+#endif
+}
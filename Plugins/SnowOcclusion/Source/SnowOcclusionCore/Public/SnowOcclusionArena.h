@@ -0,0 +1,150 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionArena.h: linear memory for the transient data of a frame.
+	Containers built and thrown away every frame allocate from an arena that
+	is reset instead of freed, so steady frames don't touch the heap.
+=============================================================================*/
+
+#include "SnowOcclusionMath.h"
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef SNOWOCCLUSIONCORE_API
+#define SNOWOCCLUSIONCORE_API
+#endif
+
+namespace SnowOcclusion
+{
+	/**
+	 * Allocations are only freed all at once by Reset, which keeps the memory. A frame that outgrew the arena
+	 * spills into extra blocks, the next Reset replaces them with one block the size of everything that frame used.
+	 */
+	class SNOWOCCLUSIONCORE_API FLinearArena
+	{
+	public:
+		FLinearArena() = default;
+		~FLinearArena();
+		FLinearArena(const FLinearArena&) = delete;
+		FLinearArena& operator=(const FLinearArena&) = delete;
+
+		void* Alloc(size_t Size, size_t Alignment);
+
+		/** Objects are never destroyed, only for types whose destructors would only free arena memory */
+		template<typename T, typename... ArgTypes>
+		T* New(ArgTypes&&... Args)
+		{
+			return new (Alloc(sizeof(T), alignof(T))) T(std::forward<ArgTypes>(Args)...);
+		}
+
+		/** Forgets every allocation, nothing allocated from the arena may be used after */
+		void Reset();
+
+		size_t GetCapacity() const { return Capacity; }
+		/** Blocks taken from the heap since the arena was made, steady frames add none */
+		int32 GetNumHeapAllocs() const { return NumHeapAllocs; }
+
+	private:
+		void AddBlock(size_t MinSize);
+
+		struct FBlock
+		{
+			uint8* Data;
+			size_t Size;
+		};
+
+		// The last block is the one allocated from
+		std::vector<FBlock> Blocks;
+		size_t Offset = 0;
+		// Bytes handed out since the last Reset, alignment included
+		size_t Used = 0;
+		size_t Capacity = 0;
+		int32 NumHeapAllocs = 0;
+	};
+
+	/** Standard allocator over an arena, deallocation is a no-op. Containers take the arena along when moved. */
+	template<typename T>
+	struct TArenaAllocator
+	{
+		using value_type = T;
+		using propagate_on_container_copy_assignment = std::true_type;
+		using propagate_on_container_move_assignment = std::true_type;
+		using propagate_on_container_swap = std::true_type;
+
+		// Null only for containers that are assigned one with an arena before use
+		FLinearArena* Arena = nullptr;
+
+		TArenaAllocator() = default;
+		TArenaAllocator(FLinearArena& InArena) : Arena(&InArena) {}
+		template<typename U>
+		TArenaAllocator(const TArenaAllocator<U>& Other) : Arena(Other.Arena) {}
+
+		T* allocate(size_t Num) { return (T*)Arena->Alloc(Num * sizeof(T), alignof(T)); }
+		void deallocate(T*, size_t) {}
+
+		template<typename U>
+		bool operator==(const TArenaAllocator<U>& Other) const { return Arena == Other.Arena; }
+		template<typename U>
+		bool operator!=(const TArenaAllocator<U>& Other) const { return Arena != Other.Arena; }
+	};
+
+	template<typename T>
+	using TArenaVector = std::vector<T, TArenaAllocator<T>>;
+
+	/**
+	 * Arenas of ProcessOcclusionFrame, one for each piece of work that runs in parallel with the others (views, setup chunks).
+	 * Keep one per frame in flight.
+	 */
+	class FFrameArena
+	{
+	public:
+		/** Resets the arenas for a new frame */
+		void Reset()
+		{
+			for (std::unique_ptr<FLinearArena>& Arena : Arenas)
+			{
+				Arena->Reset();
+			}
+		}
+
+		/** Makes sure there are NumArenas, without resetting the ones there are. Not thread safe. */
+		void Reserve(int32 NumArenas)
+		{
+			while ((int32)Arenas.size() < NumArenas)
+			{
+				Arenas.emplace_back(new FLinearArena);
+			}
+		}
+
+		FLinearArena& Get(int32 ArenaIdx) { return *Arenas[ArenaIdx]; }
+
+		size_t GetCapacity() const
+		{
+			size_t Capacity = 0;
+			for (const std::unique_ptr<FLinearArena>& Arena : Arenas)
+			{
+				Capacity += Arena->GetCapacity();
+			}
+			return Capacity;
+		}
+
+		int32 GetNumHeapAllocs() const
+		{
+			int32 NumHeapAllocs = 0;
+			for (const std::unique_ptr<FLinearArena>& Arena : Arenas)
+			{
+				NumHeapAllocs += Arena->GetNumHeapAllocs();
+			}
+			return NumHeapAllocs;
+		}
+
+	private:
+		std::vector<std::unique_ptr<FLinearArena>> Arenas;
+	};
+}
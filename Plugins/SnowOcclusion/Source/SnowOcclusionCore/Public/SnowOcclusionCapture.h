@@ -0,0 +1,105 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionCapture.h: capture files of processed occlusion frames.
+	Each frame keeps the whole scene the core processed and the results it
+	gave, occluder meshes are stored once per file. Replaying a capture
+	reproduces a session without the game and checks the results still match.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace SnowOcclusion
+{
+	/** Results of a captured frame, what a replay is compared against */
+	struct FCapturedResults
+	{
+		struct FView
+		{
+			// HashViewBins of the rasterized buffer
+			uint64 BinsHash = 0;
+			FViewStats Stats;
+			std::vector<uint8> OccludeeVisible;
+		};
+
+		std::vector<FView> Views;
+		std::vector<uint8> OccludeeVisible;
+		std::vector<uint8> ShadowVolumeVisible;
+		FAccuracyStats Accuracy;
+	};
+
+	struct FCapturedFrame
+	{
+		uint64 FrameNumber = 0;
+		// Occluder meshes point into the reader the frame was read from
+		FScene Scene;
+		FCapturedResults Results;
+	};
+
+	/** Hash of the coverage bits of a view, tells whether two rasterizations came out the same */
+	SNOWOCCLUSIONCORE_API uint64 HashViewBins(const FViewResults& View);
+
+	/** Receives the bytes of the capture file, returns false if they couldn't be written */
+	using FCaptureSink = std::function<bool(const void* Data, size_t Size)>;
+
+	class SNOWOCCLUSIONCORE_API FCaptureWriter
+	{
+	public:
+		/** Starts a capture, the header goes to the sink right away */
+		bool Open(FCaptureSink&& InSink);
+		void Close();
+		bool IsOpen() const { return (bool)Sink; }
+		int32 GetNumFrames() const { return NumFrames; }
+
+		/** Appends the scene of a frame and the results it gave. Meshes are written the first time they are seen. */
+		bool WriteFrame(uint64 FrameNumber, const FScene& Scene, const FFrameResults& Results);
+
+	private:
+		FCaptureSink Sink;
+		// Id of each mesh written, by content hash
+		std::unordered_map<uint64, int32> MeshIds;
+		std::vector<uint8> Buffer;
+		int32 NumFrames = 0;
+	};
+
+	class SNOWOCCLUSIONCORE_API FCaptureReader
+	{
+	public:
+		FCaptureReader() = default;
+		~FCaptureReader();
+		FCaptureReader(const FCaptureReader&) = delete;
+		FCaptureReader& operator=(const FCaptureReader&) = delete;
+
+		bool Open(const char* Path);
+
+		/** Reads the next frame. False at the end of the file, or if it is malformed and GetError says why. */
+		bool ReadFrame(FCapturedFrame& OutFrame);
+
+		const std::string& GetError() const { return Error; }
+
+	private:
+		struct FMesh
+		{
+			std::vector<FVec3> Vertices;
+			std::vector<uint16> Indices;
+		};
+
+		bool ReadMesh(const std::vector<uint8>& Chunk);
+
+		FILE* File = nullptr;
+		uint32 Version = 0;
+		// Frames point into the meshes, they live as long as the reader
+		std::vector<std::unique_ptr<FMesh>> Meshes;
+		std::vector<uint8> Chunk;
+		std::string Error;
+	};
+
+	/** Sink writing to a file opened with fopen, for the standalone tools. Fails if the file can't be created. */
+	SNOWOCCLUSIONCORE_API FCaptureSink MakeFileCaptureSink(const char* Path);
+}
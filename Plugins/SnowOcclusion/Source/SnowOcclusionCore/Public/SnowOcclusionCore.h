@@ -0,0 +1,313 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionCore.h: engine independent software occlusion.
+	Rasterizes occluder meshes into a binned bitmask buffer per view and tests
+	occludee boxes against it. Plain scene in, plain results out: the
+	SnowOcclusion module gathers the scene from the engine, the standalone
+	tools build it themselves (see Tools/CMakeLists.txt).
+=============================================================================*/
+
+#include "SnowOcclusionArena.h"
+#include "SnowOcclusionMath.h"
+#include <functional>
+#include <vector>
+
+#ifndef SNOWOCCLUSIONCORE_API
+#define SNOWOCCLUSIONCORE_API
+#endif
+
+namespace SnowOcclusion
+{
+	static const int32 BIN_WIDTH = 64;
+	static const int32 BIN_NUM = 6;
+	static const int32 FRAMEBUFFER_WIDTH = BIN_WIDTH * BIN_NUM;
+	static const int32 FRAMEBUFFER_HEIGHT = 256;
+	// Coverage depth is tracked per tile, a tile is a byte of a bin row over TILE_SIZE rows
+	static const int32 TILE_SIZE = 8;
+	static const int32 TILES_PER_BIN = BIN_WIDTH / TILE_SIZE;
+	static const int32 TILES_X = FRAMEBUFFER_WIDTH / TILE_SIZE;
+	static const int32 TILES_Y = FRAMEBUFFER_HEIGHT / TILE_SIZE;
+
+	/**
+	 * Piecewise linear mapping, per axis, from linear buffer positions to the variable resolution buffer: a center region
+	 * and two edge regions, each scaled uniformly. Rectangles map to rectangles, triangles are split at the region edges.
+	 */
+	struct FFoveation
+	{
+		bool bEnabled = false;
+		float Size[2] = { FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT };
+		// Center region edges, in linear and in warped buffer positions
+		float LinearMin[2] = { 0.0f, 0.0f };
+		float LinearMax[2] = { FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT };
+		float WarpedMin[2] = { 0.0f, 0.0f };
+		float WarpedMax[2] = { FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT };
+
+		static float Map(float P, float FromMin, float FromMax, float ToMin, float ToMax, float AxisSize)
+		{
+			if (P < FromMin)
+			{
+				return P * ToMin / FromMin;
+			}
+			if (P > FromMax)
+			{
+				return ToMax + (P - FromMax) * (AxisSize - ToMax) / (AxisSize - FromMax);
+			}
+			return ToMin + (P - FromMin) * (ToMax - ToMin) / (FromMax - FromMin);
+		}
+
+		float Warp(int32 Axis, float P) const
+		{
+			return bEnabled ? Map(P, LinearMin[Axis], LinearMax[Axis], WarpedMin[Axis], WarpedMax[Axis], Size[Axis]) : P;
+		}
+
+		float Unwarp(int32 Axis, float Q) const
+		{
+			return bEnabled ? Map(Q, WarpedMin[Axis], WarpedMax[Axis], LinearMin[Axis], LinearMax[Axis], Size[Axis]) : Q;
+		}
+	};
+
+	struct FFramebufferBin
+	{
+		uint64 Data[FRAMEBUFFER_HEIGHT];
+		uint64 Type[FRAMEBUFFER_HEIGHT];
+		// Farthest depth of the occluder triangles that covered pixels of each tile
+		float TileDepth[TILES_Y][TILES_PER_BIN];
+	};
+
+	/** Counters and phase timings of one view */
+	struct FViewStats
+	{
+		int32 NumTriangles = 0;
+		// Occluder triangles transformed and set up, before clipping and culling
+		int32 NumOccluderSetupTris = 0;
+		int32 NumRasterizedOccluderTris = 0;
+		int32 NumRasterizedOccludeeTris = 0;
+		int32 NumExpandedGroups = 0;
+		// Occluders skipped as covered by the reprojected coverage of the previous frame
+		int32 NumSkippedOccluders = 0;
+		double OccluderSeconds = 0.0;
+		double OccludeeSeconds = 0.0;
+		double SortSeconds = 0.0;
+		double RasterizeSeconds = 0.0;
+	};
+
+	/** Culling mistakes of a frame, found by MeasureCullingAccuracy against the reference rasterizer */
+	struct FAccuracyStats
+	{
+		bool bMeasured = false;
+		// Primitive occludees visible in the reference
+		int32 NumReferenceVisible = 0;
+		// Visible but hidden in the reference are missed culling, occluded but visible in the reference are errors
+		int32 NumFalseVisible = 0;
+		int32 NumFalseOccluded = 0;
+		int32 NumFalseVisibleShadows = 0;
+		int32 NumFalseOccludedShadows = 0;
+		double ReferenceSeconds = 0.0;
+	};
+
+	struct FViewResults
+	{
+		FFramebufferBin Bins[BIN_NUM];
+		// View the bins were rasterized with, to test occludees against them later
+		FMat4 ViewProj;
+		FFoveation Foveation;
+		float ClipW = 0.0f;
+		bool bShadowView = false;
+		// Visibility of each occludee in this view, indexed like FScene::OccludeeBoxMinMax pairs
+		std::vector<uint8> OccludeeVisible;
+		FViewStats Stats;
+	};
+
+	struct FOccluderMesh
+	{
+		FMat4 LocalToWorld;
+		FBox3 WorldBounds;
+		// Not owned, must outlive the processing of the scene
+		const FVec3* Vertices = nullptr;
+		int32 NumVertices = 0;
+		const uint16* Indices = nullptr;
+		int32 NumIndices = 0;
+	};
+
+	struct FOrientedBox
+	{
+		FMat4 BoxToWorld;
+		// Min and max are read as a pair, like FScene::OccludeeBoxMinMax
+		FVec3 Min;
+		FVec3 Max;
+	};
+
+	struct FSceneView
+	{
+		FMat4 ViewProj;
+		FFoveation Foveation;
+		// Vertices with a smaller clip space W are behind the near plane, orthographic views never clip
+		float ClipW = 0.0f;
+		bool bReverseCulling = false;
+		// Orthographic light view, only decides whether occluded shadow casters still need their shadow
+		bool bShadowView = false;
+	};
+
+	struct FScene
+	{
+		// Occluder and occludee geometry is shared by all views
+		std::vector<FSceneView> Views;
+		std::vector<FVec3> OccludeeBoxMinMax; // world aligned, also kept for oriented boxes
+		std::vector<int32> OccludeeBoxOrientedIdx; // into OccludeeOrientedBoxes, -1 for world aligned boxes
+		std::vector<FOrientedBox> OccludeeOrientedBoxes;
+		// Sorted by weight, each view rasterizes at most MaxRasterizedOccluders of them
+		std::vector<FOccluderMesh> Occluders;
+		int32 NumOccluderTriangles = 0;
+		int32 MaxRasterizedOccluders = 0x7fffffff;
+
+		// Primitive occludees come first, they are followed by one shadow volume per shadow caster and shadow view.
+		// Shadow volumes are only tested by regular views, shadow views only test the primitives.
+		int32 NumPrimitiveOccludees = 0;
+		std::vector<int32> ShadowVolumeCasterIdx;
+		std::vector<int32> ShadowVolumeViewIdx;
+
+		// Primitive occludees close to each other are grouped by BuildOccludeeGroups. A group box is tested first and its members
+		// are only projected once the group is found visible. Top level boxes are the groups and the occludees not in any group,
+		// shadow volumes last so shadow views can skip them.
+		std::vector<int32> OccludeeGroupMembers;
+		std::vector<int32> OccludeeGroupFirstMember; // one entry per group plus one, ranges into OccludeeGroupMembers
+		std::vector<FVec3> TopLevelBoxMinMax;
+		std::vector<int32> TopLevelBoxId; // occludee index, or group index encoded by EncodeOccludeeGroup
+		std::vector<int32> TopLevelBoxOrientedIdx;
+		int32 NumTopLevelPrimitiveBoxes = 0;
+
+		// Reproject the coverage kept in FHistory to skip occluders it covers
+		bool bReprojection = false;
+		bool bUseSIMD = true;
+
+		int32 NumOccludees() const { return (int32)OccludeeBoxOrientedIdx.size(); }
+
+		/** Empties the scene to gather the next frame into it, keeping the memory */
+		void Reset()
+		{
+			Views.clear();
+			OccludeeBoxMinMax.clear();
+			OccludeeBoxOrientedIdx.clear();
+			OccludeeOrientedBoxes.clear();
+			Occluders.clear();
+			NumOccluderTriangles = 0;
+			MaxRasterizedOccluders = 0x7fffffff;
+			NumPrimitiveOccludees = 0;
+			ShadowVolumeCasterIdx.clear();
+			ShadowVolumeViewIdx.clear();
+			OccludeeGroupMembers.clear();
+			OccludeeGroupFirstMember.clear();
+			TopLevelBoxMinMax.clear();
+			TopLevelBoxId.clear();
+			TopLevelBoxOrientedIdx.clear();
+			NumTopLevelPrimitiveBoxes = 0;
+			bReprojection = false;
+			bUseSIMD = true;
+		}
+
+		/** Adds a world aligned occludee box, returns its index */
+		int32 AddOccludee(const FBox3& Box)
+		{
+			OccludeeBoxMinMax.push_back(Box.Min);
+			OccludeeBoxMinMax.push_back(Box.Max);
+			OccludeeBoxOrientedIdx.push_back(-1);
+			return NumOccludees() - 1;
+		}
+
+		/** Adds an occludee projected with its oriented box, Box is its world aligned bounds. Returns its index. */
+		int32 AddOccludee(const FBox3& Box, const FOrientedBox& OrientedBox)
+		{
+			const int32 OccludeeIdx = AddOccludee(Box);
+			OccludeeBoxOrientedIdx.back() = (int32)OccludeeOrientedBoxes.size();
+			OccludeeOrientedBoxes.push_back(OrientedBox);
+			return OccludeeIdx;
+		}
+	};
+
+	/** Coverage of a view kept for the next frame */
+	struct FHistoryView
+	{
+		FMat4 ViewProj;
+		FFoveation Foveation;
+		bool bShadowView = false;
+		// Farthest occluder depth of each fully covered tile, 0 (the far plane) for tiles that weren't fully covered
+		std::vector<float> TileDepth;
+	};
+
+	struct FHistory
+	{
+		std::vector<FHistoryView> Views;
+		// Written by the frame being processed then swapped with Views, so the tile depths are allocated once
+		std::vector<FHistoryView> NextViews;
+	};
+
+	struct FFrameResults
+	{
+		std::vector<FViewResults> Views;
+		// Visibility of each occludee combined over the regular views
+		std::vector<uint8> OccludeeVisible;
+		// Per shadow volume: the caster is lit by its light, or out of its light view, and the volume its shadow sweeps is visible
+		std::vector<uint8> ShadowVolumeVisible;
+		// Only filled by MeasureCullingAccuracy
+		FAccuracyStats Accuracy;
+
+		SNOWOCCLUSIONCORE_API void Reset(int32 NumViews);
+	};
+
+	/** Runs Body for every index in [0, Num), possibly in parallel. Null runs them in order. */
+	using FParallelFor = std::function<void(int32 Num, const std::function<void(int32)>& Body)>;
+
+	/**
+	 * Marks the stages of the core for a profiler, called on the thread running the stage. EndScope is only called
+	 * when BeginScope returned true. Names are string literals.
+	 */
+	struct FProfilerHooks
+	{
+		bool (*BeginScope)(const char* Name) = nullptr;
+		void (*EndScope)() = nullptr;
+	};
+
+	/** Sets the profiler hooks, while no frame is being processed */
+	SNOWOCCLUSIONCORE_API void SetProfilerHooks(const FProfilerHooks& Hooks);
+
+	inline int32 EncodeOccludeeGroup(int32 GroupIdx)
+	{
+		return -1 - GroupIdx;
+	}
+
+	/** Instruction set the kernels were built for: SSE2, NEON or scalar */
+	SNOWOCCLUSIONCORE_API const char* GetSimdName();
+
+	/** World to clip space matrix of a perspective or orthographic view, and its near clip W */
+	SNOWOCCLUSIONCORE_API float ComputeClipW(const FMat4& ViewProj, bool bOrthographic);
+
+	/**
+	 * Whether a box lies entirely in the clip volume of a view, depth range included. A light view can only find a shadow
+	 * caster unlit if it holds all of it, the part outside could still be lit.
+	 */
+	SNOWOCCLUSIONCORE_API bool IsBoxInsideView(const FSceneView& View, const FBox3& Box);
+
+	/** Mapping that gives the center region CenterResolution of the buffer on each axis, CenterSize is its size as a fraction of the view */
+	SNOWOCCLUSIONCORE_API FFoveation MakeFoveation(bool bEnabled, float CenterSize, float CenterResolution);
+
+	/** Groups the primitive occludees by grid cell and fills the top level boxes. Returns the number of groups. Scratch memory comes from Arena, if given. */
+	SNOWOCCLUSIONCORE_API int32 BuildOccludeeGroups(FScene& Scene, float CellSize, int32 MinMembers, FLinearArena* Arena = nullptr);
+
+	/**
+	 * Rasterizes the occluders of one view and tests the occludees. PrevHistory is last frame's coverage of the view, if any.
+	 * Transient data comes from Arena, if given, the caller resets it.
+	 */
+	SNOWOCCLUSIONCORE_API void ProcessOcclusionView(const FScene& Scene, int32 ViewIdx, const FHistoryView* PrevHistory, FHistoryView* OutHistory, FViewResults& OutResults, FLinearArena* Arena = nullptr);
+
+	/**
+	 * Processes every view and combines their results. History, if given, is read and replaced for reprojection.
+	 * Arena, if given, is reset and holds the transient data of the frame, without it that data comes from the heap.
+	 */
+	SNOWOCCLUSIONCORE_API void ProcessOcclusionFrame(const FScene& Scene, FHistory* History, FFrameResults& OutResults, const FParallelFor& ParallelFor = nullptr, FFrameArena* Arena = nullptr);
+
+	/** Whether a box is visible in any regular view of finished results, its screen rectangle grown by MarginPixels */
+	SNOWOCCLUSIONCORE_API bool IsBoxVisibleInResults(const std::vector<FViewResults>& Views, const FBox3& Box, const FOrientedBox* OrientedBox, int32 MarginPixels, bool bUseSIMD);
+}
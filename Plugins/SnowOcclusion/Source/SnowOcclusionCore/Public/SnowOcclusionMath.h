@@ -0,0 +1,159 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionMath.h: minimal math for the occlusion core.
+	Row vectors like Unreal: a point is transformed by Point * Matrix, and
+	A * B applies A first.
+=============================================================================*/
+
+#include <cstdint>
+
+namespace SnowOcclusion
+{
+	using int32 = std::int32_t;
+	using uint8 = std::uint8_t;
+	using uint16 = std::uint16_t;
+	using uint32 = std::uint32_t;
+	using uint64 = std::uint64_t;
+
+	struct FVec2
+	{
+		float X, Y;
+
+		float operator[](int32 Axis) const { return Axis == 0 ? X : Y; }
+		FVec2 operator+(const FVec2& Other) const { return { X + Other.X, Y + Other.Y }; }
+		FVec2 operator-(const FVec2& Other) const { return { X - Other.X, Y - Other.Y }; }
+		FVec2 operator*(float Scale) const { return { X * Scale, Y * Scale }; }
+	};
+
+	struct FVec3
+	{
+		float X, Y, Z;
+
+		FVec3 operator+(const FVec3& Other) const { return { X + Other.X, Y + Other.Y, Z + Other.Z }; }
+		FVec3 operator-(const FVec3& Other) const { return { X - Other.X, Y - Other.Y, Z - Other.Z }; }
+		FVec3 operator*(float Scale) const { return { X * Scale, Y * Scale, Z * Scale }; }
+	};
+
+	struct alignas(16) FVec4
+	{
+		float X, Y, Z, W;
+
+		FVec4 operator+(const FVec4& Other) const { return { X + Other.X, Y + Other.Y, Z + Other.Z, W + Other.W }; }
+		FVec4 operator-(const FVec4& Other) const { return { X - Other.X, Y - Other.Y, Z - Other.Z, W - Other.W }; }
+		FVec4 operator*(float Scale) const { return { X * Scale, Y * Scale, Z * Scale, W * Scale }; }
+		FVec4 operator/(float Scale) const { return { X / Scale, Y / Scale, Z / Scale, W / Scale }; }
+	};
+
+	struct FBox3
+	{
+		FVec3 Min;
+		FVec3 Max;
+	};
+
+	struct alignas(16) FMat4
+	{
+		float M[4][4];
+
+		static FMat4 Identity()
+		{
+			FMat4 Result = {};
+			Result.M[0][0] = Result.M[1][1] = Result.M[2][2] = Result.M[3][3] = 1.0f;
+			return Result;
+		}
+
+		FMat4 operator*(const FMat4& Other) const
+		{
+			FMat4 Result;
+			for (int32 Row = 0; Row < 4; ++Row)
+			{
+				for (int32 Col = 0; Col < 4; ++Col)
+				{
+					Result.M[Row][Col] = M[Row][0] * Other.M[0][Col] + M[Row][1] * Other.M[1][Col] + M[Row][2] * Other.M[2][Col] + M[Row][3] * Other.M[3][Col];
+				}
+			}
+			return Result;
+		}
+
+		FVec4 TransformVec4(const FVec4& V) const
+		{
+			return {
+				V.X * M[0][0] + V.Y * M[1][0] + V.Z * M[2][0] + V.W * M[3][0],
+				V.X * M[0][1] + V.Y * M[1][1] + V.Z * M[2][1] + V.W * M[3][1],
+				V.X * M[0][2] + V.Y * M[1][2] + V.Z * M[2][2] + V.W * M[3][2],
+				V.X * M[0][3] + V.Y * M[1][3] + V.Z * M[2][3] + V.W * M[3][3]
+			};
+		}
+
+		/** General inverse, computed in double precision. Singular matrices return the identity. */
+		FMat4 Inverse() const
+		{
+			double A[4][8];
+			for (int32 Row = 0; Row < 4; ++Row)
+			{
+				for (int32 Col = 0; Col < 4; ++Col)
+				{
+					A[Row][Col] = M[Row][Col];
+					A[Row][Col + 4] = Row == Col ? 1.0 : 0.0;
+				}
+			}
+
+			for (int32 Col = 0; Col < 4; ++Col)
+			{
+				int32 Pivot = Col;
+				for (int32 Row = Col + 1; Row < 4; ++Row)
+				{
+					if ((A[Row][Col] < 0 ? -A[Row][Col] : A[Row][Col]) > (A[Pivot][Col] < 0 ? -A[Pivot][Col] : A[Pivot][Col]))
+					{
+						Pivot = Row;
+					}
+				}
+
+				if (A[Pivot][Col] == 0.0)
+				{
+					return Identity();
+				}
+
+				if (Pivot != Col)
+				{
+					for (int32 k = 0; k < 8; ++k)
+					{
+						const double Temp = A[Col][k];
+						A[Col][k] = A[Pivot][k];
+						A[Pivot][k] = Temp;
+					}
+				}
+
+				const double InvPivot = 1.0 / A[Col][Col];
+				for (int32 k = 0; k < 8; ++k)
+				{
+					A[Col][k] *= InvPivot;
+				}
+
+				for (int32 Row = 0; Row < 4; ++Row)
+				{
+					if (Row != Col && A[Row][Col] != 0.0)
+					{
+						const double Factor = A[Row][Col];
+						for (int32 k = 0; k < 8; ++k)
+						{
+							A[Row][k] -= Factor * A[Col][k];
+						}
+					}
+				}
+			}
+
+			FMat4 Result;
+			for (int32 Row = 0; Row < 4; ++Row)
+			{
+				for (int32 Col = 0; Col < 4; ++Col)
+				{
+					Result.M[Row][Col] = (float)A[Row][Col + 4];
+				}
+			}
+			return Result;
+		}
+	};
+}
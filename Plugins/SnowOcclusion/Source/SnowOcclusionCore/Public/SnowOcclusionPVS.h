@@ -0,0 +1,88 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionPVS.h: baked potentially visible sets.
+	A grid of cells over where the camera goes, each cell lists the static
+	primitives seen from anywhere in it. The sets are baked offline by
+	rasterizing cube views at points over every cell with the core, cells
+	with the same set share it and sets are run length coded. At runtime
+	the sets of the cells the camera is in cull static primitives before
+	anything is rasterized.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+
+namespace SnowOcclusion
+{
+	/** Set of the cells nothing was baked for, everything is visible from them */
+	static const int32 PVS_NO_SET = -1;
+
+	/** Cells on each axis of the grid */
+	static const int32 MAX_PVS_GRID_SIZE = 1024;
+
+	struct FPVSBakeSettings
+	{
+		float CellSize = 400.0f;
+		// Sample points along each cell edge, corners included and shared with the neighbouring cells. At least 2.
+		int32 SamplesPerEdge = 2;
+		// Primitive boxes are grown by this much while baking, for the places between the samples
+		float BoxMargin = 50.0f;
+		// Near plane of the cube views, boxes closer than that to a sample are visible
+		float Near = 10.0f;
+		// Occludee group cell size of the bake scene, 0 disables groups
+		float GroupCellSize = 2000.0f;
+		bool bUseSIMD = true;
+	};
+
+	struct FPVSBakeStats
+	{
+		int32 NumCells = 0;
+		int32 NumBakedCells = 0;
+		int32 NumSamples = 0;
+		int32 NumSets = 0;
+		// Visible primitives summed over the baked cells
+		uint64 NumVisible = 0;
+		size_t NumBytes = 0;
+		double Seconds = 0.0;
+	};
+
+	struct FPVS
+	{
+		// Minimum corner of the grid
+		FVec3 Origin = { 0.0f, 0.0f, 0.0f };
+		float CellSize = 0.0f;
+		int32 GridSize[3] = { 0, 0, 0 };
+		int32 NumPrimitives = 0;
+		// Set of each cell, X first then Y then Z, PVS_NO_SET for cells not baked
+		std::vector<int32> CellSets;
+		// Run length coded sets: alternating runs of hidden and visible primitives, hidden first, as variable length integers
+		std::vector<uint8> SetData;
+		std::vector<uint32> SetFirstByte; // one entry per set plus one, ranges into SetData
+
+		bool IsEmpty() const { return CellSets.empty(); }
+		int32 NumSets() const { return SetFirstByte.empty() ? 0 : (int32)SetFirstByte.size() - 1; }
+
+		/** The sets of the cells ViewerBounds touches, each once. False if it reaches out of the grid or into a cell not baked. */
+		SNOWOCCLUSIONCORE_API bool FindSets(const FBox3& ViewerBounds, std::vector<int32>& OutSets) const;
+
+		/** Sets InOutVisible to 1 for the primitives of a set, one byte per primitive */
+		SNOWOCCLUSIONCORE_API void AddSetVisible(int32 SetIdx, uint8* InOutVisible) const;
+
+		/** Little endian bytes with a magic and a version, what the engine stores in the baked asset */
+		SNOWOCCLUSIONCORE_API void Serialize(std::vector<uint8>& OutBytes) const;
+		SNOWOCCLUSIONCORE_API bool Deserialize(const uint8* Bytes, size_t Size);
+	};
+
+	/** Whether the camera goes anywhere in a cell, only those get a set */
+	using FPVSCellFilter = std::function<bool(const FBox3& Cell)>;
+
+	/**
+	 * Bakes the sets of a grid over Bounds. The primitives are boxes, Min, Max pairs like FScene::OccludeeBoxMinMax, hidden
+	 * by Occluders. A point sees what the six views of a cube around it see, a cell what its sample points see. Cells
+	 * IsCellUsed, if given, rejects get no set. Sample points run in parallel with ParallelFor, if given.
+	 */
+	SNOWOCCLUSIONCORE_API void BakePVS(const std::vector<FOccluderMesh>& Occluders, const FVec3* BoxMinMax, int32 NumBoxes, const FBox3& Bounds,
+		const FPVSBakeSettings& Settings, const FPVSCellFilter& IsCellUsed, FPVS& Out, FPVSBakeStats* OutStats = nullptr, const FParallelFor& ParallelFor = nullptr);
+}
@@ -0,0 +1,109 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionPortals.h: cell and portal visibility for interiors.
+	Cells are boxes, portals are the openings between them. A traversal
+	from the cells of the camera narrows the screen rectangle through every
+	portal it sees, boxes are only visible where the rectangle their cells
+	were reached with covers them. Cheap enough to cull occludees before the
+	rasterizer, whatever the number of walls.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+
+namespace SnowOcclusion
+{
+	/** Portal side that leads out of the cells, into the space no cell covers */
+	static const int32 PORTAL_EXTERIOR = -1;
+
+	/** Portals reached through more portals than this aren't followed */
+	static const int32 MAX_PORTAL_DEPTH = 32;
+
+	/** Squares on each axis of the grid that finds the cells a box touches */
+	static const int32 MAX_PORTAL_GRID_SIZE = 256;
+
+	struct FPortal
+	{
+		// Corners in order around the opening, either winding
+		FVec3 Corners[4];
+		// Cells on either side, Cells[1] is PORTAL_EXTERIOR for openings to the outside
+		int32 Cells[2];
+	};
+
+	struct FPortalGraph
+	{
+		std::vector<FBox3> Cells;
+		std::vector<FPortal> Portals;
+
+		// Filled by LinkPortals: the portals of each cell, and the ones leading outside
+		std::vector<int32> CellPortals;
+		std::vector<int32> CellFirstPortal; // one entry per cell plus one, ranges into CellPortals
+		std::vector<int32> ExteriorPortals;
+
+		// Filled by LinkPortals too: a grid on the XY bounds of the cells, about a square per cell, listing the cells over each square
+		FBox3 CellBounds = {};
+		int32 GridSize[2] = { 0, 0 };
+		float GridSquaresPerUnit[2] = { 0.0f, 0.0f };
+		std::vector<int32> GridCells;
+		std::vector<int32> GridFirstCell; // one entry per square plus one, ranges into GridCells
+
+		bool IsEmpty() const { return Cells.empty(); }
+
+		void Reset()
+		{
+			Cells.clear();
+			Portals.clear();
+			CellPortals.clear();
+			CellFirstPortal.clear();
+			ExteriorPortals.clear();
+			GridSize[0] = GridSize[1] = 0;
+			GridCells.clear();
+			GridFirstCell.clear();
+		}
+
+		/** Indexes the portals by cell and the cells by grid square, once Cells and Portals are filled */
+		SNOWOCCLUSIONCORE_API void LinkPortals();
+	};
+
+	/** Screen rectangle in normalized device coordinates */
+	struct FPortalRect
+	{
+		float MinX = 1.0f;
+		float MinY = 1.0f;
+		float MaxX = -1.0f;
+		float MaxY = -1.0f;
+
+		bool IsEmpty() const { return MinX > MaxX || MinY > MaxY; }
+		static FPortalRect Full() { return { -1.0f, -1.0f, 1.0f, 1.0f }; }
+	};
+
+	/** What a view sees of the cells */
+	struct FPortalVisibility
+	{
+		// Bounding rectangle of everything the view sees of each cell through portals, empty for cells it doesn't see
+		std::vector<FPortalRect> CellRects;
+		FPortalRect ExteriorRect;
+		int32 NumVisibleCells = 0;
+		// Traversal steps taken, the work grows with the portals seen rather than the walls
+		int32 NumSteps = 0;
+	};
+
+	/**
+	 * Walks the portals from the cells ViewerBounds touches, from the exterior if it touches none. ViewerBounds holds the eye
+	 * wherever it may be while the results are used, so a camera about to step through a doorway already sees both cells.
+	 */
+	SNOWOCCLUSIONCORE_API void ComputePortalVisibility(const FPortalGraph& Graph, const FBox3& ViewerBounds, const FMat4& ViewProj, FPortalVisibility& Out);
+
+	/**
+	 * Whether any cell Box touches is seen where Box is on screen. Boxes not entirely inside the cells are also
+	 * tested against the exterior. Boxes off screen are visible, frustum culling is left to the engine like for
+	 * the rasterizer, and so are boxes crossing the near plane.
+	 */
+	SNOWOCCLUSIONCORE_API bool IsBoxPortalVisible(const FPortalGraph& Graph, const FPortalVisibility& Visibility, const FMat4& ViewProj, const FBox3& Box);
+
+	/** IsBoxPortalVisible for Min, Max pairs like FScene::OccludeeBoxMinMax. Boxes already visible are skipped, so views can add up. */
+	SNOWOCCLUSIONCORE_API void TestBoxesPortalVisible(const FPortalGraph& Graph, const FPortalVisibility& Visibility, const FMat4& ViewProj,
+		const FVec3* BoxMinMax, int32 NumBoxes, uint8* InOutVisible);
+}
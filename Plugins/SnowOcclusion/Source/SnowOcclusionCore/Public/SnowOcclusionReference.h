@@ -0,0 +1,29 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionReference.h: reference rasterizer to measure culling accuracy.
+	Draws every occluder into a float depth buffer at a multiple of the
+	occlusion buffer resolution and tests the occludee box faces per sample,
+	with no bins, no per-bin sort, no budget and no reprojection. Comparing
+	with it tells what the coarse buffer misses and where it culls wrongly.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+
+namespace SnowOcclusion
+{
+	/** Reference buffer size as a multiple of FRAMEBUFFER_WIDTH x FRAMEBUFFER_HEIGHT */
+	static const int32 DEFAULT_REFERENCE_SCALE = 4;
+	static const int32 MAX_REFERENCE_SCALE = 8;
+
+	/**
+	 * Visibility of each occludee of a view in the reference, indexed like FScene::OccludeeBoxMinMax pairs.
+	 * Like the core, shadow views only test the primitives and boxes crossing the near plane are visible.
+	 */
+	SNOWOCCLUSIONCORE_API void ComputeReferenceVisibility(const FScene& Scene, int32 ViewIdx, int32 Scale, std::vector<uint8>& OutOccludeeVisible);
+
+	/** Compares processed results with the reference and fills Results.Accuracy. Slow, meant for tuning and debugging. */
+	SNOWOCCLUSIONCORE_API void MeasureCullingAccuracy(const FScene& Scene, FFrameResults& Results, int32 Scale, const FParallelFor& ParallelFor = nullptr);
+}
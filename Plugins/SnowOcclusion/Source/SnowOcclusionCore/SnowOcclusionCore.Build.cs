@@ -0,0 +1,26 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+using UnrealBuildTool;
+
+// Engine independent occlusion kernels. Only the module boilerplate touches the engine,
+// the same sources build standalone through Plugins/SnowOcclusion/Tools/CMakeLists.txt.
+public class SnowOcclusionCore : ModuleRules
+{
+	public SnowOcclusionCore(ReadOnlyTargetRules Target) : base(Target)
+	{
+		PCHUsage = PCHUsageMode.UseExplicitOrSharedPCHs;
+
+		bUseUnity = false;
+
+		PrivateDependencyModuleNames.AddRange(new string[]
+		{
+			"Core",
+		});
+
+		// The occludee debug buffer is only drawn by development builds
+		if (Target.Configuration == UnrealTargetConfiguration.Shipping || Target.Configuration == UnrealTargetConfiguration.Test)
+		{
+			PrivateDefinitions.Add("SNOWOCCLUSION_DEBUG_BUFFER=0");
+		}
+	}
+}
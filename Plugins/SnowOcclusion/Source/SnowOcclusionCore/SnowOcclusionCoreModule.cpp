@@ -0,0 +1,5 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "Modules/ModuleManager.h"
+
+IMPLEMENT_MODULE(FDefaultModuleImpl, SnowOcclusionCore);
@@ -0,0 +1,516 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "SnowOcclusionSyntheticScene.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <random>
+
+namespace SnowOcclusion
+{
+	namespace
+	{
+		const float PI = 3.14159265358979f;
+		const FVec3 CameraOrigin = { 0.0f, 0.0f, 170.0f };
+
+		// Low sun from behind the camera's left, unit length, and how far a shadow volume reaches along it like r.so.ShadowVolumeLength
+		const FVec3 SunDirection = { 0.6f, 0.48f, -0.64f };
+		const float ShadowVolumeLength = 2000.0f;
+
+		// Generated occluders stay out of the line of sight from the camera to the near occludee
+		const FBox3 ClearZone = { { -300.0f, -120.0f, -1e30f }, { 650.0f, 120.0f, 1e30f } };
+
+		bool Intersects(const FBox3& A, const FBox3& B)
+		{
+			return A.Min.X <= B.Max.X && A.Max.X >= B.Min.X && A.Min.Y <= B.Max.Y && A.Max.Y >= B.Min.Y && A.Min.Z <= B.Max.Z && A.Max.Z >= B.Min.Z;
+		}
+
+		/** Unit box around the origin, each face split in Steps x Steps quads, outward facing triangles */
+		void BuildBoxMesh(int32 Steps, std::vector<FVec3>& OutVertices, std::vector<uint16>& OutIndices)
+		{
+			// Corner and edge directions of each face, U x V points inwards
+			struct FFace { FVec3 Origin, U, V; };
+			static const FFace Faces[6] =
+			{
+				{ { -0.5f, -0.5f, -0.5f }, { 1, 0, 0 }, { 0, 1, 0 } }, // -Z
+				{ { -0.5f, -0.5f, 0.5f }, { 0, 1, 0 }, { 1, 0, 0 } }, // +Z
+				{ { -0.5f, -0.5f, -0.5f }, { 0, 0, 1 }, { 1, 0, 0 } }, // -Y
+				{ { -0.5f, 0.5f, -0.5f }, { 1, 0, 0 }, { 0, 0, 1 } }, // +Y
+				{ { -0.5f, -0.5f, -0.5f }, { 0, 1, 0 }, { 0, 0, 1 } }, // -X
+				{ { 0.5f, -0.5f, -0.5f }, { 0, 0, 1 }, { 0, 1, 0 } }, // +X
+			};
+
+			OutVertices.clear();
+			OutIndices.clear();
+			for (const FFace& Face : Faces)
+			{
+				const int32 FirstVertex = (int32)OutVertices.size();
+				for (int32 B = 0; B <= Steps; ++B)
+				{
+					for (int32 A = 0; A <= Steps; ++A)
+					{
+						OutVertices.push_back(Face.Origin + Face.U * ((float)A / Steps) + Face.V * ((float)B / Steps));
+					}
+				}
+
+				for (int32 B = 0; B < Steps; ++B)
+				{
+					for (int32 A = 0; A < Steps; ++A)
+					{
+						const uint16 P00 = (uint16)(FirstVertex + B * (Steps + 1) + A);
+						const uint16 P10 = (uint16)(P00 + 1);
+						const uint16 P01 = (uint16)(P00 + Steps + 1);
+						const uint16 P11 = (uint16)(P01 + 1);
+						const uint16 Quad[6] = { P00, P11, P10, P00, P01, P11 };
+						OutIndices.insert(OutIndices.end(), Quad, Quad + 6);
+					}
+				}
+			}
+		}
+
+		struct FSceneBuilder
+		{
+			FSyntheticScene& Out;
+			std::mt19937 Random;
+			std::uniform_real_distribution<float> Unit{ 0.0f, 1.0f };
+
+			FSceneBuilder(FSyntheticScene& InOut, uint32 Seed)
+				: Out(InOut)
+				, Random(Seed)
+			{
+			}
+
+			float Range(float Min, float Max)
+			{
+				return Min + Unit(Random) * (Max - Min);
+			}
+
+			FVec3 PointInDisc(float MinRadius, float MaxRadius, float MinZ, float MaxZ)
+			{
+				const float Angle = Unit(Random) * 2.0f * PI;
+				const float Distance = Range(MinRadius, MaxRadius);
+				return { std::cos(Angle) * Distance, std::sin(Angle) * Distance, Range(MinZ, MaxZ) };
+			}
+
+			/** Box mesh occluder, false if it would block the clear zone */
+			bool AddOccluder(const FVec3& Scale, float Yaw, const FVec3& Center, bool bKeepClear = true)
+			{
+				const FMat4 LocalToWorld = MakeTransform(Scale, Yaw, Center);
+				const FBox3 WorldBounds = TransformBox(LocalToWorld, { { -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f } });
+				if (bKeepClear && Intersects(WorldBounds, ClearZone))
+				{
+					return false;
+				}
+
+				FOccluderMesh Mesh;
+				Mesh.LocalToWorld = LocalToWorld;
+				Mesh.WorldBounds = WorldBounds;
+				Mesh.Vertices = Out.MeshVertices.data();
+				Mesh.NumVertices = (int32)Out.MeshVertices.size();
+				Mesh.Indices = Out.MeshIndices.data();
+				Mesh.NumIndices = (int32)Out.MeshIndices.size();
+				Out.Scene.Occluders.push_back(Mesh);
+				Out.Scene.NumOccluderTriangles += Mesh.NumIndices / 3;
+				return true;
+			}
+
+			/** Occludee box around Center, some long rotated ones are projected with their oriented box */
+			void AddProp(const FVec3& Center, const FVec3& Extent)
+			{
+				if (Unit(Random) < 0.1f)
+				{
+					FOrientedBox OrientedBox;
+					OrientedBox.BoxToWorld = MakeTransform({ 1.0f, 1.0f, 1.0f }, Unit(Random) * 360.0f, Center);
+					OrientedBox.Min = { -Extent.X * 4.0f, -Extent.Y * 0.25f, -Extent.Z };
+					OrientedBox.Max = { Extent.X * 4.0f, Extent.Y * 0.25f, Extent.Z };
+					Out.Scene.AddOccludee(TransformBox(OrientedBox.BoxToWorld, { OrientedBox.Min, OrientedBox.Max }), OrientedBox);
+				}
+				else
+				{
+					Out.Scene.AddOccludee({ Center - Extent, Center + Extent });
+				}
+			}
+
+			void BuildOpen(const FSyntheticSceneDesc& Desc)
+			{
+				for (int32 Attempt = 0; (int32)Out.Scene.Occluders.size() < Desc.Occluders && Attempt < Desc.Occluders * 16; ++Attempt)
+				{
+					const FVec3 Scale = { Range(50.0f, 250.0f), Range(500.0f, 3500.0f), Range(300.0f, 1500.0f) };
+					FVec3 Center = PointInDisc(2000.0f, 22000.0f, 0.0f, 0.0f);
+					Center.Z = Scale.Z * 0.5f;
+					AddOccluder(Scale, Unit(Random) * 360.0f, Center);
+				}
+
+				for (int32 OccludeeIdx = 0; OccludeeIdx < Desc.Occludees; ++OccludeeIdx)
+				{
+					AddProp(PointInDisc(300.0f, 20300.0f, 0.0f, 500.0f), { Range(25.0f, 175.0f), Range(25.0f, 175.0f), Range(25.0f, 175.0f) });
+				}
+			}
+
+			void BuildCity(const FSyntheticSceneDesc& Desc)
+			{
+				// Blocks between streets running along both axes through the origin, the nearest ones get built first
+				const float Pitch = 4000.0f;
+				const float StreetHalfWidth = 500.0f;
+				const int32 Side = (int32)std::ceil(std::sqrt((float)std::max(Desc.Occluders, 1))) + 1;
+				std::vector<std::pair<int32, int32>> Blocks;
+				for (int32 Y = -Side / 2 - 1; Y <= Side / 2; ++Y)
+				{
+					for (int32 X = -Side / 2 - 1; X <= Side / 2; ++X)
+					{
+						Blocks.emplace_back(X, Y);
+					}
+				}
+				std::stable_sort(Blocks.begin(), Blocks.end(), [](const std::pair<int32, int32>& A, const std::pair<int32, int32>& B) {
+					return (A.first * 2 + 1) * (A.first * 2 + 1) + (A.second * 2 + 1) * (A.second * 2 + 1) < (B.first * 2 + 1) * (B.first * 2 + 1) + (B.second * 2 + 1) * (B.second * 2 + 1);
+				});
+
+				float CityRadius = Pitch;
+				for (const std::pair<int32, int32>& Block : Blocks)
+				{
+					if ((int32)Out.Scene.Occluders.size() >= Desc.Occluders)
+					{
+						break;
+					}
+
+					const float BlockSize = Pitch - StreetHalfWidth * 2.0f;
+					const FVec3 Scale = { BlockSize * Range(0.6f, 1.0f), BlockSize * Range(0.6f, 1.0f), Range(1000.0f, 8000.0f) };
+					const FVec3 Center =
+					{
+						Block.first * Pitch + StreetHalfWidth + Scale.X * 0.5f + Range(0.0f, BlockSize - Scale.X),
+						Block.second * Pitch + StreetHalfWidth + Scale.Y * 0.5f + Range(0.0f, BlockSize - Scale.Y),
+						Scale.Z * 0.5f
+					};
+					if (AddOccluder(Scale, 0.0f, Center))
+					{
+						CityRadius = std::max(CityRadius, std::max(std::fabs(Center.X), std::fabs(Center.Y)) + Pitch * 0.5f);
+					}
+				}
+
+				// Props on the streets and on the blocks, inside the buildings too
+				for (int32 OccludeeIdx = 0; OccludeeIdx < Desc.Occludees; ++OccludeeIdx)
+				{
+					const FVec3 Center = { Range(-CityRadius, CityRadius), Range(-CityRadius, CityRadius), Range(0.0f, 300.0f) };
+					AddProp(Center, { Range(25.0f, 175.0f), Range(25.0f, 175.0f), Range(25.0f, 175.0f) });
+				}
+			}
+
+			void BuildIndoor(const FSyntheticSceneDesc& Desc)
+			{
+				// Rooms on a grid, each owns its -X and -Y walls, every wall has a doorway. The camera stands in the middle of room 0, 0.
+				const float Pitch = 1200.0f;
+				const float WallThickness = 20.0f;
+				const float WallHeight = 300.0f;
+				const float DoorHalfWidth = 100.0f;
+				const int32 Side = (int32)std::ceil(std::sqrt((float)std::max(Desc.Occluders, 1) / 4.0f)) + 2;
+				std::vector<std::pair<int32, int32>> Rooms;
+				for (int32 Y = -Side / 2; Y <= Side / 2; ++Y)
+				{
+					for (int32 X = -Side / 2; X <= Side / 2; ++X)
+					{
+						Rooms.emplace_back(X, Y);
+					}
+				}
+				std::stable_sort(Rooms.begin(), Rooms.end(), [](const std::pair<int32, int32>& A, const std::pair<int32, int32>& B) {
+					return A.first * A.first + A.second * A.second < B.first * B.first + B.second * B.second;
+				});
+
+				// Doorways, and wall segments left out by the clear zone or the occluder count
+				struct FOpening
+				{
+					std::pair<int32, int32> Room;
+					int32 Axis;
+					float WallPos;
+					float Min;
+					float Max;
+				};
+				std::vector<FOpening> Openings;
+
+				int32 NumRooms = 0;
+				for (const std::pair<int32, int32>& Room : Rooms)
+				{
+					if ((int32)Out.Scene.Occluders.size() >= Desc.Occluders)
+					{
+						break;
+					}
+					NumRooms++;
+
+					for (int32 Axis = 0; Axis < 2; ++Axis)
+					{
+						// The wall runs along the other axis, split in two by the doorway
+						const float WallPos = ((Axis == 0 ? Room.first : Room.second) - 0.5f) * Pitch;
+						const float RoomMin = ((Axis == 0 ? Room.second : Room.first) - 0.5f) * Pitch;
+						const float Door = RoomMin + Pitch * 0.5f + Range(-300.0f, 300.0f);
+						const float Segments[2][2] = { { RoomMin, Door - DoorHalfWidth }, { Door + DoorHalfWidth, RoomMin + Pitch } };
+						Openings.push_back({ Room, Axis, WallPos, Door - DoorHalfWidth, Door + DoorHalfWidth });
+						for (const float* Segment : Segments)
+						{
+							const float Length = Segment[1] - Segment[0];
+							const float Mid = (Segment[0] + Segment[1]) * 0.5f;
+							const FVec3 Scale = Axis == 0 ? FVec3{ WallThickness, Length, WallHeight } : FVec3{ Length, WallThickness, WallHeight };
+							const FVec3 Center = Axis == 0 ? FVec3{ WallPos, Mid, WallHeight * 0.5f } : FVec3{ Mid, WallPos, WallHeight * 0.5f };
+							if ((int32)Out.Scene.Occluders.size() >= Desc.Occluders || !AddOccluder(Scale, 0.0f, Center))
+							{
+								Openings.push_back({ Room, Axis, WallPos, Segment[0], Segment[1] });
+							}
+						}
+					}
+				}
+
+				// A cell per room that got walls, the rooms left out are the exterior
+				FPortalGraph& Graph = Out.Portals;
+				std::map<std::pair<int32, int32>, int32> RoomCells;
+				for (int32 RoomIdx = 0; RoomIdx < NumRooms; ++RoomIdx)
+				{
+					const std::pair<int32, int32>& Room = Rooms[RoomIdx];
+					RoomCells[Room] = RoomIdx;
+					Graph.Cells.push_back({ { (Room.first - 0.5f) * Pitch, (Room.second - 0.5f) * Pitch, 0.0f }, { (Room.first + 0.5f) * Pitch, (Room.second + 0.5f) * Pitch, WallHeight } });
+				}
+				auto FindCell = [&RoomCells](int32 X, int32 Y)
+				{
+					const std::map<std::pair<int32, int32>, int32>::const_iterator Found = RoomCells.find({ X, Y });
+					return Found != RoomCells.end() ? Found->second : PORTAL_EXTERIOR;
+				};
+				auto AddPortal = [&Graph, WallHeight](int32 Axis, float WallPos, float Min, float Max, int32 Cell, int32 OtherCell)
+				{
+					FPortal Portal;
+					for (int32 CornerIdx = 0; CornerIdx < 4; ++CornerIdx)
+					{
+						const float Along = CornerIdx == 1 || CornerIdx == 2 ? Max : Min;
+						const float Z = CornerIdx >= 2 ? WallHeight : 0.0f;
+						Portal.Corners[CornerIdx] = Axis == 0 ? FVec3{ WallPos, Along, Z } : FVec3{ Along, WallPos, Z };
+					}
+					Portal.Cells[0] = Cell;
+					Portal.Cells[1] = OtherCell;
+					Graph.Portals.push_back(Portal);
+				};
+
+				for (const FOpening& Opening : Openings)
+				{
+					const int32 Cell = FindCell(Opening.Room.first, Opening.Room.second);
+					const int32 OtherCell = FindCell(Opening.Room.first - (Opening.Axis == 0), Opening.Room.second - (Opening.Axis == 1));
+					AddPortal(Opening.Axis, Opening.WallPos, Opening.Min, Opening.Max, Cell, OtherCell);
+				}
+
+				// Rooms on the edge have no wall on the sides where no room was built
+				for (int32 RoomIdx = 0; RoomIdx < NumRooms; ++RoomIdx)
+				{
+					const std::pair<int32, int32>& Room = Rooms[RoomIdx];
+					for (int32 Axis = 0; Axis < 2; ++Axis)
+					{
+						if (FindCell(Room.first + (Axis == 0), Room.second + (Axis == 1)) == PORTAL_EXTERIOR)
+						{
+							const float WallPos = ((Axis == 0 ? Room.first : Room.second) + 0.5f) * Pitch;
+							const float RoomMin = ((Axis == 0 ? Room.second : Room.first) - 0.5f) * Pitch;
+							AddPortal(Axis, WallPos, RoomMin, RoomMin + Pitch, RoomIdx, PORTAL_EXTERIOR);
+						}
+					}
+				}
+				Graph.LinkPortals();
+
+				// Furniture in the rooms that got walls
+				for (int32 OccludeeIdx = 0; OccludeeIdx < Desc.Occludees; ++OccludeeIdx)
+				{
+					const std::pair<int32, int32>& Room = Rooms[std::min((int32)(Unit(Random) * NumRooms), NumRooms - 1)];
+					const FVec3 Extent = { Range(20.0f, 100.0f), Range(20.0f, 100.0f), Range(20.0f, 75.0f) };
+					const FVec3 Center = { Room.first * Pitch + Range(-450.0f, 450.0f), Room.second * Pitch + Range(-450.0f, 450.0f), Extent.Z };
+					AddProp(Center, Extent);
+				}
+			}
+
+			void BuildForest(const FSyntheticSceneDesc& Desc)
+			{
+				for (int32 Attempt = 0; (int32)Out.Scene.Occluders.size() < Desc.Occluders && Attempt < Desc.Occluders * 16; ++Attempt)
+				{
+					const FVec3 Scale = { Range(40.0f, 120.0f), Range(40.0f, 120.0f), Range(800.0f, 2500.0f) };
+					FVec3 Center = PointInDisc(300.0f, 20000.0f, 0.0f, 0.0f);
+					Center.Z = Scale.Z * 0.5f;
+					AddOccluder(Scale, Unit(Random) * 360.0f, Center);
+				}
+
+				// Bushes and rocks
+				for (int32 OccludeeIdx = 0; OccludeeIdx < Desc.Occludees; ++OccludeeIdx)
+				{
+					const FVec3 Extent = { Range(25.0f, 150.0f), Range(25.0f, 150.0f), Range(25.0f, 100.0f) };
+					FVec3 Center = PointInDisc(300.0f, 20300.0f, 0.0f, 0.0f);
+					Center.Z = Extent.Z;
+					AddProp(Center, Extent);
+				}
+			}
+		};
+	}
+
+	const char* GetSceneLayoutName(ESceneLayout Layout)
+	{
+		switch (Layout)
+		{
+		case ESceneLayout::City: return "city";
+		case ESceneLayout::Indoor: return "indoor";
+		case ESceneLayout::Forest: return "forest";
+		default: return "open";
+		}
+	}
+
+	bool ParseSceneLayout(const char* Name, ESceneLayout& OutLayout)
+	{
+		const ESceneLayout Layouts[] = { ESceneLayout::Open, ESceneLayout::City, ESceneLayout::Indoor, ESceneLayout::Forest };
+		for (ESceneLayout Layout : Layouts)
+		{
+			if (!std::strcmp(Name, GetSceneLayoutName(Layout)))
+			{
+				OutLayout = Layout;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void BuildSyntheticScene(const FSyntheticSceneDesc& Desc, FSyntheticScene& Out)
+	{
+		// Index buffers are 16 bit, 100 steps is 61206 vertices
+		const int32 Steps = std::min(std::max((int32)std::ceil(std::sqrt(Desc.OccluderTriangles / 12.0f)), 1), 100);
+		BuildBoxMesh(Steps, Out.MeshVertices, Out.MeshIndices);
+
+		FSceneBuilder Builder(Out, Desc.Seed);
+		FScene& Scene = Out.Scene;
+
+		// Every layout starts with a wall right in front of the camera, it hides what is behind it
+		if (Desc.Occluders > 0)
+		{
+			Builder.AddOccluder({ 50.0f, 3000.0f, 1500.0f }, 0.0f, { 1500.0f, 0.0f, 750.0f }, false);
+			Out.HiddenOccludee = Scene.AddOccludee({ { 2500.0f, -100.0f, 0.0f }, { 2700.0f, 100.0f, 200.0f } });
+		}
+		Out.NearOccludee = Scene.AddOccludee({ { 500.0f, -50.0f, 100.0f }, { 600.0f, 50.0f, 200.0f } });
+		Out.ViewerBounds = { CameraOrigin - FVec3{ 10.0f, 10.0f, 10.0f }, CameraOrigin + FVec3{ 10.0f, 10.0f, 10.0f } };
+
+		switch (Desc.Layout)
+		{
+		case ESceneLayout::City: Builder.BuildCity(Desc); break;
+		case ESceneLayout::Indoor: Builder.BuildIndoor(Desc); break;
+		case ESceneLayout::Forest: Builder.BuildForest(Desc); break;
+		default: Builder.BuildOpen(Desc); break;
+		}
+
+		Scene.NumPrimitiveOccludees = Scene.NumOccludees();
+		if (Desc.bShadows)
+		{
+			// The light view comes after the views of each frame, AddSyntheticShadowView points the volumes at it
+			const FVec3 ShadowOffset = SunDirection * ShadowVolumeLength;
+			for (int32 CasterIdx = 0; CasterIdx < Scene.NumPrimitiveOccludees; ++CasterIdx)
+			{
+				const FVec3& Min = Scene.OccludeeBoxMinMax[CasterIdx * 2];
+				const FVec3& Max = Scene.OccludeeBoxMinMax[CasterIdx * 2 + 1];
+				const FVec3 SweptMin = Min + ShadowOffset;
+				const FVec3 SweptMax = Max + ShadowOffset;
+				Scene.AddOccludee({
+					{ std::fmin(Min.X, SweptMin.X), std::fmin(Min.Y, SweptMin.Y), std::fmin(Min.Z, SweptMin.Z) },
+					{ std::fmax(Max.X, SweptMax.X), std::fmax(Max.Y, SweptMax.Y), std::fmax(Max.Z, SweptMax.Z) } });
+				Scene.ShadowVolumeCasterIdx.push_back(CasterIdx);
+				Scene.ShadowVolumeViewIdx.push_back(0);
+			}
+		}
+		Scene.MaxRasterizedOccluders = Desc.MaxRasterizedOccluders;
+		BuildOccludeeGroups(Scene, Desc.GroupCellSize, Desc.GroupMinMembers);
+	}
+
+	void SetupSyntheticViews(int32 NumViews, float Yaw, bool bFoveation, FScene& Scene)
+	{
+		const float EyeOffset = 3.2f;
+		Scene.Views.resize(NumViews);
+		for (int32 ViewIdx = 0; ViewIdx < NumViews; ++ViewIdx)
+		{
+			const float Offset = NumViews == 2 ? (ViewIdx == 0 ? -EyeOffset : EyeOffset) : 0.0f;
+			const float ViewYaw = NumViews > 2 ? Yaw + ViewIdx * 360.0f / NumViews : Yaw;
+			const float C = std::cos(ViewYaw * PI / 180.0f);
+			const float S = std::sin(ViewYaw * PI / 180.0f);
+			const FVec3 EyeOrigin = { CameraOrigin.X - S * Offset, CameraOrigin.Y + C * Offset, CameraOrigin.Z };
+
+			FSceneView& View = Scene.Views[ViewIdx];
+			View.ViewProj = MakeViewProjection(EyeOrigin, ViewYaw, 45.0f, 16.0f / 9.0f, 10.0f);
+			View.ClipW = ComputeClipW(View.ViewProj, false);
+			View.Foveation = MakeFoveation(bFoveation, 0.5f, 0.75f);
+			View.bReverseCulling = false;
+			View.bShadowView = false;
+		}
+	}
+
+	void AddSyntheticShadowView(float Radius, FScene& Scene)
+	{
+		// UE view axes looking down the sun, the right axis stays horizontal
+		const FVec3& Forward = SunDirection;
+		const float RightLength = std::sqrt(Forward.X * Forward.X + Forward.Y * Forward.Y);
+		const FVec3 Right = { -Forward.Y / RightLength, Forward.X / RightLength, 0.0f };
+		const FVec3 Up = { Forward.Y * Right.Z - Forward.Z * Right.Y, Forward.Z * Right.X - Forward.X * Right.Z, Forward.X * Right.Y - Forward.Y * Right.X };
+		const FVec3 Origin = CameraOrigin - Forward * Radius;
+		auto Dot = [](const FVec3& A, const FVec3& B) { return A.X * B.X + A.Y * B.Y + A.Z * B.Z; };
+
+		FMat4 View = FMat4::Identity();
+		View.M[0][0] = Right.X; View.M[0][1] = Up.X; View.M[0][2] = Forward.X;
+		View.M[1][0] = Right.Y; View.M[1][1] = Up.Y; View.M[1][2] = Forward.Y;
+		View.M[2][0] = Right.Z; View.M[2][1] = Up.Z; View.M[2][2] = Forward.Z;
+		View.M[3][0] = -Dot(Origin, Right); View.M[3][1] = -Dot(Origin, Up); View.M[3][2] = -Dot(Origin, Forward);
+
+		// FReversedZOrthoMatrix(Radius, Radius, 0.5 / Radius, 0): depth 1 at the origin down to 0 at twice the radius
+		FMat4 Projection = {};
+		Projection.M[0][0] = 1.0f / Radius;
+		Projection.M[1][1] = 1.0f / Radius;
+		Projection.M[2][2] = -0.5f / Radius;
+		Projection.M[3][2] = 1.0f;
+		Projection.M[3][3] = 1.0f;
+
+		FSceneView& ShadowView = Scene.Views.emplace_back();
+		ShadowView.ViewProj = View * Projection;
+		ShadowView.ClipW = ComputeClipW(ShadowView.ViewProj, true);
+		ShadowView.bShadowView = true;
+		std::fill(Scene.ShadowVolumeViewIdx.begin(), Scene.ShadowVolumeViewIdx.end(), (int32)Scene.Views.size() - 1);
+	}
+
+	FMat4 MakeTransform(const FVec3& Scale, float Yaw, const FVec3& Translation)
+	{
+		const float C = std::cos(Yaw * PI / 180.0f);
+		const float S = std::sin(Yaw * PI / 180.0f);
+		FMat4 Result = FMat4::Identity();
+		Result.M[0][0] = C * Scale.X; Result.M[0][1] = S * Scale.X;
+		Result.M[1][0] = -S * Scale.Y; Result.M[1][1] = C * Scale.Y;
+		Result.M[2][2] = Scale.Z;
+		Result.M[3][0] = Translation.X; Result.M[3][1] = Translation.Y; Result.M[3][2] = Translation.Z;
+		return Result;
+	}
+
+	FBox3 TransformBox(const FMat4& Transform, const FBox3& Box)
+	{
+		FBox3 Result = { { 1e30f, 1e30f, 1e30f }, { -1e30f, -1e30f, -1e30f } };
+		for (int32 Corner = 0; Corner < 8; ++Corner)
+		{
+			const FVec4 P = Transform.TransformVec4({ Corner & 1 ? Box.Max.X : Box.Min.X, Corner & 2 ? Box.Max.Y : Box.Min.Y, Corner & 4 ? Box.Max.Z : Box.Min.Z, 1.0f });
+			Result.Min = { std::fmin(Result.Min.X, P.X), std::fmin(Result.Min.Y, P.Y), std::fmin(Result.Min.Z, P.Z) };
+			Result.Max = { std::fmax(Result.Max.X, P.X), std::fmax(Result.Max.Y, P.Y), std::fmax(Result.Max.Z, P.Z) };
+		}
+		return Result;
+	}
+
+	FMat4 MakeViewProjection(const FVec3& Origin, float Yaw, float HalfFOV, float Aspect, float Near)
+	{
+		const float C = std::cos(Yaw * PI / 180.0f);
+		const float S = std::sin(Yaw * PI / 180.0f);
+		const FVec3 Forward = { C, S, 0.0f };
+		const FVec3 Right = { -S, C, 0.0f };
+		const FVec3 Up = { 0.0f, 0.0f, 1.0f };
+		auto Dot = [](const FVec3& A, const FVec3& B) { return A.X * B.X + A.Y * B.Y + A.Z * B.Z; };
+
+		FMat4 View = FMat4::Identity();
+		View.M[0][0] = Right.X; View.M[0][1] = Up.X; View.M[0][2] = Forward.X;
+		View.M[1][0] = Right.Y; View.M[1][1] = Up.Y; View.M[1][2] = Forward.Y;
+		View.M[2][0] = Right.Z; View.M[2][1] = Up.Z; View.M[2][2] = Forward.Z;
+		View.M[3][0] = -Dot(Origin, Right); View.M[3][1] = -Dot(Origin, Up); View.M[3][2] = -Dot(Origin, Forward);
+
+		const float XScale = 1.0f / std::tan(HalfFOV * PI / 180.0f);
+		FMat4 Projection = {};
+		Projection.M[0][0] = XScale;
+		Projection.M[1][1] = XScale * Aspect;
+		Projection.M[2][3] = 1.0f;
+		Projection.M[3][2] = Near;
+		return View * Projection;
+	}
+}
@@ -0,0 +1,86 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionSyntheticScene.h: parameterized test scenes for the tools.
+	Box occluders and occludees laid out like an open field, a city, an
+	interior or a forest, seen by a camera standing at the origin.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+#include "SnowOcclusionPortals.h"
+
+namespace SnowOcclusion
+{
+	enum class ESceneLayout : uint8
+	{
+		// Walls scattered in a ring around the camera
+		Open,
+		// Buildings on a block grid, the camera stands on a crossing
+		City,
+		// Rooms with doorways, the camera stands in one of them. Also builds their cells and portals.
+		Indoor,
+		// Thin trunks everywhere, little occlusion
+		Forest,
+	};
+
+	const char* GetSceneLayoutName(ESceneLayout Layout);
+	bool ParseSceneLayout(const char* Name, ESceneLayout& OutLayout);
+
+	struct FSyntheticSceneDesc
+	{
+		ESceneLayout Layout = ESceneLayout::Open;
+		int32 Occluders = 200;
+		// Each occluder is a box tessellated to at least this many triangles
+		int32 OccluderTriangles = 12;
+		int32 Occludees = 5000;
+		int32 MaxRasterizedOccluders = 150;
+		uint32 Seed = 1;
+		// 0 disables occludee groups
+		float GroupCellSize = 2000.0f;
+		int32 GroupMinMembers = 4;
+		// Every occludee casts a shadow from a low sun, its box swept along the sun is a shadow volume
+		bool bShadows = false;
+	};
+
+	struct FSyntheticScene
+	{
+		FScene Scene;
+		// The box mesh all occluders instance
+		std::vector<FVec3> MeshVertices;
+		std::vector<uint16> MeshIndices;
+		// Occludees every layout places for sanity checks: in front of the camera, and behind the wall in front of it
+		int32 NearOccludee = -1;
+		int32 HiddenOccludee = -1;
+		// Rooms and doorways of the indoor layout, empty for the others
+		FPortalGraph Portals;
+		// Holds the eyes of every view SetupSyntheticViews sets up
+		FBox3 ViewerBounds = {};
+
+		FSyntheticScene() = default;
+		// Occluders point at the mesh
+		FSyntheticScene(const FSyntheticScene&) = delete;
+		FSyntheticScene& operator=(const FSyntheticScene&) = delete;
+	};
+
+	/** Fills an empty scene, same description and seed give the same scene */
+	void BuildSyntheticScene(const FSyntheticSceneDesc& Desc, FSyntheticScene& Out);
+
+	/**
+	 * Views of the camera standing at the origin turned by Yaw degrees, Views.size() of them:
+	 * one camera, a stereo pair, or more cameras spread evenly around.
+	 */
+	void SetupSyntheticViews(int32 NumViews, float Yaw, bool bFoveation, FScene& Scene);
+
+	/** Adds the orthographic view of the sun, Radius around the camera like the engine, after the views SetupSyntheticViews set up */
+	void AddSyntheticShadowView(float Radius, FScene& Scene);
+
+	/** Scale, then yaw (degrees, around Z), then translation */
+	FMat4 MakeTransform(const FVec3& Scale, float Yaw, const FVec3& Translation);
+
+	FBox3 TransformBox(const FMat4& Transform, const FBox3& Box);
+
+	/** World to clip space of a camera at Origin turned by Yaw degrees: UE view axes and a reversed Z infinite perspective */
+	FMat4 MakeViewProjection(const FVec3& Origin, float Yaw, float HalfFOV, float Aspect, float Near);
+}
@@ -0,0 +1,128 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionThreadPool.h: persistent workers for the tools' ParallelFor,
+	so timings don't include starting threads.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace SnowOcclusion
+{
+	class FThreadPool
+	{
+	public:
+		/** NumThreads counts the calling thread, which works on every ParallelFor too */
+		explicit FThreadPool(int32 NumThreads)
+		{
+			for (int32 ThreadIdx = 1; ThreadIdx < NumThreads; ++ThreadIdx)
+			{
+				Workers.emplace_back(&FThreadPool::WorkerLoop, this);
+			}
+		}
+
+		~FThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> Lock(Mutex);
+				bQuit = true;
+			}
+			WakeWorkers.notify_all();
+			for (std::thread& Worker : Workers)
+			{
+				Worker.join();
+			}
+		}
+
+		FThreadPool(const FThreadPool&) = delete;
+		FThreadPool& operator=(const FThreadPool&) = delete;
+
+		int32 NumThreads() const { return (int32)Workers.size() + 1; }
+
+		void ParallelFor(int32 InNum, const std::function<void(int32)>& InBody)
+		{
+			if (Workers.empty() || InNum <= 1)
+			{
+				for (int32 Index = 0; Index < InNum; ++Index)
+				{
+					InBody(Index);
+				}
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> Lock(Mutex);
+				Body = &InBody;
+				Num = InNum;
+				NextIndex = 0;
+				NumBusy = (int32)Workers.size();
+				++Generation;
+			}
+			WakeWorkers.notify_all();
+
+			RunItems();
+
+			std::unique_lock<std::mutex> Lock(Mutex);
+			JobDone.wait(Lock, [this]() { return NumBusy == 0; });
+			Body = nullptr;
+		}
+
+		/** Adaptor for ProcessOcclusionFrame, the pool must outlive it */
+		FParallelFor AsParallelFor()
+		{
+			return [this](int32 InNum, const std::function<void(int32)>& InBody) { ParallelFor(InNum, InBody); };
+		}
+
+	private:
+		void RunItems()
+		{
+			for (int32 Index = NextIndex++; Index < Num; Index = NextIndex++)
+			{
+				(*Body)(Index);
+			}
+		}
+
+		void WorkerLoop()
+		{
+			uint64 SeenGeneration = 0;
+			for (;;)
+			{
+				{
+					std::unique_lock<std::mutex> Lock(Mutex);
+					WakeWorkers.wait(Lock, [this, SeenGeneration]() { return bQuit || Generation != SeenGeneration; });
+					if (bQuit)
+					{
+						return;
+					}
+					SeenGeneration = Generation;
+				}
+
+				RunItems();
+
+				std::lock_guard<std::mutex> Lock(Mutex);
+				if (--NumBusy == 0)
+				{
+					JobDone.notify_one();
+				}
+			}
+		}
+
+		std::vector<std::thread> Workers;
+		std::mutex Mutex;
+		std::condition_variable WakeWorkers;
+		std::condition_variable JobDone;
+		const std::function<void(int32)>* Body = nullptr;
+		int32 Num = 0;
+		std::atomic<int32> NextIndex{ 0 };
+		// Workers that haven't finished the current ParallelFor
+		int32 NumBusy = 0;
+		uint64 Generation = 0;
+		bool bQuit = false;
+	};
+}
@@ -0,0 +1,109 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#include "SnowOcclusionTraceFile.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace SnowOcclusion
+{
+	namespace
+	{
+		struct FTraceEvent
+		{
+			const char* Name;
+			int32 ThreadId;
+			bool bBegin;
+			std::chrono::steady_clock::time_point Time;
+		};
+
+		// The hooks are plain functions, the recording is global
+		std::mutex EventsMutex;
+		std::vector<FTraceEvent> Events;
+		std::chrono::steady_clock::time_point StartTime;
+		std::atomic<int32> NextThreadId{ 1 };
+
+		int32 GetThreadId()
+		{
+			thread_local int32 ThreadId = NextThreadId++;
+			return ThreadId;
+		}
+
+		bool BeginScope(const char* Name)
+		{
+			const FTraceEvent Event = { Name, GetThreadId(), true, std::chrono::steady_clock::now() };
+			std::lock_guard<std::mutex> Lock(EventsMutex);
+			Events.push_back(Event);
+			return true;
+		}
+
+		void EndScope()
+		{
+			const FTraceEvent Event = { nullptr, GetThreadId(), false, std::chrono::steady_clock::now() };
+			std::lock_guard<std::mutex> Lock(EventsMutex);
+			Events.push_back(Event);
+		}
+	}
+
+	FTraceFile::~FTraceFile()
+	{
+		Close();
+	}
+
+	bool FTraceFile::Open(const char* InPath)
+	{
+		Close();
+
+		Path = InPath;
+		Events.clear();
+		StartTime = std::chrono::steady_clock::now();
+
+		FProfilerHooks Hooks;
+		Hooks.BeginScope = &BeginScope;
+		Hooks.EndScope = &EndScope;
+		SetProfilerHooks(Hooks);
+		return true;
+	}
+
+	int32 FTraceFile::Close()
+	{
+		if (Path.empty())
+		{
+			return 0;
+		}
+
+		SetProfilerHooks(FProfilerHooks());
+		const std::string ClosedPath = Path;
+		Path.clear();
+
+		FILE* File = std::fopen(ClosedPath.c_str(), "w");
+		if (!File)
+		{
+			return -1;
+		}
+
+		// Duration events, the end of a scope closes the last one begun on its thread
+		std::fprintf(File, "{\"traceEvents\":[\n");
+		for (size_t EventIdx = 0; EventIdx < Events.size(); ++EventIdx)
+		{
+			const FTraceEvent& Event = Events[EventIdx];
+			const double Microseconds = std::chrono::duration<double, std::micro>(Event.Time - StartTime).count();
+			if (Event.bBegin)
+			{
+				std::fprintf(File, "{\"name\":\"%s\",\"ph\":\"B\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", Event.Name, Event.ThreadId, Microseconds);
+			}
+			else
+			{
+				std::fprintf(File, "{\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", Event.ThreadId, Microseconds);
+			}
+			std::fprintf(File, "%s\n", EventIdx + 1 < Events.size() ? "," : "");
+		}
+		std::fprintf(File, "]}\n");
+
+		const int32 NumEvents = (int32)Events.size();
+		Events.clear();
+		return std::fclose(File) == 0 ? NumEvents : -1;
+	}
+}
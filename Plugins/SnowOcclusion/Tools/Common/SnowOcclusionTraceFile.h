@@ -0,0 +1,34 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+#pragma once
+
+/*=============================================================================
+	SnowOcclusionTraceFile.h: records the stage scopes of the core on every
+	thread through the profiler hooks, and writes them as a Chrome trace
+	(chrome://tracing, Perfetto) to see which worker ran what.
+=============================================================================*/
+
+#include "SnowOcclusionCore.h"
+#include <string>
+
+namespace SnowOcclusion
+{
+	/** Installs the profiler hooks while open, one trace at a time */
+	class FTraceFile
+	{
+	public:
+		FTraceFile() = default;
+		~FTraceFile();
+		FTraceFile(const FTraceFile&) = delete;
+		FTraceFile& operator=(const FTraceFile&) = delete;
+
+		bool Open(const char* InPath);
+		/** Removes the hooks and writes the recorded events, returns how many or -1 if the file can't be written */
+		int32 Close();
+
+		bool IsOpen() const { return !Path.empty(); }
+
+	private:
+		std::string Path;
+	};
+}
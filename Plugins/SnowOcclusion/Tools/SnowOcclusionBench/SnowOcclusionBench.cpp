@@ -0,0 +1,894 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+/*=============================================================================
+	SnowOcclusionBench.cpp: microbenchmark of the occlusion core.
+	Builds a synthetic scene around a turning camera and times
+	ProcessOcclusionFrame stage by stage. Runs headless, a single
+	configuration or the whole suite, and writes JSON to track results.
+=============================================================================*/
+
+#include "SnowOcclusionCapture.h"
+#include "SnowOcclusionCore.h"
+#include "SnowOcclusionPortals.h"
+#include "SnowOcclusionPVS.h"
+#include "SnowOcclusionReference.h"
+#include "SnowOcclusionSyntheticScene.h"
+#include "SnowOcclusionThreadPool.h"
+#include "SnowOcclusionTraceFile.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+using namespace SnowOcclusion;
+
+namespace
+{
+	struct FBenchOptions
+	{
+		FSyntheticSceneDesc Scene;
+		int32 Frames = 100;
+		// Frames run before timing starts, they fill the history and warm the caches
+		int32 Warmup = 2;
+		int32 Views = 1;
+		// Views are processed in parallel by this many threads
+		int32 Threads = 1;
+		bool bScalar = false;
+		bool bReprojection = false;
+		bool bFoveation = false;
+		// Degrees the camera turns every frame
+		float TurnRate = 0.5f;
+		bool bSuite = false;
+		std::string JsonPath;
+		std::string Label;
+		// Capture of every frame run, warmup included, for SnowOcclusionReplay
+		std::string CapturePath;
+		// Compare every timed frame with the reference rasterizer, outside the timings
+		bool bAccuracy = false;
+		int32 ReferenceScale = DEFAULT_REFERENCE_SCALE;
+		// Chrome trace of the stages of every frame run
+		std::string TracePath;
+		// Cull occludees and occluders through the cells and portals of the layout before rasterizing
+		bool bPortals = false;
+		// Bake the potentially visible sets of a grid around the camera, then cull with them before rasterizing
+		bool bPVS = false;
+		FPVSBakeSettings PVSBake;
+		// Window of the sun's view around the camera, with --shadows
+		float ShadowViewRadius = 5000.0f;
+	};
+
+	void PrintUsage()
+	{
+		std::printf(
+			"Usage: SnowOcclusionBench [options]\n"
+			"  --layout NAME      open, city, indoor or forest (open)\n"
+			"  --occluders N      box occluders in the scene (200)\n"
+			"  --occluder-tris N  triangles of each occluder box, at least 12 (12)\n"
+			"  --occludees N      box occludees in the scene (5000)\n"
+			"  --max-occluders N  occluders rasterized per view (150)\n"
+			"  --seed N           scene generator seed (1)\n"
+			"  --group-cell SIZE  occludee group cell size, 0 disables groups (2000)\n"
+			"  --frames N         timed frames (100)\n"
+			"  --warmup N         frames run before timing (2)\n"
+			"  --views N          1 camera, 2 for a stereo pair, up to 8 spread around (1)\n"
+			"  --threads N        threads processing the views (1)\n"
+			"  --turn DEG         camera yaw per frame (0.5)\n"
+			"  --scalar           project occludees without SIMD\n"
+			"  --reprojection     skip occluders covered by last frame's coverage\n"
+			"  --foveation        variable resolution buffer\n"
+			"  --suite            run every layout with and without SIMD, and the thread scaling\n"
+			"  --json PATH        write the results as JSON\n"
+			"  --label TEXT       stored in the JSON, e.g. the commit measured\n"
+			"  --capture PATH     write the frames run to an occlusion capture\n"
+			"  --accuracy         count culling mistakes against the reference rasterizer\n"
+			"  --reference-scale N  reference buffer size as a multiple of the occlusion buffer (4)\n"
+			"  --trace PATH       write the stages run on each thread as a Chrome trace\n"
+			"  --portals          cull through the rooms and doorways first, indoor layout only\n"
+			"  --pvs              bake visible sets around the camera, then cull with them first\n"
+			"  --pvs-cell SIZE    cell size of the visible sets (400)\n"
+			"  --pvs-samples N    sample points along each cell edge, at least 2 (2)\n"
+			"  --shadows          every occludee casts a shadow, the sun's view decides which are needed\n"
+			"  --shadow-radius R  half size of the sun's view around the camera (5000)\n");
+	}
+
+	bool ParseOptions(int Argc, char** Argv, FBenchOptions& Options)
+	{
+		for (int ArgIdx = 1; ArgIdx < Argc; ++ArgIdx)
+		{
+			const char* Arg = Argv[ArgIdx];
+			const char* Value = ArgIdx + 1 < Argc ? Argv[ArgIdx + 1] : nullptr;
+			auto TakeInt = [&](int32& Out) { if (!Value) { return false; } Out = std::atoi(Value); ++ArgIdx; return true; };
+			auto TakeFloat = [&](float& Out) { if (!Value) { return false; } Out = (float)std::atof(Value); ++ArgIdx; return true; };
+			auto TakeString = [&](std::string& Out) { if (!Value) { return false; } Out = Value; ++ArgIdx; return true; };
+			auto TakeLayout = [&](ESceneLayout& Out) { if (!Value || !ParseSceneLayout(Value, Out)) { return false; } ++ArgIdx; return true; };
+
+			bool bOk = true;
+			if (!std::strcmp(Arg, "--layout")) bOk = TakeLayout(Options.Scene.Layout);
+			else if (!std::strcmp(Arg, "--occluders")) bOk = TakeInt(Options.Scene.Occluders);
+			else if (!std::strcmp(Arg, "--occluder-tris")) bOk = TakeInt(Options.Scene.OccluderTriangles);
+			else if (!std::strcmp(Arg, "--occludees")) bOk = TakeInt(Options.Scene.Occludees);
+			else if (!std::strcmp(Arg, "--max-occluders")) bOk = TakeInt(Options.Scene.MaxRasterizedOccluders);
+			else if (!std::strcmp(Arg, "--seed")) { int32 Seed = 0; bOk = TakeInt(Seed); Options.Scene.Seed = (uint32)Seed; }
+			else if (!std::strcmp(Arg, "--group-cell")) bOk = TakeFloat(Options.Scene.GroupCellSize);
+			else if (!std::strcmp(Arg, "--frames")) bOk = TakeInt(Options.Frames);
+			else if (!std::strcmp(Arg, "--warmup")) bOk = TakeInt(Options.Warmup);
+			else if (!std::strcmp(Arg, "--views")) bOk = TakeInt(Options.Views);
+			else if (!std::strcmp(Arg, "--threads")) bOk = TakeInt(Options.Threads);
+			else if (!std::strcmp(Arg, "--turn")) bOk = TakeFloat(Options.TurnRate);
+			else if (!std::strcmp(Arg, "--scalar")) Options.bScalar = true;
+			else if (!std::strcmp(Arg, "--reprojection")) Options.bReprojection = true;
+			else if (!std::strcmp(Arg, "--foveation")) Options.bFoveation = true;
+			else if (!std::strcmp(Arg, "--suite")) Options.bSuite = true;
+			else if (!std::strcmp(Arg, "--json")) bOk = TakeString(Options.JsonPath);
+			else if (!std::strcmp(Arg, "--label")) bOk = TakeString(Options.Label);
+			else if (!std::strcmp(Arg, "--capture")) bOk = TakeString(Options.CapturePath);
+			else if (!std::strcmp(Arg, "--trace")) bOk = TakeString(Options.TracePath);
+			else if (!std::strcmp(Arg, "--accuracy")) Options.bAccuracy = true;
+			else if (!std::strcmp(Arg, "--reference-scale")) bOk = TakeInt(Options.ReferenceScale);
+			else if (!std::strcmp(Arg, "--portals")) Options.bPortals = true;
+			else if (!std::strcmp(Arg, "--pvs")) Options.bPVS = true;
+			else if (!std::strcmp(Arg, "--pvs-cell")) bOk = TakeFloat(Options.PVSBake.CellSize);
+			else if (!std::strcmp(Arg, "--pvs-samples")) bOk = TakeInt(Options.PVSBake.SamplesPerEdge);
+			else if (!std::strcmp(Arg, "--shadows")) Options.Scene.bShadows = true;
+			else if (!std::strcmp(Arg, "--shadow-radius")) bOk = TakeFloat(Options.ShadowViewRadius);
+			else bOk = false;
+
+			if (!bOk)
+			{
+				PrintUsage();
+				return false;
+			}
+		}
+
+		Options.Views = std::min(std::max(Options.Views, 1), 8);
+		Options.Threads = std::max(Options.Threads, 1);
+		Options.Warmup = std::max(Options.Warmup, 0);
+		Options.ReferenceScale = std::min(std::max(Options.ReferenceScale, 1), MAX_REFERENCE_SCALE);
+		Options.ShadowViewRadius = std::max(Options.ShadowViewRadius, 1.0f);
+		// The pre-culled scene leaves the shadow volumes out, the engine always rasterizes the casters with shadow views
+		if (Options.Scene.bShadows && (Options.bPortals || Options.bPVS))
+		{
+			std::printf("error: --shadows doesn't run with --portals or --pvs\n");
+			return false;
+		}
+		return Options.Frames > 0;
+	}
+
+	struct FBenchResult
+	{
+		std::string Name;
+		FBenchOptions Options;
+		int32 NumOccluders = 0;
+		int32 NumOccluderTriangles = 0;
+		int32 NumOccludees = 0;
+		int32 NumGroups = 0;
+		// Wall time of each timed frame
+		std::vector<double> FrameSeconds;
+		// Summed over the views of every timed frame
+		FViewStats Total;
+		double ApplySeconds = 0.0;
+		int64_t NumVisible = 0;
+		// Summed over the timed frames, with --accuracy
+		FAccuracyStats Accuracy;
+		// Summed over the timed frames, with --shadows
+		int32 NumShadowVolumes = 0;
+		int64_t NumVisibleShadows = 0;
+		int64_t NumCastersOutsideLightView = 0;
+		// Summed over the timed frames, with --portals. Visible cells and traversal steps are summed over the views too.
+		bool bPortals = false;
+		int64_t NumPortalCulledOccludees = 0;
+		int64_t NumPortalCulledOccluders = 0;
+		int64_t NumPortalVisibleCells = 0;
+		int64_t NumPortalSteps = 0;
+		double PortalSeconds = 0.0;
+		// Summed over the timed frames, with --pvs, and what the bake took
+		bool bPVS = false;
+		int64_t NumPVSCulledOccludees = 0;
+		int64_t NumPVSCulledOccluders = 0;
+		double PVSSeconds = 0.0;
+		FPVSBakeStats PVSBake;
+		// Frame arena size at the end, and the blocks it took from the heap during the timed frames
+		size_t ArenaBytes = 0;
+		int32 NumArenaHeapAllocs = 0;
+		bool bSanityOk = true;
+
+		double ViewFrames() const { return (double)FrameSeconds.size() * (Options.Views + (Options.Scene.bShadows ? 1 : 0)); }
+
+		double FramePercentile(double Fraction) const
+		{
+			std::vector<double> Sorted = FrameSeconds;
+			std::sort(Sorted.begin(), Sorted.end());
+			return Sorted[std::min((size_t)(Fraction * Sorted.size()), Sorted.size() - 1)];
+		}
+
+		double FrameAverage() const
+		{
+			double Sum = 0.0;
+			for (double Seconds : FrameSeconds)
+			{
+				Sum += Seconds;
+			}
+			return Sum / FrameSeconds.size();
+		}
+	};
+
+	double NsPer(double Seconds, double Count)
+	{
+		return Count > 0.0 ? Seconds * 1e9 / Count : 0.0;
+	}
+
+	/**
+	 * Stands in for the engine side of a frame: the visibility of the occludees goes into a map by primitive id,
+	 * then every primitive looks itself up, like ApplyResults does. Returns the number of occluded primitives.
+	 */
+	int32 ApplyResults(const FFrameResults& Results, int32 NumPrimitives, std::unordered_map<uint32, bool>& VisibilityMap)
+	{
+		VisibilityMap.clear();
+		for (int32 OccludeeIdx = 0; OccludeeIdx < NumPrimitives; ++OccludeeIdx)
+		{
+			VisibilityMap[(uint32)OccludeeIdx + 1] = Results.OccludeeVisible[OccludeeIdx] != 0;
+		}
+
+		int32 NumOccluded = 0;
+		for (int32 PrimIdx = 0; PrimIdx < NumPrimitives; ++PrimIdx)
+		{
+			const std::unordered_map<uint32, bool>::const_iterator Found = VisibilityMap.find((uint32)PrimIdx + 1);
+			NumOccluded += Found != VisibilityMap.end() && !Found->second;
+		}
+		return NumOccluded;
+	}
+
+	/**
+	 * Bakes the sets of a grid around the eyes. Occluders are primitives too, after the occludees, so the sets cull both.
+	 * The primitives are static, the camera only turns. False if the baked sets don't read back.
+	 */
+	bool BakeSyntheticPVS(const FSyntheticScene& Synthetic, const FPVSBakeSettings& Settings, const FParallelFor& ParallelFor, FPVS& Out, FPVSBakeStats& OutStats)
+	{
+		const FScene& Scene = Synthetic.Scene;
+		std::vector<FVec3> BoxMinMax(Scene.OccludeeBoxMinMax.begin(), Scene.OccludeeBoxMinMax.begin() + Scene.NumPrimitiveOccludees * 2);
+		for (const FOccluderMesh& Occluder : Scene.Occluders)
+		{
+			BoxMinMax.push_back(Occluder.WorldBounds.Min);
+			BoxMinMax.push_back(Occluder.WorldBounds.Max);
+		}
+
+		const float HalfCell = Settings.CellSize * 0.5f;
+		const FBox3 Bounds = {
+			{ Synthetic.ViewerBounds.Min.X - HalfCell, Synthetic.ViewerBounds.Min.Y - HalfCell, Synthetic.ViewerBounds.Min.Z - HalfCell },
+			{ Synthetic.ViewerBounds.Max.X + HalfCell, Synthetic.ViewerBounds.Max.Y + HalfCell, Synthetic.ViewerBounds.Max.Z + HalfCell } };
+		FPVS Baked;
+		BakePVS(Scene.Occluders, BoxMinMax.data(), (int32)BoxMinMax.size() / 2, Bounds, Settings, nullptr, Baked, &OutStats, ParallelFor);
+
+		// The frames use what comes back from the bytes the asset stores
+		std::vector<uint8> Bytes;
+		Baked.Serialize(Bytes);
+		return Out.Deserialize(Bytes.data(), Bytes.size());
+	}
+
+	/** Whether part of the box is behind the near plane of a view, the core and the reference find those visible */
+	bool IsBoxNearClipped(const FScene& Scene, const FVec3& Min, const FVec3& Max)
+	{
+		for (const FSceneView& View : Scene.Views)
+		{
+			// Clip space W is a dot product with the last column, the corner closest to the eye has the smallest
+			const FMat4& M = View.ViewProj;
+			const float NearestW = std::min(M.M[0][3] * Min.X, M.M[0][3] * Max.X) + std::min(M.M[1][3] * Min.Y, M.M[1][3] * Max.Y)
+				+ std::min(M.M[2][3] * Min.Z, M.M[2][3] * Max.Z) + M.M[3][3];
+			if (!View.bShadowView && NearestW < View.ClipW)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Clears what the sets of the cells the eyes are in don't hold, like the engine gather does. The sets are only decoded again
+	 * when the cells change. Boxes reaching behind the eyes are left to the frustum culling the engine runs first, the accuracy
+	 * reference would count them. Returns false if the eyes are out of the baked cells, nothing is culled then.
+	 */
+	bool ApplyPVS(const FPVS& PVS, const FSyntheticScene& Synthetic, std::vector<int32>& InOutDecodedSets, std::vector<int32>& FoundSets,
+		std::vector<uint8>& InOutPVSVisible, std::vector<uint8>& InOutOccludeeVisible, std::vector<uint8>& InOutOccluderVisible)
+	{
+		if (!PVS.FindSets(Synthetic.ViewerBounds, FoundSets))
+		{
+			return false;
+		}
+		if (FoundSets != InOutDecodedSets)
+		{
+			InOutDecodedSets = FoundSets;
+			InOutPVSVisible.assign(PVS.NumPrimitives, 0);
+			for (int32 Set : FoundSets)
+			{
+				PVS.AddSetVisible(Set, InOutPVSVisible.data());
+			}
+		}
+
+		const FScene& Scene = Synthetic.Scene;
+		const int32 NumOccludees = (int32)InOutOccludeeVisible.size();
+		for (int32 OccludeeIdx = 0; OccludeeIdx < NumOccludees; ++OccludeeIdx)
+		{
+			if (!InOutPVSVisible[OccludeeIdx] && !IsBoxNearClipped(Scene, Scene.OccludeeBoxMinMax[OccludeeIdx * 2], Scene.OccludeeBoxMinMax[OccludeeIdx * 2 + 1]))
+			{
+				InOutOccludeeVisible[OccludeeIdx] = 0;
+			}
+		}
+		for (size_t OccluderIdx = 0; OccluderIdx < InOutOccluderVisible.size(); ++OccluderIdx)
+		{
+			const FBox3& Bounds = Scene.Occluders[OccluderIdx].WorldBounds;
+			if (!InOutPVSVisible[NumOccludees + OccluderIdx] && !IsBoxNearClipped(Scene, Bounds.Min, Bounds.Max))
+			{
+				InOutOccluderVisible[OccluderIdx] = 0;
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Whether any view sees each occludee and occluder through the portals. Adds the cells visible and the traversal steps
+	 * taken, summed over the views.
+	 */
+	void TestPortalVisibility(const FSyntheticScene& Synthetic, std::vector<FPortalVisibility>& Visibilities, std::vector<uint8>& OutOccludeeVisible,
+		std::vector<uint8>& OutOccluderVisible, int64_t& InOutNumVisibleCells, int64_t& InOutNumSteps)
+	{
+		const FScene& Scene = Synthetic.Scene;
+		Visibilities.resize(Scene.Views.size());
+		for (size_t ViewIdx = 0; ViewIdx < Scene.Views.size(); ++ViewIdx)
+		{
+			ComputePortalVisibility(Synthetic.Portals, Synthetic.ViewerBounds, Scene.Views[ViewIdx].ViewProj, Visibilities[ViewIdx]);
+			InOutNumVisibleCells += Visibilities[ViewIdx].NumVisibleCells;
+			InOutNumSteps += Visibilities[ViewIdx].NumSteps;
+		}
+
+		OutOccludeeVisible.assign(Scene.NumPrimitiveOccludees, 0);
+		OutOccluderVisible.assign(Scene.Occluders.size(), 0);
+		for (size_t ViewIdx = 0; ViewIdx < Scene.Views.size(); ++ViewIdx)
+		{
+			const FMat4& ViewProj = Scene.Views[ViewIdx].ViewProj;
+			TestBoxesPortalVisible(Synthetic.Portals, Visibilities[ViewIdx], ViewProj, Scene.OccludeeBoxMinMax.data(), Scene.NumPrimitiveOccludees, OutOccludeeVisible.data());
+			for (size_t OccluderIdx = 0; OccluderIdx < Scene.Occluders.size(); ++OccluderIdx)
+			{
+				OutOccluderVisible[OccluderIdx] |= IsBoxPortalVisible(Synthetic.Portals, Visibilities[ViewIdx], ViewProj, Scene.Occluders[OccluderIdx].WorldBounds);
+			}
+		}
+	}
+
+	/**
+	 * Stands in for the engine gather with portals or visible sets on: the scene with only what they left visible.
+	 * OutKept maps its occludees to the ones of the full scene.
+	 */
+	void BuildPreCulledScene(const FScene& Scene, const FSyntheticSceneDesc& Desc, const std::vector<uint8>& OccludeeVisible, const std::vector<uint8>& OccluderVisible,
+		FScene& Out, std::vector<int32>& OutKept)
+	{
+		Out.Reset();
+		Out.Views = Scene.Views;
+		Out.MaxRasterizedOccluders = Scene.MaxRasterizedOccluders;
+		Out.bReprojection = Scene.bReprojection;
+		Out.bUseSIMD = Scene.bUseSIMD;
+		for (size_t OccluderIdx = 0; OccluderIdx < Scene.Occluders.size(); ++OccluderIdx)
+		{
+			if (OccluderVisible[OccluderIdx])
+			{
+				Out.Occluders.push_back(Scene.Occluders[OccluderIdx]);
+				Out.NumOccluderTriangles += Scene.Occluders[OccluderIdx].NumIndices / 3;
+			}
+		}
+
+		OutKept.clear();
+		for (int32 OccludeeIdx = 0; OccludeeIdx < Scene.NumPrimitiveOccludees; ++OccludeeIdx)
+		{
+			if (!OccludeeVisible[OccludeeIdx])
+			{
+				continue;
+			}
+
+			OutKept.push_back(OccludeeIdx);
+			const FBox3 Box = { Scene.OccludeeBoxMinMax[OccludeeIdx * 2], Scene.OccludeeBoxMinMax[OccludeeIdx * 2 + 1] };
+			const int32 OrientedIdx = Scene.OccludeeBoxOrientedIdx[OccludeeIdx];
+			if (OrientedIdx >= 0)
+			{
+				Out.AddOccludee(Box, Scene.OccludeeOrientedBoxes[OrientedIdx]);
+			}
+			else
+			{
+				Out.AddOccludee(Box);
+			}
+		}
+		Out.NumPrimitiveOccludees = Out.NumOccludees();
+		BuildOccludeeGroups(Out, Desc.GroupCellSize, Desc.GroupMinMembers);
+	}
+
+	/** Spreads the results of the pre-culled scene over the occludees of the full scene, the ones left out are occluded */
+	void ExpandPreCulledResults(const std::vector<int32>& Kept, int32 NumOccludees, FFrameResults& Results)
+	{
+		auto Expand = [&](std::vector<uint8>& Visible)
+		{
+			std::vector<uint8> Full(NumOccludees, 0);
+			for (size_t KeptIdx = 0; KeptIdx < Kept.size(); ++KeptIdx)
+			{
+				Full[Kept[KeptIdx]] = Visible[KeptIdx];
+			}
+			Visible.swap(Full);
+		};
+
+		Expand(Results.OccludeeVisible);
+		for (FViewResults& View : Results.Views)
+		{
+			Expand(View.OccludeeVisible);
+		}
+	}
+
+	void RunBench(const std::string& Name, const FBenchOptions& Options, FBenchResult& Result)
+	{
+		FSyntheticScene Synthetic;
+		BuildSyntheticScene(Options.Scene, Synthetic);
+		FScene& Scene = Synthetic.Scene;
+		Scene.bReprojection = Options.bReprojection;
+		Scene.bUseSIMD = !Options.bScalar;
+
+		Result.Name = Name;
+		Result.Options = Options;
+		Result.NumOccluders = (int32)Scene.Occluders.size();
+		Result.NumOccluderTriangles = Scene.NumOccluderTriangles;
+		Result.NumOccludees = Scene.NumOccludees();
+		Result.NumGroups = std::max((int32)Scene.OccludeeGroupFirstMember.size() - 1, 0);
+		Result.NumShadowVolumes = (int32)Scene.ShadowVolumeCasterIdx.size();
+		Result.FrameSeconds.reserve(Options.Frames);
+		Result.bPortals = Options.bPortals && !Synthetic.Portals.IsEmpty();
+		Result.bPVS = Options.bPVS;
+
+		std::unique_ptr<FThreadPool> ThreadPool;
+		FParallelFor ParallelFor;
+		if (Options.Threads > 1)
+		{
+			ThreadPool.reset(new FThreadPool(Options.Threads));
+			ParallelFor = ThreadPool->AsParallelFor();
+		}
+
+		// Baked before the frames like on the build farm, not timed with them
+		FPVS PVS;
+		if (Result.bPVS)
+		{
+			if (!BakeSyntheticPVS(Synthetic, Options.PVSBake, ParallelFor, PVS, Result.PVSBake))
+			{
+				std::printf("error: %s: the baked sets don't read back, running without them\n", Result.Name.c_str());
+				Result.bPVS = false;
+			}
+		}
+
+		FHistory History;
+		FFrameArena Arena;
+		int32 NumWarmupHeapAllocs = 0;
+		FFrameResults Results;
+		std::unordered_map<uint32, bool> VisibilityMap;
+		VisibilityMap.reserve(Scene.NumPrimitiveOccludees);
+
+		std::vector<FPortalVisibility> PortalVisibilities;
+		std::vector<uint8> PortalOccludeeVisible;
+		std::vector<uint8> PortalOccluderVisible;
+		std::vector<int32> PVSDecodedSets;
+		std::vector<int32> PVSFoundSets;
+		std::vector<uint8> PVSVisible;
+		const bool bPreCull = Result.bPortals || Result.bPVS;
+		std::vector<uint8> PreCulledOccludeeVisible;
+		std::vector<uint8> PreCulledOccluderVisible;
+		FScene PreCulledScene;
+		std::vector<int32> PreCulledKept;
+
+		FCaptureWriter Capture;
+		if (!Options.CapturePath.empty() && !Capture.Open(MakeFileCaptureSink(Options.CapturePath.c_str())))
+		{
+			std::printf("error: can't write %s\n", Options.CapturePath.c_str());
+		}
+
+		for (int32 Frame = 0; Frame < Options.Warmup + Options.Frames; ++Frame)
+		{
+			SetupSyntheticViews(Options.Views, Frame * Options.TurnRate, Options.bFoveation, Scene);
+			if (Options.Scene.bShadows)
+			{
+				AddSyntheticShadowView(Options.ShadowViewRadius, Scene);
+			}
+			Results.Reset((int32)Scene.Views.size());
+
+			// The visible sets and the portal tests are timed, not the copy of the scene: the engine leaves out what they cull while it gathers
+			double PVSSeconds = 0.0;
+			int64_t NumPVSCulledOccludees = 0;
+			int64_t NumPVSCulledOccluders = 0;
+			double PortalSeconds = 0.0;
+			int64_t NumPortalVisibleCells = 0;
+			int64_t NumPortalSteps = 0;
+			if (bPreCull)
+			{
+				PreCulledOccludeeVisible.assign(Scene.NumPrimitiveOccludees, 1);
+				PreCulledOccluderVisible.assign(Scene.Occluders.size(), 1);
+			}
+			if (Result.bPVS)
+			{
+				const std::chrono::steady_clock::time_point PVSStart = std::chrono::steady_clock::now();
+				ApplyPVS(PVS, Synthetic, PVSDecodedSets, PVSFoundSets, PVSVisible, PreCulledOccludeeVisible, PreCulledOccluderVisible);
+				PVSSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - PVSStart).count();
+				NumPVSCulledOccludees = std::count(PreCulledOccludeeVisible.begin(), PreCulledOccludeeVisible.end(), 0);
+				NumPVSCulledOccluders = std::count(PreCulledOccluderVisible.begin(), PreCulledOccluderVisible.end(), 0);
+			}
+			if (Result.bPortals)
+			{
+				const std::chrono::steady_clock::time_point PortalStart = std::chrono::steady_clock::now();
+				TestPortalVisibility(Synthetic, PortalVisibilities, PortalOccludeeVisible, PortalOccluderVisible, NumPortalVisibleCells, NumPortalSteps);
+				PortalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - PortalStart).count();
+				for (size_t OccludeeIdx = 0; OccludeeIdx < PreCulledOccludeeVisible.size(); ++OccludeeIdx)
+				{
+					PreCulledOccludeeVisible[OccludeeIdx] &= PortalOccludeeVisible[OccludeeIdx];
+				}
+				for (size_t OccluderIdx = 0; OccluderIdx < PreCulledOccluderVisible.size(); ++OccluderIdx)
+				{
+					PreCulledOccluderVisible[OccluderIdx] &= PortalOccluderVisible[OccluderIdx];
+				}
+			}
+			if (bPreCull)
+			{
+				BuildPreCulledScene(Scene, Options.Scene, PreCulledOccludeeVisible, PreCulledOccluderVisible, PreCulledScene, PreCulledKept);
+			}
+
+			const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+			ProcessOcclusionFrame(bPreCull ? PreCulledScene : Scene, &History, Results, ParallelFor, &Arena);
+			const std::chrono::steady_clock::time_point ProcessEnd = std::chrono::steady_clock::now();
+			if (bPreCull)
+			{
+				// Captured as processed, the replay runs the same scene again
+				if (Capture.IsOpen())
+				{
+					Capture.WriteFrame((uint64)Frame, PreCulledScene, Results);
+				}
+				ExpandPreCulledResults(PreCulledKept, Scene.NumPrimitiveOccludees, Results);
+			}
+			const std::chrono::steady_clock::time_point ApplyStart = std::chrono::steady_clock::now();
+			ApplyResults(Results, Scene.NumPrimitiveOccludees, VisibilityMap);
+			const std::chrono::steady_clock::time_point End = std::chrono::steady_clock::now();
+
+			if (Options.bAccuracy && Frame >= Options.Warmup)
+			{
+				MeasureCullingAccuracy(Scene, Results, Options.ReferenceScale, ParallelFor);
+				FAccuracyStats& Accuracy = Result.Accuracy;
+				Accuracy.bMeasured = true;
+				Accuracy.NumReferenceVisible += Results.Accuracy.NumReferenceVisible;
+				Accuracy.NumFalseVisible += Results.Accuracy.NumFalseVisible;
+				Accuracy.NumFalseOccluded += Results.Accuracy.NumFalseOccluded;
+				Accuracy.NumFalseVisibleShadows += Results.Accuracy.NumFalseVisibleShadows;
+				Accuracy.NumFalseOccludedShadows += Results.Accuracy.NumFalseOccludedShadows;
+				Accuracy.ReferenceSeconds += Results.Accuracy.ReferenceSeconds;
+			}
+
+			if (Capture.IsOpen() && !bPreCull)
+			{
+				Capture.WriteFrame((uint64)Frame, Scene, Results);
+			}
+
+			// The first view of the first frame looks straight at the wall. Only that view, the others find boxes behind them visible.
+			if (Frame == 0)
+			{
+				const std::vector<uint8>& FirstView = Results.Views[0].OccludeeVisible;
+				Result.bSanityOk &= FirstView[Synthetic.NearOccludee] != 0;
+				Result.bSanityOk &= Synthetic.HiddenOccludee == -1 || FirstView[Synthetic.HiddenOccludee] == 0;
+			}
+
+			if (Frame < Options.Warmup)
+			{
+				NumWarmupHeapAllocs = Arena.GetNumHeapAllocs();
+				continue;
+			}
+
+			const double ApplySeconds = std::chrono::duration<double>(End - ApplyStart).count();
+			Result.FrameSeconds.push_back(PVSSeconds + PortalSeconds + std::chrono::duration<double>(ProcessEnd - Start).count() + ApplySeconds);
+			Result.ApplySeconds += ApplySeconds;
+			if (Result.bPVS)
+			{
+				Result.NumPVSCulledOccludees += NumPVSCulledOccludees;
+				Result.NumPVSCulledOccluders += NumPVSCulledOccluders;
+				Result.PVSSeconds += PVSSeconds;
+			}
+			if (Result.bPortals)
+			{
+				// What the visible sets left for the portals to cull
+				Result.NumPortalCulledOccludees += Scene.NumPrimitiveOccludees - (int32)PreCulledKept.size() - NumPVSCulledOccludees;
+				Result.NumPortalCulledOccluders += Scene.Occluders.size() - PreCulledScene.Occluders.size() - NumPVSCulledOccluders;
+				Result.NumPortalVisibleCells += NumPortalVisibleCells;
+				Result.NumPortalSteps += NumPortalSteps;
+				Result.PortalSeconds += PortalSeconds;
+			}
+			for (const FViewResults& View : Results.Views)
+			{
+				FViewStats& Total = Result.Total;
+				Total.NumTriangles += View.Stats.NumTriangles;
+				Total.NumOccluderSetupTris += View.Stats.NumOccluderSetupTris;
+				Total.NumRasterizedOccluderTris += View.Stats.NumRasterizedOccluderTris;
+				Total.NumRasterizedOccludeeTris += View.Stats.NumRasterizedOccludeeTris;
+				Total.NumExpandedGroups += View.Stats.NumExpandedGroups;
+				Total.NumSkippedOccluders += View.Stats.NumSkippedOccluders;
+				Total.OccluderSeconds += View.Stats.OccluderSeconds;
+				Total.OccludeeSeconds += View.Stats.OccludeeSeconds;
+				Total.SortSeconds += View.Stats.SortSeconds;
+				Total.RasterizeSeconds += View.Stats.RasterizeSeconds;
+			}
+			for (uint8 bVisible : Results.OccludeeVisible)
+			{
+				Result.NumVisible += bVisible;
+			}
+			for (int32 VolumeIdx = 0; VolumeIdx < Result.NumShadowVolumes; ++VolumeIdx)
+			{
+				const int32 CasterIdx = Scene.ShadowVolumeCasterIdx[VolumeIdx];
+				const FBox3 CasterBox = { Scene.OccludeeBoxMinMax[CasterIdx * 2], Scene.OccludeeBoxMinMax[CasterIdx * 2 + 1] };
+				Result.NumVisibleShadows += Results.ShadowVolumeVisible[VolumeIdx];
+				Result.NumCastersOutsideLightView += !IsBoxInsideView(Scene.Views[Scene.ShadowVolumeViewIdx[VolumeIdx]], CasterBox);
+			}
+		}
+
+		Result.ArenaBytes = Arena.GetCapacity();
+		Result.NumArenaHeapAllocs = Arena.GetNumHeapAllocs() - NumWarmupHeapAllocs;
+	}
+
+	void PrintResult(const FBenchResult& Result)
+	{
+		const FBenchOptions& Options = Result.Options;
+		const FViewStats& Total = Result.Total;
+		const double Frames = (double)Result.FrameSeconds.size();
+		const double ViewFrames = Result.ViewFrames();
+
+		std::printf("scene: %s, %d occluders of %d tris (%d rasterized), %d occludees, %d groups, %d view(s), %d thread(s)%s%s%s\n",
+			GetSceneLayoutName(Options.Scene.Layout), Result.NumOccluders, Result.NumOccluders > 0 ? Result.NumOccluderTriangles / Result.NumOccluders : 0,
+			Options.Scene.MaxRasterizedOccluders, Result.NumOccludees, Result.NumGroups, Options.Views, Options.Threads,
+			Options.bScalar ? ", scalar" : "", Options.bReprojection ? ", reprojection" : "", Options.bFoveation ? ", foveation" : "");
+		std::printf("frame: avg %.3f ms, median %.3f ms, p95 %.3f ms, min %.3f ms, max %.3f ms\n",
+			Result.FrameAverage() * 1000.0, Result.FramePercentile(0.5) * 1000.0, Result.FramePercentile(0.95) * 1000.0,
+			Result.FramePercentile(0.0) * 1000.0, Result.FramePercentile(1.0) * 1000.0);
+		std::printf("view:  occluders %.3f ms, occludees %.3f ms, sort %.3f ms, rasterize %.3f ms, frame apply %.3f ms\n",
+			Total.OccluderSeconds * 1000.0 / ViewFrames, Total.OccludeeSeconds * 1000.0 / ViewFrames, Total.SortSeconds * 1000.0 / ViewFrames,
+			Total.RasterizeSeconds * 1000.0 / ViewFrames, Result.ApplySeconds * 1000.0 / Frames);
+		std::printf("cost:  %.1f ns/occluder tri set up, %.1f ns/occludee, %.1f ns/tri sorted, %.1f ns/tri rasterized, %.1f ns/primitive applied\n",
+			NsPer(Total.OccluderSeconds, Total.NumOccluderSetupTris), NsPer(Total.OccludeeSeconds, ViewFrames * Result.NumOccludees),
+			NsPer(Total.SortSeconds, Total.NumTriangles), NsPer(Total.RasterizeSeconds, (double)Total.NumRasterizedOccluderTris + Total.NumRasterizedOccludeeTris),
+			NsPer(Result.ApplySeconds, Frames * Result.NumOccludees));
+		std::printf("view:  %.0f triangles, %.0f occluder tris set up, %.0f occluder tris, %.0f occludee tris, %.1f expanded groups, %.1f occluders skipped\n",
+			Total.NumTriangles / ViewFrames, Total.NumOccluderSetupTris / ViewFrames, Total.NumRasterizedOccluderTris / ViewFrames,
+			Total.NumRasterizedOccludeeTris / ViewFrames, Total.NumExpandedGroups / ViewFrames, Total.NumSkippedOccluders / ViewFrames);
+		std::printf("visible: %.1f of %d occludees\n", Result.NumVisible / Frames, Result.NumOccludees);
+		if (Options.Scene.bShadows)
+		{
+			std::printf("shadows: %.1f of %d visible, %.1f casters outside the light view of radius %.0f\n",
+				Result.NumVisibleShadows / Frames, Result.NumShadowVolumes, Result.NumCastersOutsideLightView / Frames, Options.ShadowViewRadius);
+		}
+		std::printf("memory: %.1f KB frame arena, %d heap blocks taken after warmup\n", Result.ArenaBytes / 1024.0, Result.NumArenaHeapAllocs);
+		if (Result.bPortals)
+		{
+			std::printf("portals: %.1f of %d occludees and %.1f of %d occluders culled, %.1f cells and %.1f steps per view, %.3f ms\n",
+				Result.NumPortalCulledOccludees / Frames, Result.NumOccludees, Result.NumPortalCulledOccluders / Frames, Result.NumOccluders,
+				Result.NumPortalVisibleCells / ViewFrames, Result.NumPortalSteps / ViewFrames, Result.PortalSeconds * 1000.0 / Frames);
+		}
+		if (Result.bPVS)
+		{
+			const FPVSBakeStats& Bake = Result.PVSBake;
+			std::printf("pvs: %.1f of %d occludees and %.1f of %d occluders culled, %.3f ms\n",
+				Result.NumPVSCulledOccludees / Frames, Result.NumOccludees, Result.NumPVSCulledOccluders / Frames, Result.NumOccluders, Result.PVSSeconds * 1000.0 / Frames);
+			std::printf("pvs bake: %d of %d cells, %d samples, %d sets, %.1f visible per cell, %.1f KB, %.1f ms\n",
+				Bake.NumBakedCells, Bake.NumCells, Bake.NumSamples, Bake.NumSets, Bake.NumBakedCells > 0 ? (double)Bake.NumVisible / Bake.NumBakedCells : 0.0,
+				Bake.NumBytes / 1024.0, Bake.Seconds * 1000.0);
+		}
+
+		const FAccuracyStats& Accuracy = Result.Accuracy;
+		if (Accuracy.bMeasured)
+		{
+			// Missed culling is relative to what the reference hides, what could have been culled
+			const double NumHidden = Frames * Result.NumOccludees - Accuracy.NumReferenceVisible;
+			std::printf("accuracy: %.1f visible in the reference, %.1f false visible (%.1f%% of the hidden missed), %.1f false occluded, reference x%d %.1f ms\n",
+				Accuracy.NumReferenceVisible / Frames, Accuracy.NumFalseVisible / Frames, NumHidden > 0.0 ? Accuracy.NumFalseVisible * 100.0 / NumHidden : 0.0,
+				Accuracy.NumFalseOccluded / Frames, Options.ReferenceScale, Accuracy.ReferenceSeconds * 1000.0 / Frames);
+			if (Options.Scene.bShadows)
+			{
+				std::printf("accuracy: shadows %.1f false visible, %.1f false occluded\n", Accuracy.NumFalseVisibleShadows / Frames, Accuracy.NumFalseOccludedShadows / Frames);
+			}
+		}
+	}
+
+	void PrintSuiteRow(const FBenchResult& Result, double Speedup)
+	{
+		const FViewStats& Total = Result.Total;
+		const double ViewFrames = Result.ViewFrames();
+		std::printf("%-24s %8.3f %8.3f %8.3f %8.3f %8.3f %8.1f %8.1f %8.1f %7.2fx%s\n",
+			Result.Name.c_str(), Result.FrameAverage() * 1000.0, Result.FramePercentile(0.95) * 1000.0,
+			Total.OccluderSeconds * 1000.0 / ViewFrames, Total.OccludeeSeconds * 1000.0 / ViewFrames,
+			(Total.SortSeconds + Total.RasterizeSeconds) * 1000.0 / ViewFrames,
+			NsPer(Total.OccluderSeconds, Total.NumOccluderSetupTris), NsPer(Total.OccludeeSeconds, ViewFrames * Result.NumOccludees),
+			NsPer(Total.RasterizeSeconds, (double)Total.NumRasterizedOccluderTris + Total.NumRasterizedOccludeeTris),
+			Speedup, Result.bSanityOk ? "" : "  SANITY FAILED");
+	}
+
+	std::string JsonString(const std::string& Value)
+	{
+		std::string Result = "\"";
+		for (char C : Value)
+		{
+			if (C == '"' || C == '\\')
+			{
+				Result += '\\';
+				Result += C;
+			}
+			else if ((unsigned char)C >= 0x20)
+			{
+				Result += C;
+			}
+		}
+		return Result + "\"";
+	}
+
+	/** One object per run, schema version 1. Times are milliseconds, stage times are per view. */
+	bool WriteJson(const std::string& Path, const std::string& Label, const std::vector<FBenchResult>& Results, const std::vector<double>& Speedups)
+	{
+		FILE* File = std::fopen(Path.c_str(), "w");
+		if (!File)
+		{
+			std::printf("error: can't write %s\n", Path.c_str());
+			return false;
+		}
+
+		std::fprintf(File, "{\n  \"schema\": 1,\n  \"tool\": \"SnowOcclusionBench\",\n  \"label\": %s,\n  \"simd_isa\": \"%s\",\n  \"hardware_threads\": %u,\n  \"runs\": [\n",
+			JsonString(Label).c_str(), GetSimdName(), std::thread::hardware_concurrency());
+		for (size_t RunIdx = 0; RunIdx < Results.size(); ++RunIdx)
+		{
+			const FBenchResult& Result = Results[RunIdx];
+			const FBenchOptions& Options = Result.Options;
+			const FViewStats& Total = Result.Total;
+			const double Frames = (double)Result.FrameSeconds.size();
+			const double ViewFrames = Result.ViewFrames();
+
+			std::fprintf(File, "    {\n      \"name\": %s,\n", JsonString(Result.Name).c_str());
+			std::fprintf(File, "      \"scene\": { \"layout\": \"%s\", \"occluders\": %d, \"occluder_triangles\": %d, \"occludees\": %d, \"groups\": %d, \"max_rasterized_occluders\": %d, \"seed\": %u },\n",
+				GetSceneLayoutName(Options.Scene.Layout), Result.NumOccluders, Result.NumOccluderTriangles, Result.NumOccludees, Result.NumGroups,
+				Options.Scene.MaxRasterizedOccluders, Options.Scene.Seed);
+			std::fprintf(File, "      \"config\": { \"views\": %d, \"threads\": %d, \"simd\": %s, \"reprojection\": %s, \"foveation\": %s, \"frames\": %d, \"warmup\": %d },\n",
+				Options.Views, Options.Threads, Options.bScalar ? "false" : "true", Options.bReprojection ? "true" : "false", Options.bFoveation ? "true" : "false",
+				(int)Frames, Options.Warmup);
+			std::fprintf(File, "      \"frame_ms\": { \"avg\": %.4f, \"median\": %.4f, \"p95\": %.4f, \"min\": %.4f, \"max\": %.4f },\n",
+				Result.FrameAverage() * 1000.0, Result.FramePercentile(0.5) * 1000.0, Result.FramePercentile(0.95) * 1000.0,
+				Result.FramePercentile(0.0) * 1000.0, Result.FramePercentile(1.0) * 1000.0);
+			std::fprintf(File, "      \"view_stage_ms\": { \"occluders\": %.4f, \"occludees\": %.4f, \"sort\": %.4f, \"rasterize\": %.4f },\n",
+				Total.OccluderSeconds * 1000.0 / ViewFrames, Total.OccludeeSeconds * 1000.0 / ViewFrames,
+				Total.SortSeconds * 1000.0 / ViewFrames, Total.RasterizeSeconds * 1000.0 / ViewFrames);
+			std::fprintf(File, "      \"apply_ms\": %.4f,\n", Result.ApplySeconds * 1000.0 / Frames);
+			std::fprintf(File, "      \"ns\": { \"per_occluder_tri_setup\": %.2f, \"per_occludee\": %.2f, \"per_tri_sorted\": %.2f, \"per_tri_rasterized\": %.2f, \"per_primitive_applied\": %.2f },\n",
+				NsPer(Total.OccluderSeconds, Total.NumOccluderSetupTris), NsPer(Total.OccludeeSeconds, ViewFrames * Result.NumOccludees),
+				NsPer(Total.SortSeconds, Total.NumTriangles), NsPer(Total.RasterizeSeconds, (double)Total.NumRasterizedOccluderTris + Total.NumRasterizedOccludeeTris),
+				NsPer(Result.ApplySeconds, Frames * Result.NumOccludees));
+			std::fprintf(File, "      \"per_view\": { \"triangles\": %.1f, \"occluder_tris_setup\": %.1f, \"occluder_tris_rasterized\": %.1f, \"occludee_tris_rasterized\": %.1f, \"expanded_groups\": %.1f, \"skipped_occluders\": %.1f },\n",
+				Total.NumTriangles / ViewFrames, Total.NumOccluderSetupTris / ViewFrames, Total.NumRasterizedOccluderTris / ViewFrames,
+				Total.NumRasterizedOccludeeTris / ViewFrames, Total.NumExpandedGroups / ViewFrames, Total.NumSkippedOccluders / ViewFrames);
+			std::fprintf(File, "      \"visible_occludees\": %.1f,\n", Result.NumVisible / Frames);
+			std::fprintf(File, "      \"arena\": { \"bytes\": %zu, \"heap_allocs_after_warmup\": %d },\n", Result.ArenaBytes, Result.NumArenaHeapAllocs);
+			if (Result.bPortals)
+			{
+				std::fprintf(File, "      \"portals\": { \"culled_occludees\": %.1f, \"culled_occluders\": %.1f, \"visible_cells_per_view\": %.1f, \"steps_per_view\": %.1f, \"ms\": %.4f },\n",
+					Result.NumPortalCulledOccludees / Frames, Result.NumPortalCulledOccluders / Frames, Result.NumPortalVisibleCells / ViewFrames,
+					Result.NumPortalSteps / ViewFrames, Result.PortalSeconds * 1000.0 / Frames);
+			}
+			if (Result.bPVS)
+			{
+				const FPVSBakeStats& Bake = Result.PVSBake;
+				std::fprintf(File, "      \"pvs\": { \"culled_occludees\": %.1f, \"culled_occluders\": %.1f, \"ms\": %.4f, \"bake\": { \"cells\": %d, \"samples\": %d, \"sets\": %d, \"bytes\": %zu, \"ms\": %.1f } },\n",
+					Result.NumPVSCulledOccludees / Frames, Result.NumPVSCulledOccluders / Frames, Result.PVSSeconds * 1000.0 / Frames,
+					Bake.NumBakedCells, Bake.NumSamples, Bake.NumSets, Bake.NumBytes, Bake.Seconds * 1000.0);
+			}
+			if (Result.Accuracy.bMeasured)
+			{
+				std::fprintf(File, "      \"accuracy\": { \"reference_scale\": %d, \"reference_visible\": %.1f, \"false_visible\": %.1f, \"false_occluded\": %.1f },\n",
+					Options.ReferenceScale, Result.Accuracy.NumReferenceVisible / Frames, Result.Accuracy.NumFalseVisible / Frames, Result.Accuracy.NumFalseOccluded / Frames);
+			}
+			std::fprintf(File, "      \"speedup_vs_one_thread\": %.3f,\n", Speedups[RunIdx]);
+			std::fprintf(File, "      \"sanity_ok\": %s\n    }%s\n", Result.bSanityOk ? "true" : "false", RunIdx + 1 < Results.size() ? "," : "");
+		}
+		std::fprintf(File, "  ]\n}\n");
+		std::fclose(File);
+		return true;
+	}
+
+	/** Every layout with and without SIMD occludee projection, then the thread scaling of a multi view city */
+	void RunSuite(const FBenchOptions& Options, std::vector<FBenchResult>& OutResults, std::vector<double>& OutSpeedups)
+	{
+		std::printf("%-24s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "run", "frame", "p95", "occl", "occlee", "raster", "ns/otri", "ns/occl", "ns/rtri", "speedup");
+
+		const ESceneLayout Layouts[] = { ESceneLayout::Open, ESceneLayout::City, ESceneLayout::Indoor, ESceneLayout::Forest };
+		for (ESceneLayout Layout : Layouts)
+		{
+			for (int32 bScalar = 0; bScalar < 2; ++bScalar)
+			{
+				FBenchOptions RunOptions = Options;
+				RunOptions.Scene.Layout = Layout;
+				RunOptions.bScalar = bScalar != 0;
+				RunOptions.Threads = 1;
+
+				OutResults.emplace_back();
+				RunBench(std::string(GetSceneLayoutName(Layout)) + (bScalar ? "/scalar" : "/simd"), RunOptions, OutResults.back());
+				OutSpeedups.push_back(1.0);
+				PrintSuiteRow(OutResults.back(), 1.0);
+			}
+		}
+
+		// Views are what runs in parallel, more threads than views would idle
+		const int32 NumViews = std::max(Options.Views, 4);
+		const int32 MaxThreads = std::min(std::max((int32)std::thread::hardware_concurrency(), 1), NumViews);
+		double OneThreadSeconds = 0.0;
+		for (int32 Threads = 1; Threads <= MaxThreads; Threads = Threads < MaxThreads ? std::min(Threads * 2, MaxThreads) : MaxThreads + 1)
+		{
+			FBenchOptions RunOptions = Options;
+			RunOptions.Scene.Layout = ESceneLayout::City;
+			RunOptions.Views = NumViews;
+			RunOptions.Threads = Threads;
+
+			OutResults.emplace_back();
+			RunBench("city/views" + std::to_string(NumViews) + "/threads" + std::to_string(Threads), RunOptions, OutResults.back());
+			const double Seconds = OutResults.back().FrameAverage();
+			OneThreadSeconds = Threads == 1 ? Seconds : OneThreadSeconds;
+			OutSpeedups.push_back(OneThreadSeconds / Seconds);
+			PrintSuiteRow(OutResults.back(), OutSpeedups.back());
+		}
+	}
+}
+
+int main(int Argc, char** Argv)
+{
+	FBenchOptions Options;
+	if (!ParseOptions(Argc, Argv, Options))
+	{
+		return 1;
+	}
+
+	std::printf("kernels: %s\n", GetSimdName());
+
+	FTraceFile Trace;
+	if (!Options.TracePath.empty())
+	{
+		Trace.Open(Options.TracePath.c_str());
+	}
+
+	std::vector<FBenchResult> Results;
+	std::vector<double> Speedups;
+	if (Options.bSuite)
+	{
+		RunSuite(Options, Results, Speedups);
+	}
+	else
+	{
+		Results.emplace_back();
+		RunBench(GetSceneLayoutName(Options.Scene.Layout), Options, Results.back());
+		Speedups.push_back(1.0);
+		PrintResult(Results.back());
+	}
+
+	if (Trace.IsOpen())
+	{
+		const int32 NumEvents = Trace.Close();
+		if (NumEvents < 0)
+		{
+			std::printf("error: can't write %s\n", Options.TracePath.c_str());
+			return 1;
+		}
+		std::printf("trace: %d events written to %s\n", NumEvents, Options.TracePath.c_str());
+	}
+
+	if (!Options.JsonPath.empty() && !WriteJson(Options.JsonPath, Options.Label, Results, Speedups))
+	{
+		return 1;
+	}
+
+	for (const FBenchResult& Result : Results)
+	{
+		if (!Result.bSanityOk)
+		{
+			std::printf("error: %s: occludees in front of and behind the first wall came out wrong\n", Result.Name.c_str());
+			return 2;
+		}
+	}
+
+	return 0;
+}
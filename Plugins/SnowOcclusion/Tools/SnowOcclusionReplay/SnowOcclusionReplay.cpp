@@ -0,0 +1,346 @@
+// Copyright Fast Travel Games. All rights reserved.
+
+/*=============================================================================
+	SnowOcclusionReplay.cpp: re-runs the frames of an occlusion capture.
+	Reproduces a session recorded with r.so.Capture without the game, to
+	profile it, and checks the results still match the recorded ones so the
+	capture doubles as a golden result for rasterizer changes.
+=============================================================================*/
+
+#include "SnowOcclusionCapture.h"
+#include "SnowOcclusionCore.h"
+#include "SnowOcclusionReference.h"
+#include "SnowOcclusionThreadPool.h"
+#include "SnowOcclusionTraceFile.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+using namespace SnowOcclusion;
+
+namespace
+{
+	enum class ESimdOverride
+	{
+		// As captured
+		None,
+		SIMD,
+		Scalar,
+	};
+
+	struct FReplayOptions
+	{
+		std::string CapturePath;
+		// Passes over the capture, each starts with an empty history like the capture did
+		int32 Repeat = 1;
+		int32 MaxFrames = 0x7fffffff;
+		int32 Threads = 1;
+		ESimdOverride Simd = ESimdOverride::None;
+		bool bVerify = true;
+		bool bVerbose = false;
+		std::string RewritePath;
+		bool bAccuracy = false;
+		int32 ReferenceScale = DEFAULT_REFERENCE_SCALE;
+		std::string TracePath;
+	};
+
+	void PrintUsage()
+	{
+		std::printf(
+			"Usage: SnowOcclusionReplay CAPTURE [options]\n"
+			"  --repeat N         passes over the capture (1)\n"
+			"  --frames N         replay at most N frames of it\n"
+			"  --threads N        threads processing the views (1)\n"
+			"  --simd, --scalar   override how occludees were projected in the capture\n"
+			"  --no-verify        don't compare with the captured results\n"
+			"  --verbose          print every frame\n"
+			"  --rewrite PATH     write the capture again with the replayed results, to update a golden capture\n"
+			"  --accuracy         count culling mistakes against the reference rasterizer\n"
+			"  --reference-scale N  reference buffer size as a multiple of the occlusion buffer (4)\n"
+			"  --trace PATH       write the stages run on each thread as a Chrome trace\n");
+	}
+
+	bool ParseOptions(int Argc, char** Argv, FReplayOptions& Options)
+	{
+		for (int ArgIdx = 1; ArgIdx < Argc; ++ArgIdx)
+		{
+			const char* Arg = Argv[ArgIdx];
+			const char* Value = ArgIdx + 1 < Argc ? Argv[ArgIdx + 1] : nullptr;
+			auto TakeInt = [&](int32& Out) { if (!Value) { return false; } Out = std::atoi(Value); ++ArgIdx; return true; };
+			auto TakeString = [&](std::string& Out) { if (!Value) { return false; } Out = Value; ++ArgIdx; return true; };
+
+			bool bOk = true;
+			if (!std::strcmp(Arg, "--repeat")) bOk = TakeInt(Options.Repeat);
+			else if (!std::strcmp(Arg, "--frames")) bOk = TakeInt(Options.MaxFrames);
+			else if (!std::strcmp(Arg, "--threads")) bOk = TakeInt(Options.Threads);
+			else if (!std::strcmp(Arg, "--simd")) Options.Simd = ESimdOverride::SIMD;
+			else if (!std::strcmp(Arg, "--scalar")) Options.Simd = ESimdOverride::Scalar;
+			else if (!std::strcmp(Arg, "--no-verify")) Options.bVerify = false;
+			else if (!std::strcmp(Arg, "--verbose")) Options.bVerbose = true;
+			else if (!std::strcmp(Arg, "--rewrite")) bOk = TakeString(Options.RewritePath);
+			else if (!std::strcmp(Arg, "--trace")) bOk = TakeString(Options.TracePath);
+			else if (!std::strcmp(Arg, "--accuracy")) Options.bAccuracy = true;
+			else if (!std::strcmp(Arg, "--reference-scale")) bOk = TakeInt(Options.ReferenceScale);
+			else if (Arg[0] != '-' && Options.CapturePath.empty()) Options.CapturePath = Arg;
+			else bOk = false;
+
+			if (!bOk)
+			{
+				PrintUsage();
+				return false;
+			}
+		}
+
+		if (Options.CapturePath.empty())
+		{
+			PrintUsage();
+			return false;
+		}
+
+		Options.Repeat = std::max(Options.Repeat, 1);
+		Options.Threads = std::max(Options.Threads, 1);
+		Options.ReferenceScale = std::min(std::max(Options.ReferenceScale, 1), MAX_REFERENCE_SCALE);
+		return true;
+	}
+
+	/** Differences between replayed and captured results of a frame */
+	struct FFrameDiff
+	{
+		// Occludees visible now and occluded in the capture, and the other way around
+		int32 NumNewlyVisible = 0;
+		int32 NumNewlyOccluded = 0;
+		int32 NumShadowVolumeDiffs = 0;
+		int32 NumBinsDiffs = 0;
+
+		bool Any() const { return NumNewlyVisible || NumNewlyOccluded || NumShadowVolumeDiffs || NumBinsDiffs; }
+	};
+
+	FFrameDiff CompareResults(const FFrameResults& Replayed, const FCapturedResults& Captured)
+	{
+		FFrameDiff Diff;
+		for (size_t OccludeeIdx = 0; OccludeeIdx < Replayed.OccludeeVisible.size() && OccludeeIdx < Captured.OccludeeVisible.size(); ++OccludeeIdx)
+		{
+			Diff.NumNewlyVisible += Replayed.OccludeeVisible[OccludeeIdx] && !Captured.OccludeeVisible[OccludeeIdx];
+			Diff.NumNewlyOccluded += !Replayed.OccludeeVisible[OccludeeIdx] && Captured.OccludeeVisible[OccludeeIdx];
+		}
+		for (size_t VolumeIdx = 0; VolumeIdx < Replayed.ShadowVolumeVisible.size() && VolumeIdx < Captured.ShadowVolumeVisible.size(); ++VolumeIdx)
+		{
+			Diff.NumShadowVolumeDiffs += Replayed.ShadowVolumeVisible[VolumeIdx] != Captured.ShadowVolumeVisible[VolumeIdx];
+		}
+		for (size_t ViewIdx = 0; ViewIdx < Replayed.Views.size() && ViewIdx < Captured.Views.size(); ++ViewIdx)
+		{
+			Diff.NumBinsDiffs += HashViewBins(Replayed.Views[ViewIdx]) != Captured.Views[ViewIdx].BinsHash;
+		}
+		return Diff;
+	}
+
+	double SumStageSeconds(const FViewStats& Stats)
+	{
+		return Stats.OccluderSeconds + Stats.OccludeeSeconds + Stats.SortSeconds + Stats.RasterizeSeconds;
+	}
+
+	void AddAccuracy(const FAccuracyStats& Frame, FAccuracyStats& Total, int32& NumMeasuredFrames)
+	{
+		if (Frame.bMeasured)
+		{
+			Total.bMeasured = true;
+			Total.NumReferenceVisible += Frame.NumReferenceVisible;
+			Total.NumFalseVisible += Frame.NumFalseVisible;
+			Total.NumFalseOccluded += Frame.NumFalseOccluded;
+			Total.NumFalseVisibleShadows += Frame.NumFalseVisibleShadows;
+			Total.NumFalseOccludedShadows += Frame.NumFalseOccludedShadows;
+			Total.ReferenceSeconds += Frame.ReferenceSeconds;
+			NumMeasuredFrames++;
+		}
+	}
+
+	void PrintAccuracy(const char* Name, const FAccuracyStats& Total, int32 NumMeasuredFrames)
+	{
+		if (Total.bMeasured)
+		{
+			const double Frames = (double)std::max(NumMeasuredFrames, 1);
+			std::printf("%s %d frames, per frame: %.1f visible in the reference, %.1f false visible, %.1f false occluded, shadows %.1f false visible, %.1f false occluded, reference %.1f ms\n",
+				Name, NumMeasuredFrames, Total.NumReferenceVisible / Frames, Total.NumFalseVisible / Frames, Total.NumFalseOccluded / Frames,
+				Total.NumFalseVisibleShadows / Frames, Total.NumFalseOccludedShadows / Frames, Total.ReferenceSeconds * 1000.0 / Frames);
+		}
+	}
+}
+
+int main(int Argc, char** Argv)
+{
+	FReplayOptions Options;
+	if (!ParseOptions(Argc, Argv, Options))
+	{
+		return 1;
+	}
+
+	std::unique_ptr<FThreadPool> ThreadPool;
+	FParallelFor ParallelFor;
+	if (Options.Threads > 1)
+	{
+		ThreadPool.reset(new FThreadPool(Options.Threads));
+		ParallelFor = ThreadPool->AsParallelFor();
+	}
+
+	FCaptureWriter Rewriter;
+	if (!Options.RewritePath.empty() && !Rewriter.Open(MakeFileCaptureSink(Options.RewritePath.c_str())))
+	{
+		std::printf("error: can't write %s\n", Options.RewritePath.c_str());
+		return 1;
+	}
+
+	FTraceFile Trace;
+	if (!Options.TracePath.empty())
+	{
+		Trace.Open(Options.TracePath.c_str());
+	}
+
+	int32 NumFrames = 0;
+	int32 NumMismatchedFrames = 0;
+	FFrameDiff TotalDiff;
+	FViewStats Replayed;
+	FViewStats Captured;
+	double FrameSeconds = 0.0;
+	int64_t NumViewFrames = 0;
+	FAccuracyStats ReplayedAccuracy;
+	FAccuracyStats CapturedAccuracy;
+	int32 NumReplayedAccuracyFrames = 0;
+	int32 NumCapturedAccuracyFrames = 0;
+
+	FFrameArena Arena;
+	for (int32 Pass = 0; Pass < Options.Repeat; ++Pass)
+	{
+		FCaptureReader Reader;
+		if (!Reader.Open(Options.CapturePath.c_str()))
+		{
+			std::printf("error: %s\n", Reader.GetError().c_str());
+			return 1;
+		}
+
+		FHistory History;
+		FCapturedFrame Frame;
+		FFrameResults Results;
+		for (int32 FrameIdx = 0; FrameIdx < Options.MaxFrames && Reader.ReadFrame(Frame); ++FrameIdx)
+		{
+			FScene& Scene = Frame.Scene;
+			if (Options.Simd != ESimdOverride::None)
+			{
+				Scene.bUseSIMD = Options.Simd == ESimdOverride::SIMD;
+			}
+
+			Results.Reset((int32)Scene.Views.size());
+			const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+			ProcessOcclusionFrame(Scene, &History, Results, ParallelFor, &Arena);
+			FrameSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+			NumFrames++;
+
+			for (size_t ViewIdx = 0; ViewIdx < Results.Views.size(); ++ViewIdx)
+			{
+				const FViewStats& Stats = Results.Views[ViewIdx].Stats;
+				Replayed.OccluderSeconds += Stats.OccluderSeconds;
+				Replayed.OccludeeSeconds += Stats.OccludeeSeconds;
+				Replayed.SortSeconds += Stats.SortSeconds;
+				Replayed.RasterizeSeconds += Stats.RasterizeSeconds;
+
+				const FViewStats& CapturedStats = Frame.Results.Views[ViewIdx].Stats;
+				Captured.OccluderSeconds += CapturedStats.OccluderSeconds;
+				Captured.OccludeeSeconds += CapturedStats.OccludeeSeconds;
+				Captured.SortSeconds += CapturedStats.SortSeconds;
+				Captured.RasterizeSeconds += CapturedStats.RasterizeSeconds;
+				NumViewFrames++;
+			}
+
+			if (Options.bAccuracy)
+			{
+				MeasureCullingAccuracy(Scene, Results, Options.ReferenceScale, ParallelFor);
+				AddAccuracy(Results.Accuracy, ReplayedAccuracy, NumReplayedAccuracyFrames);
+			}
+			AddAccuracy(Frame.Results.Accuracy, CapturedAccuracy, NumCapturedAccuracyFrames);
+
+			if (Pass == 0 && Rewriter.IsOpen() && !Rewriter.WriteFrame(Frame.FrameNumber, Scene, Results))
+			{
+				std::printf("error: can't write %s\n", Options.RewritePath.c_str());
+				return 1;
+			}
+
+			if (Options.bVerify)
+			{
+				const FFrameDiff Diff = CompareResults(Results, Frame.Results);
+				TotalDiff.NumNewlyVisible += Diff.NumNewlyVisible;
+				TotalDiff.NumNewlyOccluded += Diff.NumNewlyOccluded;
+				TotalDiff.NumShadowVolumeDiffs += Diff.NumShadowVolumeDiffs;
+				TotalDiff.NumBinsDiffs += Diff.NumBinsDiffs;
+				NumMismatchedFrames += Diff.Any();
+
+				if (Diff.Any() && (Options.bVerbose || NumMismatchedFrames <= 10))
+				{
+					std::printf("frame %llu: %d newly visible, %d newly occluded, %d shadow volumes differ, %d of %d view buffers differ\n",
+						(unsigned long long)Frame.FrameNumber, Diff.NumNewlyVisible, Diff.NumNewlyOccluded, Diff.NumShadowVolumeDiffs, Diff.NumBinsDiffs, (int)Results.Views.size());
+				}
+			}
+
+			if (Options.bVerbose)
+			{
+				double ReplayedSeconds = 0.0;
+				double CapturedSeconds = 0.0;
+				for (size_t ViewIdx = 0; ViewIdx < Results.Views.size(); ++ViewIdx)
+				{
+					ReplayedSeconds += SumStageSeconds(Results.Views[ViewIdx].Stats);
+					CapturedSeconds += SumStageSeconds(Frame.Results.Views[ViewIdx].Stats);
+				}
+				std::printf("frame %llu: %d views, %d occluders, %d occludees, %.3f ms replayed, %.3f ms captured\n",
+					(unsigned long long)Frame.FrameNumber, (int)Scene.Views.size(), (int)Scene.Occluders.size(), Scene.NumOccludees(), ReplayedSeconds * 1000.0, CapturedSeconds * 1000.0);
+			}
+		}
+
+		if (!Reader.GetError().empty())
+		{
+			std::printf("error: %s\n", Reader.GetError().c_str());
+			return 1;
+		}
+	}
+
+	if (NumFrames == 0)
+	{
+		std::printf("error: %s has no frames\n", Options.CapturePath.c_str());
+		return 1;
+	}
+
+	const double ViewFrames = (double)std::max<int64_t>(NumViewFrames, 1);
+	std::printf("replayed %d frames (%s kernels)\n", NumFrames, GetSimdName());
+	std::printf("frame:    avg %.3f ms\n", FrameSeconds * 1000.0 / NumFrames);
+	std::printf("replayed: occluders %.3f ms, occludees %.3f ms, sort %.3f ms, rasterize %.3f ms per view\n",
+		Replayed.OccluderSeconds * 1000.0 / ViewFrames, Replayed.OccludeeSeconds * 1000.0 / ViewFrames, Replayed.SortSeconds * 1000.0 / ViewFrames, Replayed.RasterizeSeconds * 1000.0 / ViewFrames);
+	std::printf("captured: occluders %.3f ms, occludees %.3f ms, sort %.3f ms, rasterize %.3f ms per view\n",
+		Captured.OccluderSeconds * 1000.0 / ViewFrames, Captured.OccludeeSeconds * 1000.0 / ViewFrames, Captured.SortSeconds * 1000.0 / ViewFrames, Captured.RasterizeSeconds * 1000.0 / ViewFrames);
+
+	if (Trace.IsOpen())
+	{
+		const int32 NumEvents = Trace.Close();
+		if (NumEvents < 0)
+		{
+			std::printf("error: can't write %s\n", Options.TracePath.c_str());
+			return 1;
+		}
+		std::printf("trace:    %d events written to %s\n", NumEvents, Options.TracePath.c_str());
+	}
+
+	PrintAccuracy("accuracy, replayed:", ReplayedAccuracy, NumReplayedAccuracyFrames);
+	PrintAccuracy("accuracy, captured:", CapturedAccuracy, NumCapturedAccuracyFrames);
+
+	if (Options.bVerify)
+	{
+		std::printf("verify:   %d of %d frames differ: %d newly visible, %d newly occluded, %d shadow volumes, %d view buffers\n",
+			NumMismatchedFrames, NumFrames, TotalDiff.NumNewlyVisible, TotalDiff.NumNewlyOccluded, TotalDiff.NumShadowVolumeDiffs, TotalDiff.NumBinsDiffs);
+		if (NumMismatchedFrames > 0)
+		{
+			return 3;
+		}
+	}
+
+	return 0;
+}